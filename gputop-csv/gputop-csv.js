@@ -155,8 +155,12 @@ GputopCSV.prototype.update_features = function(features)
         log.warn("CSV:   Accumulation period: " + args.accumulation_period);
         log.warn("\n\n");
 
+        /* Only the counters being recorded need to be evaluated */
+        var recorded = this.counters_.filter((counter) => counter.record_data);
+
         this.open_oa_metric_set({guid: this.metric.guid_,
-                                 oa_exponent: closest_oa_exponent });
+                                 oa_exponent: closest_oa_exponent,
+                                 counters: recorded });
     } else {
         log.error("Failed to find counters matching requested columns");
     }
@@ -170,7 +174,8 @@ function write_rows()
         return;
 
     var ref_counter = this.counters_[this.reference_column];
-    var n_rows = ref_counter.updates.length;
+    var ref_updates = ref_counter.updates;
+    var n_rows = ref_updates.length;
 
     if (n_rows <= 1)
         return;
@@ -181,8 +186,8 @@ function write_rows()
 
     for (var r = 0; r < n_rows; r++) {
 
-        var start = ref_counter.updates[r][0];
-        var end = ref_counter.updates[r][1];
+        var start = ref_updates.start[ref_updates.at(r)];
+        var end = ref_updates.end[ref_updates.at(r)];
         var row_timestamp = start + (end - start) / 2;
 
         var row = "";
@@ -194,14 +199,16 @@ function write_rows()
             if (counter === this.dummy_timestamp_counter) {
                 val = row_timestamp;
             } else if (counter.record_data === true) {
-                start = counter.updates[r][0];
-                end = counter.updates[r][1];
-                var max = counter.updates[r][3];
+                var updates = counter.updates;
+                var k = updates.at(r);
+
+                start = updates.start[k];
+                end = updates.end[k];
                 var timestamp = start + (end - start) / 2;
 
                 log.assert(timestamp === row_timestamp, "Inconsistent row timestamp");
 
-                val = counter.updates[r][2];
+                val = updates.value[k];
             }
             /* NB: some columns may have placeholder counter objects (with
              * .record_data == false) if they aren't available on this
@@ -216,7 +223,7 @@ function write_rows()
     for (var c = 0; c < this.counters_.length; c++) {
         var counter = this.counters_[c];
         if (counter.record_data === true)
-            counter.updates.splice(0, n_rows);
+            counter.updates.consume(n_rows);
     }
 }
 
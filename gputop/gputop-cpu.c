@@ -28,6 +28,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -39,17 +42,28 @@
 static pthread_once_t count_once = PTHREAD_ONCE_INIT;
 static int n_cpus = 0;
 
+/* NB: we count all possible CPUs, not just those currently present or
+ * online, so the count doesn't change with CPU hotplug. The list is
+ * formatted like "0", "0-7" or "0-3,8-11" */
 static void
 count_cpus(void)
 {
-    char buf[32];
-    unsigned ignore = 0, max_cpu = 0;
+    char buf[256];
+    const char *p = buf;
+    unsigned max_cpu = 0;
 
-    if (!gputop_read_file("/sys/devices/system/cpu/present", buf, sizeof(buf)))
+    if (!gputop_read_file("/sys/devices/system/cpu/possible", buf, sizeof(buf)))
         return;
 
-    if (sscanf(buf, "%u-%u", &ignore, &max_cpu) != 2)
-        return;
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        unsigned cpu = strtoul(p, &end, 10);
+
+        max_cpu = MAX(max_cpu, cpu);
+        if (*end != '-' && *end != ',')
+            break;
+        p = end + 1;
+    }
 
     n_cpus = max_cpu + 1;
 }
@@ -98,44 +112,164 @@ gputop_cpu_model(char *buf, int len)
 }
 
 
-bool
-gputop_cpu_read_stats(struct cpu_stat *stats, int n_cpus)
+/*
+ * Since we may sample /proc/stat every few milliseconds, on hosts with
+ * hundreds of CPUs, we try to avoid adding noticeable overhead to the
+ * system we're observing: the file is kept open and re-read with pread()
+ * into a buffer that's reused, and then parsed by hand instead of via
+ * stdio + sscanf().
+ *
+ * The per-CPU lines come first so we only need to read up to the first
+ * line after them (the remainder of the file, such as the "intr" line,
+ * can be much larger).
+ *
+ * NB: CPUs that are offline don't have a line in /proc/stat, so rather
+ * than assume a fixed number of lines we index by the CPU number of
+ * each line and repeat the last values read for any CPU without a
+ * line (its counters don't advance while offline).
+ */
+static const char *proc_stat_path = "/proc/stat"; /* overridden by tests */
+static int proc_stat_fd = -1;
+static char *proc_stat_buf;
+static size_t proc_stat_buf_size;
+static struct cpu_stat *last_stats;
+static int last_stats_len;
+
+static const char *
+parse_ulong(const char *p, const char *end, unsigned long *value)
 {
-    FILE *fp = fopen("/proc/stat", "r");
-    char *line = NULL;
-    size_t line_len = 0;
-    uint64_t timestamp = gputop_get_time();
-    int n_read = 0;
+    unsigned long v = 0;
+
+    while (p < end && *p == ' ')
+        p++;
 
-    if (!fp) {
-        dbg("Failed to open /proc/stat\n");
+    if (p == end || *p < '0' || *p > '9')
+        return NULL;
+
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+
+    *value = v;
+    return p;
+}
+
+/* Parses a "cpuN ..." line, returning false if it's not for a specific
+ * CPU (such as the aggregate "cpu" line) or it's malformed. Fields
+ * missing on older kernels are left as zero. */
+static bool
+parse_cpu_line(const char *p, const char *end, struct cpu_stat *st)
+{
+    unsigned long *fields[] = {
+        &st->user, &st->nice, &st->system, &st->idle, &st->iowait,
+        &st->irq, &st->softirq, &st->steal, &st->guest, &st->guest_nice,
+    };
+    unsigned long cpu;
+
+    p += 3; /* "cpu" */
+    if (p == end || *p < '0' || *p > '9')
         return false;
+
+    p = parse_ulong(p, end, &cpu);
+    st->cpu = cpu;
+
+    for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        p = parse_ulong(p, end, fields[i]);
+        if (!p)
+            return i >= 4;
     }
 
-    while (getline(&line, &line_len, fp) > 0) {
-        struct cpu_stat st = { 0 };
-        int ret = sscanf(line, "cpu%u %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-                         &st.cpu, &st.user, &st.nice, &st.system, &st.idle,
-                         &st.iowait, &st.irq, &st.softirq,
-                         &st.steal, &st.guest, &st.guest_nice);
-        if (ret == 11) {
-            if (st.cpu >= n_cpus) {
-                dbg("cpu stats buffer too small\n");
+    return true;
+}
+
+/* Reads at least the per-CPU lines of /proc/stat into proc_stat_buf,
+ * returning the length read or -1 on error */
+static ssize_t
+read_proc_stat(void)
+{
+    if (proc_stat_fd == -1) {
+        proc_stat_fd = open(proc_stat_path, O_RDONLY | O_CLOEXEC);
+        if (proc_stat_fd == -1) {
+            dbg("Failed to open %s: %m\n", proc_stat_path);
+            return -1;
+        }
+
+        proc_stat_buf_size = 4096;
+        proc_stat_buf = xmalloc(proc_stat_buf_size);
+    }
+
+    while (true) {
+        ssize_t len = pread(proc_stat_fd, proc_stat_buf, proc_stat_buf_size, 0);
+        const char *p;
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            dbg("Failed to read %s: %m\n", proc_stat_path);
+            return -1;
+        }
+
+        if (len < proc_stat_buf_size)
+            return len;
+
+        /* Have we read past the last cpu line? */
+        for (p = proc_stat_buf; p; ) {
+            const char *eol = memchr(p, '\n', proc_stat_buf + len - p);
+
+            if (!eol)
                 break;
-            }
-            st.timestamp = timestamp;
-            stats[st.cpu] = st;
-            n_read++;
+            if (strncmp(p, "cpu", 3) != 0)
+                return len;
+            p = eol + 1;
         }
+
+        proc_stat_buf_size *= 2;
+        proc_stat_buf = xrealloc(proc_stat_buf, proc_stat_buf_size);
     }
+}
 
+bool
+gputop_cpu_read_stats(struct cpu_stat *stats, int n_cpus)
+{
+    uint64_t timestamp = gputop_get_time();
+    const char *p;
+    const char *end;
+    ssize_t len;
 
-    free(line);
-    fclose(fp);
+    if (last_stats_len < n_cpus) {
+        last_stats = xrealloc(last_stats, sizeof(struct cpu_stat) * n_cpus);
+        for (int i = last_stats_len; i < n_cpus; i++) {
+            memset(&last_stats[i], 0, sizeof(struct cpu_stat));
+            last_stats[i].cpu = i;
+        }
+        last_stats_len = n_cpus;
+    }
 
-    if (n_read != n_cpus) {
-        dbg("Failed to read all cpu stats\n");
+    len = read_proc_stat();
+    if (len < 0)
         return false;
+
+    p = proc_stat_buf;
+    end = proc_stat_buf + len;
+    while (p < end && strncmp(p, "cpu", MIN(3, end - p)) == 0) {
+        const char *eol = memchr(p, '\n', end - p);
+        struct cpu_stat st = { 0 };
+
+        if (!eol)
+            eol = end;
+
+        if (parse_cpu_line(p, eol, &st)) {
+            if (st.cpu < n_cpus)
+                last_stats[st.cpu] = st;
+            else
+                dbg("cpu stats buffer too small\n");
+        }
+
+        p = eol + 1;
+    }
+
+    for (int i = 0; i < n_cpus; i++) {
+        stats[i] = last_stats[i];
+        stats[i].timestamp = timestamp;
     }
 
     return true;
@@ -0,0 +1,787 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include <uv.h>
+
+#include <i915_oa_drm.h>
+
+#include "gputop-csv.h"
+#include "gputop-perf.h"
+#include "gputop-record.h"
+#include "gputop-util.h"
+#include "gputop-log.h"
+#include "gputop-mainloop.h"
+
+/*
+ * Headless recording of OA counters to a CSV file, as a native alternative
+ * to the gputop-csv node.js tool for when node isn't available.
+ *
+ * A single OA metric set is sampled in-process and the reports are
+ * accumulated as they are read, writing a row of the selected counters
+ * for each aggregation period. The counters for the rows completed by
+ * each read are evaluated together (see
+ * gputop_oa_metric_set_read_all_batch()) before being formatted.
+ * gputop-main configures this via the environment:
+ *
+ *   GPUTOP_CSV_FILE                 File to write, or "-" for stdout
+ *   GPUTOP_CSV_METRICS              Metric set symbol name, or "list"
+ *   GPUTOP_CSV_COLUMNS              Comma separated counter symbol names
+ *                                   (or "Timestamp"), or "list"
+ *   GPUTOP_CSV_PERIOD               Maximum OA sampling period (ns)
+ *   GPUTOP_CSV_AGGREGATION_PERIOD   Period covered by each row (ns)
+ *
+ * Alternatively, with GPUTOP_REPLAY set, rows are written for an OA stream
+ * previously captured with GPUTOP_RECORD (see gputop-record.h) instead of
+ * sampling live. The metric set is then the one that was recorded and the
+ * recording's device info is used to evaluate counters:
+ *
+ *   GPUTOP_REPLAY                   Recording to replay
+ *   GPUTOP_REPLAY_START             Offset into the recording to start
+ *                                   from (ns)
+ */
+
+#define CSV_DEFAULT_PERIOD 40000000ULL
+#define CSV_DEFAULT_AGGREGATION_PERIOD 1000000000ULL
+
+/* NB: must be a power of two. This should be large enough to absorb the
+ * reports for a few mainloop iterations at the highest sampling
+ * frequencies */
+#define CSV_RING_SIZE (8 * 1024 * 1024)
+
+/* Rows are formatted into this buffer, which is written out whenever it
+ * fills up, periodically, and when recording finishes */
+#define CSV_BUFFER_SIZE (256 * 1024)
+#define CSV_FLUSH_PERIOD_MS 1000
+
+/* Upper bound on the formatted length of a single value (including the
+ * separator) for reserving buffer space per row */
+#define CSV_MAX_FIELD_LEN 32
+
+/* The most rows to queue before evaluating their counters */
+#define CSV_MAX_PENDING_ROWS 64
+
+#define CSV_COLUMN_TIMESTAMP -1
+#define CSV_COLUMN_UNAVAILABLE -2
+
+struct csv_column {
+    char *name;
+    int counter; /* index into metric_set->counters[] or one of the above */
+};
+
+static int csv_fd = -1;
+static char csv_buffer[CSV_BUFFER_SIZE];
+static size_t csv_buffer_len;
+
+/* NB: the application may exit while the mainloop is writing rows */
+static pthread_mutex_t csv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct gputop_metric_set *csv_metric_set;
+static struct csv_column *csv_columns;
+static int n_csv_columns;
+static uint64_t csv_aggregation_period;
+
+static struct gputop_perf_stream *csv_stream;
+static struct gputop_oa_accumulator csv_accumulator;
+
+/* The deltas and timestamp of each completed row that's waiting to be
+ * written, and the (value, max) pairs for all the counters of each of
+ * those rows */
+static uint64_t csv_pending_deltas[CSV_MAX_PENDING_ROWS][MAX_RAW_OA_COUNTERS];
+static uint64_t csv_pending_timestamps[CSV_MAX_PENDING_ROWS];
+static int csv_n_pending_rows;
+static double *csv_counter_values;
+
+/* The last report seen, to continue accumulating from once more data is
+ * read, since the ring may be overwritten by then */
+static uint8_t *csv_last_report;
+static bool csv_have_last_report;
+
+static uint64_t csv_n_rows;
+static uint64_t csv_n_lost;
+
+static uv_timer_t csv_flush_timer;
+static uv_signal_t csv_sigint;
+static uv_signal_t csv_sigterm;
+
+/* NB: called with csv_lock held */
+static void
+csv_flush(void)
+{
+    size_t written = 0;
+
+    while (written < csv_buffer_len) {
+        ssize_t ret = write(csv_fd, csv_buffer + written,
+                            csv_buffer_len - written);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to write CSV file: %m\n");
+            break;
+        }
+
+        written += ret;
+    }
+
+    csv_buffer_len = 0;
+}
+
+/* Returns space for at least @len more bytes in csv_buffer */
+static char *
+csv_reserve(size_t len)
+{
+    if (csv_buffer_len + len > CSV_BUFFER_SIZE)
+        csv_flush();
+
+    return csv_buffer + csv_buffer_len;
+}
+
+static char *
+csv_format_u64(char *p, uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (n)
+        *p++ = digits[--n];
+
+    return p;
+}
+
+/* Writes @value with up to four decimal places. This is considerably
+ * cheaper than printf("%f") which would otherwise dominate the cost of
+ * writing rows at short aggregation periods. Values outside the range
+ * that can be handled with integer arithmetic, or too small to be
+ * represented with four decimal places, fall back to "%g" */
+static char *
+csv_format_double(char *p, double value)
+{
+    double magnitude = fabs(value);
+    uint64_t scaled;
+
+    if (!(magnitude < 1e14) || (magnitude != 0 && magnitude < 0.001))
+        return p + snprintf(p, CSV_MAX_FIELD_LEN, "%g", value);
+
+    scaled = (uint64_t)(magnitude * 10000.0 + 0.5);
+
+    if (value < 0 && scaled)
+        *p++ = '-';
+
+    p = csv_format_u64(p, scaled / 10000);
+
+    if (scaled % 10000) {
+        unsigned frac = scaled % 10000;
+
+        *p++ = '.';
+        for (unsigned d = 1000; frac; d /= 10) {
+            *p++ = '0' + frac / d;
+            frac %= d;
+        }
+    }
+
+    return p;
+}
+
+/* NB: called with csv_lock held */
+static void
+csv_write_rows(void)
+{
+    int n_values = csv_metric_set->n_counters * 2;
+
+    gputop_oa_metric_set_read_all_batch(&gputop_devinfo, csv_metric_set,
+                                        csv_pending_deltas[0],
+                                        MAX_RAW_OA_COUNTERS,
+                                        csv_n_pending_rows,
+                                        csv_counter_values);
+
+    for (int row = 0; row < csv_n_pending_rows; row++) {
+        const double *values = csv_counter_values + row * n_values;
+        char *start = csv_reserve(n_csv_columns * CSV_MAX_FIELD_LEN + 1);
+        char *p = start;
+
+        for (int i = 0; i < n_csv_columns; i++) {
+            int counter = csv_columns[i].counter;
+
+            if (i)
+                *p++ = ',';
+
+            switch (counter) {
+            case CSV_COLUMN_TIMESTAMP:
+                p = csv_format_u64(p, csv_pending_timestamps[row]);
+                break;
+            case CSV_COLUMN_UNAVAILABLE:
+                *p++ = '0';
+                break;
+            default:
+                p = csv_format_double(p, values[counter * 2]);
+                break;
+            }
+        }
+        *p++ = '\n';
+
+        csv_buffer_len += p - start;
+        csv_n_rows++;
+    }
+
+    csv_n_pending_rows = 0;
+}
+
+/* NB: called with csv_lock held */
+static void
+csv_queue_row(struct gputop_oa_accumulator *accumulator)
+{
+    int row = csv_n_pending_rows++;
+
+    memcpy(csv_pending_deltas[row], accumulator->deltas,
+           sizeof(accumulator->deltas));
+    csv_pending_timestamps[row] = accumulator->first_timestamp +
+        (accumulator->last_timestamp - accumulator->first_timestamp) / 2;
+
+    if (csv_n_pending_rows == CSV_MAX_PENDING_ROWS)
+        csv_write_rows();
+}
+
+static void
+csv_accumulate_sample_run(const uint8_t *reports, size_t stride, int n_reports)
+{
+    while (n_reports > 1) {
+        int n = gputop_oa_accumulator_period_reports(&csv_accumulator,
+                                                     reports, stride,
+                                                     n_reports,
+                                                     csv_aggregation_period);
+
+        gputop_oa_accumulate_report_batch(&csv_accumulator, reports, stride, n);
+
+        if (csv_accumulator.last_timestamp - csv_accumulator.first_timestamp >
+            csv_aggregation_period)
+        {
+            csv_queue_row(&csv_accumulator);
+            gputop_oa_accumulator_clear(&csv_accumulator);
+        }
+
+        /* The last report accumulated starts the next row */
+        reports += (n - 1) * stride;
+        n_reports -= n - 1;
+    }
+}
+
+/* Reports are accumulated as soon as they are read so that, even with
+ * short aggregation periods, nothing is buffered besides the stream's
+ * ring */
+static void
+csv_stream_ready_cb(struct gputop_perf_stream *stream)
+{
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    const uint8_t *last = NULL;
+    const uint8_t *data;
+    const uint8_t *end;
+
+    gputop_i915_perf_stream_drain(stream);
+
+    if (csv_have_last_report)
+        last = csv_last_report;
+
+    /* NB: the ring is mapped twice, back to back, so the pending data is
+     * always contiguous even if it straddles the wrap point */
+    data = ring->data + (ring->tail & (ring->size - 1));
+    end = data + (ring->head - ring->tail);
+
+    pthread_mutex_lock(&csv_lock);
+
+    /* Recording has finished if the application is exiting */
+    if (csv_fd < 0)
+        data = end;
+
+    while (data < end) {
+        const struct i915_perf_record_header *header = (const void *)data;
+
+        switch (header->type) {
+        case DRM_I915_PERF_RECORD_OA_BUFFER_LOST:
+        case DRM_I915_PERF_RECORD_OA_REPORT_LOST:
+            /* Don't accumulate across a discontinuity */
+            csv_n_lost++;
+            last = NULL;
+            break;
+
+        case DRM_I915_PERF_RECORD_SAMPLE: {
+            const uint8_t *report = (const uint8_t *)(header + 1);
+            int n;
+
+            if (last &&
+                gputop_oa_accumulate_reports(&csv_accumulator, last, report,
+                                             false))
+            {
+                uint64_t elapsed = (csv_accumulator.last_timestamp -
+                                    csv_accumulator.first_timestamp);
+
+                if (elapsed > csv_aggregation_period) {
+                    csv_queue_row(&csv_accumulator);
+                    gputop_oa_accumulator_clear(&csv_accumulator);
+                }
+            }
+
+            last = report;
+
+            /* The run of samples that follows is accumulated in batches,
+             * split wherever a row's aggregation period ends */
+            n = gputop_i915_perf_count_sample_run(data, end);
+            csv_accumulate_sample_run(report, header->size, n);
+            last = report + (n - 1) * header->size;
+            data += (n - 1) * header->size;
+            break;
+        }
+
+        default:
+            dbg("i915 perf: Spurious header type = %d\n", header->type);
+            break;
+        }
+
+        data += header->size;
+    }
+
+    csv_write_rows();
+
+    pthread_mutex_unlock(&csv_lock);
+
+    if (last && last != csv_last_report)
+        memcpy(csv_last_report, last, csv_metric_set->perf_raw_size);
+    csv_have_last_report = last != NULL;
+
+    gputop_i915_perf_stream_ring_consume(stream, ring->head - ring->tail);
+}
+
+static void
+csv_finish(void)
+{
+    pthread_mutex_lock(&csv_lock);
+
+    if (csv_fd >= 0) {
+        csv_write_rows();
+        csv_flush();
+        if (csv_fd != STDOUT_FILENO)
+            close(csv_fd);
+        csv_fd = -1;
+
+        fprintf(stderr, "CSV: %"PRIu64" rows written", csv_n_rows);
+        if (csv_n_lost)
+            fprintf(stderr, ", %"PRIu64" discontinuities in the OA data", csv_n_lost);
+        fprintf(stderr, "\n");
+    }
+
+    pthread_mutex_unlock(&csv_lock);
+}
+
+static void
+csv_flush_timer_cb(uv_timer_t *timer)
+{
+    pthread_mutex_lock(&csv_lock);
+    if (csv_fd >= 0)
+        csv_flush();
+    pthread_mutex_unlock(&csv_lock);
+}
+
+static void
+csv_signal_cb(uv_signal_t *handle, int signo)
+{
+    csv_finish();
+    exit(128 + signo);
+}
+
+static void
+csv_replay_update_cb(struct gputop_oa_accumulator *accumulator, void *data)
+{
+    csv_queue_row(accumulator);
+}
+
+/* Opens the recording to replay and initializes perf for the device it
+ * was made on, returning the recorded metric set */
+static struct gputop_metric_set *
+csv_open_replay(const char *filename, struct gputop_record_reader **reader_out)
+{
+    struct gputop_record_reader *reader;
+    const struct gputop_record_header *header;
+    struct gputop_metric_set *metric_set;
+    char *error = NULL;
+
+    reader = gputop_record_reader_open(filename, &error);
+    if (!reader) {
+        fprintf(stderr, "%s", error);
+        free(error);
+        return NULL;
+    }
+
+    header = reader->header;
+
+    if (!gputop_perf_initialize_for_replay(&reader->devinfo)) {
+        fprintf(stderr, "Failed to initialize perf for replay\n");
+        gputop_record_reader_close(reader);
+        return NULL;
+    }
+
+    metric_set = memchr(header->guid, '\0', sizeof(header->guid)) ?
+        gputop_perf_lookup_metric_set(header->guid) : NULL;
+    if (!metric_set ||
+        metric_set->perf_oa_format != header->perf_oa_format ||
+        metric_set->perf_raw_size != header->perf_raw_size)
+    {
+        fprintf(stderr, "Failed to find the metric set recorded in %s\n",
+                filename);
+        gputop_record_reader_close(reader);
+        return NULL;
+    }
+
+    *reader_out = reader;
+
+    return metric_set;
+}
+
+/* NB: the application isn't sampled so just exit once finished */
+static void __attribute__((noreturn))
+csv_replay(struct gputop_record_reader *reader, uint64_t start)
+{
+    const uint8_t *pos = gputop_record_reader_seek(reader, start);
+
+    pthread_mutex_lock(&csv_lock);
+    gputop_record_reader_accumulate(reader, pos, &csv_accumulator,
+                                    csv_aggregation_period,
+                                    csv_replay_update_cb, NULL);
+    csv_write_rows();
+    pthread_mutex_unlock(&csv_lock);
+
+    gputop_record_reader_close(reader);
+
+    csv_finish();
+    exit(0);
+}
+
+static uint64_t
+csv_get_u64_env(const char *var, uint64_t default_value)
+{
+    const char *str = getenv(var);
+
+    return str ? strtoull(str, NULL, 10) : default_value;
+}
+
+static void
+csv_list_metric_sets(void)
+{
+    fprintf(stderr, "\nList of metric sets selectable with --metrics=...\n");
+
+    for (int i = 0; i < gputop_perf_oa_supported_metric_set_guids->len; i++) {
+        const char *guid = array_value_at(gputop_perf_oa_supported_metric_set_guids,
+                                          char *, i);
+        struct gputop_metric_set *metric_set =
+            gputop_perf_lookup_metric_set(guid);
+
+        fprintf(stderr, "%s: %s, hw-config-guid=%s\n",
+                metric_set->symbol_name, metric_set->name, guid);
+    }
+}
+
+static void
+csv_list_columns(struct gputop_metric_set *metric_set)
+{
+    fprintf(stderr, "\nList of counters selectable with --columns=... (comma separated)\n");
+    fprintf(stderr, "Timestamp: Sample timestamp\n");
+
+    for (int i = 0; i < metric_set->n_counters; i++) {
+        const struct gputop_metric_set_counter *counter = &metric_set->counters[i];
+
+        fprintf(stderr, "%s: %s - %s\n",
+                counter->symbol_name, counter->name, counter->desc);
+    }
+
+    fprintf(stderr, "\nALL: Timestamp");
+    for (int i = 0; i < metric_set->n_counters; i++)
+        fprintf(stderr, ",%s", metric_set->counters[i].symbol_name);
+    fprintf(stderr, "\n");
+}
+
+static struct gputop_metric_set *
+csv_lookup_metric_set(const char *symbol_name)
+{
+    for (int i = 0; i < gputop_perf_oa_supported_metric_set_guids->len; i++) {
+        const char *guid = array_value_at(gputop_perf_oa_supported_metric_set_guids,
+                                          char *, i);
+        struct gputop_metric_set *metric_set =
+            gputop_perf_lookup_metric_set(guid);
+
+        if (strcmp(metric_set->symbol_name, symbol_name) == 0)
+            return metric_set;
+    }
+
+    return NULL;
+}
+
+/* Returns false if none of the columns correspond to available counters */
+static bool
+csv_parse_columns(const char *columns)
+{
+    char *copy = strdup(columns);
+    char *saveptr = NULL;
+    bool have_counter = false;
+
+    for (char *name = strtok_r(copy, ",", &saveptr);
+         name;
+         name = strtok_r(NULL, ",", &saveptr))
+    {
+        struct csv_column *column;
+
+        csv_columns = xrealloc(csv_columns,
+                               sizeof(*csv_columns) * (n_csv_columns + 1));
+        column = &csv_columns[n_csv_columns++];
+        column->name = strdup(name);
+
+        if (strcmp(name, "Timestamp") == 0) {
+            column->counter = CSV_COLUMN_TIMESTAMP;
+            continue;
+        }
+
+        /* NB: as with gputop-csv.js, columns for counters not available
+         * on this system are kept, but just written as zero */
+        column->counter = CSV_COLUMN_UNAVAILABLE;
+        for (int i = 0; i < csv_metric_set->n_counters; i++) {
+            if (strcmp(csv_metric_set->counters[i].symbol_name, name) == 0) {
+                column->counter = i;
+                have_counter = true;
+                break;
+            }
+        }
+    }
+
+    free(copy);
+
+    return have_counter;
+}
+
+/* The largest exponent whose sampling period, of
+ * 2^(exponent + 1) timestamp ticks, doesn't exceed @period_ns */
+static int
+csv_exponent_for_period(uint64_t period_ns)
+{
+    uint64_t timestamp_frequency = gputop_devinfo.timestamp_frequency;
+    int exponent;
+
+    /* The timestamp for HSW+ increments every 80ns */
+    if (!timestamp_frequency)
+        timestamp_frequency = 12500000;
+
+    for (exponent = 0; exponent < 31; exponent++) {
+        double next_period = (double)(1ULL << (exponent + 2)) * 1000000000.0 /
+            timestamp_frequency;
+
+        if (next_period > period_ns)
+            break;
+    }
+
+    return exponent;
+}
+
+static void
+csv_write_header(void)
+{
+    /* NB: matches the header written by gputop-csv.js */
+    for (int i = 0; i < n_csv_columns; i++) {
+        char *p = csv_reserve(strlen(csv_columns[i].name) + 4);
+
+        if (i)
+            csv_buffer_len += sprintf(p, ",\"%s\"", csv_columns[i].name);
+        else
+            csv_buffer_len += sprintf(p, "%s", csv_columns[i].name);
+    }
+
+    *csv_reserve(1) = '\n';
+    csv_buffer_len++;
+}
+
+bool
+gputop_csv_run(void)
+{
+    const char *filename = getenv("GPUTOP_CSV_FILE");
+    const char *metrics_name = getenv("GPUTOP_CSV_METRICS");
+    const char *columns = getenv("GPUTOP_CSV_COLUMNS");
+    const char *replay = getenv("GPUTOP_REPLAY");
+    struct gputop_record_reader *reader = NULL;
+    uint64_t period = csv_get_u64_env("GPUTOP_CSV_PERIOD", CSV_DEFAULT_PERIOD);
+    int period_exponent;
+    char *error = NULL;
+
+    if (replay) {
+        csv_metric_set = csv_open_replay(replay, &reader);
+        if (!csv_metric_set)
+            return false;
+
+        /* The sampling period was fixed when recording */
+        period_exponent = reader->header->period_exponent;
+        period = (double)(2ULL << period_exponent) * 1000000000.0 /
+            gputop_devinfo.timestamp_frequency;
+    } else {
+        if (!gputop_perf_initialize()) {
+            fprintf(stderr, "Failed to initialize perf\n");
+            return false;
+        }
+
+        if (!metrics_name || strcmp(metrics_name, "list") == 0) {
+            csv_list_metric_sets();
+            return false;
+        }
+
+        csv_metric_set = csv_lookup_metric_set(metrics_name);
+        if (!csv_metric_set) {
+            fprintf(stderr, "Failed to look up metric set \"%s\"\n", metrics_name);
+            return false;
+        }
+
+        period_exponent = csv_exponent_for_period(period);
+    }
+
+    if (!columns || strcmp(columns, "list") == 0) {
+        csv_list_columns(csv_metric_set);
+        return false;
+    }
+
+    if (!csv_parse_columns(columns)) {
+        fprintf(stderr, "Failed to find counters matching requested columns\n");
+        return false;
+    }
+
+    if (n_csv_columns * CSV_MAX_FIELD_LEN + 1 > CSV_BUFFER_SIZE) {
+        fprintf(stderr, "Too many CSV columns\n");
+        return false;
+    }
+
+    if (!replay) {
+        if (period == 0 || period > 1000000000) {
+            fprintf(stderr, "Sampling period out of range [1, 1000000000]\n");
+            return false;
+        }
+        if (period > 40000000) {
+            fprintf(stderr, "WARNING: EU counters may overflow 32 bits with a long "
+                    "sampling period (recommend < 40 millisecond period)\n");
+        }
+    }
+
+    csv_aggregation_period = csv_get_u64_env("GPUTOP_CSV_AGGREGATION_PERIOD",
+                                             CSV_DEFAULT_AGGREGATION_PERIOD);
+    if (csv_aggregation_period < period) {
+        fprintf(stderr, "Counter aggregation period (%"PRIu64") should be >= "
+                "requested hardware sampling period (%"PRIu64")\n",
+                csv_aggregation_period, period);
+        return false;
+    }
+
+    if (!filename || strcmp(filename, "-") == 0)
+        csv_fd = STDOUT_FILENO;
+    else {
+        csv_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        if (csv_fd < 0) {
+            fprintf(stderr, "Failed to open CSV file %s: %m\n", filename);
+            return false;
+        }
+    }
+
+    fprintf(stderr, "CSV: Capture Settings:\n");
+    if (replay)
+        fprintf(stderr, "CSV:   Replaying: %s\n", replay);
+    fprintf(stderr, "CSV:   File: %s\n", csv_fd == STDOUT_FILENO ? "STDOUT" : filename);
+    fprintf(stderr, "CSV:   Metric Set: %s\n", csv_metric_set->name);
+    fprintf(stderr, "CSV:   Columns: %s\n", columns);
+    fprintf(stderr, "CSV:   OA Hardware Period requested: %"PRIu64"\n", period);
+    fprintf(stderr, "CSV:   OA Hardware Sampling Exponent: %d\n", period_exponent);
+    fprintf(stderr, "CSV:   Accumulation period: %"PRIu64"\n", csv_aggregation_period);
+
+    csv_write_header();
+
+    gputop_oa_accumulator_init(&csv_accumulator, csv_metric_set);
+    csv_counter_values = xmalloc(sizeof(double) * 2 * csv_metric_set->n_counters *
+                                 CSV_MAX_PENDING_ROWS);
+    csv_last_report = xmalloc(csv_metric_set->perf_raw_size);
+
+    if (replay)
+        csv_replay(reader, csv_get_u64_env("GPUTOP_REPLAY_START", 0));
+
+    csv_stream = gputop_open_i915_perf_oa_stream(csv_metric_set,
+                                                 period_exponent,
+                                                 NULL, /* system wide */
+                                                 csv_stream_ready_cb,
+                                                 false,
+                                                 &error);
+    if (!csv_stream ||
+        !gputop_i915_perf_stream_enable_ring(csv_stream, CSV_RING_SIZE, &error))
+    {
+        fprintf(stderr, "Failed to open OA stream: %s\n", error);
+        free(error);
+        csv_finish();
+        return false;
+    }
+
+    if (getenv("GPUTOP_OA_READER_THREAD") || getenv("GPUTOP_OA_READER_CPU")) {
+        const char *cpu = getenv("GPUTOP_OA_READER_CPU");
+        char *reader_error = NULL;
+
+        /* Falling back to reading from the mainloop is fine */
+        if (!gputop_i915_perf_stream_start_reader(csv_stream,
+                                                  cpu ? atoi(cpu) : -1,
+                                                  &reader_error))
+        {
+            dbg("%s", reader_error);
+            free(reader_error);
+        }
+    }
+
+    uv_timer_init(gputop_mainloop, &csv_flush_timer);
+    uv_timer_start(&csv_flush_timer, csv_flush_timer_cb,
+                   CSV_FLUSH_PERIOD_MS, CSV_FLUSH_PERIOD_MS);
+
+    uv_signal_init(gputop_mainloop, &csv_sigint);
+    uv_signal_start(&csv_sigint, csv_signal_cb, SIGINT);
+    uv_signal_init(gputop_mainloop, &csv_sigterm);
+    uv_signal_start(&csv_sigterm, csv_signal_cb, SIGTERM);
+
+    atexit(csv_finish);
+
+    return true;
+}
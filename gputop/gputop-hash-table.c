@@ -165,6 +165,7 @@ gputop_hash_table_destroy(struct gputop_hash_table *ht,
             delete_function(entry);
         }
     }
+    free(ht->table);
     free(ht);
 }
 
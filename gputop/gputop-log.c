@@ -28,107 +28,200 @@
 #include <stdio.h>
 #include <string.h>
 
+/* NB: We use a portable stdatomic.h, so we don't depend on a recent compiler...
+ */
+#include "stdatomic.h"
+
 #include "gputop-util.h"
 #include "gputop-log.h"
 
-pthread_once_t gputop_log_init_once = PTHREAD_ONCE_INIT;
-pthread_rwlock_t gputop_log_lock = PTHREAD_RWLOCK_INITIALIZER;
-
-int gputop_log_len;
-gputop_list_t gputop_log_entries;
-
-void
-gputop_log_init(void)
+/*
+ * A bounded multi-producer, single-consumer ring of log slots.
+ *
+ * Each slot has a sequence number that says whether it is free for the
+ * producer claiming ring position N (seq == N) or holds a message ready for
+ * the consumer at position N (seq == N + 1). Producers claim a position by
+ * advancing log_tail with a compare and exchange, then publish the slot by
+ * storing seq; the consumer frees a slot for the next lap of the ring by
+ * setting seq = N + GPUTOP_LOG_RING_SIZE.
+ *
+ * Positions are free running and compared via signed differences so they
+ * can safely wrap.
+ */
+struct log_slot {
+    atomic_uint seq;
+    int level;
+    char msg[GPUTOP_LOG_MAX_MESSAGE_LEN];
+};
+
+static pthread_once_t log_init_once = PTHREAD_ONCE_INIT;
+static struct log_slot log_ring[GPUTOP_LOG_RING_SIZE];
+static atomic_uint log_tail;
+static atomic_uint log_n_dropped;
+
+/* Only accessed by the consumer */
+static unsigned int log_head;
+
+static void
+log_init(void)
 {
-    gputop_list_init(&gputop_log_entries);
+    for (int i = 0; i < GPUTOP_LOG_RING_SIZE; i++)
+        atomic_init(&log_ring[i].seq, i);
+    atomic_init(&log_tail, 0);
+    atomic_init(&log_n_dropped, 0);
 }
 
 void
 gputop_log(int level, const char *message, int len)
 {
-    struct gputop_log_entry *entry;
+    struct log_slot *slot;
+    unsigned int pos;
+
+    pthread_once(&log_init_once, log_init);
+
+    pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    while (true) {
+        unsigned int seq;
+        int diff;
+
+        slot = &log_ring[pos & (GPUTOP_LOG_RING_SIZE - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (int)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+            /* NB: pos was updated by the failed exchange */
+        } else if (diff < 0) {
+            /* The consumer hasn't freed this slot yet; the ring is full */
+            atomic_fetch_add_explicit(&log_n_dropped, 1, memory_order_relaxed);
+            return;
+        } else
+            pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    }
 
-    pthread_once(&gputop_log_init_once, gputop_log_init);
+    if (len < 0)
+        len = strnlen(message, sizeof(slot->msg) - 1);
+    else
+        len = MIN(len, sizeof(slot->msg) - 1);
 
-    /* XXX: HACK */
-    printf("%s", message);
+    slot->level = level;
+    memcpy(slot->msg, message, len);
+    slot->msg[len] = '\0';
 
-    if (len < 0)
-        len = strlen(message);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
 
-    pthread_rwlock_wrlock(&gputop_log_lock);
+int
+gputop_log_drain(int max_entries,
+                 void (*entry_cb)(int level, const char *message, void *data),
+                 void *data)
+{
+    unsigned int n_dropped;
+    int n = 0;
 
-    if (gputop_log_len > 10000) {
-        entry = gputop_container_of(gputop_log_entries.prev,
-                                    struct gputop_log_entry, link);
-        gputop_list_remove(&entry->link);
-        free(entry->msg);
-        gputop_log_len--;
-    } else
-        entry = xmalloc(sizeof(*entry));
+    pthread_once(&log_init_once, log_init);
 
-    entry->level = level;
-    entry->msg = strndup(message, len);
+    n_dropped = atomic_exchange_explicit(&log_n_dropped, 0,
+                                         memory_order_relaxed);
+    if (n_dropped && max_entries) {
+        char note[64];
 
-    gputop_list_insert(gputop_log_entries.prev, &entry->link);
-    gputop_log_len++;
+        snprintf(note, sizeof(note), "gputop: %u log messages dropped\n",
+                 n_dropped);
+        entry_cb(GPUTOP_LOG_LEVEL_HIGH, note, data);
+        n++;
+    }
 
-    pthread_rwlock_unlock(&gputop_log_lock);
-}
+    while (n < max_entries) {
+        struct log_slot *slot = &log_ring[log_head & (GPUTOP_LOG_RING_SIZE - 1)];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
 
-Gputop__Log *
-gputop_get_pb_log(void)
-{
-    Gputop__Log *log = NULL;
-    struct gputop_log_entry *entry, *tmp;
-    int i = 0;
+        if ((int)(seq - (log_head + 1)) < 0)
+            break;
 
-    pthread_once(&gputop_log_init_once, gputop_log_init);
+        entry_cb(slot->level, slot->msg, data);
+        n++;
 
-    if (!gputop_log_len) {
-        return NULL;
+        atomic_store_explicit(&slot->seq, log_head + GPUTOP_LOG_RING_SIZE,
+                              memory_order_release);
+        log_head++;
     }
 
-    pthread_rwlock_rdlock(&gputop_log_lock);
+    return n;
+}
 
-    log = xmalloc(sizeof(Gputop__Log));
-    gputop__log__init(log);
-    log->n_entries = gputop_log_len;
-    log->entries = xmalloc(gputop_log_len * sizeof(void *));
+struct pb_log_closure {
+    Gputop__Log *log;
+    ProtobufCAllocator *allocator;
+};
+
+static void
+append_pb_log_entry_cb(int level, const char *message, void *data)
+{
+    struct pb_log_closure *closure = data;
+    ProtobufCAllocator *allocator = closure->allocator;
+    Gputop__Log *log = closure->log;
+    Gputop__LogEntry *pb_entry;
+    int len = strlen(message);
+
+    /* XXX: HACK */
+    printf("%s", message);
 
-    gputop_list_for_each_safe(entry, tmp, &gputop_log_entries, link) {
-        Gputop__LogEntry *pb_entry = xmalloc(sizeof(Gputop__LogEntry));
+    pb_entry = allocator->alloc(allocator->allocator_data,
+                                sizeof(Gputop__LogEntry));
+    gputop__log_entry__init(pb_entry);
+    pb_entry->log_level = level;
+    pb_entry->log_message = allocator->alloc(allocator->allocator_data, len + 1);
+    memcpy(pb_entry->log_message, message, len + 1);
+    log->entries[log->n_entries++] = pb_entry;
+}
 
-        gputop__log_entry__init(pb_entry);
-        pb_entry->log_level = entry->level;
-        pb_entry->log_message = entry->msg; /* steal the string */
-        log->entries[i] = pb_entry;
+Gputop__Log *
+gputop_get_pb_log(ProtobufCAllocator *allocator)
+{
+    /* One more than the ring size, for the dropped messages note */
+    Gputop__LogEntry *entries[GPUTOP_LOG_RING_SIZE + 1];
+    struct pb_log_closure closure;
+    Gputop__Log *log = NULL;
+    Gputop__Log tmp;
 
-        i++;
+    gputop__log__init(&tmp);
+    tmp.entries = entries;
 
-        gputop_list_remove(&entry->link);
-    }
-    gputop_log_len = 0;
+    closure.log = &tmp;
+    closure.allocator = allocator;
+
+    if (!gputop_log_drain(GPUTOP_LOG_RING_SIZE + 1,
+                          append_pb_log_entry_cb, &closure))
+        return NULL;
 
-    pthread_rwlock_unlock(&gputop_log_lock);
+    log = allocator->alloc(allocator->allocator_data, sizeof(Gputop__Log));
+    gputop__log__init(log);
+    log->n_entries = tmp.n_entries;
+    log->entries = allocator->alloc(allocator->allocator_data,
+                                    tmp.n_entries * sizeof(void *));
+    memcpy(log->entries, entries, tmp.n_entries * sizeof(void *));
 
     return log;
 }
 
 void
-gputop_pb_log_free(Gputop__Log *log)
+gputop_pb_log_free(Gputop__Log *log, ProtobufCAllocator *allocator)
 {
     int i;
 
     if (log->n_entries) {
         for (i = 0; i < log->n_entries; i++) {
             Gputop__LogEntry *entry = log->entries[i];
-            free(entry->log_message);
-            free(entry);
+            allocator->free(allocator->allocator_data, entry->log_message);
+            allocator->free(allocator->allocator_data, entry);
         }
 
-        free(log->entries);
+        allocator->free(allocator->allocator_data, log->entries);
     }
 
-    free(log);
+    allocator->free(allocator->allocator_data, log);
 }
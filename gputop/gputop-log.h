@@ -50,11 +50,6 @@
 #endif
 
 
-extern pthread_once_t gputop_log_init_once;
-extern pthread_rwlock_t gputop_log_lock;
-extern int gputop_log_len;
-extern gputop_list_t gputop_log_entries;
-
 enum gputop_log_level {
     GPUTOP_LOG_LEVEL_HIGH = 1,
     GPUTOP_LOG_LEVEL_MEDIUM,
@@ -62,14 +57,27 @@ enum gputop_log_level {
     GPUTOP_LOG_LEVEL_NOTIFICATION,
 };
 
-struct gputop_log_entry {
-    gputop_list_t link;
-    char *msg;
-    int level;
-};
+/* Messages are copied into a fixed size ring of preallocated slots so that
+ * logging never allocates or takes a lock, since we may be called from an
+ * application's render thread (e.g. via KHR_debug callbacks). Longer
+ * messages are truncated and if the ring is full the message is dropped
+ * and counted instead. */
+#define GPUTOP_LOG_RING_SIZE 1024 /* must be a power of two */
+#define GPUTOP_LOG_MAX_MESSAGE_LEN 256
 
-void gputop_log_init(void);
 void gputop_log(int level, const char *message, int len);
 
-Gputop__Log *gputop_get_pb_log(void);
-void gputop_pb_log_free(Gputop__Log *log);
+/* Consumer side; these must only be called from one thread (the mainloop).
+ *
+ * gputop_log_drain() calls entry_cb for up to max_entries pending messages,
+ * oldest first, and returns the number drained. The message is only valid
+ * for the duration of the callback. If messages had to be dropped since
+ * the last drain a note of how many is reported first. */
+int gputop_log_drain(int max_entries,
+                     void (*entry_cb)(int level, const char *message,
+                                      void *data),
+                     void *data);
+
+/* The log message and its entries are allocated with @allocator */
+Gputop__Log *gputop_get_pb_log(ProtobufCAllocator *allocator);
+void gputop_pb_log_free(Gputop__Log *log, ProtobufCAllocator *allocator);
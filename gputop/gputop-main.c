@@ -50,7 +50,11 @@ usage(void)
            "                                   without executing the program\n\n"
            "     --dry-run                     Print the environment variables\n"
            "                                   without executing the program\n\n"
-           "     --fake                        Run gputop using fake metrics\n\n");
+           "     --fake                        Run gputop using fake metrics\n\n"
+           "     --metrics-xml=<oa-chipset.xml>\n"
+           "                                   Load the metric sets from an OA\n"
+           "                                   metrics xml file at runtime instead\n"
+           "                                   of using the built in metric sets\n\n");
 #ifdef SUPPORT_GL
     printf("     --libgl=<libgl_filename>      Explicitly specify the real libGL\n"
            "                                   library to intercept\n\n"
@@ -63,6 +67,25 @@ usage(void)
 #endif
     printf("     --ncurses                     Enable ncurses view of metrics\n");
     printf("                                   (deprecated)\n\n");
+    printf("     --record=<filename>           Capture the raw OA reports of the\n"
+           "                                   first metric set opened remotely\n"
+           "                                   to a file for later replay\n\n");
+    printf("     --record-csv=<filename>       Write counters to a CSV file (or \"-\"\n"
+           "                                   for stdout) without a remote client\n\n"
+           "     --metrics=<symbol>            Metric set to record to CSV\n"
+           "                                   (\"list\" to list them)\n\n"
+           "     --columns=<symbol,...>        Counters to record as CSV columns,\n"
+           "                                   including \"Timestamp\" (\"list\" to\n"
+           "                                   list them)\n\n"
+           "     --period=<ns>                 Maximum OA sampling period for CSV\n"
+           "                                   recording (default 40 milliseconds)\n\n"
+           "     --aggregation-period=<ns>     Period covered by each CSV row\n"
+           "                                   (default 1 second)\n\n"
+           "     --replay=<filename>           Write counters to CSV from a file\n"
+           "                                   captured with --record instead of\n"
+           "                                   sampling live (--metrics is ignored)\n\n"
+           "     --replay-start=<ns>           Offset into the recording to start\n"
+           "                                   replaying from\n\n");
     printf(" -h, --help                        Display this help\n\n"
            "\n"
            " Note: gputop is only a wrapper for setting environment variables\n"
@@ -72,8 +95,28 @@ usage(void)
            "\n"
            " Environment:\n"
            "\n"
-           "     GPUTOP_MODE={remote,ncurses}  The mode of accessing metrics\n"
+           "     GPUTOP_MODE={remote,ncurses,csv}\n"
+           "                                   The mode of accessing metrics\n"
            "                                   (defaults to remote)\n\n"
+           "     GPUTOP_RECORD=<filename>      File to capture raw OA reports to\n"
+           "                                   (always read from a dedicated thread)\n\n"
+           "     GPUTOP_REPLAY=<filename>      Recording to write CSV counters for\n\n"
+           "     GPUTOP_REPLAY_START=<ns>      Offset into the recording to start from\n\n"
+           "     GPUTOP_OA_READER_THREAD=1     Read OA reports from a dedicated\n"
+           "                                   thread per stream so a busy server\n"
+           "                                   can't cause reports to be lost\n\n"
+           "     GPUTOP_OA_READER_CPU=<cpu>    Also pin OA reader threads to <cpu>\n\n"
+           "     GPUTOP_OA_EXPONENT={0-31,auto}\n"
+           "                                   OA sampling exponent for the ncurses\n"
+           "                                   tabs; the period is 2^(exponent + 1)\n"
+           "                                   GPU timestamp ticks. \"auto\" picks\n"
+           "                                   the longest period that avoids EU\n"
+           "                                   counter overflow\n\n"
+           "     GPUTOP_TRACE_SECONDS=<seconds>\n"
+           "                                   Duration of the ncurses trace buffer\n"
+           "                                   (defaults to 5)\n\n"
+           "     GPUTOP_METRICS_XML=<filename> OA metrics xml file to load metric\n"
+           "                                   sets from at runtime\n\n"
 #ifdef SUPPORT_GL
            "     LD_PRELOAD=<prefix>/lib/wrappers/libfakeGL.so:<prefix>/lib/libgputop.so\n"
            "                                   The gputop libGL.so and syscall\n"
@@ -268,6 +311,32 @@ print_gputop_env_vars(void)
         fprintf(stderr, "GPUTOP_MODE=%s \\\n", getenv("GPUTOP_MODE"));
     if (getenv("GPUTOP_WEB_ROOT"))
         fprintf(stderr, "GPUTOP_WEB_ROOT=%s \\\n", getenv("GPUTOP_WEB_ROOT"));
+    if (getenv("GPUTOP_RECORD"))
+        fprintf(stderr, "GPUTOP_RECORD=%s \\\n", getenv("GPUTOP_RECORD"));
+    if (getenv("GPUTOP_REPLAY"))
+        fprintf(stderr, "GPUTOP_REPLAY=%s \\\n", getenv("GPUTOP_REPLAY"));
+    if (getenv("GPUTOP_REPLAY_START"))
+        fprintf(stderr, "GPUTOP_REPLAY_START=%s \\\n", getenv("GPUTOP_REPLAY_START"));
+    if (getenv("GPUTOP_CSV_FILE"))
+        fprintf(stderr, "GPUTOP_CSV_FILE=%s \\\n", getenv("GPUTOP_CSV_FILE"));
+    if (getenv("GPUTOP_CSV_METRICS"))
+        fprintf(stderr, "GPUTOP_CSV_METRICS=%s \\\n", getenv("GPUTOP_CSV_METRICS"));
+    if (getenv("GPUTOP_CSV_COLUMNS"))
+        fprintf(stderr, "GPUTOP_CSV_COLUMNS=%s \\\n", getenv("GPUTOP_CSV_COLUMNS"));
+    if (getenv("GPUTOP_CSV_PERIOD"))
+        fprintf(stderr, "GPUTOP_CSV_PERIOD=%s \\\n", getenv("GPUTOP_CSV_PERIOD"));
+    if (getenv("GPUTOP_CSV_AGGREGATION_PERIOD"))
+        fprintf(stderr, "GPUTOP_CSV_AGGREGATION_PERIOD=%s \\\n", getenv("GPUTOP_CSV_AGGREGATION_PERIOD"));
+    if (getenv("GPUTOP_OA_READER_THREAD"))
+        fprintf(stderr, "GPUTOP_OA_READER_THREAD=%s \\\n", getenv("GPUTOP_OA_READER_THREAD"));
+    if (getenv("GPUTOP_OA_READER_CPU"))
+        fprintf(stderr, "GPUTOP_OA_READER_CPU=%s \\\n", getenv("GPUTOP_OA_READER_CPU"));
+    if (getenv("GPUTOP_OA_EXPONENT"))
+        fprintf(stderr, "GPUTOP_OA_EXPONENT=%s \\\n", getenv("GPUTOP_OA_EXPONENT"));
+    if (getenv("GPUTOP_TRACE_SECONDS"))
+        fprintf(stderr, "GPUTOP_TRACE_SECONDS=%s \\\n", getenv("GPUTOP_TRACE_SECONDS"));
+    if (getenv("GPUTOP_METRICS_XML"))
+        fprintf(stderr, "GPUTOP_METRICS_XML=%s \\\n", getenv("GPUTOP_METRICS_XML"));
 }
 
 static char *
@@ -341,6 +410,15 @@ main (int argc, char **argv)
 #define FAKE_OPT                (CHAR_MAX + 7)
 #define GPUTOP_SCISSOR_TEST     (CHAR_MAX + 8)
 #define PORT_OPT                (CHAR_MAX + 9)
+#define RECORD_OPT              (CHAR_MAX + 10)
+#define RECORD_CSV_OPT          (CHAR_MAX + 11)
+#define METRICS_OPT             (CHAR_MAX + 12)
+#define COLUMNS_OPT             (CHAR_MAX + 13)
+#define PERIOD_OPT              (CHAR_MAX + 14)
+#define AGGREGATION_PERIOD_OPT  (CHAR_MAX + 15)
+#define METRICS_XML_OPT         (CHAR_MAX + 16)
+#define REPLAY_OPT              (CHAR_MAX + 17)
+#define REPLAY_START_OPT        (CHAR_MAX + 18)
 
     /* The initial '+' means that getopt will stop looking for
      * options after the first non-option argument. */
@@ -358,6 +436,15 @@ main (int argc, char **argv)
 #endif
         {"ncurses",         no_argument,        0, NCURSES_OPT},
         {"port",            required_argument,  0, PORT_OPT},
+        {"record",          required_argument,  0, RECORD_OPT},
+        {"record-csv",      required_argument,  0, RECORD_CSV_OPT},
+        {"metrics",         required_argument,  0, METRICS_OPT},
+        {"columns",         required_argument,  0, COLUMNS_OPT},
+        {"period",          required_argument,  0, PERIOD_OPT},
+        {"aggregation-period", required_argument, 0, AGGREGATION_PERIOD_OPT},
+        {"metrics-xml",     required_argument,  0, METRICS_XML_OPT},
+        {"replay",          required_argument,  0, REPLAY_OPT},
+        {"replay-start",    required_argument,  0, REPLAY_START_OPT},
         {0, 0, 0, 0}
     };
     char *ld_preload_path;
@@ -406,6 +493,35 @@ main (int argc, char **argv)
             case PORT_OPT:
                 setenv("GPUTOP_PORT", optarg, true);
                 break;
+            case RECORD_OPT:
+                setenv("GPUTOP_RECORD", optarg, true);
+                break;
+            case RECORD_CSV_OPT:
+                setenv("GPUTOP_MODE", "csv", true);
+                setenv("GPUTOP_CSV_FILE", optarg, true);
+                break;
+            case METRICS_OPT:
+                setenv("GPUTOP_CSV_METRICS", optarg, true);
+                break;
+            case COLUMNS_OPT:
+                setenv("GPUTOP_CSV_COLUMNS", optarg, true);
+                break;
+            case PERIOD_OPT:
+                setenv("GPUTOP_CSV_PERIOD", optarg, true);
+                break;
+            case AGGREGATION_PERIOD_OPT:
+                setenv("GPUTOP_CSV_AGGREGATION_PERIOD", optarg, true);
+                break;
+            case METRICS_XML_OPT:
+                setenv("GPUTOP_METRICS_XML", optarg, true);
+                break;
+            case REPLAY_OPT:
+                setenv("GPUTOP_MODE", "csv", true);
+                setenv("GPUTOP_REPLAY", optarg, true);
+                break;
+            case REPLAY_START_OPT:
+                setenv("GPUTOP_REPLAY_START", optarg, true);
+                break;
             default:
                 fprintf(stderr, "Internal error: "
                         "unexpected getopt value: %d\n", opt);
@@ -42,6 +42,7 @@
 #include "gputop-mainloop.h"
 #include "gputop-util.h"
 #include "gputop-server.h"
+#include "gputop-csv.h"
 #include "gputop-log.h"
 #include "gputop-oa-counters.h"
 
@@ -97,12 +98,26 @@ static bool debug_disable_ncurses = false;
 
 static struct gputop_perf_stream *current_oa_stream;
 static struct gputop_oa_accumulator current_oa_accumulator;
+static double *current_oa_counter_values;
 
 static bool remote_ui = false;
+static bool csv_ui = false;
 
 static int y_pos;
 static double zoom = 1;
 
+/* The OA sampling exponent used by the overview and trace tabs. This is
+ * either one of the values below or an explicit exponent set via
+ * GPUTOP_OA_EXPONENT or the 'e'/'E' keys */
+#define OA_EXPONENT_DEFAULT     -1 /* per-tab default */
+#define OA_EXPONENT_AUTO        -2 /* see auto_oa_exponent() */
+#define OA_EXPONENT_MAX         31
+
+static int oa_exponent = OA_EXPONENT_DEFAULT;
+static int current_oa_exponent;
+
+static double trace_duration = 5.0; /* seconds */
+
 struct key_func
 {
     char* key;
@@ -138,6 +153,75 @@ static struct perf_oa_user overview_user = {
     .sample = overview_sample_cb,
 };
 
+static uint64_t
+oa_exponent_period_ns(int exponent)
+{
+    uint64_t timestamp_frequency = gputop_devinfo.timestamp_frequency;
+
+    /* The timestamp for HSW+ increments every 80ns */
+    if (!timestamp_frequency)
+        timestamp_frequency = 12500000;
+
+    /* The period_exponent gives a sampling period as follows:
+     *   sample_period = timestamp_period * 2^(period_exponent + 1)
+     */
+    return (2ULL << exponent) * 1000000000ULL / timestamp_frequency;
+}
+
+/* The aggregate EU counters can each increment by up to 2 per EU per
+ * GT clock, so the overflow period can be calculated as:
+ *
+ * 2^32 / (n_eus * max_gen_freq * 2)
+ * (E.g. 40 EUs @ 1GHz = ~53ms, 72 EUs @ 1.15GHz = ~26ms)
+ *
+ * This returns the largest exponent whose sampling period is still
+ * shorter than that, or -1 if we don't know enough about the device.
+ */
+static int
+auto_oa_exponent(void)
+{
+    uint64_t max_freq_hz = gputop_devinfo.gt_max_freq * 1000000ULL;
+    double overflow_ns;
+    int exponent;
+
+    if (!gputop_devinfo.n_eus || !max_freq_hz)
+        return -1;
+
+    overflow_ns = 4294967296.0 * 1000000000.0 /
+        ((double)gputop_devinfo.n_eus * max_freq_hz * 2);
+
+    for (exponent = 0; exponent < OA_EXPONENT_MAX; exponent++) {
+        if (oa_exponent_period_ns(exponent + 1) >= overflow_ns)
+            break;
+    }
+
+    return exponent;
+}
+
+/* NB: must be called after gputop_perf_initialize() so that
+ * gputop_devinfo is valid */
+static int
+resolve_oa_exponent(int tab_default)
+{
+    int exponent = oa_exponent;
+
+    if (exponent == OA_EXPONENT_AUTO) {
+        exponent = auto_oa_exponent();
+        if (exponent < 0) {
+            gputop_log(GPUTOP_LOG_LEVEL_HIGH,
+                       "Unknown EU count or max GT frequency; "
+                       "can't automatically pick OA exponent\n", -1);
+        }
+    }
+
+    if (exponent < 0)
+        exponent = tab_default;
+
+    current_oa_exponent = exponent;
+
+    return exponent;
+}
+
 static bool
 i915_perf_oa_overview_open(struct gputop_metric_set *metric_set,
                            bool enable_per_ctx)
@@ -164,19 +248,8 @@ i915_perf_oa_overview_open(struct gputop_metric_set *metric_set,
             goto err;
     }
 
-    /* The timestamp for HSW+ increments every 80ns
-     *
-     * The period_exponent gives a sampling period as follows:
-     *   sample_period = 80ns * 2^(period_exponent + 1)
-     *
-     * The overflow period for Haswell can be calculated as:
-     *
-     * 2^32 / (n_eus * max_gen_freq * 2)
-     * (E.g. 40 EUs @ 1GHz = ~53ms)
-     *
-     * We currently sample ~ every 10 milliseconds...
-     */
-    period_exponent = 16;
+    /* We currently sample ~ every 10 milliseconds by default... */
+    period_exponent = resolve_oa_exponent(16);
 
     current_oa_stream =
         gputop_open_i915_perf_oa_stream(metric_set,
@@ -190,6 +263,8 @@ i915_perf_oa_overview_open(struct gputop_metric_set *metric_set,
         goto err;
 
     gputop_oa_accumulator_init(&current_oa_accumulator, metric_set);
+    current_oa_counter_values = xrealloc(current_oa_counter_values,
+                                         sizeof(double) * 2 * metric_set->n_counters);
 
     return true;
 
@@ -227,6 +302,292 @@ bool gputop_perf_trace_full;
 uint8_t *gputop_perf_trace_head;
 int gputop_perf_n_samples = 0;
 
+/* So that redrawing a long trace doesn't mean re-accumulating every
+ * report that falls into each column, we also maintain a pyramid of
+ * pre-accumulated summaries as samples arrive.
+ *
+ * Numbering the pairs of consecutive reports from the start of the
+ * trace, the j'th summary at level k covers pairs [j << k, (j + 1) << k)
+ * with the sum of their deltas and the timestamps of their first and
+ * last report. A column can then be accumulated from O(log n) summaries.
+ *
+ * Levels below TRACE_SUMMARY_MIN_LEVEL aren't stored, to keep the
+ * pyramid smaller than the trace buffer itself. Those few pairs at the
+ * edges of a column are re-accumulated from the trace buffer instead.
+ */
+#define TRACE_SUMMARY_MIN_LEVEL 4
+#define TRACE_SUMMARY_MAX_LEVELS 48
+
+struct trace_summary {
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    uint64_t deltas[MAX_RAW_OA_COUNTERS];
+};
+
+struct trace_summary_level {
+    uint8_t *summaries; /* ring of capacity summaries */
+    uint64_t capacity;
+    uint64_t n_summaries; /* completed since the trace started */
+};
+
+static struct {
+    struct gputop_metric_set *metric_set;
+    bool per_ctx_mode;
+
+    int n_levels;
+    struct trace_summary_level levels[TRACE_SUMMARY_MAX_LEVELS];
+    struct trace_summary *pending; /* next TRACE_SUMMARY_MIN_LEVEL summary */
+
+    /* Report r of the trace is in trace buffer slot r % n_slots */
+    int n_slots;
+    uint64_t n_reports;
+    uint64_t *report_timestamps; /* per slot */
+    bool *pair_skipped;          /* per slot of the pair's first report */
+
+    /* Maintains the timestamp clock and per-context state as pairs are
+     * added */
+    struct gputop_oa_accumulator accumulator;
+} trace_pyramid;
+
+static struct trace_summary *
+trace_summary_at(int level, uint64_t index)
+{
+    struct trace_summary_level *l = &trace_pyramid.levels[level];
+
+    return (struct trace_summary *)l->summaries + (index % l->capacity);
+}
+
+/* Adds the deltas (if any, they're NULL for pairs skipped while in
+ * per-context mode) for a span of the trace to a summary */
+static void
+trace_summary_add(struct trace_summary *summary,
+                  const uint64_t *deltas,
+                  uint64_t first_timestamp,
+                  uint64_t last_timestamp)
+{
+    int i;
+
+    if (summary->first_timestamp == 0)
+        summary->first_timestamp = first_timestamp;
+    summary->last_timestamp = last_timestamp;
+
+    if (!deltas)
+        return;
+
+    for (i = 0; i < MAX_RAW_OA_COUNTERS; i++)
+        summary->deltas[i] += deltas[i];
+}
+
+static void
+trace_pyramid_fini(void)
+{
+    int i;
+
+    for (i = 0; i < TRACE_SUMMARY_MAX_LEVELS; i++)
+        free(trace_pyramid.levels[i].summaries);
+    free(trace_pyramid.pending);
+    free(trace_pyramid.report_timestamps);
+    free(trace_pyramid.pair_skipped);
+
+    memset(&trace_pyramid, 0, sizeof(trace_pyramid));
+}
+
+static void
+trace_pyramid_init(struct gputop_metric_set *metric_set, bool per_ctx_mode,
+                   int n_slots)
+{
+    int k;
+
+    trace_pyramid_fini();
+
+    trace_pyramid.metric_set = metric_set;
+    trace_pyramid.per_ctx_mode = per_ctx_mode;
+
+    for (k = TRACE_SUMMARY_MIN_LEVEL;
+         k < TRACE_SUMMARY_MAX_LEVELS && (1ULL << k) <= (uint64_t)n_slots;
+         k++)
+    {
+        struct trace_summary_level *level = &trace_pyramid.levels[k];
+
+        /* Enough to cover all the pairs in the trace buffer, including
+         * partial overlap at either end */
+        level->capacity = (n_slots >> k) + 2;
+        level->summaries = xmalloc(level->capacity * sizeof(struct trace_summary));
+    }
+    trace_pyramid.n_levels = k;
+
+    trace_pyramid.pending = xmalloc0(sizeof(struct trace_summary));
+
+    trace_pyramid.n_slots = n_slots;
+    trace_pyramid.report_timestamps = xmalloc0(sizeof(uint64_t) * n_slots);
+    trace_pyramid.pair_skipped = xmalloc0(sizeof(bool) * n_slots);
+
+    gputop_oa_accumulator_init(&trace_pyramid.accumulator, metric_set);
+}
+
+static void
+trace_pyramid_add_first_report(const uint8_t *report)
+{
+    struct gputop_oa_accumulator *accumulator = &trace_pyramid.accumulator;
+    const uint32_t *report32 = (const uint32_t *)report;
+
+    assert(trace_pyramid.n_reports == 0);
+
+    gputop_u32_clock_init(&accumulator->clock, report32[1]);
+    accumulator->last_ctx_id = report32[2];
+
+    trace_pyramid.report_timestamps[0] =
+        gputop_u32_clock_get_time(&accumulator->clock);
+    trace_pyramid.n_reports = 1;
+}
+
+/* Adds the pair of the last report added and the given report, which is
+ * expected to be the next report written to the trace buffer */
+static void
+trace_pyramid_add_report(const uint8_t *last_report, const uint8_t *report)
+{
+    struct gputop_oa_accumulator *accumulator = &trace_pyramid.accumulator;
+    int n_slots = trace_pyramid.n_slots;
+    uint64_t pair = trace_pyramid.n_reports - 1;
+    uint64_t first_timestamp = trace_pyramid.report_timestamps[pair % n_slots];
+    uint64_t last_timestamp;
+    bool skipped;
+    int k;
+
+    gputop_oa_accumulator_clear(accumulator);
+    skipped = !gputop_oa_accumulate_reports(accumulator, last_report, report,
+                                            trace_pyramid.per_ctx_mode);
+    if (skipped) {
+        /* The accumulator doesn't progress its clock for skipped pairs */
+        gputop_u32_clock_progress(&accumulator->clock,
+                                  ((const uint32_t *)report)[1]);
+    }
+    last_timestamp = gputop_u32_clock_get_time(&accumulator->clock);
+
+    trace_pyramid.report_timestamps[(pair + 1) % n_slots] = last_timestamp;
+    trace_pyramid.pair_skipped[pair % n_slots] = skipped;
+    trace_pyramid.n_reports++;
+
+    if (trace_pyramid.n_levels <= TRACE_SUMMARY_MIN_LEVEL)
+        return;
+
+    trace_summary_add(trace_pyramid.pending,
+                      skipped ? NULL : accumulator->deltas,
+                      first_timestamp, last_timestamp);
+
+    if ((pair + 1) % (1 << TRACE_SUMMARY_MIN_LEVEL))
+        return;
+
+    /* Complete the lowest level summary and then any higher level
+     * summaries that it completes */
+    k = TRACE_SUMMARY_MIN_LEVEL;
+    *trace_summary_at(k, trace_pyramid.levels[k].n_summaries++) =
+        *trace_pyramid.pending;
+    memset(trace_pyramid.pending, 0, sizeof(struct trace_summary));
+
+    for (k = k + 1; k < trace_pyramid.n_levels; k++) {
+        uint64_t n_children = trace_pyramid.levels[k - 1].n_summaries;
+        struct trace_summary *second;
+        struct trace_summary *summary;
+
+        if (n_children % 2)
+            break;
+
+        second = trace_summary_at(k - 1, n_children - 1);
+        summary = trace_summary_at(k, trace_pyramid.levels[k].n_summaries++);
+        *summary = *trace_summary_at(k - 1, n_children - 2);
+        trace_summary_add(summary, second->deltas,
+                          second->first_timestamp, second->last_timestamp);
+    }
+}
+
+/* The first pair whose reports are both still in the trace buffer */
+static uint64_t
+trace_pyramid_first_pair(void)
+{
+    uint64_t n_slots = trace_pyramid.n_slots;
+
+    return trace_pyramid.n_reports > n_slots ?
+        trace_pyramid.n_reports - n_slots : 0;
+}
+
+/* Adds the pairs from *pair onwards that end by end_timestamp to the
+ * given summary, using the largest summaries available, and advances
+ * *pair past them. Returns false if there were no such pairs. */
+static bool
+trace_pyramid_accumulate(uint64_t *pair, uint64_t end_timestamp,
+                         struct trace_summary *summary)
+{
+    int n_slots = trace_pyramid.n_slots;
+    uint64_t n_pairs = trace_pyramid.n_reports ? trace_pyramid.n_reports - 1 : 0;
+    uint64_t p = *pair;
+
+    while (p < n_pairs) {
+        uint64_t last_timestamp;
+        int k;
+
+        for (k = trace_pyramid.n_levels - 1; k >= TRACE_SUMMARY_MIN_LEVEL; k--) {
+            struct trace_summary_level *level = &trace_pyramid.levels[k];
+            uint64_t index = p >> k;
+            struct trace_summary *s;
+
+            if (p & (((uint64_t)1 << k) - 1) || index >= level->n_summaries)
+                continue;
+
+            s = trace_summary_at(k, index);
+            if (s->last_timestamp <= end_timestamp) {
+                trace_summary_add(summary, s->deltas,
+                                  s->first_timestamp, s->last_timestamp);
+                p += (uint64_t)1 << k;
+                break;
+            }
+        }
+        if (k >= TRACE_SUMMARY_MIN_LEVEL)
+            continue;
+
+        last_timestamp = trace_pyramid.report_timestamps[(p + 1) % n_slots];
+        if (last_timestamp > end_timestamp)
+            break;
+
+        if (trace_pyramid.pair_skipped[p % n_slots]) {
+            trace_summary_add(summary, NULL,
+                              trace_pyramid.report_timestamps[p % n_slots],
+                              last_timestamp);
+        } else {
+            int sample_size = trace_pyramid.metric_set->perf_raw_size;
+            const uint8_t *report0 =
+                gputop_perf_trace_buffer + (p % n_slots) * sample_size;
+            const uint8_t *report1 =
+                gputop_perf_trace_buffer + ((p + 1) % n_slots) * sample_size;
+            struct gputop_oa_accumulator accumulator;
+
+            gputop_oa_accumulator_init(&accumulator, trace_pyramid.metric_set);
+            gputop_oa_accumulate_reports(&accumulator, report0, report1, false);
+
+            trace_summary_add(summary, accumulator.deltas,
+                              trace_pyramid.report_timestamps[p % n_slots],
+                              last_timestamp);
+        }
+        p++;
+    }
+
+    if (p == *pair)
+        return false;
+
+    *pair = p;
+    return true;
+}
+
+static void
+trace_advance_head(int sample_size)
+{
+    gputop_perf_trace_head += sample_size;
+    if (gputop_perf_trace_head >= (gputop_perf_trace_buffer + gputop_perf_trace_buffer_size)) {
+        gputop_perf_trace_head = gputop_perf_trace_buffer;
+        gputop_perf_trace_full = true;
+    }
+}
+
 static void
 trace_sample_cb(struct gputop_perf_stream *stream, uint8_t *start, uint8_t *end)
 {
@@ -235,22 +596,105 @@ trace_sample_cb(struct gputop_perf_stream *stream, uint8_t *start, uint8_t *end)
 
     if (gputop_perf_trace_empty) {
         memcpy(gputop_perf_trace_head, start, sample_size);
-        gputop_perf_trace_head += sample_size;
+        trace_advance_head(sample_size);
         gputop_perf_trace_empty = false;
+
+        trace_pyramid_add_first_report(start);
     }
 
     memcpy(gputop_perf_trace_head, end, sample_size);
+    trace_pyramid_add_report(start, end);
 
-    gputop_perf_trace_head += sample_size;
-    if (gputop_perf_trace_head >= (gputop_perf_trace_buffer + gputop_perf_trace_buffer_size)) {
-        gputop_perf_trace_head = gputop_perf_trace_buffer;
-        gputop_perf_trace_full = true;
-    }
+    trace_advance_head(sample_size);
 
     if (!gputop_perf_trace_full)
         gputop_perf_n_samples++;
 }
 
+/* Don't let a long trace at a high sampling frequency eat all memory */
+#define MAX_TRACE_BUFFER_SIZE (256 * 1024 * 1024)
+
+static uint64_t
+trace_buffer_n_samples(int sample_size, int period_exponent)
+{
+    uint64_t n_samples =
+        (trace_duration * 1000000000.0) / oa_exponent_period_ns(period_exponent);
+
+    n_samples *= 1.25; /* a bit of leeway */
+
+    if (n_samples > MAX_TRACE_BUFFER_SIZE / sample_size)
+        n_samples = MAX_TRACE_BUFFER_SIZE / sample_size;
+
+    /* Even if the period is longer than the trace, there needs to be
+     * room for the pair of reports passed to trace_sample_cb() */
+    return n_samples > 2 ? n_samples : 2;
+}
+
+/* (Re)allocates the trace buffer to hold trace_duration seconds of
+ * samples, linearizing any samples already collected into the new
+ * buffer, oldest first. If the buffer shrinks we keep the most recent
+ * samples. */
+static void
+resize_trace_buffer(int sample_size, int period_exponent)
+{
+    int size = trace_buffer_n_samples(sample_size, period_exponent) * sample_size;
+    uint8_t *buffer = xmalloc0(size);
+    uint8_t *head = gputop_perf_trace_head;
+    uint8_t *old_end = gputop_perf_trace_buffer + gputop_perf_trace_buffer_size;
+    struct {
+        uint8_t *start;
+        uint8_t *end;
+    } segments[2] = {
+        { gputop_perf_trace_full ? head : NULL, gputop_perf_trace_full ? old_end : NULL },
+        { gputop_perf_trace_buffer, head },
+    };
+    size_t fill = (segments[0].end - segments[0].start) +
+                  (segments[1].end - segments[1].start);
+    size_t skip = fill > size ? fill - size : 0;
+    uint8_t *pos = buffer;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        size_t len = segments[i].end - segments[i].start;
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        memcpy(pos, segments[i].start + skip, len - skip);
+        pos += len - skip;
+        skip = 0;
+    }
+
+    free(gputop_perf_trace_buffer);
+
+    gputop_perf_trace_buffer = buffer;
+    gputop_perf_trace_buffer_size = size;
+    gputop_perf_n_samples = (pos - buffer) / sample_size;
+
+    if (pos >= buffer + size) {
+        gputop_perf_trace_head = buffer;
+        gputop_perf_trace_full = true;
+    } else {
+        gputop_perf_trace_head = pos;
+        gputop_perf_trace_full = false;
+    }
+
+    /* Rebuild the summary pyramid for the linearized reports */
+    trace_pyramid_init(current_oa_stream->metric_set,
+                       current_oa_stream->per_ctx_mode,
+                       size / sample_size);
+    for (i = 0; i < gputop_perf_n_samples; i++) {
+        if (i == 0)
+            trace_pyramid_add_first_report(buffer);
+        else {
+            trace_pyramid_add_report(buffer + (i - 1) * sample_size,
+                                     buffer + i * sample_size);
+        }
+    }
+}
+
 static struct perf_oa_user trace_user = {
     .sample = trace_sample_cb,
 };
@@ -260,9 +704,6 @@ gputop_i915_perf_oa_trace_open(struct gputop_metric_set *metric_set,
                                bool enable_per_ctx)
 {
     int period_exponent;
-    double duration = 5.0; /* seconds */
-    uint64_t period_ns;
-    uint64_t n_samples;
     char *error = NULL;
     struct ctx_handle *ctx = NULL;
 
@@ -284,14 +725,8 @@ gputop_i915_perf_oa_trace_open(struct gputop_metric_set *metric_set,
             goto err;
     }
 
-    /* The timestamp for HSW+ increments every 80ns
-     *
-     * The period_exponent gives a sampling period as follows:
-     *   sample_period = 80ns * 2^(period_exponent + 1)
-     *
-     * Sample ~ every 1 millisecond...
-     */
-    period_exponent = 11;
+    /* Sample ~ every 1 millisecond by default... */
+    period_exponent = resolve_oa_exponent(11);
 
     current_oa_stream =
         gputop_open_i915_perf_oa_stream(metric_set,
@@ -304,16 +739,17 @@ gputop_i915_perf_oa_trace_open(struct gputop_metric_set *metric_set,
         goto err;
 
     gputop_oa_accumulator_init(&current_oa_accumulator, metric_set);
+    current_oa_counter_values = xrealloc(current_oa_counter_values,
+                                         sizeof(double) * 2 * metric_set->n_counters);
 
-    period_ns = 80 * (2 << period_exponent);
-    n_samples = (duration  * 1000000000.0) / period_ns;
-    n_samples *= 1.25; /* a bit of leeway */
-
-    gputop_perf_trace_buffer_size = n_samples * metric_set->perf_raw_size;
-    gputop_perf_trace_buffer = xmalloc0(gputop_perf_trace_buffer_size);
-    gputop_perf_trace_head = gputop_perf_trace_buffer;
+    gputop_perf_trace_buffer = NULL;
+    gputop_perf_trace_buffer_size = 0;
+    gputop_perf_trace_head = NULL;
     gputop_perf_trace_empty = true;
     gputop_perf_trace_full = false;
+    gputop_perf_n_samples = 0;
+
+    resize_trace_buffer(metric_set->perf_raw_size, period_exponent);
 
     return true;
 
@@ -332,7 +768,10 @@ trace_closed_cb(struct gputop_perf_stream *stream)
     gputop_perf_stream_unref(current_oa_stream);
 
     free(gputop_perf_trace_buffer);
+    gputop_perf_trace_buffer = NULL;
     current_oa_stream = NULL;
+
+    trace_pyramid_fini();
 }
 
 void
@@ -351,6 +790,22 @@ timer_cb(uv_timer_t *timer)
     redraw_ui();
 }
 
+static void
+print_oa_exponent_status(WINDOW *win, int y)
+{
+    const char *mode = "";
+
+    if (oa_exponent == OA_EXPONENT_AUTO)
+        mode = " auto";
+    else if (oa_exponent == OA_EXPONENT_DEFAULT)
+        mode = " default";
+
+    wattrset(win, A_NORMAL);
+    mvwprintw(win, y, 0, "OA exponent: %d%s (%.3fms period)  [e/E: shorter/longer, a: toggle auto]",
+              current_oa_exponent, mode,
+              oa_exponent_period_ns(current_oa_exponent) / 1000000.0);
+}
+
 #define RANGE_BAR_WIDTH 30
 /* Follow the horrible ncurses convention of passing y before x */
 static void
@@ -387,82 +842,34 @@ print_range_bar(WINDOW *win, int y, int x, uint64_t val, uint64_t range)
 }
 
 static void
-print_range_oa_counter(WINDOW *win, int y, int x,
-                       struct gputop_perf_stream *stream,
-                       const struct gputop_metric_set_counter *counter,
-                       uint64_t range)
+print_range_oa_counter(WINDOW *win, int y, int x, double value, uint64_t range)
 {
-    uint64_t val;
-
-    switch(counter->data_type) {
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-        val = read_uint32_oa_counter(stream->metric_set, counter,
-                                     current_oa_accumulator.deltas);
-        break;
-
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-        val = read_uint64_oa_counter(stream->metric_set, counter,
-                                     current_oa_accumulator.deltas);
-        break;
-
-    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-        val = (read_float_oa_counter(stream->metric_set, counter,
-                                     current_oa_accumulator.deltas) + 0.5);
-        break;
-    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-        val = (read_double_oa_counter(stream->metric_set, counter,
-                                      current_oa_accumulator.deltas) + 0.5);
-        break;
-
-    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-        val = read_bool_oa_counter(stream->metric_set, counter,
-                                   current_oa_accumulator.deltas);
-        break;
-    }
+    uint64_t val = value + 0.5;
 
     if (range > 0 && val <= range)
         print_range_bar(win, y, x, val, range);
     else {
         wattrset(win, A_NORMAL);
-        mvwprintw(win, y, x, "%f", val);
+        mvwprintw(win, y, x, "%f", value);
     }
 }
 
 static void
 print_raw_oa_counter(WINDOW *win, int y, int x,
-                     struct gputop_perf_stream *stream,
-                     const struct gputop_metric_set_counter *counter)
+                     const struct gputop_metric_set_counter *counter,
+                     double value)
 {
     switch(counter->data_type) {
     case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-        mvwprintw(win, y, x, "%" PRIu32,
-                  read_uint32_oa_counter(stream->metric_set,
-                                         counter,
-                                         current_oa_accumulator.deltas));
-        break;
     case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-        mvwprintw(win, y, x, "%" PRIu64,
-                  read_uint64_oa_counter(stream->metric_set,
-                                         counter,
-                                         current_oa_accumulator.deltas));
+        mvwprintw(win, y, x, "%" PRIu64, (uint64_t)value);
         break;
     case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-        mvwprintw(win, y, x, "%f",
-                  read_float_oa_counter(stream->metric_set,
-                                        counter,
-                                        current_oa_accumulator.deltas));
-        break;
     case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-        mvwprintw(win, y, x, "%f",
-                  read_double_oa_counter(stream->metric_set,
-                                         counter,
-                                         current_oa_accumulator.deltas));
+        mvwprintw(win, y, x, "%f", value);
         break;
     case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-        mvwprintw(win, y, x, "%s",
-                  read_bool_oa_counter(stream->metric_set,
-                                       counter,
-                                       current_oa_accumulator.deltas) ? "TRUE" : "FALSE");
+        mvwprintw(win, y, x, "%s", value ? "TRUE" : "FALSE");
         break;
     }
 }
@@ -487,48 +894,54 @@ perf_counters_redraw(WINDOW *win)
 
     gputop_perf_read_samples(stream);
 
+    print_oa_exponent_status(win, y - 1);
+
     metric_set = stream->metric_set;
 
+    metric_set->read_all(&gputop_devinfo, metric_set,
+                         current_oa_accumulator.deltas,
+                         current_oa_counter_values);
+
     for (j = 0; j < metric_set->n_counters; j++) {
-        struct gputop_metric_set_counter *counter = &metric_set->counters[j];
+        const struct gputop_metric_set_counter *counter = &metric_set->counters[j];
+        double value = current_oa_counter_values[j * 2];
+        uint64_t max = current_oa_counter_values[j * 2 + 1];
 
         wattrset(win, A_NORMAL);
 
         switch (counter->type) {
         case GPUTOP_PERFQUERY_COUNTER_EVENT:
             mvwprintw(win, y, 0, "%40s: ", counter->name);
-            print_raw_oa_counter(win, y, 41, stream, counter);
+            print_raw_oa_counter(win, y, 41, counter, value);
             break;
         case GPUTOP_PERFQUERY_COUNTER_DURATION_NORM:
             mvwprintw(win, y, 0, "%40s: ", counter->name);
-            print_raw_oa_counter(win, y, 41, stream, counter);
+            print_raw_oa_counter(win, y, 41, counter, value);
             break;
         case GPUTOP_PERFQUERY_COUNTER_DURATION_RAW:
             mvwprintw(win, y, 0, "%40s: ", counter->name);
-            print_raw_oa_counter(win, y, 41, stream, counter);
+            print_raw_oa_counter(win, y, 41, counter, value);
             break;
         case GPUTOP_PERFQUERY_COUNTER_THROUGHPUT:
             if (wmove(win, y, 0) == ERR)
                 break;
             wprintw(win, "%40s: ", counter->name);
-            print_raw_oa_counter(win, y, 41, stream, counter);
+            print_raw_oa_counter(win, y, 41, counter, value);
             wprintw(win, " bytes/s");
             break;
         case GPUTOP_PERFQUERY_COUNTER_RAW:
             mvwprintw(win, y, 0, "%40s: ", counter->name);
-            print_raw_oa_counter(win, y, 41, stream, counter);
+            print_raw_oa_counter(win, y, 41, counter, value);
             break;
         case GPUTOP_PERFQUERY_COUNTER_TIMESTAMP:
             mvwprintw(win, y, 0, "%40s: ", counter->name);
-            print_raw_oa_counter(win, y, 41, stream, counter);
+            print_raw_oa_counter(win, y, 41, counter, value);
             break;
         }
 
-        if (counter->max) {
-            uint64_t max = counter->max(&gputop_devinfo, stream->metric_set,
-                                        current_oa_accumulator.deltas);
-            print_range_oa_counter(win, y, 60, stream, counter, max);
-        }
+        /* NB: metric sets loaded at runtime don't have max callbacks */
+        if (max)
+            print_range_oa_counter(win, y, 60, value, max);
 
         y++;
     }
@@ -567,38 +980,8 @@ print_percentage_spark(WINDOW *win, int x, int y, float percent)
 }
 
 static void
-trace_print_percentage_oa_counter(WINDOW *win, int x, int y,
-                                  struct gputop_perf_stream *stream,
-                                  const struct gputop_metric_set_counter *counter)
+trace_print_percentage_oa_counter(WINDOW *win, int x, int y, double percentage)
 {
-    float percentage;
-
-    switch(counter->data_type) {
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-        percentage = read_uint32_oa_counter(stream->metric_set, counter,
-                                            current_oa_accumulator.deltas);
-        break;
-
-    case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-        percentage = read_uint64_oa_counter(stream->metric_set, counter,
-                                            current_oa_accumulator.deltas);
-        break;
-
-    case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-        percentage = read_float_oa_counter(stream->metric_set, counter,
-                                           current_oa_accumulator.deltas);
-        break;
-    case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-        percentage = read_double_oa_counter(stream->metric_set, counter,
-                                            current_oa_accumulator.deltas);
-        break;
-
-    case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-        percentage = read_bool_oa_counter(stream->metric_set, counter,
-                                          current_oa_accumulator.deltas);
-        break;
-    }
-
     if (percentage <= 100) {
         wattrset(win, COLOR_PAIR (GPUTOP_BAR_GOOD_COLOR));
         //wbkgd(win, COLOR_PAIR (GPUTOP_BAR_GOOD_COLOR));
@@ -611,9 +994,7 @@ trace_print_percentage_oa_counter(WINDOW *win, int x, int y,
 }
 
 static void
-trace_print_raw_oa_counter(WINDOW *win, int x, int y,
-                           struct gputop_perf_stream *stream,
-                           const struct gputop_metric_set_counter *counter)
+trace_print_raw_oa_counter(WINDOW *win, int x, int y, double value)
 {
 }
 
@@ -625,7 +1006,7 @@ print_trace_counter_names(WINDOW *win, struct gputop_perf_stream *stream)
 
     wattrset(win, A_NORMAL);
     for (i = 0; i < stream->metric_set->n_counters; i++) {
-        struct gputop_metric_set_counter *counter =
+        const struct gputop_metric_set_counter *counter =
             &stream->metric_set->counters[i];
 
         mvwprintw(win, y, 0, "%25s: ", counter->name);
@@ -634,8 +1015,11 @@ print_trace_counter_names(WINDOW *win, struct gputop_perf_stream *stream)
     }
 }
 
+/* Draws a column of the trace given the (value, max) pairs of each
+ * counter, as evaluated by metric_set->read_all() */
 static void
-print_trace_counter_spark(WINDOW *win, struct gputop_perf_stream *stream, int x)
+print_trace_counter_spark(WINDOW *win, struct gputop_perf_stream *stream, int x,
+                          const double *values)
 {
     struct gputop_metric_set *metric_set = stream->metric_set;
     int i;
@@ -644,38 +1028,23 @@ print_trace_counter_spark(WINDOW *win, struct gputop_perf_stream *stream, int x)
     x += 27;
 
     for (i = 0; i < metric_set->n_counters; i++) {
-        struct gputop_metric_set_counter *counter = &metric_set->counters[i];
+        const struct gputop_metric_set_counter *counter = &metric_set->counters[i];
+        double value = values[i * 2];
+        double max = values[i * 2 + 1];
 
         switch (counter->type) {
         case GPUTOP_PERFQUERY_COUNTER_EVENT:
-            trace_print_raw_oa_counter(win, x, y, stream, counter);
-            break;
         case GPUTOP_PERFQUERY_COUNTER_DURATION_NORM:
-            trace_print_raw_oa_counter(win, x, y, stream, counter);
-            break;
-        case GPUTOP_PERFQUERY_COUNTER_DURATION_RAW:
-            if (counter->max &&
-                counter->max(&gputop_devinfo, stream->metric_set,
-                             current_oa_accumulator.deltas) == 100)
-            {
-                trace_print_percentage_oa_counter(win, x, y, stream, counter);
-            } else
-                trace_print_raw_oa_counter(win, x, y, stream, counter);
-            break;
         case GPUTOP_PERFQUERY_COUNTER_THROUGHPUT:
-            trace_print_raw_oa_counter(win, x, y, stream, counter);
+        case GPUTOP_PERFQUERY_COUNTER_TIMESTAMP:
+            trace_print_raw_oa_counter(win, x, y, value);
             break;
+        case GPUTOP_PERFQUERY_COUNTER_DURATION_RAW:
         case GPUTOP_PERFQUERY_COUNTER_RAW:
-            if (counter->max &&
-                counter->max(&gputop_devinfo, stream->metric_set,
-                             current_oa_accumulator.deltas) == 100)
-            {
-                trace_print_percentage_oa_counter(win, x, y, stream, counter);
-            } else
-                trace_print_raw_oa_counter(win, x, y, stream, counter);
-            break;
-        case GPUTOP_PERFQUERY_COUNTER_TIMESTAMP:
-            trace_print_raw_oa_counter(win, x, y, stream, counter);
+            if (max == 100)
+                trace_print_percentage_oa_counter(win, x, y, value);
+            else
+                trace_print_raw_oa_counter(win, x, y, value);
             break;
         }
 
@@ -685,17 +1054,6 @@ print_trace_counter_spark(WINDOW *win, struct gputop_perf_stream *stream, int x)
 
 static uint64_t trace_view_start;
 
-const uint8_t *
-get_next_trace_sample(struct gputop_perf_stream *stream, const uint8_t *current_sample)
-{
-    const uint8_t *next = current_sample + stream->metric_set->perf_raw_size;
-
-    if (next >= (gputop_perf_trace_buffer + gputop_perf_trace_buffer_size))
-        next = gputop_perf_trace_buffer;
-
-    return next;
-}
-
 static void
 perf_oa_trace_redraw(WINDOW *win)
 {
@@ -707,10 +1065,8 @@ perf_oa_trace_redraw(WINDOW *win)
     float fill_percentage = 100.0f * ((float)fill / (float)gputop_perf_trace_buffer_size);
     int timeline_width;
     uint64_t ns_per_column;
-    uint64_t start_timestamp = 0;
-    //float bars[timeline_width];
-    const uint8_t *report0;
-    const uint8_t *report1;
+    uint64_t start_timestamp;
+    uint64_t pair;
 
     wattrset(win, A_NORMAL);
 
@@ -723,6 +1079,9 @@ perf_oa_trace_redraw(WINDOW *win)
 
     gputop_perf_read_samples(stream);
 
+    print_oa_exponent_status(win, 0);
+    mvwprintw(win, 1, 0, "Trace duration: %.0fs  [t/T: shorter/longer]", trace_duration);
+
     if (!gputop_perf_trace_full) {
         mvwprintw(win, 2, 0, "Trace buffer fill %3.0f%: ", fill_percentage);
         print_range_bar(win, 2, 25, fill_percentage, 100);
@@ -742,40 +1101,80 @@ perf_oa_trace_redraw(WINDOW *win)
 
     ns_per_column = (1000000000 * zoom) / timeline_width;
 
-    report0 = gputop_perf_trace_head;
-    report1 = get_next_trace_sample(stream, report0);
-
-    gputop_oa_accumulator_clear(&current_oa_accumulator);
-
-    do {
-        if (gputop_oa_accumulate_reports(&current_oa_accumulator,
-                                         report0, report1,
-                                         stream->per_ctx_mode))
-            start_timestamp = current_oa_accumulator.first_timestamp;
-
-        report0 = report1;
-        report1 = get_next_trace_sample(stream, report0);
-    } while (start_timestamp == 0);
+    /* Each column is accumulated from the summary pyramid, so this is
+     * O(columns * log(trace length)) rather than touching every report */
+    pair = trace_pyramid_first_pair();
+    start_timestamp =
+        trace_pyramid.report_timestamps[pair % trace_pyramid.n_slots];
 
     for (int i = 0; i < timeline_width; i++) {
         uint64_t column_end = start_timestamp + trace_view_start +
             (i *  ns_per_column) + ns_per_column;
+        struct trace_summary column;
 
-        while (1) {
-            if (gputop_oa_accumulate_reports(&current_oa_accumulator,
-                                             report0, report1,
-                                             stream->per_ctx_mode))
-            {
-                if (current_oa_accumulator.last_timestamp > column_end) {
-                    print_trace_counter_spark(win, stream, i);
-                    gputop_oa_accumulator_clear(&current_oa_accumulator);
-                }
-            }
+        memset(&column, 0, sizeof(column));
+        if (!trace_pyramid_accumulate(&pair, column_end, &column))
+            continue;
 
-            report0 = report1;
-            report1 = get_next_trace_sample(stream, report0);
-        }
+        stream->metric_set->read_all(&gputop_devinfo, stream->metric_set,
+                                     column.deltas, current_oa_counter_values);
+        print_trace_counter_spark(win, stream, i, current_oa_counter_values);
+    }
+}
+
+/* Closes and re-opens the current tab's stream so that a new OA
+ * exponent takes effect */
+static void
+restart_current_tab(void)
+{
+    struct tab *tab = current_tab;
+
+    if (!tab || pending_tab)
+        return;
+
+    /* If the stream failed to open there's nothing to wait for... */
+    if (!current_oa_stream) {
+        tab->leave();
+        tab->enter(tab);
+        return;
+    }
+
+    /* NB: current_tab will be set to NULL once the stream has been
+     * closed, at which point the next redraw_ui() will call
+     * pending_tab->enter() */
+    pending_tab = tab;
+    tab->leave();
+}
+
+static bool
+oa_exponent_input(int key)
+{
+    int exponent = current_oa_exponent;
+
+    switch (key) {
+    case 'e':
+        if (exponent > 0)
+            exponent--;
+        break;
+    case 'E':
+        if (exponent < OA_EXPONENT_MAX)
+            exponent++;
+        break;
+    case 'a':
+        oa_exponent = oa_exponent == OA_EXPONENT_AUTO ?
+            OA_EXPONENT_DEFAULT : OA_EXPONENT_AUTO;
+        restart_current_tab();
+        return true;
+    default:
+        return false;
+    }
+
+    if (exponent != current_oa_exponent || oa_exponent < 0) {
+        oa_exponent = exponent;
+        restart_current_tab();
     }
+
+    return true;
 }
 
 static void
@@ -798,7 +1197,7 @@ perf_tab_leave(void)
 static void
 perf_tab_input(int key)
 {
-
+    oa_exponent_input(key);
 }
 
 static void
@@ -830,7 +1229,36 @@ perf_3d_trace_tab_leave(void)
 static void
 perf_3d_trace_tab_input(int key)
 {
+    double duration = trace_duration;
+
+    if (oa_exponent_input(key))
+        return;
 
+    switch (key) {
+    case 't':
+        if (duration > 1)
+            duration -= 1;
+        break;
+    case 'T':
+        if (duration < 60)
+            duration += 1;
+        break;
+    default:
+        return;
+    }
+
+    if (duration == trace_duration)
+        return;
+
+    trace_duration = duration;
+
+    /* Changing the duration doesn't need the stream to be re-opened so
+     * we can resize the buffer in place without losing what's already
+     * been captured */
+    if (current_oa_stream && gputop_perf_trace_buffer) {
+        resize_trace_buffer(current_oa_stream->metric_set->perf_raw_size,
+                            current_oa_exponent);
+    }
 }
 
 static void
@@ -867,22 +1295,33 @@ debug_log_tab_input(int key)
 
 }
 
+/* The most recent log messages, drained from gputop_log()'s ring */
+#define LOG_HISTORY_LEN 256
+static char *log_history[LOG_HISTORY_LEN];
+static int log_history_len; /* total number appended */
+
+static void
+append_log_history_cb(int level, const char *message, void *data)
+{
+    int idx = log_history_len++ % LOG_HISTORY_LEN;
+
+    free(log_history[idx]);
+    log_history[idx] = strdup(message);
+}
+
 static void
 debug_log_tab_redraw(WINDOW *win)
 {
     int win_width __attribute__ ((unused));
     int win_height;
-    struct gputop_log_entry *tmp;
     int i = 0;
 
     getmaxyx(win, win_height, win_width);
 
-    pthread_once(&gputop_log_init_once, gputop_log_init);
-
-    pthread_rwlock_rdlock(&gputop_log_lock);
+    gputop_log_drain(GPUTOP_LOG_RING_SIZE + 1, append_log_history_cb, NULL);
 
 #ifdef SUPPORT_GL
-    if (gputop_gl_contexts && gputop_list_empty(&gputop_log_entries)) {
+    if (gputop_gl_contexts && log_history_len == 0) {
         struct winsys_context **contexts = gputop_gl_contexts->data;
         struct winsys_context *wctx = contexts[i];
 
@@ -907,14 +1346,14 @@ debug_log_tab_redraw(WINDOW *win)
     }
 #endif
 
-    gputop_list_for_each(tmp, &gputop_log_entries, link) {
-        mvwprintw(win, win_height - 1 - i, 0, tmp->msg);
+    for (i = 0; i < MIN(log_history_len, LOG_HISTORY_LEN); i++) {
+        int idx = (log_history_len - 1 - i) % LOG_HISTORY_LEN;
 
-        if (i++ > win_height)
+        if (i > win_height)
             break;
-    }
 
-    pthread_rwlock_unlock(&gputop_log_lock);
+        mvwprintw(win, win_height - 1 - i, 0, "%s", log_history[idx]);
+    }
 }
 
 static struct tab tab_debug_log =
@@ -1604,6 +2043,35 @@ exit_fake_mode_cb(uv_timer_t *timer)
     exit(0);
 }
 
+static void
+read_oa_sampling_env(void)
+{
+    const char *exponent = getenv("GPUTOP_OA_EXPONENT");
+    const char *seconds = getenv("GPUTOP_TRACE_SECONDS");
+
+    if (exponent) {
+        if (strcmp(exponent, "auto") == 0)
+            oa_exponent = OA_EXPONENT_AUTO;
+        else {
+            oa_exponent = strtol(exponent, NULL, 10);
+            if (oa_exponent < 0 || oa_exponent > OA_EXPONENT_MAX) {
+                fprintf(stderr, "Ignoring invalid GPUTOP_OA_EXPONENT=%s (expected 0-%d or \"auto\")\n",
+                        exponent, OA_EXPONENT_MAX);
+                oa_exponent = OA_EXPONENT_DEFAULT;
+            }
+        }
+    }
+
+    if (seconds) {
+        double duration = strtod(seconds, NULL);
+
+        if (duration > 0)
+            trace_duration = duration;
+        else
+            fprintf(stderr, "Ignoring invalid GPUTOP_TRACE_SECONDS=%s\n", seconds);
+    }
+}
+
 static void *
 run_ncurses_ui(void *arg)
 {
@@ -1616,8 +2084,13 @@ run_ncurses_ui(void *arg)
     if (strcmp(mode, "remote") == 0) {
         debug_disable_ncurses = true;
         remote_ui = true;
+    } else if (strcmp(mode, "csv") == 0) {
+        debug_disable_ncurses = true;
+        csv_ui = true;
     }
 
+    read_oa_sampling_env();
+
     gputop_mainloop = uv_loop_new();
 
     if (!debug_disable_ncurses) {
@@ -1677,7 +2150,11 @@ run_ncurses_ui(void *arg)
 
     if (remote_ui)
         gputop_server_run();
-    else {
+    else if (csv_ui) {
+        /* NB: there's no other way to report a bad configuration */
+        if (!gputop_csv_run())
+            exit(1);
+    } else {
         uv_idle_init(gputop_mainloop, &redraw_idle);
 
         current_tab->enter(current_tab);
@@ -1715,8 +2192,8 @@ gputop_ncurses_init(void)
 
     for (i = 0; i < gputop_perf_oa_supported_metric_set_guids->len; i++)
     {
-        struct gputop_metric_set *metric_set = (gputop_hash_table_search(metrics,
-            array_value_at(gputop_perf_oa_supported_metric_set_guids, char*, i)))->data;
+        struct gputop_metric_set *metric_set = gputop_perf_lookup_metric_set(
+            array_value_at(gputop_perf_oa_supported_metric_set_guids, char*, i));
         struct tab *counter_tab = xmalloc0(sizeof(struct tab));
 
         counter_tab->name = (char*)metric_set->name;
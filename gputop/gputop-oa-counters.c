@@ -24,9 +24,12 @@
 
 #define _GNU_SOURCE
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "gputop-oa-counters.h"
+#include "gputop-oa-xml.h"
+#include "gputop-util.h"
 
 #ifdef EMSCRIPTEN
 #include "gputop-web-lib.h"
@@ -35,6 +38,11 @@
 #include "gputop-log.h"
 #endif
 
+#if !defined(EMSCRIPTEN) && defined(__x86_64__) && defined(__GNUC__)
+#define GPUTOP_OA_ACCUMULATE_SIMD
+#include <immintrin.h>
+#endif
+
 struct gputop_devinfo gputop_devinfo;
 
 static uint64_t
@@ -97,6 +105,202 @@ gputop_oa_accumulate_uint40(int a_index,
     *deltas += delta;
 }
 
+/* The A32u40_A4u32_B8_C8 counters laid out as deltas[]:
+ *
+ *   [0]      timestamp       (report dword 1)
+ *   [1]      clock           (report dword 3)
+ *   [2..33]  32x 40bit A     (low dwords 4..35, high bytes from dword 40)
+ *   [34..37] 4x 32bit A      (dwords 36..39)
+ *   [38..53] 8x B + 8x C     (dwords 48..63)
+ *
+ * The kernels below accumulate the deltas for @n_pairs report pairs where
+ * pair N is (report0 + N * stride, report1 + N * stride), so the same code
+ * handles a lone pair of unrelated reports (with n_pairs = 1) as well as a
+ * contiguous run of reports (with report1 = report0 + stride).
+ */
+typedef void (*a32u40_accumulate_func_t)(const uint8_t *report0,
+                                         const uint8_t *report1,
+                                         size_t stride,
+                                         int n_pairs,
+                                         uint64_t *deltas);
+
+static void
+accumulate_a32u40_scalar(const uint8_t *report0,
+                         const uint8_t *report1,
+                         size_t stride,
+                         int n_pairs,
+                         uint64_t *deltas)
+{
+    int n, i;
+
+    for (n = 0; n < n_pairs; n++) {
+        const uint32_t *start = (const uint32_t *)(report0 + n * stride);
+        const uint32_t *end = (const uint32_t *)(report1 + n * stride);
+        int idx = 0;
+
+        gputop_oa_accumulate_uint32(start + 1, end + 1, deltas + idx++); /* timestamp */
+        gputop_oa_accumulate_uint32(start + 3, end + 3, deltas + idx++); /* clock */
+
+        /* 32x 40bit A counters... */
+        for (i = 0; i < 32; i++)
+            gputop_oa_accumulate_uint40(i, start, end, deltas + idx++);
+
+        /* 4x 32bit A counters... */
+        for (i = 0; i < 4; i++)
+            gputop_oa_accumulate_uint32(start + 36 + i, end + 36 + i,
+                                        deltas + idx++);
+
+        /* 8x 32bit B counters + 8x 32bit C counters... */
+        for (i = 0; i < 16; i++)
+            gputop_oa_accumulate_uint32(start + 48 + i, end + 48 + i,
+                                        deltas + idx++);
+    }
+}
+
+#ifdef GPUTOP_OA_ACCUMULATE_SIMD
+
+/* NB: both 40bit values are < 2^40 so the wrap handling of
+ * gputop_oa_accumulate_uint40() is equivalent to taking the 64bit
+ * difference modulo 2^40, which lets us avoid a per-lane compare.
+ */
+
+static inline uint32_t
+load_u32_unaligned(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint16_t
+load_u16_unaligned(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+__attribute__((target("sse4.2"))) static void
+accumulate_a32u40_sse42(const uint8_t *report0,
+                        const uint8_t *report1,
+                        size_t stride,
+                        int n_pairs,
+                        uint64_t *deltas)
+{
+    const __m128i mask40 = _mm_set1_epi64x((1ULL << 40) - 1);
+    int n, i;
+
+    for (n = 0; n < n_pairs; n++) {
+        const uint32_t *start = (const uint32_t *)(report0 + n * stride);
+        const uint32_t *end = (const uint32_t *)(report1 + n * stride);
+        const uint8_t *high_bytes0 = (const uint8_t *)(start + 40);
+        const uint8_t *high_bytes1 = (const uint8_t *)(end + 40);
+
+        deltas[0] += (uint32_t)(end[1] - start[1]); /* timestamp */
+        deltas[1] += (uint32_t)(end[3] - start[3]); /* clock */
+
+        /* 32x 40bit A counters, two per iteration... */
+        for (i = 0; i < 32; i += 2) {
+            __m128i lo0 = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)(start + 4 + i)));
+            __m128i lo1 = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)(end + 4 + i)));
+            __m128i hi0 = _mm_cvtepu8_epi64(_mm_cvtsi32_si128(load_u16_unaligned(high_bytes0 + i)));
+            __m128i hi1 = _mm_cvtepu8_epi64(_mm_cvtsi32_si128(load_u16_unaligned(high_bytes1 + i)));
+            __m128i value0 = _mm_or_si128(lo0, _mm_slli_epi64(hi0, 32));
+            __m128i value1 = _mm_or_si128(lo1, _mm_slli_epi64(hi1, 32));
+            __m128i delta = _mm_and_si128(_mm_sub_epi64(value1, value0), mask40);
+            __m128i *acc = (__m128i *)(deltas + 2 + i);
+
+            _mm_storeu_si128(acc, _mm_add_epi64(_mm_loadu_si128(acc), delta));
+        }
+
+        /* 4x 32bit A counters + 8x 32bit B counters + 8x 32bit C counters,
+         * four per iteration... */
+        for (i = 0; i < 20; i += 4) {
+            int offset = i < 4 ? 36 + i : 44 + i;
+            __m128i delta32 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(end + offset)),
+                                            _mm_loadu_si128((const __m128i *)(start + offset)));
+            __m128i *acc = (__m128i *)(deltas + 34 + i);
+
+            _mm_storeu_si128(acc, _mm_add_epi64(_mm_loadu_si128(acc),
+                                                _mm_cvtepu32_epi64(delta32)));
+            _mm_storeu_si128(acc + 1, _mm_add_epi64(_mm_loadu_si128(acc + 1),
+                                                    _mm_cvtepu32_epi64(_mm_srli_si128(delta32, 8))));
+        }
+    }
+}
+
+__attribute__((target("avx2"))) static void
+accumulate_a32u40_avx2(const uint8_t *report0,
+                       const uint8_t *report1,
+                       size_t stride,
+                       int n_pairs,
+                       uint64_t *deltas)
+{
+    const __m256i mask40 = _mm256_set1_epi64x((1ULL << 40) - 1);
+    int n, i;
+
+    for (n = 0; n < n_pairs; n++) {
+        const uint32_t *start = (const uint32_t *)(report0 + n * stride);
+        const uint32_t *end = (const uint32_t *)(report1 + n * stride);
+        const uint8_t *high_bytes0 = (const uint8_t *)(start + 40);
+        const uint8_t *high_bytes1 = (const uint8_t *)(end + 40);
+
+        deltas[0] += (uint32_t)(end[1] - start[1]); /* timestamp */
+        deltas[1] += (uint32_t)(end[3] - start[3]); /* clock */
+
+        /* 32x 40bit A counters, four per iteration... */
+        for (i = 0; i < 32; i += 4) {
+            __m256i lo0 = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(start + 4 + i)));
+            __m256i lo1 = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(end + 4 + i)));
+            __m256i hi0 = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(load_u32_unaligned(high_bytes0 + i)));
+            __m256i hi1 = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(load_u32_unaligned(high_bytes1 + i)));
+            __m256i value0 = _mm256_or_si256(lo0, _mm256_slli_epi64(hi0, 32));
+            __m256i value1 = _mm256_or_si256(lo1, _mm256_slli_epi64(hi1, 32));
+            __m256i delta = _mm256_and_si256(_mm256_sub_epi64(value1, value0), mask40);
+            __m256i *acc = (__m256i *)(deltas + 2 + i);
+
+            _mm256_storeu_si256(acc, _mm256_add_epi64(_mm256_loadu_si256(acc), delta));
+        }
+
+        /* 4x 32bit A counters + 8x 32bit B counters + 8x 32bit C counters,
+         * four per iteration... */
+        for (i = 0; i < 20; i += 4) {
+            int offset = i < 4 ? 36 + i : 44 + i;
+            __m128i delta32 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(end + offset)),
+                                            _mm_loadu_si128((const __m128i *)(start + offset)));
+            __m256i *acc = (__m256i *)(deltas + 34 + i);
+
+            _mm256_storeu_si256(acc, _mm256_add_epi64(_mm256_loadu_si256(acc),
+                                                      _mm256_cvtepu32_epi64(delta32)));
+        }
+    }
+}
+
+#endif /* GPUTOP_OA_ACCUMULATE_SIMD */
+
+static a32u40_accumulate_func_t accumulate_a32u40 = accumulate_a32u40_scalar;
+
+/* Picks the widest A32u40_A4u32_B8_C8 accumulation kernel supported by the
+ * CPU we're running on. Setting GPUTOP_DISABLE_SIMD=1 forces the scalar
+ * fallback which is handy when comparing results. */
+__attribute__((constructor)) static void
+gputop_oa_accumulate_select_simd(void)
+{
+#ifdef GPUTOP_OA_ACCUMULATE_SIMD
+    const char *disable = getenv("GPUTOP_DISABLE_SIMD");
+
+    if (disable && strcmp(disable, "0") != 0)
+        return;
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        accumulate_a32u40 = accumulate_a32u40_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        accumulate_a32u40 = accumulate_a32u40_sse42;
+#endif
+}
+
 bool
 gputop_oa_accumulate_reports(struct gputop_oa_accumulator *accumulator,
                              const uint8_t *report0,
@@ -112,7 +316,6 @@ gputop_oa_accumulate_reports(struct gputop_oa_accumulator *accumulator,
     uint32_t end_reason = ((start[0] >> OAREPORT_REASON_SHIFT) &
                            OAREPORT_REASON_MASK);
     bool ret = true;
-    int idx = 0;
     int i;
 
     assert(report0 != report1);
@@ -187,22 +390,7 @@ gputop_oa_accumulate_reports(struct gputop_oa_accumulator *accumulator,
             }
         }
 
-        gputop_oa_accumulate_uint32(start + 1, end + 1, deltas + idx++); /* timestamp */
-        gputop_oa_accumulate_uint32(start + 3, end + 3, deltas + idx++); /* clock */
-
-        /* 32x 40bit A counters... */
-        for (i = 0; i < 32; i++)
-            gputop_oa_accumulate_uint40(i, start, end, deltas + idx++);
-
-        /* 4x 32bit A counters... */
-        for (i = 0; i < 4; i++)
-            gputop_oa_accumulate_uint32(start + 36 + i, end + 36 + i,
-                                        deltas + idx++);
-
-        /* 8x 32bit B counters + 8x 32bit C counters... */
-        for (i = 0; i < 16; i++)
-            gputop_oa_accumulate_uint32(start + 48 + i, end + 48 + i,
-                                        deltas + idx++);
+        accumulate_a32u40(report0, report1, 0, 1, deltas);
         break;
 
     case I915_OA_FORMAT_A45_B8_C8:
@@ -236,6 +424,197 @@ exit:
     return ret;
 }
 
+void
+gputop_oa_accumulate_report_batch(struct gputop_oa_accumulator *accumulator,
+                                  const uint8_t *reports,
+                                  size_t stride,
+                                  int n_reports)
+{
+    struct gputop_metric_set *metric_set = accumulator->metric_set;
+    uint64_t *deltas = accumulator->deltas;
+    int n, i;
+
+    if (n_reports < 2)
+        return;
+
+    switch (metric_set->perf_oa_format) {
+    case I915_OA_FORMAT_A32u40_A4u32_B8_C8:
+        accumulate_a32u40(reports, reports + stride, stride, n_reports - 1,
+                          deltas);
+        break;
+    case I915_OA_FORMAT_A45_B8_C8:
+        for (n = 0; n < n_reports - 1; n++) {
+            const uint32_t *start = (const uint32_t *)(reports + n * stride);
+            const uint32_t *end = (const uint32_t *)(reports + (n + 1) * stride);
+
+            gputop_oa_accumulate_uint32(start + 1, end + 1, deltas); /* timestamp */
+
+            for (i = 0; i < 61; i++)
+                gputop_oa_accumulate_uint32(start + 3 + i, end + 3 + i,
+                                            deltas + 1 + i);
+        }
+        break;
+    default:
+        assert(0);
+    }
+
+    /* NB: progressing the clock through every report (not just the first
+     * and last) is required to notice each 32bit timestamp wrap. */
+    if (!accumulator->clock.initialized)
+        gputop_u32_clock_init(&accumulator->clock,
+                              ((const uint32_t *)reports)[1]);
+
+    for (n = 0; n < n_reports; n++) {
+        const uint32_t *report = (const uint32_t *)(reports + n * stride);
+
+        gputop_u32_clock_progress(&accumulator->clock, report[1]);
+        if (accumulator->first_timestamp == 0)
+            accumulator->first_timestamp =
+                gputop_u32_clock_get_time(&accumulator->clock);
+    }
+    accumulator->last_timestamp =
+        gputop_u32_clock_get_time(&accumulator->clock);
+
+    accumulator->last_ctx_id =
+        ((const uint32_t *)(reports + (n_reports - 1) * stride))[2];
+}
+
+int
+gputop_oa_accumulator_period_reports(const struct gputop_oa_accumulator *accumulator,
+                                     const uint8_t *reports,
+                                     size_t stride,
+                                     int n_reports,
+                                     uint64_t period)
+{
+    struct gputop_u32_clock clock = accumulator->clock;
+    uint64_t first_timestamp = accumulator->first_timestamp;
+    int n;
+
+    if (n_reports < 2)
+        return n_reports;
+
+    if (!clock.initialized)
+        gputop_u32_clock_init(&clock, ((const uint32_t *)reports)[1]);
+
+    gputop_u32_clock_progress(&clock, ((const uint32_t *)reports)[1]);
+    if (first_timestamp == 0)
+        first_timestamp = gputop_u32_clock_get_time(&clock);
+
+    for (n = 1; n < n_reports; n++) {
+        const uint32_t *report = (const uint32_t *)(reports + n * stride);
+
+        gputop_u32_clock_progress(&clock, report[1]);
+        if (gputop_u32_clock_get_time(&clock) - first_timestamp > period)
+            return n + 1;
+    }
+
+    return n_reports;
+}
+
+/* Finds the metric set with the given guid without determining which of
+ * its counters are available (so metric_set->counters may still be NULL)
+ */
+struct gputop_metric_set *
+gputop_oa_metrics_find(const struct gputop_oa_metrics *metrics,
+                       const char *guid)
+{
+    uint32_t hash = gputop_oa_guid_hash(guid, metrics->hash_seed);
+    int idx = metrics->hash_table[hash & metrics->hash_mask];
+
+    if (idx < 0 || strcmp(metrics->metric_sets[idx].guid, guid) != 0)
+        return NULL;
+
+    return &metrics->metric_sets[idx];
+}
+
+/* The counter descriptors are static tables that include counters that
+ * may not be available on the current device, so the first time a
+ * metric set with any such counters is looked up we make a copy of just
+ * the available counters (matching the order that ->read_all() writes
+ * values in) */
+static void
+init_available_counters(const struct gputop_oa_metrics *metrics,
+                        struct gputop_metric_set *metric_set,
+                        struct gputop_devinfo *devinfo)
+{
+    uint32_t available = metrics->availability(metrics, devinfo);
+    struct gputop_metric_set_counter *counters =
+        xmalloc(sizeof(*counters) * metric_set->n_all_counters);
+    int n_counters = 0;
+    int i;
+
+    for (i = 0; i < metric_set->n_all_counters; i++) {
+        const struct gputop_metric_set_counter *counter =
+            &metric_set->all_counters[i];
+
+        if (counter->availability && !(counter->availability & available))
+            continue;
+
+        counters[n_counters++] = *counter;
+    }
+
+    metric_set->counters = counters;
+    metric_set->n_counters = n_counters;
+}
+
+struct gputop_metric_set *
+gputop_oa_metrics_lookup(const struct gputop_oa_metrics *metrics,
+                         struct gputop_devinfo *devinfo,
+                         const char *guid)
+{
+    struct gputop_metric_set *metric_set = gputop_oa_metrics_find(metrics, guid);
+
+    if (metric_set && !metric_set->counters)
+        init_available_counters(metrics, metric_set, devinfo);
+
+    return metric_set;
+}
+
+/* Forgets which counters were found to be available, e.g. if the device
+ * info has changed */
+void
+gputop_oa_metrics_reset(const struct gputop_oa_metrics *metrics)
+{
+    int i;
+
+    for (i = 0; i < metrics->n_metric_sets; i++) {
+        struct gputop_metric_set *metric_set = &metrics->metric_sets[i];
+
+        if (metric_set->counters != metric_set->all_counters) {
+            free((void *)metric_set->counters);
+            metric_set->counters = NULL;
+            metric_set->n_counters = 0;
+        }
+
+        /* The registers cached by the program depend on the device info */
+        if (metric_set->program)
+            gputop_oa_xml_program_reset(metric_set->program);
+    }
+}
+
+void
+gputop_oa_metric_set_read_all_batch(struct gputop_devinfo *devinfo,
+                                    const struct gputop_metric_set *metric_set,
+                                    const uint64_t *deltas,
+                                    int deltas_stride,
+                                    int n_windows,
+                                    double *out)
+{
+    int i;
+
+    if (metric_set->program) {
+        gputop_oa_xml_read_all_batch(devinfo, metric_set, deltas,
+                                     deltas_stride, n_windows, out);
+        return;
+    }
+
+    for (i = 0; i < n_windows; i++) {
+        metric_set->read_all(devinfo, metric_set,
+                             deltas + i * deltas_stride,
+                             out + i * metric_set->n_counters * 2);
+    }
+}
+
 void
 gputop_oa_accumulator_clear(struct gputop_oa_accumulator *accumulator)
 {
@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -83,6 +84,7 @@ typedef enum {
 #define OAREPORT_REASON_CTX_SWITCH     (1<<3)
 
 struct gputop_metric_set;
+struct gputop_oa_program;
 struct gputop_metric_set_counter
 {
    const char *name;
@@ -94,6 +96,11 @@ struct gputop_metric_set_counter
                    const struct gputop_metric_set *metric_set,
                    uint64_t *deltas);
 
+   /* Bit for the availability predicate this counter depends on, as
+    * evaluated by gputop_oa_metrics::availability, or 0 if the counter
+    * is always available */
+   uint32_t availability;
+
    union {
       uint64_t (*oa_counter_read_uint64)(struct gputop_devinfo *devinfo,
                                          const struct gputop_metric_set *metric_set,
@@ -115,7 +122,17 @@ struct gputop_metric_set
     const char *name;
     const char *symbol_name;
     const char *guid;
-    struct gputop_metric_set_counter *counters;
+
+    /* Every counter described for this metric set, as generated by
+     * oa-gen.py */
+    const struct gputop_metric_set_counter *all_counters;
+    int n_all_counters;
+
+    /* The counters available on the current device. This is the same as
+     * all_counters if none of them depend on an availability predicate,
+     * otherwise it's NULL until the metric set is looked up via
+     * gputop_oa_metrics_lookup() */
+    const struct gputop_metric_set_counter *counters;
     int n_counters;
 
     int perf_oa_metrics_set;
@@ -129,6 +146,20 @@ struct gputop_metric_set
     int b_offset;
     int c_offset;
 
+    /* Evaluates all counters at once, writing a (value, max) pair of
+     * doubles per counter to out[] in the same order as counters[] (a
+     * max of zero means the counter has no defined maximum) */
+    void (*read_all)(struct gputop_devinfo *devinfo,
+                     const struct gputop_metric_set *metric_set,
+                     const uint64_t *deltas,
+                     double *out);
+
+    /* The compiled equations of a metric set loaded at runtime (see
+     * gputop-oa-xml.c), or NULL for the sets generated by oa-gen.py.
+     * NB: the per-counter read and max callbacks are NULL for these
+     * metric sets, so counters can only be read via read_all() */
+    struct gputop_oa_program *program;
+
     gputop_list_t link;
 };
 
@@ -147,6 +178,44 @@ struct gputop_oa_accumulator
 };
 
 
+/* The metric sets for one chipset as static tables generated by
+ * oa-gen.py (see gputop_oa_metrics_<chipset> in oa-<chipset>.h) */
+struct gputop_oa_metrics
+{
+    struct gputop_metric_set *metric_sets;
+    int n_metric_sets;
+
+    /* A perfect hash of the metric set GUIDs found at build time:
+     * hash_table[gputop_oa_guid_hash(guid, hash_seed) & hash_mask] is the
+     * index of the only metric set that may have that guid, or -1 */
+    const int8_t *hash_table;
+    uint32_t hash_seed;
+    uint32_t hash_mask;
+
+    /* Evaluates each availability predicate referenced by the counters
+     * of these metric sets, returning a mask of those that hold for the
+     * given device */
+    uint32_t (*availability)(const struct gputop_oa_metrics *metrics,
+                             struct gputop_devinfo *devinfo);
+};
+
+/* FNV-1a, with a seed, as also implemented by oa-gen.py. The high bits
+ * are folded into the low bits that index the hash table since the low
+ * bits alone don't depend on the high bits of the seed. */
+static inline uint32_t
+gputop_oa_guid_hash(const char *guid, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (; *guid; guid++) {
+        hash ^= (uint8_t)*guid;
+        hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 16);
+}
+
+
 extern struct gputop_devinfo gputop_devinfo;
 
 void gputop_u32_clock_init(struct gputop_u32_clock *clock, uint32_t u32_start);
@@ -154,6 +223,26 @@ uint64_t gputop_u32_clock_get_time(struct gputop_u32_clock *clock);
 void gputop_u32_clock_progress(struct gputop_u32_clock *clock,
                                uint32_t u32_timestamp);
 
+struct gputop_metric_set *gputop_oa_metrics_find(const struct gputop_oa_metrics *metrics,
+                                                 const char *guid);
+struct gputop_metric_set *gputop_oa_metrics_lookup(const struct gputop_oa_metrics *metrics,
+                                                   struct gputop_devinfo *devinfo,
+                                                   const char *guid);
+void gputop_oa_metrics_reset(const struct gputop_oa_metrics *metrics);
+
+/* Evaluates every available counter of a metric set for @n_windows
+ * accumulated windows, with the deltas for window i at
+ * deltas + i * deltas_stride, writing n_counters (value, max) pairs per
+ * window to out[]. Metric sets loaded at runtime evaluate the windows
+ * together (see gputop_oa_xml_read_all_batch()), otherwise this is the
+ * same as calling read_all() for each window. */
+void gputop_oa_metric_set_read_all_batch(struct gputop_devinfo *devinfo,
+                                         const struct gputop_metric_set *metric_set,
+                                         const uint64_t *deltas,
+                                         int deltas_stride,
+                                         int n_windows,
+                                         double *out);
+
 void gputop_oa_accumulator_init(struct gputop_oa_accumulator *accumulator,
                                 struct gputop_metric_set *metric_set);
 void gputop_oa_accumulator_clear(struct gputop_oa_accumulator *accumulator);
@@ -161,3 +250,24 @@ bool gputop_oa_accumulate_reports(struct gputop_oa_accumulator *accumulator,
                                   const uint8_t *report0,
                                   const uint8_t *report1,
                                   bool per_ctx_mode);
+
+/* Accumulates the deltas between each consecutive pair of a contiguous run
+ * of @n_reports raw OA reports laid out @stride bytes apart (e.g. a run of
+ * i915 perf sample records). This is equivalent to calling
+ * gputop_oa_accumulate_reports() for each pair without per_ctx_mode, but
+ * processes the whole run in one pass. */
+void gputop_oa_accumulate_report_batch(struct gputop_oa_accumulator *accumulator,
+                                       const uint8_t *reports,
+                                       size_t stride,
+                                       int n_reports);
+
+/* Returns how many reports from the start of such a run can be passed to
+ * gputop_oa_accumulate_report_batch() before the accumulated timestamps
+ * span more than @period nanoseconds, including the report that crosses
+ * that boundary (so the run can be split where an aggregation period
+ * ends) or @n_reports if the whole run fits. */
+int gputop_oa_accumulator_period_reports(const struct gputop_oa_accumulator *accumulator,
+                                         const uint8_t *reports,
+                                         size_t stride,
+                                         int n_reports,
+                                         uint64_t period);
@@ -0,0 +1,1705 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Metric sets loaded at runtime from the same XML that oa-gen.py reads.
+ *
+ * Instead of generating C code, the RPN equations of each metric set are
+ * compiled into a single register based program in the same way that
+ * oa-gen.py generates a metric set's read_all() function: every register
+ * is only written once, identical instructions are only emitted once and
+ * counters reference the registers of counters declared before them.
+ *
+ * The values are typed the same way as in the generated C code (taking
+ * into account C's implicit conversions) so the results match the
+ * generated code exactly. Floats are stored as doubles, rounded to float
+ * precision.
+ *
+ * The interpreter runs each instruction over a batch of accumulated
+ * windows at a time to amortize the cost of decoding instructions, and
+ * instructions that only depend on constants and the device info are
+ * only run once, with their results kept in the program until the
+ * metric sets are reset.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <alloca.h>
+
+#include "gputop-oa-xml.h"
+#include "gputop-util.h"
+
+/* The number of windows evaluated per pass through a program */
+#define BATCH_SIZE 16
+
+#define NO_REG 0xffff
+
+#ifndef ARRAY_SIZE
+#  define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+#endif
+
+enum value_type {
+    TYPE_U64,
+    TYPE_F32,
+    TYPE_F64,
+};
+
+enum opcode {
+    OP_CONST,   /* src0 = index into constants[] */
+    OP_DEVINFO, /* src0 = offset of a uint64_t in struct gputop_devinfo */
+    OP_DELTA,   /* src0 = index into the accumulated deltas */
+    OP_U2F,
+    OP_U2F32,
+    OP_F2U,
+    OP_F2F32,
+    OP_UADD,
+    OP_USUB,
+    OP_UMUL,
+    OP_UDIV,
+    OP_UMIN,
+    OP_FADD,
+    OP_FSUB,
+    OP_FMUL,
+    OP_FDIV,
+    OP_FMAX,
+    OP_FMIN,
+    OP_AND,
+    OP_LAND,
+    OP_ULT,
+    OP_UGTE,
+};
+
+/* Floating point instructions convert uint64_t operands themselves
+ * instead of needing separate OP_U2F instructions */
+#define SRC0_U64 0x100
+#define SRC1_U64 0x200
+
+/* Integer instructions may read their first operand straight from the
+ * deltas (src0 being the index as for OP_DELTA) */
+#define SRC0_DELTA 0x400
+
+/* Integer instructions with a second operand that's the same for every
+ * window (such as a constant scale factor) */
+#define SRC1_UNIFORM 0x800
+
+#define OPCODE_MASK 0xff
+
+struct insn {
+    uint16_t opcode;
+    uint16_t dst;
+    uint16_t src0;
+    uint16_t src1;
+};
+
+union reg {
+    uint64_t u;
+    double f;
+};
+
+/* Where to find the (value, max) pair for each counter once a program
+ * has run, and the register with its availability predicate */
+struct output {
+    uint16_t value;
+    uint16_t max;
+    uint16_t available; /* NO_REG if always available */
+    uint8_t value_type;
+    bool value_is_delta; /* if value is an index into the deltas */
+};
+
+struct gputop_oa_program {
+    struct insn *insns;
+    int n_insns;
+
+    /* The first n_uniform_insns don't depend on the deltas so they only
+     * need to be run once for any number of batches */
+    int n_uniform_insns;
+
+    uint64_t *constants;
+    int n_constants;
+
+    int n_regs;
+
+    struct output *outputs;
+    int n_outputs;
+
+    /* Register files for batches of 1 and BATCH_SIZE windows, allocated
+     * on first use with the uniform registers already evaluated, until
+     * gputop_oa_xml_program_reset(). NB: counters are only evaluated on
+     * the mainloop so the remaining registers are simply scratch space
+     * for each call */
+    union reg *regs[2];
+};
+
+struct xml_metrics {
+    struct gputop_oa_metrics base;
+
+    /* The strings of the metric sets point into this copy of the xml */
+    char *xml;
+
+    int8_t *hash_table;
+
+    /* One output per availability predicate bit */
+    struct gputop_oa_program *availability;
+};
+
+struct parsed_counter {
+    const char *name;
+    const char *symbol_name;
+    const char *desc;
+    const char *data_type;
+    const char *semantic_type;
+    const char *equation;
+    const char *max_equation;
+    const char *availability;
+};
+
+struct parsed_set {
+    const char *name;
+    const char *symbol_name;
+    const char *guid;
+    const char *chipset;
+
+    struct parsed_counter *counters;
+    int n_counters;
+    int counters_size;
+};
+
+#define MAX_ATTRIBUTES 32
+
+struct xml_element {
+    const char *name;
+
+    const char *attribute_names[MAX_ATTRIBUTES];
+    const char *attribute_values[MAX_ATTRIBUTES];
+    int n_attributes;
+};
+
+struct cse_entry {
+    uint64_t key;
+    int reg; /* -1 if unused */
+};
+
+struct compiler {
+    struct gputop_oa_program *program;
+    int insns_size;
+    int constants_size;
+
+    /* So that identical instructions are only emitted once */
+    struct cse_entry *cse;
+    int cse_size;
+    int cse_count;
+
+    const char *set_name;
+    const char *counter_name;
+    char **error;
+};
+
+struct operand {
+    const char *token;  /* until resolved */
+    int reg;            /* -1 until resolved */
+    enum value_type type;
+};
+
+struct counter_ref {
+    const char *symbol_name;
+    int reg;
+    enum value_type type;
+    bool round; /* if a float counter still needs rounding */
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+} hw_vars[] = {
+    { "$EuCoresTotalCount", offsetof(struct gputop_devinfo, n_eus) },
+    { "$EuSlicesTotalCount", offsetof(struct gputop_devinfo, n_eu_slices) },
+    { "$EuSubslicesTotalCount", offsetof(struct gputop_devinfo, n_eu_sub_slices) },
+    { "$EuThreadsCount", offsetof(struct gputop_devinfo, eu_threads_count) },
+    { "$SliceMask", offsetof(struct gputop_devinfo, slice_mask) },
+    { "$SubsliceMask", offsetof(struct gputop_devinfo, subslice_mask) },
+    { "$GpuTimestampFrequency", offsetof(struct gputop_devinfo, timestamp_frequency) },
+    { "$GpuMinFrequencyMHz", offsetof(struct gputop_devinfo, gt_min_freq) },
+    { "$GpuMaxFrequencyMHz", offsetof(struct gputop_devinfo, gt_max_freq) },
+};
+
+static const struct {
+    const char *name;
+    gputop_counter_type_t type;
+} semantic_types[] = {
+    { "raw", GPUTOP_PERFQUERY_COUNTER_RAW },
+    { "duration", GPUTOP_PERFQUERY_COUNTER_RAW },
+    { "duration_raw", GPUTOP_PERFQUERY_COUNTER_DURATION_RAW },
+    { "duration_norm", GPUTOP_PERFQUERY_COUNTER_DURATION_NORM },
+    { "event", GPUTOP_PERFQUERY_COUNTER_EVENT },
+    { "ratio", GPUTOP_PERFQUERY_COUNTER_EVENT },
+    { "throughput", GPUTOP_PERFQUERY_COUNTER_THROUGHPUT },
+    { "timestamp", GPUTOP_PERFQUERY_COUNTER_TIMESTAMP },
+};
+
+/******************************************************************************/
+
+static inline __attribute__((always_inline)) void
+run_program(const struct gputop_oa_program *program,
+            int first, int last,
+            struct gputop_devinfo *devinfo,
+            const uint64_t *deltas,
+            int deltas_stride,
+            int n,
+            union reg *regs)
+{
+    int i, w;
+
+    for (i = first; i < last; i++) {
+        const struct insn *insn = &program->insns[i];
+        union reg *restrict dst = regs + insn->dst * n;
+
+#define UNARY(OPCODE, EXPR)                                             \
+        case OPCODE: {                                                  \
+            const union reg *restrict a = regs + insn->src0 * n;        \
+            for (w = 0; w < n; w++)                                     \
+                EXPR;                                                   \
+            break;                                                      \
+        }
+#define BINARY(OPCODE, EXPR)                                            \
+        case OPCODE: {                                                  \
+            const union reg *restrict a = regs + insn->src0 * n;        \
+            const union reg *restrict b = regs + insn->src1 * n;        \
+            for (w = 0; w < n; w++)                                     \
+                EXPR;                                                   \
+            break;                                                      \
+        }
+#define UBINARY(OPCODE, EXPR)                                           \
+        BINARY(OPCODE, { uint64_t x = a[w].u; uint64_t y = b[w].u; EXPR; }) \
+        case OPCODE | SRC1_UNIFORM: {                                   \
+            const union reg *restrict a = regs + insn->src0 * n;        \
+            uint64_t y = regs[insn->src1 * n].u;                        \
+            for (w = 0; w < n; w++) {                                   \
+                uint64_t x = a[w].u;                                    \
+                EXPR;                                                   \
+            }                                                           \
+            break;                                                      \
+        }                                                               \
+        case OPCODE | SRC0_DELTA: {                                     \
+            const uint64_t *restrict a = deltas + insn->src0;           \
+            const union reg *restrict b = regs + insn->src1 * n;        \
+            for (w = 0; w < n; w++) {                                   \
+                uint64_t x = a[w * deltas_stride];                      \
+                uint64_t y = b[w].u;                                    \
+                EXPR;                                                   \
+            }                                                           \
+            break;                                                      \
+        }                                                               \
+        case OPCODE | SRC0_DELTA | SRC1_UNIFORM: {                      \
+            const uint64_t *restrict a = deltas + insn->src0;           \
+            uint64_t y = regs[insn->src1 * n].u;                        \
+            for (w = 0; w < n; w++) {                                   \
+                uint64_t x = a[w * deltas_stride];                      \
+                EXPR;                                                   \
+            }                                                           \
+            break;                                                      \
+        }
+#define FBINARY(OPCODE, EXPR)                                           \
+        BINARY(OPCODE, { double x = a[w].f; double y = b[w].f; EXPR; }) \
+        BINARY(OPCODE | SRC0_U64,                                       \
+               { double x = a[w].u; double y = b[w].f; EXPR; })         \
+        BINARY(OPCODE | SRC1_U64,                                       \
+               { double x = a[w].f; double y = b[w].u; EXPR; })         \
+        BINARY(OPCODE | SRC0_U64 | SRC1_U64,                            \
+               { double x = a[w].u; double y = b[w].u; EXPR; })
+
+        switch (insn->opcode) {
+        case OP_CONST: {
+            uint64_t value = program->constants[insn->src0];
+            for (w = 0; w < n; w++)
+                dst[w].u = value;
+            break;
+        }
+        case OP_DEVINFO: {
+            uint64_t value = *(uint64_t *)((uint8_t *)devinfo + insn->src0);
+            for (w = 0; w < n; w++)
+                dst[w].u = value;
+            break;
+        }
+        case OP_DELTA:
+            for (w = 0; w < n; w++)
+                dst[w].u = deltas[w * deltas_stride + insn->src0];
+            break;
+
+        UNARY(OP_U2F, dst[w].f = a[w].u)
+        UNARY(OP_U2F32, dst[w].f = (float)a[w].u)
+        UNARY(OP_F2U, dst[w].u = a[w].f)
+        UNARY(OP_F2F32, dst[w].f = (float)a[w].f)
+
+        UBINARY(OP_UADD, dst[w].u = x + y)
+        UBINARY(OP_USUB, dst[w].u = x - y)
+        UBINARY(OP_UMUL, dst[w].u = x * y)
+        UBINARY(OP_UDIV, dst[w].u = y ? x / y : 0)
+        UBINARY(OP_UMIN, dst[w].u = MIN(x, y))
+        FBINARY(OP_FADD, dst[w].f = x + y)
+        FBINARY(OP_FSUB, dst[w].f = x - y)
+        FBINARY(OP_FMUL, dst[w].f = x * y)
+        FBINARY(OP_FDIV, dst[w].f = y ? x / y : 0)
+        FBINARY(OP_FMAX, dst[w].f = MAX(x, y))
+        FBINARY(OP_FMIN, dst[w].f = MIN(x, y))
+        BINARY(OP_AND, dst[w].u = a[w].u & b[w].u)
+        BINARY(OP_LAND, dst[w].u = a[w].u && b[w].u)
+        BINARY(OP_ULT, dst[w].u = a[w].u < b[w].u)
+        BINARY(OP_UGTE, dst[w].u = a[w].u >= b[w].u)
+        }
+
+#undef UNARY
+#undef BINARY
+#undef UBINARY
+#undef FBINARY
+    }
+}
+
+/* NB: availability predicates only depend on the device info, so they
+ * are the same for every window */
+static bool
+output_available(const struct output *output, const union reg *regs, int n)
+{
+    return output->available == NO_REG || regs[output->available * n].u;
+}
+
+static inline __attribute__((always_inline)) double *
+write_outputs(const struct gputop_oa_program *program,
+              const union reg *regs,
+              const uint64_t *deltas,
+              int deltas_stride,
+              int n,
+              double *out)
+{
+    int stride = 0;
+    int i, w;
+
+    for (i = 0; i < program->n_outputs; i++) {
+        if (output_available(&program->outputs[i], regs, n))
+            stride += 2;
+    }
+
+    /* Writing out one counter at a time for all the windows... */
+    for (i = 0; i < program->n_outputs; i++) {
+        const struct output *output = &program->outputs[i];
+        const union reg *value = regs + output->value * n;
+        const union reg *max = regs + output->max * n;
+        double *counter_out = out;
+
+        if (!output_available(output, regs, n))
+            continue;
+
+        /* NB: float counters are only rounded here, unless referenced
+         * by another counter */
+        if (output->value_is_delta) {
+            const uint64_t *delta = deltas + output->value;
+
+            for (w = 0; w < n; w++, counter_out += stride) {
+                counter_out[0] = delta[w * deltas_stride];
+                counter_out[1] = max[w].u;
+            }
+        } else if (output->value_type == TYPE_U64) {
+            for (w = 0; w < n; w++, counter_out += stride) {
+                counter_out[0] = value[w].u;
+                counter_out[1] = max[w].u;
+            }
+        } else {
+            for (w = 0; w < n; w++, counter_out += stride) {
+                counter_out[0] = (float)value[w].f;
+                counter_out[1] = max[w].u;
+            }
+        }
+
+        out += 2;
+    }
+
+    return out + (n - 1) * stride;
+}
+
+/* Returns the cached register file for batches of n (1 or BATCH_SIZE)
+ * windows */
+static union reg *
+get_program_regs(struct gputop_oa_program *program,
+                 struct gputop_devinfo *devinfo,
+                 int n)
+{
+    union reg **regs = &program->regs[n == 1 ? 0 : 1];
+
+    if (!*regs) {
+        *regs = xmalloc(sizeof(union reg) * program->n_regs * n);
+        run_program(program, 0, program->n_uniform_insns,
+                    devinfo, NULL, 0, n, *regs);
+    }
+
+    return *regs;
+}
+
+void
+gputop_oa_xml_read_all_batch(struct gputop_devinfo *devinfo,
+                             const struct gputop_metric_set *metric_set,
+                             const uint64_t *deltas,
+                             int deltas_stride,
+                             int n_windows,
+                             double *out)
+{
+    struct gputop_oa_program *program = metric_set->program;
+    union reg *regs;
+    int i;
+
+    for (i = 0; i < n_windows; i += BATCH_SIZE) {
+        const uint64_t *batch_deltas = deltas + i * deltas_stride;
+        int n = MIN(BATCH_SIZE, n_windows - i);
+
+        /* Giving the compiler a constant batch size to optimize for in
+         * the common cases... */
+        if (n == BATCH_SIZE) {
+            regs = get_program_regs(program, devinfo, BATCH_SIZE);
+            run_program(program, program->n_uniform_insns, program->n_insns,
+                        devinfo, batch_deltas, deltas_stride, BATCH_SIZE, regs);
+            out = write_outputs(program, regs, batch_deltas, deltas_stride,
+                                BATCH_SIZE, out);
+        } else if (n == 1) {
+            regs = get_program_regs(program, devinfo, 1);
+            run_program(program, program->n_uniform_insns, program->n_insns,
+                        devinfo, batch_deltas, deltas_stride, 1, regs);
+            out = write_outputs(program, regs, batch_deltas, deltas_stride,
+                                1, out);
+        } else {
+            /* Only the last, partial, batch gets here so it's not worth
+             * caching a register file for */
+            regs = alloca(sizeof(union reg) * program->n_regs * n);
+            run_program(program, 0, program->n_insns,
+                        devinfo, batch_deltas, deltas_stride, n, regs);
+            out = write_outputs(program, regs, batch_deltas, deltas_stride,
+                                n, out);
+        }
+    }
+}
+
+void
+gputop_oa_xml_program_reset(struct gputop_oa_program *program)
+{
+    free(program->regs[0]);
+    free(program->regs[1]);
+    program->regs[0] = NULL;
+    program->regs[1] = NULL;
+}
+
+static void
+xml_read_all(struct gputop_devinfo *devinfo,
+             const struct gputop_metric_set *metric_set,
+             const uint64_t *deltas,
+             double *out)
+{
+    gputop_oa_xml_read_all_batch(devinfo, metric_set, deltas, 0, 1, out);
+}
+
+static uint32_t
+xml_availability(const struct gputop_oa_metrics *metrics,
+                 struct gputop_devinfo *devinfo)
+{
+    struct xml_metrics *xml_metrics =
+        gputop_container_of(metrics, struct xml_metrics, base);
+    const struct gputop_oa_program *program = xml_metrics->availability;
+    union reg *regs = alloca(sizeof(union reg) * (program->n_regs + 1));
+    uint32_t available = 0;
+    int i;
+
+    run_program(program, 0, program->n_insns, devinfo, NULL, 0, 1, regs);
+
+    for (i = 0; i < program->n_outputs; i++) {
+        if (regs[program->outputs[i].value].u)
+            available |= 1U << i;
+    }
+
+    return available;
+}
+
+/******************************************************************************/
+
+static uint32_t
+cse_hash(uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static void
+cse_insert(struct compiler *c, uint64_t key, int reg)
+{
+    uint32_t mask = c->cse_size - 1;
+    uint32_t i = cse_hash(key) & mask;
+
+    while (c->cse[i].reg != -1)
+        i = (i + 1) & mask;
+
+    c->cse[i].key = key;
+    c->cse[i].reg = reg;
+    c->cse_count++;
+}
+
+static void
+cse_grow(struct compiler *c)
+{
+    struct cse_entry *old = c->cse;
+    int old_size = c->cse_size;
+    int i;
+
+    c->cse_size = old_size ? old_size * 2 : 256;
+    c->cse = xmalloc(sizeof(struct cse_entry) * c->cse_size);
+    for (i = 0; i < c->cse_size; i++)
+        c->cse[i].reg = -1;
+
+    c->cse_count = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].reg != -1)
+            cse_insert(c, old[i].key, old[i].reg);
+    }
+
+    free(old);
+}
+
+/* Returns the register holding the result of the given instruction,
+ * only emitting a new instruction if it's not been seen before */
+static int
+emit(struct compiler *c, enum opcode opcode, int src0, int src1)
+{
+    struct gputop_oa_program *program = c->program;
+    uint64_t key = ((uint64_t)opcode << 32) | ((uint64_t)src0 << 16) | src1;
+    uint32_t mask;
+    uint32_t i;
+    int reg;
+
+    if (c->cse_count * 2 >= c->cse_size)
+        cse_grow(c);
+
+    mask = c->cse_size - 1;
+    for (i = cse_hash(key) & mask; c->cse[i].reg != -1; i = (i + 1) & mask) {
+        if (c->cse[i].key == key)
+            return c->cse[i].reg;
+    }
+
+    if (program->n_regs >= NO_REG) {
+        asprintf(c->error, "Too many registers needed for %s\n", c->set_name);
+        return -1;
+    }
+
+    if (program->n_insns == c->insns_size) {
+        c->insns_size = c->insns_size ? c->insns_size * 2 : 64;
+        program->insns = xrealloc(program->insns,
+                                  sizeof(struct insn) * c->insns_size);
+    }
+
+    reg = program->n_regs++;
+    program->insns[program->n_insns++] = (struct insn) {
+        .opcode = opcode,
+        .dst = reg,
+        .src0 = src0,
+        .src1 = src1,
+    };
+
+    cse_insert(c, key, reg);
+
+    return reg;
+}
+
+static int
+emit_constant(struct compiler *c, uint64_t value)
+{
+    struct gputop_oa_program *program = c->program;
+    int i;
+
+    for (i = 0; i < program->n_constants; i++) {
+        if (program->constants[i] == value)
+            return emit(c, OP_CONST, i, 0);
+    }
+
+    if (program->n_constants == c->constants_size) {
+        c->constants_size = c->constants_size ? c->constants_size * 2 : 16;
+        program->constants = xrealloc(program->constants,
+                                      sizeof(uint64_t) * c->constants_size);
+    }
+    program->constants[program->n_constants++] = value;
+
+    return emit(c, OP_CONST, i, 0);
+}
+
+/* Converts a value with C's semantics */
+static bool
+convert(struct compiler *c, struct operand *operand, enum value_type type)
+{
+    int reg = operand->reg;
+
+    if (operand->type == type)
+        return true;
+
+    switch (type) {
+    case TYPE_U64:
+        reg = emit(c, OP_F2U, reg, 0);
+        break;
+    case TYPE_F32:
+        reg = emit(c, operand->type == TYPE_U64 ? OP_U2F32 : OP_F2F32, reg, 0);
+        break;
+    case TYPE_F64:
+        /* NB: floats are already stored as doubles */
+        if (operand->type == TYPE_U64)
+            reg = emit(c, OP_U2F, reg, 0);
+        break;
+    }
+
+    operand->reg = reg;
+    operand->type = type;
+
+    return reg >= 0;
+}
+
+static bool
+resolve(struct compiler *c,
+        const char *equation,
+        const struct counter_ref *refs, int n_refs,
+        struct operand *operand)
+{
+    const char *token = operand->token;
+    int i;
+
+    if (operand->reg >= 0)
+        return true;
+
+    operand->type = TYPE_U64;
+
+    if (isdigit(token[0])) {
+        char *end;
+        uint64_t value = strtoull(token, &end, 0);
+
+        if (*end != '\0') {
+            asprintf(c->error, "Invalid number %s in equation %s for %s :: %s\n",
+                     token, equation, c->set_name, c->counter_name);
+            return false;
+        }
+
+        operand->reg = emit_constant(c, value);
+        return operand->reg >= 0;
+    }
+
+    if (token[0] == '$') {
+        for (i = 0; i < ARRAY_SIZE(hw_vars); i++) {
+            if (strcmp(token, hw_vars[i].name) == 0) {
+                operand->reg = emit(c, OP_DEVINFO, hw_vars[i].offset, 0);
+                return operand->reg >= 0;
+            }
+        }
+
+        for (i = 0; i < n_refs; i++) {
+            if (strcmp(token + 1, refs[i].symbol_name) == 0) {
+                operand->reg = refs[i].reg;
+                operand->type = refs[i].type;
+                if (refs[i].round)
+                    operand->reg = emit(c, OP_F2F32, operand->reg, 0);
+                return operand->reg >= 0;
+            }
+        }
+    }
+
+    asprintf(c->error, "Failed to resolve variable %s in equation %s for %s :: %s\n",
+             token, equation, c->set_name, c->counter_name);
+    return false;
+}
+
+static bool
+compile_read(struct compiler *c,
+             const char *equation,
+             const struct gputop_metric_set *metric_set,
+             struct operand *type, struct operand *index,
+             struct operand *result)
+{
+    char *end;
+    int offset;
+    unsigned long idx;
+
+    /* NB: metric_set is NULL for availability predicates */
+    if (!metric_set || index->reg >= 0 || type->reg >= 0)
+        goto error;
+
+    idx = strtoul(index->token, &end, 10);
+    if (*end != '\0')
+        goto error;
+
+    if (strcmp(type->token, "GPU_TIME") == 0)
+        offset = metric_set->gpu_time_offset;
+    else if (strcmp(type->token, "GPU_CLOCK") == 0)
+        offset = metric_set->gpu_clock_offset;
+    else if (strcmp(type->token, "A") == 0)
+        offset = metric_set->a_offset;
+    else if (strcmp(type->token, "B") == 0)
+        offset = metric_set->b_offset;
+    else if (strcmp(type->token, "C") == 0)
+        offset = metric_set->c_offset;
+    else
+        goto error;
+
+    if (offset + idx >= MAX_RAW_OA_COUNTERS)
+        goto error;
+
+    result->reg = emit(c, OP_DELTA, offset + idx, 0);
+    result->type = TYPE_U64;
+
+    return result->reg >= 0;
+
+error:
+    asprintf(c->error, "Invalid READ in equation %s for %s :: %s\n",
+             equation, c->set_name, c->counter_name);
+    return false;
+}
+
+/* Evaluates @a @op @b as an expression in the C code generated by
+ * oa-gen.py would be, including the implicit conversions */
+static bool
+compile_op(struct compiler *c,
+           const char *op,
+           struct operand *a, struct operand *b,
+           struct operand *result)
+{
+    enum value_type common = MAX(a->type, b->type);
+    enum opcode opcode;
+    int flags = 0;
+
+    if (strcmp(op, "UADD") == 0 || strcmp(op, "FADD") == 0)
+        opcode = common == TYPE_U64 ? OP_UADD : OP_FADD;
+    else if (strcmp(op, "USUB") == 0 || strcmp(op, "FSUB") == 0)
+        opcode = common == TYPE_U64 ? OP_USUB : OP_FSUB;
+    else if (strcmp(op, "UMUL") == 0 || strcmp(op, "FMUL") == 0)
+        opcode = common == TYPE_U64 ? OP_UMUL : OP_FMUL;
+    else if (strcmp(op, "UMIN") == 0)
+        opcode = common == TYPE_U64 ? OP_UMIN : OP_FMIN;
+    else {
+        /* These convert their operands first */
+        if (strcmp(op, "UDIV") == 0) {
+            opcode = OP_UDIV;
+            common = TYPE_U64;
+        } else if (strcmp(op, "FDIV") == 0) {
+            opcode = OP_FDIV;
+            common = TYPE_F64;
+        } else if (strcmp(op, "FMAX") == 0) {
+            opcode = OP_FMAX;
+            common = TYPE_F64;
+        } else if (strcmp(op, "AND") == 0) {
+            opcode = OP_AND;
+            common = TYPE_U64;
+        } else if (strcmp(op, "&&") == 0) {
+            opcode = OP_LAND;
+            common = TYPE_U64;
+        } else if (strcmp(op, "ULT") == 0) {
+            opcode = OP_ULT;
+            common = TYPE_U64;
+        } else if (strcmp(op, "UGTE") == 0) {
+            opcode = OP_UGTE;
+            common = TYPE_U64;
+        } else
+            assert(0);
+    }
+
+    if (common == TYPE_F64 && opcode >= OP_FADD && opcode <= OP_FMIN) {
+        if (a->type == TYPE_U64)
+            flags |= SRC0_U64;
+        if (b->type == TYPE_U64)
+            flags |= SRC1_U64;
+    }
+
+    if ((!(flags & SRC0_U64) && !convert(c, a, common)) ||
+        (!(flags & SRC1_U64) && !convert(c, b, common)))
+        return false;
+
+    result->reg = emit(c, opcode | flags, a->reg, b->reg);
+    result->type = common;
+    if (result->reg < 0)
+        return false;
+
+    /* Arithmetic on floats is done with doubles, which is exact for a
+     * single operation once rounded back to float precision */
+    if (common == TYPE_F32) {
+        result->reg = emit(c, OP_F2F32, result->reg, 0);
+        if (result->reg < 0)
+            return false;
+    }
+
+    /* Finally assigned to a uint64_t or double temporary... */
+    return convert(c, result, op[0] == 'F' ? TYPE_F64 : TYPE_U64);
+}
+
+static bool
+is_op(const char *token)
+{
+    static const char *ops[] = {
+        "FADD", "FDIV", "FMAX", "FMUL", "FSUB", "READ",
+        "UADD", "UDIV", "UMUL", "USUB", "UMIN",
+        "AND", "UGTE", "ULT", "&&",
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        if (strcmp(token, ops[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static bool
+compile_equation(struct compiler *c,
+                 const struct gputop_metric_set *metric_set,
+                 const char *equation,
+                 const struct counter_ref *refs, int n_refs,
+                 struct operand *result)
+{
+    char *tokens = strdup(equation);
+    struct operand *stack = xmalloc(sizeof(struct operand) * (strlen(equation) + 1));
+    int depth = 0;
+    char *saveptr = NULL;
+    char *token;
+    bool ret = false;
+
+    for (token = strtok_r(tokens, " \t\n", &saveptr);
+         token;
+         token = strtok_r(NULL, " \t\n", &saveptr))
+    {
+        struct operand *a, *b;
+
+        if (!is_op(token)) {
+            stack[depth++] = (struct operand) { .token = token, .reg = -1 };
+            continue;
+        }
+
+        if (depth < 2) {
+            asprintf(c->error, "Missing operands for %s in equation %s for %s :: %s\n",
+                     token, equation, c->set_name, c->counter_name);
+            goto out;
+        }
+
+        a = &stack[depth - 2];
+        b = &stack[depth - 1];
+
+        if (strcmp(token, "READ") == 0) {
+            if (!compile_read(c, equation, metric_set, a, b, a))
+                goto out;
+        } else {
+            if (!resolve(c, equation, refs, n_refs, a) ||
+                !resolve(c, equation, refs, n_refs, b) ||
+                !compile_op(c, token, a, b, a))
+                goto out;
+        }
+        a->token = NULL;
+        depth--;
+    }
+
+    if (depth != 1) {
+        asprintf(c->error, "Spurious empty rpn code for %s :: %s in equation %s\n",
+                 c->set_name, c->counter_name, equation);
+        goto out;
+    }
+
+    if (!resolve(c, equation, refs, n_refs, &stack[0]))
+        goto out;
+
+    result->reg = stack[0].reg;
+    result->type = stack[0].type;
+    ret = true;
+
+out:
+    free(stack);
+    free(tokens);
+
+    return ret;
+}
+
+static void
+compiler_init(struct compiler *c, const char *set_name, char **error)
+{
+    memset(c, 0, sizeof(*c));
+    c->program = xmalloc0(sizeof(struct gputop_oa_program));
+    c->set_name = set_name;
+    c->error = error;
+}
+
+static void
+program_free(struct gputop_oa_program *program)
+{
+    if (!program)
+        return;
+
+    gputop_oa_xml_program_reset(program);
+    free(program->insns);
+    free(program->constants);
+    free(program->outputs);
+    free(program);
+}
+
+/* Most deltas are only read to be scaled by some factor or written out
+ * as is, so integer instructions and outputs read them directly where
+ * possible, and OP_DELTA instructions are only kept for deltas that are
+ * still read from a register */
+static void
+fuse_delta_reads(struct gputop_oa_program *program)
+{
+    int *uses = xmalloc0(sizeof(int) * (program->n_regs + 1));
+    int *delta_index = xmalloc(sizeof(int) * (program->n_regs + 1));
+    int n = 0;
+    int i;
+
+    for (i = 0; i < program->n_regs; i++)
+        delta_index[i] = -1;
+
+    for (i = 0; i < program->n_insns; i++) {
+        const struct insn *insn = &program->insns[i];
+
+        switch (insn->opcode & OPCODE_MASK) {
+        case OP_CONST:
+        case OP_DEVINFO:
+            break;
+        case OP_DELTA:
+            delta_index[insn->dst] = insn->src0;
+            break;
+        case OP_U2F:
+        case OP_U2F32:
+        case OP_F2U:
+        case OP_F2F32:
+            uses[insn->src0]++;
+            break;
+        default:
+            uses[insn->src0]++;
+            uses[insn->src1]++;
+            break;
+        }
+    }
+
+    for (i = 0; i < program->n_outputs; i++) {
+        struct output *output = &program->outputs[i];
+
+        if (delta_index[output->value] >= 0) {
+            output->value = delta_index[output->value];
+            output->value_is_delta = true;
+        } else
+            uses[output->value]++;
+        uses[output->max]++;
+        if (output->available != NO_REG)
+            uses[output->available]++;
+    }
+
+    for (i = 0; i < program->n_insns; i++) {
+        struct insn *insn = &program->insns[i];
+
+        switch (insn->opcode) {
+        case OP_UADD:
+        case OP_USUB:
+        case OP_UMUL:
+        case OP_UDIV:
+        case OP_UMIN:
+            if (delta_index[insn->src0] >= 0) {
+                uses[insn->src0]--;
+                insn->opcode |= SRC0_DELTA;
+                insn->src0 = delta_index[insn->src0];
+            }
+            break;
+        }
+    }
+
+    for (i = 0; i < program->n_insns; i++) {
+        const struct insn *insn = &program->insns[i];
+
+        if (insn->opcode != OP_DELTA || uses[insn->dst])
+            program->insns[n++] = *insn;
+    }
+    program->n_insns = n;
+
+    free(delta_index);
+    free(uses);
+}
+
+/* Moves the instructions that don't depend on any deltas to the start of
+ * the program (keeping the order of instructions within each group so
+ * registers are still written before being read) */
+static void
+hoist_uniform_insns(struct gputop_oa_program *program)
+{
+    bool *uniform = xmalloc0(sizeof(bool) * (program->n_regs + 1));
+    struct insn *insns = xmalloc(sizeof(struct insn) * (program->n_insns + 1));
+    int n_uniform = 0;
+    int n = 0;
+    int i;
+
+    for (i = 0; i < program->n_insns; i++) {
+        const struct insn *insn = &program->insns[i];
+
+        switch (insn->opcode & OPCODE_MASK) {
+        case OP_CONST:
+        case OP_DEVINFO:
+            uniform[insn->dst] = true;
+            break;
+        case OP_DELTA:
+            break;
+        case OP_U2F:
+        case OP_U2F32:
+        case OP_F2U:
+        case OP_F2F32:
+            uniform[insn->dst] = uniform[insn->src0];
+            break;
+        default:
+            uniform[insn->dst] = !(insn->opcode & SRC0_DELTA) &&
+                uniform[insn->src0] && uniform[insn->src1];
+            break;
+        }
+
+        if (uniform[insn->dst])
+            n_uniform++;
+    }
+
+    for (i = 0; i < program->n_insns; i++) {
+        const struct insn *insn = &program->insns[i];
+
+        if (uniform[insn->dst])
+            insns[n++] = *insn;
+    }
+    for (i = 0; i < program->n_insns; i++) {
+        const struct insn *insn = &program->insns[i];
+
+        if (uniform[insn->dst])
+            continue;
+
+        insns[n] = *insn;
+        switch (insn->opcode & ~SRC0_DELTA) {
+        case OP_UADD:
+        case OP_USUB:
+        case OP_UMUL:
+        case OP_UDIV:
+        case OP_UMIN:
+            if (uniform[insn->src1])
+                insns[n].opcode |= SRC1_UNIFORM;
+            break;
+        }
+        n++;
+    }
+
+    free(program->insns);
+    program->insns = insns;
+    program->n_uniform_insns = n_uniform;
+
+    free(uniform);
+}
+
+static struct gputop_oa_program *
+compiler_finish(struct compiler *c, bool success)
+{
+    free(c->cse);
+
+    if (!success) {
+        program_free(c->program);
+        return NULL;
+    }
+
+    fuse_delta_reads(c->program);
+    hoist_uniform_insns(c->program);
+
+    return c->program;
+}
+
+/******************************************************************************/
+
+static const char *
+xml_attribute(const struct xml_element *element, const char *name)
+{
+    int i;
+
+    for (i = 0; i < element->n_attributes; i++) {
+        if (strcmp(element->attribute_names[i], name) == 0)
+            return element->attribute_values[i];
+    }
+
+    return NULL;
+}
+
+static void
+xml_decode_entities(char *str)
+{
+    static const struct {
+        const char *entity;
+        char c;
+    } entities[] = {
+        { "&amp;", '&' },
+        { "&lt;", '<' },
+        { "&gt;", '>' },
+        { "&quot;", '"' },
+        { "&apos;", '\'' },
+    };
+    char *out = str;
+    int i;
+
+    while (*str) {
+        if (str[0] == '&' && str[1] == '#') {
+            char *end;
+            unsigned long c = str[2] == 'x' ?
+                strtoul(str + 3, &end, 16) : strtoul(str + 2, &end, 10);
+
+            /* NB: only expecting ascii characters like newlines here */
+            if (*end == ';' && c > 0 && c < 128) {
+                *out++ = c;
+                str = end + 1;
+                continue;
+            }
+        }
+
+        if (*str == '&') {
+            for (i = 0; i < ARRAY_SIZE(entities); i++) {
+                int len = strlen(entities[i].entity);
+
+                if (strncmp(str, entities[i].entity, len) == 0) {
+                    *out++ = entities[i].c;
+                    str += len;
+                    break;
+                }
+            }
+            if (i < ARRAY_SIZE(entities))
+                continue;
+        }
+        *out++ = *str++;
+    }
+    *out = '\0';
+}
+
+/* Parses the start tag at @p (pointing at the '<'), NUL terminating the
+ * element name and attribute names and values in place.
+ *
+ * Returns a pointer to just after the tag or NULL on error
+ */
+static char *
+xml_parse_element(char *p, struct xml_element *element, char **error)
+{
+    char end;
+
+    element->name = ++p;
+    element->n_attributes = 0;
+
+    while (*p && !isspace(*p) && *p != '>' && *p != '/')
+        p++;
+
+    end = *p;
+    *p = '\0';
+
+    while (end) {
+        char *name;
+        char *name_end;
+        char *value;
+        char quote;
+
+        if (end == '>')
+            return p + 1;
+        if (end == '/') {
+            if (p[1] != '>')
+                break;
+            return p + 2;
+        }
+
+        /* skip whitespace... */
+        do {
+            p++;
+        } while (isspace(*p));
+
+        if (*p == '>' || *p == '/') {
+            end = *p;
+            continue;
+        }
+
+        name = p;
+        while (*p && *p != '=' && !isspace(*p) && *p != '>')
+            p++;
+        name_end = p;
+
+        while (isspace(*p))
+            p++;
+        if (*p != '=')
+            break;
+        p++;
+        while (isspace(*p))
+            p++;
+
+        quote = *p;
+        if (quote != '"' && quote != '\'')
+            break;
+        value = ++p;
+        p = strchr(p, quote);
+        if (!p)
+            break;
+
+        *p = '\0';
+        *name_end = '\0';
+        xml_decode_entities(value);
+
+        if (element->n_attributes < MAX_ATTRIBUTES) {
+            element->attribute_names[element->n_attributes] = name;
+            element->attribute_values[element->n_attributes] = value;
+            element->n_attributes++;
+        }
+
+        /* Look at what follows the closing quote next */
+        end = ' ';
+    }
+
+    asprintf(error, "Malformed <%s> element in metrics xml\n", element->name);
+    return NULL;
+}
+
+/* We only care about the <set> and <counter> elements and their attributes
+ * so this isn't a general purpose xml parser */
+static bool
+xml_parse_sets(char *xml, struct parsed_set **sets_out, int *n_sets_out,
+               char **error)
+{
+    struct parsed_set *sets = NULL;
+    struct parsed_set *set = NULL;
+    int n_sets = 0;
+    char *p = xml;
+    int i;
+
+    while ((p = strchr(p, '<'))) {
+        struct xml_element element;
+
+        if (strncmp(p, "<!--", 4) == 0) {
+            p = strstr(p, "-->");
+            if (!p)
+                break;
+            continue;
+        }
+
+        if (p[1] == '?' || p[1] == '!') {
+            p = strchr(p, '>');
+            if (!p)
+                break;
+            continue;
+        }
+
+        if (p[1] == '/') {
+            if (strncmp(p + 2, "set", 3) == 0 && !isalnum(p[5]))
+                set = NULL;
+            p = strchr(p, '>');
+            if (!p)
+                break;
+            continue;
+        }
+
+        p = xml_parse_element(p, &element, error);
+        if (!p)
+            goto error;
+
+        if (strcmp(element.name, "set") == 0) {
+            sets = xrealloc(sets, sizeof(struct parsed_set) * (n_sets + 1));
+            set = &sets[n_sets++];
+            memset(set, 0, sizeof(*set));
+
+            set->name = xml_attribute(&element, "name");
+            set->symbol_name = xml_attribute(&element, "symbol_name");
+            set->guid = xml_attribute(&element, "guid");
+            set->chipset = xml_attribute(&element, "chipset");
+
+            if (!set->name || !set->symbol_name || !set->guid || !set->chipset) {
+                asprintf(error, "Metric set missing name, symbol_name, guid or chipset\n");
+                goto error;
+            }
+        } else if (strcmp(element.name, "counter") == 0 && set) {
+            struct parsed_counter *counter;
+
+            if (set->n_counters == set->counters_size) {
+                set->counters_size = set->counters_size ? set->counters_size * 2 : 64;
+                set->counters = xrealloc(set->counters,
+                                         sizeof(struct parsed_counter) *
+                                         set->counters_size);
+            }
+            counter = &set->counters[set->n_counters++];
+
+            counter->name = xml_attribute(&element, "name");
+            counter->symbol_name = xml_attribute(&element, "symbol_name");
+            counter->desc = xml_attribute(&element, "description");
+            counter->data_type = xml_attribute(&element, "data_type");
+            counter->semantic_type = xml_attribute(&element, "semantic_type");
+            counter->equation = xml_attribute(&element, "equation");
+            counter->max_equation = xml_attribute(&element, "max_equation");
+            counter->availability = xml_attribute(&element, "availability");
+
+            if (!counter->name || !counter->symbol_name || !counter->data_type ||
+                !counter->semantic_type || !counter->equation)
+            {
+                asprintf(error, "Counter in %s missing name, symbol_name, data_type, semantic_type or equation\n",
+                         set->name);
+                goto error;
+            }
+            if (!counter->desc)
+                counter->desc = "";
+        }
+    }
+
+    *sets_out = sets;
+    *n_sets_out = n_sets;
+
+    return true;
+
+error:
+    for (i = 0; i < n_sets; i++)
+        free(sets[i].counters);
+    free(sets);
+
+    return false;
+}
+
+/******************************************************************************/
+
+static bool
+build_metric_set(struct gputop_metric_set *metric_set,
+                 const struct parsed_set *set,
+                 const char **availability_exprs,
+                 int n_availability_exprs,
+                 char **error)
+{
+    struct gputop_metric_set_counter *counters =
+        xmalloc0(sizeof(struct gputop_metric_set_counter) * set->n_counters);
+    struct counter_ref *refs =
+        xmalloc(sizeof(struct counter_ref) * set->n_counters);
+    struct compiler c;
+    struct gputop_oa_program *program;
+    bool predicated = false;
+    bool success = false;
+    int i, j;
+
+    metric_set->name = set->name;
+    metric_set->symbol_name = set->symbol_name;
+    metric_set->guid = set->guid;
+    metric_set->all_counters = counters;
+    metric_set->n_all_counters = set->n_counters;
+    metric_set->perf_raw_size = 256;
+    metric_set->read_all = xml_read_all;
+
+    /* Matching the offsets assigned by oa-gen.py */
+    if (strcasecmp(set->chipset, "hsw") == 0) {
+        metric_set->perf_oa_format = I915_OA_FORMAT_A45_B8_C8;
+        metric_set->gpu_time_offset = 0;
+        metric_set->a_offset = 1;
+        metric_set->b_offset = metric_set->a_offset + 45;
+        metric_set->c_offset = metric_set->b_offset + 8;
+    } else {
+        metric_set->perf_oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8;
+        metric_set->gpu_time_offset = 0;
+        metric_set->gpu_clock_offset = 1;
+        metric_set->a_offset = 2;
+        metric_set->b_offset = metric_set->a_offset + 36;
+        metric_set->c_offset = metric_set->b_offset + 8;
+    }
+
+    compiler_init(&c, set->name, error);
+    program = c.program;
+    program->outputs = xmalloc(sizeof(struct output) * set->n_counters);
+
+    for (i = 0; i < set->n_counters; i++) {
+        const struct parsed_counter *parsed = &set->counters[i];
+        struct gputop_metric_set_counter *counter = &counters[i];
+        struct output *output = &program->outputs[i];
+        struct operand value, max;
+        enum value_type type;
+
+        c.counter_name = parsed->name;
+
+        if (strcmp(parsed->data_type, "uint64") == 0) {
+            counter->data_type = GPUTOP_PERFQUERY_COUNTER_DATA_UINT64;
+            type = TYPE_U64;
+        } else if (strcmp(parsed->data_type, "float") == 0) {
+            counter->data_type = GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT;
+            type = TYPE_F32;
+        } else {
+            asprintf(error, "Unsupported data type %s for %s :: %s\n",
+                     parsed->data_type, set->name, parsed->name);
+            goto out;
+        }
+
+        for (j = 0; j < ARRAY_SIZE(semantic_types); j++) {
+            if (strcmp(parsed->semantic_type, semantic_types[j].name) == 0)
+                break;
+        }
+        if (j == ARRAY_SIZE(semantic_types)) {
+            asprintf(error, "Unsupported semantic type %s for %s :: %s\n",
+                     parsed->semantic_type, set->name, parsed->name);
+            goto out;
+        }
+
+        counter->name = parsed->name;
+        counter->symbol_name = parsed->symbol_name;
+        counter->desc = parsed->desc;
+        counter->type = semantic_types[j].type;
+
+        if (!compile_equation(&c, metric_set, parsed->equation, refs, i, &value))
+            goto out;
+
+        refs[i].symbol_name = parsed->symbol_name;
+        refs[i].type = type;
+
+        /* Double values of float counters are only rounded when written out,
+         * or if referenced by a later counter */
+        if (type == TYPE_F32 && value.type == TYPE_F64)
+            refs[i].round = true;
+        else {
+            refs[i].round = false;
+            if (!convert(&c, &value, type))
+                goto out;
+        }
+        refs[i].reg = value.reg;
+
+        if (parsed->max_equation) {
+            if (!compile_equation(&c, metric_set, parsed->max_equation, refs, i, &max) ||
+                !convert(&c, &max, TYPE_U64))
+                goto out;
+        } else {
+            max.reg = emit_constant(&c, 0);
+            if (max.reg < 0)
+                goto out;
+        }
+
+        output->value = value.reg;
+        output->value_type = type;
+        output->value_is_delta = false;
+        output->max = max.reg;
+        output->available = NO_REG;
+
+        if (parsed->availability) {
+            struct operand available;
+
+            for (j = 0; j < n_availability_exprs; j++) {
+                if (strcmp(parsed->availability, availability_exprs[j]) == 0)
+                    break;
+            }
+            assert(j < n_availability_exprs);
+            counter->availability = 1U << j;
+
+            /* NB: availability predicates can't READ deltas */
+            if (!compile_equation(&c, NULL, parsed->availability, NULL, 0, &available) ||
+                !convert(&c, &available, TYPE_U64))
+                goto out;
+            output->available = available.reg;
+
+            predicated = true;
+        }
+
+        program->n_outputs++;
+    }
+
+    /* As for the generated metric sets, the counters are only filtered
+     * once looked up if any depend on an availability predicate */
+    if (!predicated) {
+        metric_set->counters = counters;
+        metric_set->n_counters = set->n_counters;
+    }
+
+    success = true;
+
+out:
+    metric_set->program = compiler_finish(&c, success);
+    free(refs);
+
+    return success;
+}
+
+static bool
+build_availability(struct xml_metrics *metrics,
+                   const char **availability_exprs,
+                   int n_availability_exprs,
+                   char **error)
+{
+    struct compiler c;
+    bool success = false;
+    int i;
+
+    compiler_init(&c, "availability", error);
+    c.program->outputs = xmalloc(sizeof(struct output) * (n_availability_exprs + 1));
+
+    for (i = 0; i < n_availability_exprs; i++) {
+        struct operand available;
+
+        c.counter_name = availability_exprs[i];
+        if (!compile_equation(&c, NULL, availability_exprs[i], NULL, 0, &available) ||
+            !convert(&c, &available, TYPE_U64))
+            goto out;
+
+        c.program->outputs[i] = (struct output) {
+            .value = available.reg,
+            .value_type = TYPE_U64,
+            .max = available.reg,
+            .available = NO_REG,
+        };
+        c.program->n_outputs++;
+    }
+
+    success = true;
+
+out:
+    metrics->availability = compiler_finish(&c, success);
+
+    return success;
+}
+
+/* As done by oa-gen.py at build time */
+static bool
+build_perfect_hash(struct xml_metrics *metrics, char **error)
+{
+    struct gputop_oa_metrics *base = &metrics->base;
+    uint32_t size = 1;
+    uint32_t seed;
+    int i;
+
+    while (size < base->n_metric_sets * 2)
+        size *= 2;
+
+    metrics->hash_table = xmalloc(size);
+    base->hash_table = metrics->hash_table;
+    base->hash_mask = size - 1;
+
+    for (seed = 0; seed < (1 << 20); seed++) {
+        memset(metrics->hash_table, -1, size);
+
+        for (i = 0; i < base->n_metric_sets; i++) {
+            uint32_t hash = gputop_oa_guid_hash(base->metric_sets[i].guid, seed);
+            uint32_t slot = hash & base->hash_mask;
+
+            if (metrics->hash_table[slot] != -1)
+                break;
+            metrics->hash_table[slot] = i;
+        }
+
+        if (i == base->n_metric_sets) {
+            base->hash_seed = seed;
+            return true;
+        }
+    }
+
+    asprintf(error, "Failed to find a perfect hash for the metric set guids\n");
+    return false;
+}
+
+struct gputop_oa_metrics *
+gputop_oa_xml_load(const char *xml, const char *chipset, char **error)
+{
+    struct xml_metrics *metrics = xmalloc0(sizeof(struct xml_metrics));
+    struct gputop_oa_metrics *base = &metrics->base;
+    struct parsed_set *sets = NULL;
+    const char *availability_exprs[32];
+    int n_availability_exprs = 0;
+    int n_sets = 0;
+    int i, j, k;
+
+    metrics->xml = strdup(xml);
+    base->availability = xml_availability;
+
+    if (!xml_parse_sets(metrics->xml, &sets, &n_sets, error))
+        goto error;
+
+    if (n_sets == 0 || n_sets > 127) {
+        asprintf(error, "Unsupported number of metric sets (%d) in metrics xml\n", n_sets);
+        goto error;
+    }
+
+    for (i = 0; i < n_sets; i++) {
+        if (chipset && strcasecmp(sets[i].chipset, chipset) != 0) {
+            asprintf(error, "Metric set %s is for %s, not %s\n",
+                     sets[i].name, sets[i].chipset, chipset);
+            goto error;
+        }
+
+        /* Each distinct availability expression gets a bit... */
+        for (j = 0; j < sets[i].n_counters; j++) {
+            const char *availability = sets[i].counters[j].availability;
+
+            if (!availability)
+                continue;
+
+            for (k = 0; k < n_availability_exprs; k++) {
+                if (strcmp(availability, availability_exprs[k]) == 0)
+                    break;
+            }
+            if (k < n_availability_exprs)
+                continue;
+
+            if (n_availability_exprs == ARRAY_SIZE(availability_exprs)) {
+                asprintf(error, "Too many distinct counter availability expressions\n");
+                goto error;
+            }
+            availability_exprs[n_availability_exprs++] = availability;
+        }
+    }
+
+    base->metric_sets = xmalloc0(sizeof(struct gputop_metric_set) * n_sets);
+    for (i = 0; i < n_sets; i++) {
+        base->n_metric_sets++;
+        if (!build_metric_set(&base->metric_sets[i], &sets[i],
+                              availability_exprs, n_availability_exprs,
+                              error))
+            goto error;
+    }
+
+    if (!build_availability(metrics, availability_exprs, n_availability_exprs, error) ||
+        !build_perfect_hash(metrics, error))
+        goto error;
+
+    for (i = 0; i < n_sets; i++)
+        free(sets[i].counters);
+    free(sets);
+
+    return base;
+
+error:
+    for (i = 0; i < n_sets; i++)
+        free(sets[i].counters);
+    free(sets);
+
+    gputop_oa_xml_free(base);
+
+    return NULL;
+}
+
+void
+gputop_oa_xml_free(struct gputop_oa_metrics *base)
+{
+    struct xml_metrics *metrics =
+        gputop_container_of(base, struct xml_metrics, base);
+    int i;
+
+    gputop_oa_metrics_reset(base);
+
+    for (i = 0; i < base->n_metric_sets; i++) {
+        struct gputop_metric_set *metric_set = &base->metric_sets[i];
+
+        free((void *)metric_set->all_counters);
+        program_free(metric_set->program);
+    }
+
+    free(base->metric_sets);
+    free(metrics->hash_table);
+    program_free(metrics->availability);
+    free(metrics->xml);
+    free(metrics);
+}
@@ -0,0 +1,57 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "gputop-oa-counters.h"
+
+/* Loads the metric sets described by an oa-<chipset>.xml file (as also
+ * read by oa-gen.py) at runtime, compiling the equations of each metric
+ * set into bytecode.
+ *
+ * If chipset isn't NULL then every metric set must be for that chipset.
+ *
+ * Returns NULL on failure with a description in *error
+ */
+struct gputop_oa_metrics *gputop_oa_xml_load(const char *xml,
+                                             const char *chipset,
+                                             char **error);
+void gputop_oa_xml_free(struct gputop_oa_metrics *metrics);
+
+/* Evaluates every available counter of a metric set loaded via
+ * gputop_oa_xml_load() for n_windows accumulated windows, with the deltas
+ * for window i at deltas + i * deltas_stride and writing n_counters
+ * (value, max) pairs per window to out[] (i.e. like calling read_all()
+ * for each window, but with each instruction being run over a batch of
+ * windows) */
+void gputop_oa_xml_read_all_batch(struct gputop_devinfo *devinfo,
+                                  const struct gputop_metric_set *metric_set,
+                                  const uint64_t *deltas,
+                                  int deltas_stride,
+                                  int n_windows,
+                                  double *out);
+
+/* Frees the registers cached by gputop_oa_xml_read_all_batch() that
+ * depend on the device info (as done via gputop_oa_metrics_reset()) */
+void gputop_oa_xml_program_reset(struct gputop_oa_program *program);
@@ -0,0 +1,346 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-perf-records.h"
+
+#ifdef EMSCRIPTEN
+#include "gputop-web-lib.h"
+#define dbg gputop_web_console_log
+
+/* The web UI is built without kernel headers so we define the subset of
+ * the perf ABI we need to parse forwarded records... */
+struct perf_event_header {
+    uint32_t type;
+    uint16_t misc;
+    uint16_t size;
+};
+
+#define PERF_RECORD_LOST                2
+#define PERF_RECORD_THROTTLE            5
+#define PERF_RECORD_UNTHROTTLE          6
+#define PERF_RECORD_SAMPLE              9
+
+#define PERF_SAMPLE_IP                  (1U << 0)
+#define PERF_SAMPLE_TID                 (1U << 1)
+#define PERF_SAMPLE_TIME                (1U << 2)
+#define PERF_SAMPLE_ADDR                (1U << 3)
+#define PERF_SAMPLE_READ                (1U << 4)
+#define PERF_SAMPLE_CALLCHAIN           (1U << 5)
+#define PERF_SAMPLE_ID                  (1U << 6)
+#define PERF_SAMPLE_CPU                 (1U << 7)
+#define PERF_SAMPLE_PERIOD              (1U << 8)
+#define PERF_SAMPLE_STREAM_ID           (1U << 9)
+#define PERF_SAMPLE_RAW                 (1U << 10)
+#define PERF_SAMPLE_IDENTIFIER          (1U << 16)
+
+#define PERF_FORMAT_TOTAL_TIME_ENABLED  (1U << 0)
+#define PERF_FORMAT_TOTAL_TIME_RUNNING  (1U << 1)
+#define PERF_FORMAT_ID                  (1U << 2)
+#define PERF_FORMAT_GROUP               (1U << 3)
+#else
+#include <linux/perf_event.h>
+
+#include "gputop-log.h"
+#endif
+
+#ifndef PERF_RECORD_LOST_SAMPLES
+#define PERF_RECORD_LOST_SAMPLES        13
+#endif
+
+/* perf_event_header::size is 16 bits */
+#define MAX_RECORD_SIZE 65536
+
+struct cursor {
+    const uint8_t *pos;
+    const uint8_t *end;
+};
+
+static bool
+read_u64(struct cursor *c, uint64_t *value)
+{
+    if (c->end - c->pos < 8)
+        return false;
+
+    memcpy(value, c->pos, 8);
+    c->pos += 8;
+    return true;
+}
+
+static bool
+skip(struct cursor *c, size_t len)
+{
+    if ((size_t)(c->end - c->pos) < len)
+        return false;
+
+    c->pos += len;
+    return true;
+}
+
+/* See the PERF_RECORD_SAMPLE layout in linux/perf_event.h; fields are
+ * present in this order according to the sample_type bits */
+static bool
+decode_sample(struct gputop_perf_parser *parser,
+              struct cursor *c,
+              struct gputop_perf_event *event)
+{
+    uint64_t sample_type = parser->sample_type;
+    uint64_t read_format = parser->read_format;
+    uint64_t ignore;
+
+    if (sample_type & PERF_SAMPLE_IDENTIFIER && !read_u64(c, &event->id))
+        return false;
+    if (sample_type & PERF_SAMPLE_IP && !read_u64(c, &ignore))
+        return false;
+    if (sample_type & PERF_SAMPLE_TID && !read_u64(c, &ignore))
+        return false;
+    if (sample_type & PERF_SAMPLE_TIME && !read_u64(c, &event->time))
+        return false;
+    if (sample_type & PERF_SAMPLE_ADDR && !read_u64(c, &ignore))
+        return false;
+    if (sample_type & PERF_SAMPLE_ID && !read_u64(c, &event->id))
+        return false;
+    if (sample_type & PERF_SAMPLE_STREAM_ID && !read_u64(c, &ignore))
+        return false;
+    if (sample_type & PERF_SAMPLE_CPU && !read_u64(c, &ignore))
+        return false;
+    if (sample_type & PERF_SAMPLE_PERIOD && !read_u64(c, &ignore))
+        return false;
+
+    if (sample_type & PERF_SAMPLE_READ) {
+        /* We don't open any event groups */
+        if (read_format & PERF_FORMAT_GROUP)
+            return false;
+
+        if (!read_u64(c, &event->value))
+            return false;
+        if (read_format & PERF_FORMAT_TOTAL_TIME_ENABLED &&
+            !read_u64(c, &event->time_enabled))
+            return false;
+        if (read_format & PERF_FORMAT_TOTAL_TIME_RUNNING &&
+            !read_u64(c, &event->time_running))
+            return false;
+        if (read_format & PERF_FORMAT_ID && !read_u64(c, &event->id))
+            return false;
+    }
+
+    if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+        uint64_t nr;
+
+        if (!read_u64(c, &nr) || nr > MAX_RECORD_SIZE / 8 || !skip(c, nr * 8))
+            return false;
+    }
+
+    if (sample_type & PERF_SAMPLE_RAW) {
+        uint32_t size;
+
+        if (c->end - c->pos < 4)
+            return false;
+        memcpy(&size, c->pos, 4);
+        c->pos += 4;
+
+        event->raw = c->pos;
+        event->raw_size = size;
+        if (!skip(c, size))
+            return false;
+    }
+
+    /* Anything following PERF_SAMPLE_RAW is ignored */
+
+    return true;
+}
+
+static void
+handle_record(struct gputop_perf_parser *parser,
+              const struct perf_event_header *header,
+              gputop_perf_event_cb event_cb,
+              void *data)
+{
+    struct gputop_perf_event event;
+    struct cursor c = {
+        .pos = (const uint8_t *)(header + 1),
+        .end = (const uint8_t *)header + header->size,
+    };
+
+    memset(&event, 0, sizeof(event));
+
+    switch (header->type) {
+    case PERF_RECORD_SAMPLE:
+        parser->n_samples++;
+        if (!event_cb)
+            return;
+
+        event.type = GPUTOP_PERF_EVENT_SAMPLE;
+        if (!decode_sample(parser, &c, &event)) {
+            parser->n_malformed++;
+            return;
+        }
+        break;
+
+    case PERF_RECORD_LOST:
+        /* struct { u64 id; u64 lost; } */
+        event.type = GPUTOP_PERF_EVENT_LOST;
+        if (!read_u64(&c, &event.id) || !read_u64(&c, &event.n_lost)) {
+            parser->n_malformed++;
+            return;
+        }
+        parser->n_lost_records++;
+        parser->n_lost_samples += event.n_lost;
+        break;
+
+    case PERF_RECORD_LOST_SAMPLES:
+        /* struct { u64 lost; } */
+        event.type = GPUTOP_PERF_EVENT_LOST;
+        if (!read_u64(&c, &event.n_lost)) {
+            parser->n_malformed++;
+            return;
+        }
+        parser->n_lost_records++;
+        parser->n_lost_samples += event.n_lost;
+        break;
+
+    case PERF_RECORD_THROTTLE:
+    case PERF_RECORD_UNTHROTTLE:
+        /* struct { u64 time; u64 id; u64 stream_id; } */
+        if (header->type == PERF_RECORD_THROTTLE) {
+            event.type = GPUTOP_PERF_EVENT_THROTTLE;
+            parser->n_throttled++;
+        } else
+            event.type = GPUTOP_PERF_EVENT_UNTHROTTLE;
+
+        if (!read_u64(&c, &event.time) || !read_u64(&c, &event.id)) {
+            parser->n_malformed++;
+            return;
+        }
+        break;
+
+    default:
+        /* E.g. PERF_RECORD_COMM/MMAP etc that we don't request */
+        return;
+    }
+
+    if (event_cb)
+        event_cb(&event, data);
+}
+
+void
+gputop_perf_parser_init(struct gputop_perf_parser *parser,
+                        uint64_t sample_type,
+                        uint64_t read_format)
+{
+    memset(parser, 0, sizeof(*parser));
+
+    parser->sample_type = sample_type;
+    parser->read_format = read_format;
+}
+
+void
+gputop_perf_parser_fini(struct gputop_perf_parser *parser)
+{
+    free(parser->wrap_buf);
+    parser->wrap_buf = NULL;
+}
+
+uint64_t
+gputop_perf_parser_parse_ring(struct gputop_perf_parser *parser,
+                              const uint8_t *buffer,
+                              size_t buffer_size,
+                              uint64_t head,
+                              uint64_t tail,
+                              gputop_perf_event_cb event_cb,
+                              void *data)
+{
+    const uint64_t mask = buffer_size - 1;
+
+    while (head - tail >= sizeof(struct perf_event_header)) {
+        uint64_t offset = tail & mask;
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(buffer + offset);
+
+        /* NB: records are 8 byte aligned and the buffer size is a power
+         * of two, so a header itself never straddles the end of the
+         * buffer, only its payload. */
+
+        if (header->size < sizeof(*header) || header->size > head - tail) {
+            dbg("Spurious perf record size %d; skipping remaining records\n",
+                header->size);
+            parser->n_malformed++;
+            return head;
+        }
+
+        if (offset + header->size > buffer_size) {
+            size_t before = buffer_size - offset;
+
+            if (!parser->wrap_buf) {
+                parser->wrap_buf = malloc(MAX_RECORD_SIZE);
+                if (!parser->wrap_buf) {
+                    parser->n_malformed++;
+                    tail += header->size;
+                    continue;
+                }
+            }
+
+            memcpy(parser->wrap_buf, header, before);
+            memcpy(parser->wrap_buf + before, buffer, header->size - before);
+
+            header = (const struct perf_event_header *)parser->wrap_buf;
+        }
+
+        tail += header->size;
+
+        handle_record(parser, header, event_cb, data);
+    }
+
+    return tail;
+}
+
+void
+gputop_perf_parser_parse(struct gputop_perf_parser *parser,
+                         const uint8_t *records,
+                         size_t len,
+                         gputop_perf_event_cb event_cb,
+                         void *data)
+{
+    size_t offset = 0;
+
+    while (len - offset >= sizeof(struct perf_event_header)) {
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(records + offset);
+
+        if (header->size < sizeof(*header) || header->size > len - offset) {
+            dbg("Spurious perf record size %d; skipping remaining records\n",
+                header->size);
+            parser->n_malformed++;
+            return;
+        }
+
+        offset += header->size;
+
+        handle_record(parser, header, event_cb, data);
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * An incremental parser for the records linux perf writes to an
+ * mmaped circular buffer.
+ *
+ * Records are decoded in place and handed out as a typed
+ * struct gputop_perf_event. Only a record that straddles the end of
+ * the circular buffer is copied (into a scratch buffer sized for the
+ * largest possible record) so memory use is bounded regardless of the
+ * event rate or the size of the perf buffer.
+ *
+ * The same parser is used natively to read the mmaped buffer directly
+ * and by the web UI to parse records forwarded over a websocket, where
+ * they are already contiguous.
+ */
+
+enum gputop_perf_event_type {
+    GPUTOP_PERF_EVENT_SAMPLE,
+    GPUTOP_PERF_EVENT_LOST,
+    GPUTOP_PERF_EVENT_THROTTLE,
+    GPUTOP_PERF_EVENT_UNTHROTTLE,
+};
+
+struct gputop_perf_event {
+    enum gputop_perf_event_type type;
+
+    uint64_t time;              /* PERF_SAMPLE_TIME or throttle time */
+    uint64_t id;
+
+    /* PERF_SAMPLE_READ (non-group read_format only) */
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+
+    /* PERF_SAMPLE_RAW; only valid until the callback returns */
+    const uint8_t *raw;
+    uint32_t raw_size;
+
+    uint64_t n_lost;            /* PERF_RECORD_LOST */
+};
+
+struct gputop_perf_parser {
+    uint64_t sample_type;
+    uint64_t read_format;
+
+    /* Only allocated once a record is seen to wrap */
+    uint8_t *wrap_buf;
+
+    uint64_t n_samples;
+    uint64_t n_lost_records;    /* PERF_RECORD_LOST records seen */
+    uint64_t n_lost_samples;    /* sum of their lost counts */
+    uint64_t n_throttled;
+    uint64_t n_malformed;       /* records we failed to decode */
+};
+
+typedef void (*gputop_perf_event_cb)(const struct gputop_perf_event *event,
+                                     void *data);
+
+void gputop_perf_parser_init(struct gputop_perf_parser *parser,
+                             uint64_t sample_type,
+                             uint64_t read_format);
+void gputop_perf_parser_fini(struct gputop_perf_parser *parser);
+
+/* Parses the records between tail and head (free running byte offsets,
+ * as found in perf_event_mmap_page) of a power of two sized circular
+ * buffer, returning the new tail. event_cb may be NULL if only the
+ * parser's counters are of interest. */
+uint64_t gputop_perf_parser_parse_ring(struct gputop_perf_parser *parser,
+                                       const uint8_t *buffer,
+                                       size_t buffer_size,
+                                       uint64_t head,
+                                       uint64_t tail,
+                                       gputop_perf_event_cb event_cb,
+                                       void *data);
+
+/* Parses len bytes of contiguous records */
+void gputop_perf_parser_parse(struct gputop_perf_parser *parser,
+                              const uint8_t *records,
+                              size_t len,
+                              gputop_perf_event_cb event_cb,
+                              void *data);
@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 
 #include <limits.h>
 #include <errno.h>
@@ -45,10 +46,16 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <uv.h>
 #include <dirent.h>
 
+/* NB: We use a portable stdatomic.h, so we don't depend on a recent compiler...
+ */
+#include "stdatomic.h"
+
 #include "intel_chipset.h"
 
 #include "gputop-util.h"
@@ -57,7 +64,9 @@
 #include "gputop-log.h"
 #include "gputop-perf.h"
 #include "gputop-oa-counters.h"
+#include "gputop-oa-xml.h"
 #include "gputop-cpu.h"
+#include "gputop-record.h"
 
 #include "oa-hsw.h"
 #include "oa-bdw.h"
@@ -113,7 +122,10 @@ static struct intel_device intel_dev;
 
 static unsigned int page_size;
 
-struct gputop_hash_table *metrics;
+/* The metric sets for the current chipset */
+static const struct gputop_oa_metrics *oa_metrics;
+/* Non-NULL if the metric sets were loaded from $GPUTOP_METRICS_XML */
+static struct gputop_oa_metrics *xml_metrics;
 struct array *gputop_perf_oa_supported_metric_set_guids;
 struct perf_oa_user *gputop_perf_current_user;
 
@@ -233,6 +245,183 @@ gputop_perf_stream_ref(struct gputop_perf_stream *stream)
     stream->ref_count++;
 }
 
+static void
+free_i915_perf_ring(struct gputop_perf_stream *stream)
+{
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+
+    if (ring->data) {
+        munmap(ring->data, ring->size * 2);
+        ring->data = NULL;
+    }
+}
+
+/*
+ * Optionally, i915 perf records can be read by a dedicated thread so that
+ * keeping up with the kernel's OA buffer doesn't depend on the mainloop,
+ * which is also busy with websocket I/O, packing protobuf messages,
+ * sampling /proc/stat etc.
+ *
+ * The thread is the only producer for the stream's ring and the mainloop
+ * is the only consumer: the thread publishes how far it has written via
+ * reader->head and the mainloop publishes how far it has consumed via
+ * reader->tail. ring->head and ring->tail themselves are still only
+ * touched by the mainloop; gputop_i915_perf_stream_drain() just picks up
+ * the thread's progress.
+ *
+ * After each batch of reads the thread wakes the mainloop with
+ * uv_async_send(), which libuv coalesces, and the mainloop wakes a thread
+ * waiting for ring space, or asked to stop, via an eventfd.
+ */
+struct gputop_perf_reader {
+    struct gputop_perf_stream *stream;
+    uv_thread_t thread;
+    uv_async_t async;
+    int wake_fd;
+    int cpu;
+
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+
+    atomic_bool waiting; /* for ring space */
+    atomic_bool stop;
+};
+
+static void
+wake_reader_thread(struct gputop_perf_reader *reader)
+{
+    uint64_t one = 1;
+
+    while (write(reader->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+reader_thread_cb(void *data)
+{
+    struct gputop_perf_reader *reader = data;
+    struct gputop_perf_stream *stream = reader->stream;
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    uint64_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+
+    if (reader->cpu >= 0) {
+        cpu_set_t cpus;
+        int ret;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(reader->cpu, &cpus);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret)
+            dbg("Failed to pin i915 perf reader thread to CPU %d: %s\n",
+                reader->cpu, strerror(ret));
+    }
+
+    while (!atomic_load_explicit(&reader->stop, memory_order_acquire)) {
+        struct pollfd fds[2] = {
+            { .fd = stream->fd, .events = POLLIN },
+            { .fd = reader->wake_fd, .events = POLLIN },
+        };
+        uint64_t start = head;
+        bool full = false;
+
+        /* Read in as large batches as the free space in the ring allows,
+         * until the kernel has nothing more for us... */
+        while (true) {
+            uint64_t tail = atomic_load_explicit(&reader->tail,
+                                                 memory_order_acquire);
+            size_t space = ring->size - (head - tail);
+            int len;
+
+            if (space < MAX_I915_PERF_OA_SAMPLE_SIZE) {
+                full = true;
+                break;
+            }
+
+            len = read(stream->fd, ring->data + (head & (ring->size - 1)),
+                       space);
+            if (len < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN)
+                    dbg("Error reading i915 OA event stream %m");
+                break;
+            }
+
+            if (len == 0)
+                break;
+
+            if (stream->oa.recorder)
+                gputop_record_writer_write(stream->oa.recorder,
+                                           ring->data + (head & (ring->size - 1)),
+                                           len);
+
+            head += len;
+        }
+
+        if (head != start) {
+            atomic_store_explicit(&reader->head, head, memory_order_release);
+            uv_async_send(&reader->async);
+        }
+
+        if (full) {
+            uint64_t tail;
+
+            /* NB: the mainloop checks ->waiting after publishing a new
+             * tail so we have to re-check the tail after setting it to
+             * be sure not to miss a wake up... */
+            atomic_store(&reader->waiting, true);
+            tail = atomic_load(&reader->tail);
+            if (ring->size - (head - tail) >= MAX_I915_PERF_OA_SAMPLE_SIZE) {
+                atomic_store(&reader->waiting, false);
+                continue;
+            }
+
+            /* Only wait to be woken up, not for more records */
+            fds[0].fd = -1;
+        }
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            dbg("Error polling i915 OA event stream %m");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            while (read(reader->wake_fd, &count, sizeof(count)) < 0 &&
+                   errno == EINTR)
+                ;
+        }
+
+        atomic_store_explicit(&reader->waiting, false, memory_order_relaxed);
+    }
+}
+
+static void
+reader_async_cb(uv_async_t *async)
+{
+    struct gputop_perf_stream *stream = async->data;
+
+    if (stream->ready_cb)
+        stream->ready_cb(stream);
+}
+
+static void
+free_reader_cb(uv_handle_t *handle)
+{
+    struct gputop_perf_reader *reader = handle->data;
+
+    close(reader->wake_fd);
+    free(reader);
+}
+
+static void
+stop_reader_thread(struct gputop_perf_reader *reader)
+{
+    atomic_store_explicit(&reader->stop, true, memory_order_release);
+    wake_reader_thread(reader);
+    uv_thread_join(&reader->thread);
+}
+
 /* Stream closing is split up to allow for the closure of
  * uv poll or timer handles to happen via the mainloop,
  * via uv_close() before we finish up here... */
@@ -255,6 +444,8 @@ finish_stream_close(struct gputop_perf_stream *stream)
                 stream->perf.header_buf.offsets = NULL;
             }
 
+            gputop_perf_parser_fini(&stream->perf.parser);
+
             close(stream->fd);
             stream->fd = -1;
 
@@ -263,6 +454,19 @@ finish_stream_close(struct gputop_perf_stream *stream)
 
         break;
     case GPUTOP_STREAM_I915_PERF:
+        if (stream->oa.reader) {
+            close(stream->oa.reader->wake_fd);
+            free(stream->oa.reader);
+            stream->oa.reader = NULL;
+        }
+
+        free_i915_perf_ring(stream);
+
+        if (stream->oa.recorder) {
+            gputop_record_writer_close(stream->oa.recorder);
+            stream->oa.recorder = NULL;
+        }
+
         if (stream->fd == -1) {
             if (stream->oa.bufs[0])
                 free(stream->oa.bufs[0]);
@@ -330,6 +534,12 @@ gputop_perf_stream_close(struct gputop_perf_stream *stream,
             uv_close((uv_handle_t *)&stream->fd_poll, stream_handle_closed_cb);
             stream->n_closing_uv_handles++;
         }
+        if (stream->oa.reader) {
+            stop_reader_thread(stream->oa.reader);
+            uv_close((uv_handle_t *)&stream->oa.reader->async,
+                     stream_handle_closed_cb);
+            stream->n_closing_uv_handles++;
+        }
         break;
     case GPUTOP_STREAM_CPU:
         break;
@@ -462,6 +672,293 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
     return stream;
 }
 
+bool
+gputop_i915_perf_stream_enable_ring(struct gputop_perf_stream *stream,
+                                    size_t size,
+                                    char **error)
+{
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    char name[64];
+    uint8_t *base;
+    int fd;
+
+    assert(stream->type == GPUTOP_STREAM_I915_PERF);
+    assert(ring->data == NULL);
+
+    /* The ring must be a power of two and a multiple of the page size
+     * for the double mapping to work... */
+    if ((size & (size - 1)) || size < page_size) {
+        asprintf(error, "Invalid i915 perf ring size %zu\n", size);
+        return false;
+    }
+
+    snprintf(name, sizeof(name), "/gputop-i915-perf-ring-%d-%p",
+             (int)getpid(), stream);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        asprintf(error, "Failed to create i915 perf ring: %m\n");
+        return false;
+    }
+    shm_unlink(name);
+
+    if (ftruncate(fd, size) == -1) {
+        asprintf(error, "Failed to size i915 perf ring: %m\n");
+        close(fd);
+        return false;
+    }
+
+    /* Reserve twice the address space, then map the same pages into both
+     * halves... */
+    base = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        asprintf(error, "Failed to reserve i915 perf ring: %m\n");
+        close(fd);
+        return false;
+    }
+
+    if (mmap(base, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        asprintf(error, "Failed to map i915 perf ring: %m\n");
+        munmap(base, size * 2);
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    ring->data = base;
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    stream->oa.ring_full = false;
+
+    return true;
+}
+
+/* Reads as many records from the kernel as will fit into the stream's ring
+ * without blocking.
+ *
+ * Returns the number of bytes read. If the ring doesn't have room for
+ * another record then stream->oa.ring_full is set and polling of the
+ * stream's fd is paused until gputop_i915_perf_stream_ring_consume() frees
+ * some space, so as to not spin on a readable fd.
+ */
+int
+gputop_i915_perf_stream_drain(struct gputop_perf_stream *stream)
+{
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    int total = 0;
+
+    assert(ring->data);
+
+    if (stream->oa.reader) {
+        uint64_t head = atomic_load_explicit(&stream->oa.reader->head,
+                                             memory_order_acquire);
+
+        total = head - ring->head;
+        ring->head = head;
+
+        if (ring->size - gputop_perf_ring_taken(ring) < MAX_I915_PERF_OA_SAMPLE_SIZE)
+            stream->oa.ring_full = true;
+
+        return total;
+    }
+
+    while (true) {
+        size_t space = ring->size - gputop_perf_ring_taken(ring);
+        uint8_t *p = ring->data + (ring->head & (ring->size - 1));
+        int len;
+
+        if (space < MAX_I915_PERF_OA_SAMPLE_SIZE) {
+            if (!stream->oa.ring_full) {
+                stream->oa.ring_full = true;
+                if (stream->fd >= 0)
+                    uv_poll_stop(&stream->fd_poll);
+            }
+            break;
+        }
+
+        if (gputop_fake_mode)
+            len = gputop_perf_fake_read(stream, p, space);
+        else
+            len = read(stream->fd, p, space);
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                dbg("Error reading i915 OA event stream %m");
+            break;
+        }
+
+        if (len == 0)
+            break;
+
+        if (stream->oa.recorder)
+            gputop_record_writer_write(stream->oa.recorder, p, len);
+
+        ring->head += len;
+        total += len;
+    }
+
+    return total;
+}
+
+void
+gputop_i915_perf_stream_ring_consume(struct gputop_perf_stream *stream,
+                                     size_t len)
+{
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+
+    assert(len <= gputop_perf_ring_taken(ring));
+
+    ring->tail += len;
+
+    if (stream->oa.reader) {
+        struct gputop_perf_reader *reader = stream->oa.reader;
+
+        atomic_store(&reader->tail, ring->tail);
+        if (atomic_load(&reader->waiting))
+            wake_reader_thread(reader);
+    }
+
+    if (stream->oa.ring_full &&
+        (ring->size - gputop_perf_ring_taken(ring)) >= MAX_I915_PERF_OA_SAMPLE_SIZE)
+    {
+        stream->oa.ring_full = false;
+        if (!stream->oa.reader &&
+            stream->fd >= 0 && !stream->pending_close && !stream->closed)
+            uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+    }
+}
+
+/* Returns the number of consecutive, equally sized, sample records
+ * starting at @data (which must be a sample record). The reports of such
+ * a run are laid out a constant stride apart so they can be accumulated
+ * with gputop_oa_accumulate_report_batch() */
+int
+gputop_i915_perf_count_sample_run(const uint8_t *data, const uint8_t *end)
+{
+    const struct i915_perf_record_header *header = (const void *)data;
+    uint16_t size = header->size;
+    int n = 0;
+
+    assert(header->type == DRM_I915_PERF_RECORD_SAMPLE);
+
+    while (data < end &&
+           header->type == DRM_I915_PERF_RECORD_SAMPLE &&
+           header->size == size)
+    {
+        n++;
+        data += size;
+        header = (const void *)data;
+    }
+
+    return n;
+}
+
+/* Hands reading the stream's records into its ring over to a dedicated
+ * thread, optionally pinned to @cpu (if >= 0), instead of polling the
+ * stream's fd from the mainloop. Requires the stream to have a ring
+ * enabled. The stream's ready_cb is still called from the mainloop,
+ * whenever the thread has read new records. */
+bool
+gputop_i915_perf_stream_start_reader(struct gputop_perf_stream *stream,
+                                     int cpu,
+                                     char **error)
+{
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    struct gputop_perf_reader *reader;
+
+    assert(stream->type == GPUTOP_STREAM_I915_PERF);
+    assert(ring->data);
+    assert(stream->oa.reader == NULL);
+
+    if (stream->fd < 0) {
+        asprintf(error, "Can't read fake i915 perf stream from a thread\n");
+        return false;
+    }
+
+    reader = xmalloc0(sizeof(*reader));
+    reader->stream = stream;
+    reader->cpu = cpu;
+    atomic_init(&reader->head, ring->head);
+    atomic_init(&reader->tail, ring->tail);
+    atomic_init(&reader->waiting, false);
+    atomic_init(&reader->stop, false);
+
+    reader->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reader->wake_fd == -1) {
+        asprintf(error, "Failed to create i915 perf reader eventfd: %m\n");
+        free(reader);
+        return false;
+    }
+
+    uv_async_init(gputop_mainloop, &reader->async, reader_async_cb);
+    reader->async.data = stream;
+
+    /* The thread takes over from here... */
+    uv_poll_stop(&stream->fd_poll);
+
+    if (uv_thread_create(&reader->thread, reader_thread_cb, reader) != 0) {
+        asprintf(error, "Failed to create i915 perf reader thread\n");
+        uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+        /* NB: the async handle has to be closed before it can be freed */
+        reader->async.data = reader;
+        uv_close((uv_handle_t *)&reader->async, free_reader_cb);
+        return false;
+    }
+
+    stream->oa.reader = reader;
+
+    return true;
+}
+
+/* Starts capturing all records subsequently read from the stream to
+ * @filename (see gputop-record.h for the format) until the stream is
+ * closed. Requires the stream to have a ring enabled.
+ *
+ * So that writing the file can't stall the mainloop, recording hands
+ * reading the stream over to a reader thread (as with
+ * gputop_i915_perf_stream_start_reader(), which therefore shouldn't be
+ * called for this stream afterwards), which writes the records out as
+ * they are read. Only if the thread can't be started (e.g. for a fake
+ * stream) are they written as they are drained by the mainloop. */
+bool
+gputop_i915_perf_stream_record(struct gputop_perf_stream *stream,
+                               const char *filename,
+                               int period_exponent,
+                               int reader_cpu,
+                               char **error)
+{
+    char *reader_error = NULL;
+
+    assert(stream->type == GPUTOP_STREAM_I915_PERF);
+    assert(stream->oa.ring.data);
+    assert(stream->oa.recorder == NULL);
+    assert(stream->oa.reader == NULL);
+
+    stream->oa.recorder = gputop_record_writer_open(filename,
+                                                    stream->metric_set,
+                                                    period_exponent,
+                                                    error);
+    if (!stream->oa.recorder)
+        return false;
+
+    /* NB: the recorder is only accessed by the thread once started */
+    if (!gputop_i915_perf_stream_start_reader(stream, reader_cpu,
+                                              &reader_error))
+    {
+        dbg("Recording from the mainloop: %s", reader_error);
+        free(reader_error);
+    }
+
+    return true;
+}
+
 struct gputop_perf_stream *
 gputop_perf_open_trace(int pid,
                        int cpu,
@@ -558,6 +1055,8 @@ gputop_perf_open_trace(int pid,
     expected_max_samples = (stream->perf.buffer_size / sample_size) * 1.2;
 
     memset(&stream->perf.header_buf, 0, sizeof(stream->perf.header_buf));
+    gputop_perf_parser_init(&stream->perf.parser,
+                            attr.sample_type, attr.read_format);
 
     stream->overwrite = overwrite;
     if (overwrite) {
@@ -636,6 +1135,8 @@ gputop_perf_open_generic_counter(int pid,
     expected_max_samples = (stream->perf.buffer_size / sample_size) * 1.2;
 
     memset(&stream->perf.header_buf, 0, sizeof(stream->perf.header_buf));
+    gputop_perf_parser_init(&stream->perf.parser,
+                            attr.sample_type, attr.read_format);
 
     stream->overwrite = overwrite;
     if (overwrite) {
@@ -681,9 +1182,10 @@ gputop_perf_open_cpu_stats(bool overwrite, uint64_t sample_period_ms)
     stream->type = GPUTOP_STREAM_CPU;
     stream->ref_count = 1;
 
-    stream->cpu.stats_buf_len = MAX(10, 1000 / sample_period_ms);
+    /* NB: stats_buf_len counts cpu_stat structures, not samples */
+    stream->cpu.stats_buf_len = MAX(10, 1000 / sample_period_ms) * n_cpus;
     stream->cpu.stats_buf = xmalloc(stream->cpu.stats_buf_len *
-                                    sizeof(struct cpu_stat) * n_cpus);
+                                    sizeof(struct cpu_stat));
     stream->cpu.stats_buf_pos = 0;
 
     stream->overwrite = overwrite;
@@ -811,10 +1313,10 @@ init_dev_info(int drm_fd, uint32_t devid)
 
 }
 
-static unsigned int
+static uint64_t
 read_perf_head(struct perf_event_mmap_page *mmap_page)
 {
-    unsigned int head = (*(volatile uint64_t *)&mmap_page->data_head);
+    uint64_t head = (*(volatile uint64_t *)&mmap_page->data_head);
     rmb();
 
     return head;
@@ -822,7 +1324,7 @@ read_perf_head(struct perf_event_mmap_page *mmap_page)
 
 static void
 write_perf_tail(struct perf_event_mmap_page *mmap_page,
-                unsigned int tail)
+                uint64_t tail)
 {
     /* Make sure we've finished reading all the sample data we
      * we're consuming before updating the tail... */
@@ -844,6 +1346,11 @@ i915_perf_stream_data_pending(struct gputop_perf_stream *stream)
 {
     struct pollfd pollfd = { stream->fd, POLLIN, 0 };
     int ret;
+
+    /* Data may have already been drained into the stream's ring... */
+    if (stream->oa.ring.data && gputop_perf_ring_taken(&stream->oa.ring))
+        return true;
+
     if (gputop_fake_mode) {
         uint64_t elapsed_time = gputop_get_time() - stream->start_time;
         if (elapsed_time / stream->period - stream->gen_so_far > 0)
@@ -906,166 +1413,121 @@ gputop_stream_data_pending(struct gputop_perf_stream *stream)
 /*
  * For each update of this buffer we:
  *
- * 1) Check what new records have been added:
- *
- *    * if buf->last_perf_head uninitialized, set it to the perf tail
- *    * foreach new record from buf->last_perf_head to the current perf head:
- *        - check there's room for a new header offset, but if not:
- *            - report an error
- *            - move the tail forward (loosing a record)
- *        - add a header offset to buf->offsets[buf->head]
- *        - buf->head++;
- *        - recognise when the perf head wraps and mark the buffer 'full'
- *
- * 2) Optionally parse any of the new records (i.e. before we update
- *    tail)
+ * 1) Drop any tracked records that perf has overwritten:
  *
- *    Typically we aren't processing the records while tracing, but
- *    beware that if anything does need passing on the fly then it
- *    needs to be done before we update the tail pointer below.
+ *    Since we always consume everything up to perf's head, the only
+ *    bytes perf can have written since the last update are those
+ *    between the old tail and the new head. Any tracked record
+ *    starting within that range has been trampled, and since the
+ *    records are tracked in order we only need to walk forward from
+ *    buf->tail until we find one that survived.
  *
- * 3) If buf 'full'; check how much of perf's tail has been eaten:
+ *    NB: we do this before adding the new offsets since new offsets
+ *    may overwrite the slots of old ones if buf->offsets overflows.
  *
- *    * move buf->tail forward to the next offset that is ahead of
- *      perf's (head + header->size)
- *        XXX: we can assert() that we don't overtake buf->head. That
- *        shouldn't be possible if we aren't enabling perf's
- *        overwriting/flight recorder mode.
- *          XXX: Note: we do this after checking for new records so we
- *          don't have to worry about the corner case of eating more
- *          than we previously knew about.
+ * 2) Scan the new records, appending their offsets to buf->offsets.
+ *    If this overflows buf->offsets then buf->tail is moved forward,
+ *    loosing track of the oldest records.
  *
- * 4) Set perf's tail to perf's head (i.e. consume everything so that
+ * 3) Set perf's tail to perf's head (i.e. consume everything so that
  *    perf won't block when wrapping around and overwriting old
  *    samples.)
+ *
+ * NB: nothing is printed here; see buf->stats instead.
  */
 void
 gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
 {
     struct gputop_perf_header_buf *hdr_buf  = &stream->perf.header_buf;
-    uint8_t *data = stream->perf.buffer;
-    const uint64_t mask = stream->perf.buffer_size - 1;
+    struct gputop_perf_header_buf_stats *stats = &hdr_buf->stats;
+    const uint8_t *data = stream->perf.buffer;
+    const uint64_t buffer_size = stream->perf.buffer_size;
+    const uint64_t mask = buffer_size - 1;
+    uint32_t *offsets = hdr_buf->offsets;
+    const uint32_t len = hdr_buf->len;
     uint64_t perf_head;
     uint64_t perf_tail;
+    uint64_t written;
+    uint32_t start_offset;
     uint32_t buf_head;
     uint32_t buf_tail;
-    uint32_t n_new = 0;
+    uint32_t idx;
 
     perf_head = read_perf_head(stream->perf.mmap_page);
-
-    //if (hdr_buf->head == hdr_buf->tail)
-        //perf_tail = hdr_buf->last_perf_head;
-    //else
-        perf_tail = stream->perf.mmap_page->data_tail;
-
-#if 0
-    if (perf_tail > perf_head) {
-        dbg("Unexpected perf tail > head condition\n");
-        return;
-    }
-#endif
+    perf_tail = stream->perf.mmap_page->data_tail;
 
     if (perf_head == perf_tail)
         return;
 
-    //hdr_buf->last_perf_head = perf_head;
+    written = perf_head - perf_tail;
+    start_offset = perf_tail & mask;
 
     buf_head = hdr_buf->head;
     buf_tail = hdr_buf->tail;
 
-#if 1
-    printf("perf records:\n");
-    printf("> fd = %d\n", stream->fd);
-    printf("> size = %lu\n", stream->perf.buffer_size);
-    printf("> tail_ptr = %p\n", &stream->perf.mmap_page->data_tail);
-    printf("> head=%"PRIu64"\n", perf_head);
-    printf("> tail=%"PRIu64"\n", (uint64_t)stream->perf.mmap_page->data_tail);
-    printf("> TAKEN=%"PRIu64"\n", (uint64_t)TAKEN(perf_head, stream->perf.mmap_page->data_tail, stream->perf.buffer_size));
-    printf("> records:\n");
-#endif
-
-    while (TAKEN(perf_head, perf_tail, stream->perf.buffer_size)) {
-        uint64_t perf_offset = perf_tail & mask;
-        const struct perf_event_header *header =
-            (const struct perf_event_header *)(data + perf_offset);
-
-        n_new++;
+    /* 1) Drop trampled records... */
+    if (written >= buffer_size) {
+        stats->n_trampled += buf_head - buf_tail;
+        buf_tail = buf_head;
+    } else {
+        while (buf_tail != buf_head) {
+            uint32_t distance = (offsets[buf_tail % len] - start_offset) & mask;
 
-        if (header->size == 0) {
-            dbg("Spurious header size == 0\n");
-            /* XXX: How should we handle this instead of exiting() */
-            break;
-            //exit(1);
-        }
+            if (distance >= written)
+                break;
 
-        if (header->size > (perf_head - perf_tail)) {
-            dbg("Spurious header size would overshoot head\n");
-            /* XXX: How should we handle this instead of exiting() */
-            break;
-            //exit(1);
+            buf_tail++;
+            stats->n_trampled++;
         }
+    }
 
-        /* Once perf wraps, the buffer is full of data and perf starts
-         * to eat its tail, overwriting old data. */
-        if ((const uint8_t *)header + header->size > data + stream->perf.buffer_size)
-            hdr_buf->full = true;
+    /* Once perf wraps, the buffer is full of data and perf starts
+     * to eat its tail, overwriting old data. */
+    if (start_offset + written >= buffer_size)
+        hdr_buf->full = true;
 
-        if ((buf_head - buf_tail) == hdr_buf->len)
-            buf_tail++;
+    /* 2) Scan new records...
+     *
+     * NB: records are 8 byte aligned and the buffer size is a power of
+     * two so a header never straddles the end of the buffer.
+     */
+    idx = buf_head % len;
+    while (perf_tail != perf_head) {
+        uint32_t perf_offset = perf_tail & mask;
+        const struct perf_event_header *header =
+            (const struct perf_event_header *)(data + perf_offset);
 
-        /* Checking what tail records have been being overwritten by this
-         * new record...
-         *
-         * NB: A record may be split at the end of the buffer
-         * NB: A large record may trample multiple smaller records
-         * NB: it's possible no records have been trampled
-         */
-        if (hdr_buf->full) {
-            while (1) {
-                uint32_t buf_tail_offset = hdr_buf->offsets[buf_tail % hdr_buf->len];
-
-                /* To simplify checking for an overlap, invariably ensure the
-                 * buf_tail_offset is ahead of perf, even if it means using a
-                 * fake offset beyond the bounds of the buffer... */
-                if (buf_tail_offset < perf_offset)
-                    buf_tail_offset += stream->perf.buffer_size;
-
-                if ((perf_offset + header->size) < buf_tail_offset) /* nothing eaten */
-                    break;
-
-                buf_tail++;
-            }
+        if (header->size == 0 || header->size > (perf_head - perf_tail)) {
+            stats->n_spurious++;
+            break;
         }
 
-        hdr_buf->offsets[buf_head++ % hdr_buf->len] = perf_offset;
+        offsets[idx] = perf_offset;
+        if (++idx == len)
+            idx = 0;
+        buf_head++;
 
         perf_tail += header->size;
     }
 
-    /* Consume all perf records so perf wont be blocked from
+    stats->n_records += buf_head - hdr_buf->head;
+
+    if (buf_head - buf_tail > len) {
+        stats->n_overflows += (buf_head - buf_tail) - len;
+        buf_tail = buf_head - len;
+    }
+
+    /* 3) Consume all perf records so perf wont be blocked from
      * overwriting old samples... */
     write_perf_tail(stream->perf.mmap_page, perf_head);
 
     hdr_buf->head = buf_head;
     hdr_buf->tail = buf_tail;
 
-#if 1
-    printf("headers update:\n");
-    printf("n new records = %d\n", n_new);
-    printf("buf len = %d\n", hdr_buf->len);
-    printf("perf head = %"PRIu64"\n", perf_head);
-    printf("perf tail = %"PRIu64"\n", perf_tail);
-    printf("buf head = %"PRIu32"\n", hdr_buf->head);
-    printf("buf tail = %"PRIu32"\n", hdr_buf->tail);
-
-    if (!hdr_buf->full) {
-        float percentage = (hdr_buf->offsets[(hdr_buf->head - 1) % hdr_buf->len] / (float)stream->perf.buffer_size) * 100.0f;
-        printf("> %d%% full\n", (int)percentage);
-    } else
-        printf("> 100%% full\n");
-
-    printf("> n records = %u\n", (hdr_buf->head - hdr_buf->tail));
-#endif
+    if (hdr_buf->full)
+        stats->fill_percentage = 100;
+    else
+        stats->fill_percentage = ((perf_head & mask) * 100) / buffer_size;
 }
 
 void
@@ -1107,10 +1569,46 @@ gputop_i915_perf_print_records(struct gputop_perf_stream *stream,
 }
 
 
+static void
+perf_event_cb(const struct gputop_perf_event *event, void *data)
+{
+    struct gputop_perf_stream *stream = data;
+
+    stream->perf.event_cb(stream, event);
+}
+
+/* Decodes any new records in the perf circular buffer, handing them to
+ * stream->perf.event_cb (if set) before consuming them.
+ *
+ * NB: Overwrite streams instead track their records via
+ * gputop_perf_update_header_offsets() which owns perf's tail pointer.
+ */
 static void
 read_perf_samples(struct gputop_perf_stream *stream)
 {
-    dbg("FIXME: read core perf samples");
+    struct perf_event_mmap_page *mmap_page = stream->perf.mmap_page;
+    uint64_t head;
+    uint64_t tail;
+
+    if (stream->overwrite) {
+        dbg("Can't parse perf samples while tracking header offsets\n");
+        return;
+    }
+
+    head = read_perf_head(mmap_page);
+    tail = mmap_page->data_tail;
+
+    if (head == tail)
+        return;
+
+    tail = gputop_perf_parser_parse_ring(&stream->perf.parser,
+                                         stream->perf.buffer,
+                                         stream->perf.buffer_size,
+                                         head, tail,
+                                         stream->perf.event_cb ? perf_event_cb : NULL,
+                                         stream);
+
+    write_perf_tail(mmap_page, tail);
 }
 
 
@@ -1292,6 +1790,94 @@ gputop_perf_read_samples(struct gputop_perf_stream *stream)
     assert(0);
 }
 
+static void
+free_ctx_accumulator_cb(struct gputop_hash_entry *entry)
+{
+    free(entry->data);
+}
+
+void
+gputop_oa_ctx_demux_init(struct gputop_oa_ctx_demux *demux,
+                         struct gputop_metric_set *metric_set)
+{
+    memset(demux, 0, sizeof(*demux));
+
+    demux->metric_set = metric_set;
+    demux->contexts = gputop_hash_table_create(NULL, gputop_hash_pointer,
+                                               gputop_key_pointer_equal);
+}
+
+void
+gputop_oa_ctx_demux_fini(struct gputop_oa_ctx_demux *demux)
+{
+    gputop_hash_table_destroy(demux->contexts, free_ctx_accumulator_cb);
+    demux->contexts = NULL;
+}
+
+struct gputop_oa_ctx_accumulator *
+gputop_oa_ctx_demux_accumulate(struct gputop_oa_ctx_demux *demux,
+                               const uint8_t *report0,
+                               const uint8_t *report1)
+{
+    const uint32_t *start = (const uint32_t *)report0;
+    const uint32_t *end = (const uint32_t *)report1;
+    uint32_t ctx_id = start[2] & GPUTOP_OA_INVALID_CTX_ID;
+    uint32_t end_reason = ((end[0] >> OAREPORT_REASON_SHIFT) &
+                           OAREPORT_REASON_MASK);
+    /* NB: NULL keys aren't allowed */
+    const void *key = (void *)(uintptr_t)(ctx_id + 1);
+    struct gputop_hash_entry *entry;
+    struct gputop_oa_ctx_accumulator *ctx;
+
+    if (!demux->clock.initialized)
+        gputop_u32_clock_init(&demux->clock, start[1]);
+
+    if (ctx_id == GPUTOP_OA_INVALID_CTX_ID) {
+        gputop_u32_clock_progress(&demux->clock, start[1]);
+        gputop_u32_clock_progress(&demux->clock, end[1]);
+        return NULL;
+    }
+
+    entry = gputop_hash_table_search(demux->contexts, key);
+    if (entry)
+        ctx = entry->data;
+    else {
+        ctx = xmalloc0(sizeof(*ctx));
+        ctx->ctx_id = ctx_id;
+        gputop_oa_accumulator_init(&ctx->accumulator, demux->metric_set);
+        gputop_hash_table_insert(demux->contexts, key, ctx);
+    }
+
+    /* Progress the shared timeline via this context's accumulator... */
+    ctx->accumulator.clock = demux->clock;
+    gputop_oa_accumulate_reports(&ctx->accumulator, report0, report1, false);
+    demux->clock = ctx->accumulator.clock;
+
+    if ((end_reason & OAREPORT_REASON_CTX_SWITCH) &&
+        (end[2] & GPUTOP_OA_INVALID_CTX_ID) != ctx_id)
+    {
+        ctx->accumulator.flags |= GPUTOP_ACCUMULATOR_CTX_SW_FROM_SEEN;
+    }
+
+    return ctx;
+}
+
+void
+gputop_oa_ctx_demux_clear(struct gputop_oa_ctx_demux *demux)
+{
+    struct gputop_hash_entry *entry;
+
+    gputop_hash_table_foreach(demux->contexts, entry) {
+        struct gputop_oa_ctx_accumulator *ctx = entry->data;
+
+        if (ctx->accumulator.first_timestamp == 0) {
+            free(ctx);
+            gputop_hash_table_remove(demux->contexts, entry);
+        } else
+            gputop_oa_accumulator_clear(&ctx->accumulator);
+    }
+}
+
 /******************************************************************************/
 
 uint64_t
@@ -1474,19 +2060,14 @@ gputop_enumerate_metrics_via_sysfs(void)
     while ((readdir_r(metrics_dir, entry1, &entry2) == 0) && entry2 != NULL)
     {
         struct gputop_metric_set *metric_set;
-        struct gputop_hash_entry *metrics_entry;
 
         if (entry2->d_type != DT_DIR || entry2->d_name[0] == '.')
             continue;
 
-        metrics_entry =
-            gputop_hash_table_search(metrics, entry2->d_name);
-
-        if (metrics_entry == NULL)
+        metric_set = gputop_oa_metrics_find(oa_metrics, entry2->d_name);
+        if (metric_set == NULL)
             continue;
 
-        metric_set = (struct gputop_metric_set*)metrics_entry->data;
-
         snprintf(buffer, sizeof(buffer),
                  "/sys/class/drm/card%d/metrics/%s/id",
                  drm_card, entry2->d_name);
@@ -1526,14 +2107,12 @@ gputop_enumerate_metrics_fake(void)
     };
 
     struct gputop_metric_set *metric_set;
-    struct gputop_hash_entry *metrics_entry;
 
     int i;
     int array_length = sizeof(fake_bdw_guids) / sizeof(fake_bdw_guids[0]);
 
     for (i = 0; i < array_length; i++){
-        metrics_entry = gputop_hash_table_search(metrics, fake_bdw_guids[i]);
-        metric_set = (struct gputop_metric_set*)metrics_entry->data;
+        metric_set = gputop_oa_metrics_find(oa_metrics, fake_bdw_guids[i]);
         metric_set->perf_oa_metrics_set = i;
         array_append(gputop_perf_oa_supported_metric_set_guids, &metric_set->guid);
     }
@@ -1541,18 +2120,90 @@ gputop_enumerate_metrics_fake(void)
     return true;
 }
 
-/* The C code generated by oa-gen.py calls this function for each
- * metric set.
+/* NB: the metric set tables generated by oa-gen.py are static and only
+ * the first lookup of a metric set determines which of its counters are
+ * available.
  */
-void
-gputop_register_oa_metric_set(struct gputop_metric_set *metric_set)
+struct gputop_metric_set *
+gputop_perf_lookup_metric_set(const char *guid)
 {
-    gputop_hash_table_insert(metrics, metric_set->guid, metric_set);
+    return gputop_oa_metrics_lookup(oa_metrics, &gputop_devinfo, guid);
+}
+
+/* Instead of the metric sets built into gputop, the same oa-<chipset>.xml
+ * description they are generated from can be loaded at runtime (e.g. to
+ * try out new or fixed equations without rebuilding) */
+static bool
+load_metrics_xml(const char *filename, const char *chipset)
+{
+    FILE *file = fopen(filename, "r");
+    char *xml = NULL;
+    char *error = NULL;
+    size_t size = 0;
+    size_t len = 0;
+    size_t r;
+
+    if (!file) {
+        asprintf(&error, "Failed to open metrics xml %s: %m\n", filename);
+        gputop_log(GPUTOP_LOG_LEVEL_HIGH, error, -1);
+        free(error);
+        return false;
+    }
+
+    do {
+        size += 65536;
+        xml = xrealloc(xml, size + 1);
+
+        r = fread(xml + len, 1, size - len, file);
+        len += r;
+    } while (len == size);
+
+    xml[len] = '\0';
+    fclose(file);
+
+    xml_metrics = gputop_oa_xml_load(xml, chipset, &error);
+    free(xml);
+
+    if (!xml_metrics) {
+        gputop_log(GPUTOP_LOG_LEVEL_HIGH, error, -1);
+        free(error);
+        return false;
+    }
+
+    oa_metrics = xml_metrics;
+
+    return true;
+}
+
+/* Selects the built in metric sets for @devid, returning the chipset
+ * name or NULL if the device isn't supported */
+static const char *
+select_oa_metrics(uint32_t devid)
+{
+    if (IS_HASWELL(devid)) {
+        oa_metrics = &gputop_oa_metrics_hsw;
+        return "hsw";
+    } else if (IS_BROADWELL(devid)) {
+        oa_metrics = &gputop_oa_metrics_bdw;
+        return "bdw";
+    } else if (IS_CHERRYVIEW(devid)) {
+        oa_metrics = &gputop_oa_metrics_chv;
+        return "chv";
+    } else if (IS_SKYLAKE(devid)) {
+        oa_metrics = &gputop_oa_metrics_skl;
+        return "skl";
+    } else if (IS_BROXTON(devid)) {
+        oa_metrics = &gputop_oa_metrics_bxt;
+        return "bxt";
+    } else
+        return NULL;
 }
 
 bool
 gputop_perf_initialize(void)
 {
+    const char *chipset;
+
     if (gputop_devinfo.n_eus)
         return true;
 
@@ -1572,22 +2223,14 @@ gputop_perf_initialize(void)
     init_dev_info(drm_fd, intel_dev.device);
     page_size = sysconf(_SC_PAGE_SIZE);
 
-    metrics = gputop_hash_table_create(NULL, gputop_key_hash_string,
-                                       gputop_key_string_equal);
     gputop_perf_oa_supported_metric_set_guids = array_new(sizeof(char*), 1);
 
-    if (IS_HASWELL(intel_dev.device)) {
-        gputop_oa_add_metrics_hsw(&gputop_devinfo);
-    } else if (IS_BROADWELL(intel_dev.device)) {
-        gputop_oa_add_metrics_bdw(&gputop_devinfo);
-    } else if (IS_CHERRYVIEW(intel_dev.device)) {
-        gputop_oa_add_metrics_chv(&gputop_devinfo);
-    } else if (IS_SKYLAKE(intel_dev.device)) {
-        gputop_oa_add_metrics_skl(&gputop_devinfo);
-    } else if (IS_BROXTON(intel_dev.device)) {
-        gputop_oa_add_metrics_bxt(&gputop_devinfo);
-    } else
-        assert(0);
+    chipset = select_oa_metrics(intel_dev.device);
+    assert(chipset);
+
+    if (getenv("GPUTOP_METRICS_XML") &&
+        !load_metrics_xml(getenv("GPUTOP_METRICS_XML"), chipset))
+        return false;
 
     if (gputop_fake_mode)
         return gputop_enumerate_metrics_fake();
@@ -1595,15 +2238,45 @@ gputop_perf_initialize(void)
         return gputop_enumerate_metrics_via_sysfs();
 }
 
-static void
-free_perf_oa_metrics(struct gputop_hash_entry *entry)
+/* Instead of opening a device, initializes the metric sets for replaying a
+ * recording made on the device described by @devinfo (which may not be
+ * the system we're running on). No metric sets are listed as supported,
+ * they can only be looked up by guid. */
+bool
+gputop_perf_initialize_for_replay(const struct gputop_devinfo *devinfo)
 {
-    free(entry->data);
+    const char *chipset;
+
+    if (gputop_devinfo.n_eus)
+        return true;
+
+    chipset = select_oa_metrics(devinfo->devid);
+    if (!chipset) {
+        gputop_log(GPUTOP_LOG_LEVEL_HIGH,
+                   "Recording was made on an unsupported device", -1);
+        return false;
+    }
+
+    gputop_devinfo = *devinfo;
+    page_size = sysconf(_SC_PAGE_SIZE);
+
+    gputop_perf_oa_supported_metric_set_guids = array_new(sizeof(char*), 1);
+
+    if (getenv("GPUTOP_METRICS_XML") &&
+        !load_metrics_xml(getenv("GPUTOP_METRICS_XML"), chipset))
+        return false;
+
+    return true;
 }
 
 void
 gputop_perf_free(void)
 {
-    gputop_hash_table_destroy(metrics, free_perf_oa_metrics);
+    gputop_oa_metrics_reset(oa_metrics);
     array_free(gputop_perf_oa_supported_metric_set_guids);
+
+    if (xml_metrics) {
+        gputop_oa_xml_free(xml_metrics);
+        xml_metrics = NULL;
+    }
 }
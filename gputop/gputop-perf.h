@@ -32,6 +32,7 @@
 #include "gputop-list.h"
 #include "gputop-hash-table.h"
 #include "gputop-oa-counters.h"
+#include "gputop-perf-records.h"
 
 uint64_t get_time(void);
 
@@ -80,41 +81,8 @@ struct ctx_handle {
  * though, and this is a more graceful failure than having to scrap
  * the entire perf buffer.
  *
- *
- * For each update of this buffer we:
- *
- * 1) Check what new records have been added:
- *
- *    * if buf->last_perf_head uninitialized, set it to the perf tail
- *    * foreach new record from buf->last_perf_head to the current perf head:
- *        - check there's room for a new header offset, but if not:
- *            - report an error
- *            - move the tail forward (loosing a record)
- *        - add a header offset to buf->offsets[buf->head]
- *        - buf->head = (buf->head + 1) % buf->len;
- *        - recognise when the perf head wraps and mark the buffer 'full'
- *
- * 2) Optionally parse any of the new records (i.e. before we update
- *    tail)
- *
- *    Typically we aren't processing the records while tracing, but
- *    beware that if anything does need passing on the fly then it
- *    needs to be done before we update the tail pointer below.
- *
- * 3) If buf 'full'; check how much of perf's tail has been eaten:
- *
- *    * move buf->tail forward to the next offset that is ahead of
- *      perf's (head + header->size)
- *        XXX: we can assert() that we don't overtake buf->head. That
- *        shouldn't be possible if we aren't enabling perf's
- *        overwriting/flight recorder mode.
- *	  XXX: Note: we do this after checking for new records so we
- *	  don't have to worry about the corner case of eating more
- *	  than we previously knew about.
- *
- * 4) Set perf's tail to perf's head (i.e. consume everything so that
- *    perf won't block when wrapping around and overwriting old
- *    samples.)
+ * See gputop_perf_update_header_offsets() for how the buffer is
+ * updated.
  *
  * XXX: Note: if tracing and using this structure to track headers
  * then when you want to process all the collected data, it's
@@ -122,16 +90,51 @@ struct ctx_handle {
  * perf circular buffer due to how we manage the tail pointer (there's
  * nothing stopping perf from overwriting all the current data)
  */
+struct gputop_perf_header_buf_stats
+{
+    uint64_t n_records;     /* records seen */
+    uint64_t n_trampled;    /* tracked records overwritten by perf */
+    uint64_t n_overflows;   /* tracked records dropped due to offsets[] being full */
+    uint64_t n_spurious;    /* updates stopped early by a bad header */
+    uint32_t fill_percentage;
+};
+
 struct gputop_perf_header_buf
 {
     uint32_t *offsets;
     uint32_t len;
     uint32_t head;
     uint32_t tail;
-    uint32_t last_perf_head;
     bool full; /* Set when we first wrap. */
+
+    struct gputop_perf_header_buf_stats stats;
+};
+
+/*
+ * A page aligned ring that i915 perf records can be drained into at the
+ * rate the kernel produces them, decoupled from how quickly they can be
+ * forwarded on (e.g. to a remote websocket client).
+ *
+ * The same pages are mapped twice, back to back, so that any span of
+ * data (or free space) up to the size of the ring can be accessed
+ * contiguously without special casing the wrap point. This lets us
+ * read() whole records straight into the ring and hand out a single
+ * contiguous range to send.
+ *
+ * head and tail are free running byte counts; masking with (size - 1)
+ * gives the offset into data.
+ */
+struct gputop_perf_ring
+{
+    uint8_t *data;
+    size_t size;
+    uint64_t head;
+    uint64_t tail;
 };
 
+struct gputop_record_writer;
+struct gputop_perf_reader;
+
 enum gputop_perf_stream_type {
     GPUTOP_STREAM_PERF,
     GPUTOP_STREAM_I915_PERF,
@@ -154,6 +157,16 @@ struct gputop_perf_stream
             uint8_t *bufs[2];
             uint8_t *last;
             int last_buf_idx;
+
+            /* Optional, see gputop_i915_perf_stream_enable_ring() */
+            struct gputop_perf_ring ring;
+            bool ring_full;
+
+            /* Optional, see gputop_i915_perf_stream_start_reader() */
+            struct gputop_perf_reader *reader;
+
+            /* Optional, see gputop_i915_perf_stream_record() */
+            struct gputop_record_writer *recorder;
         } oa;
         /* linux perf event */
         struct {
@@ -163,6 +176,11 @@ struct gputop_perf_stream
             size_t buffer_size;
 
             struct gputop_perf_header_buf header_buf;
+
+            /* For non-overwrite streams, see gputop_perf_read_samples() */
+            struct gputop_perf_parser parser;
+            void (*event_cb)(struct gputop_perf_stream *stream,
+                             const struct gputop_perf_event *event);
         } perf;
         /* /proc/stat */
         struct {
@@ -209,6 +227,52 @@ struct perf_oa_user {
                    uint8_t *start, uint8_t *end);
 };
 
+/*
+ * Attributes the deltas of a system wide OA stream to the contexts that
+ * were running, so per-context metrics can be derived from one stream
+ * instead of re-opening a stream filtered for each context.
+ *
+ * Each OA report is tagged with the ID of the context running when it
+ * was written and the HW writes a report at each context switch, so
+ * each report pair delta is attributed to the context of the first
+ * report; the intervals naturally split at context switches. Intervals
+ * starting while no context is running are not attributed to any
+ * context.
+ *
+ * All per-context accumulators share one timeline so their timestamps
+ * are comparable, even across long periods where a context is idle.
+ */
+#define GPUTOP_OA_INVALID_CTX_ID 0x1fffff
+
+struct gputop_oa_ctx_accumulator {
+    uint32_t ctx_id;
+    struct gputop_oa_accumulator accumulator;
+};
+
+struct gputop_oa_ctx_demux {
+    struct gputop_metric_set *metric_set;
+
+    /* ctx_id + 1 -> struct gputop_oa_ctx_accumulator */
+    struct gputop_hash_table *contexts;
+
+    struct gputop_u32_clock clock;
+};
+
+void gputop_oa_ctx_demux_init(struct gputop_oa_ctx_demux *demux,
+                              struct gputop_metric_set *metric_set);
+void gputop_oa_ctx_demux_fini(struct gputop_oa_ctx_demux *demux);
+
+/* Returns the context accumulator the deltas were attributed to, or
+ * NULL if the interval wasn't attributed to any context */
+struct gputop_oa_ctx_accumulator *
+gputop_oa_ctx_demux_accumulate(struct gputop_oa_ctx_demux *demux,
+                               const uint8_t *report0,
+                               const uint8_t *report1);
+
+/* Clears all per-context accumulators and forgets about any context
+ * that hasn't been seen since the last clear. */
+void gputop_oa_ctx_demux_clear(struct gputop_oa_ctx_demux *demux);
+
 extern struct perf_oa_user *gputop_perf_current_user;
 
 bool gputop_add_ctx_handle(int ctx_fd, uint32_t ctx_id);
@@ -217,9 +281,11 @@ struct ctx_handle *get_first_available_ctx(char **error);
 
 bool gputop_enumerate_metrics_via_sysfs(void);
 bool gputop_perf_initialize(void);
+bool gputop_perf_initialize_for_replay(const struct gputop_devinfo *devinfo);
 void gputop_perf_free(void);
 
-extern struct gputop_hash_table *metrics;
+struct gputop_metric_set *gputop_perf_lookup_metric_set(const char *guid);
+
 extern struct array *gputop_perf_oa_supported_metric_set_guids;
 extern int gputop_perf_trace_buffer_size;
 extern uint8_t *gputop_perf_trace_buffer;
@@ -253,6 +319,29 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
                                 void (*ready_cb)(struct gputop_perf_stream *),
                                 bool overwrite,
                                 char **error);
+bool gputop_i915_perf_stream_enable_ring(struct gputop_perf_stream *stream,
+                                         size_t size,
+                                         char **error);
+bool gputop_i915_perf_stream_start_reader(struct gputop_perf_stream *stream,
+                                          int cpu,
+                                          char **error);
+int gputop_i915_perf_stream_drain(struct gputop_perf_stream *stream);
+void gputop_i915_perf_stream_ring_consume(struct gputop_perf_stream *stream,
+                                          size_t len);
+int gputop_i915_perf_count_sample_run(const uint8_t *data,
+                                      const uint8_t *end);
+bool gputop_i915_perf_stream_record(struct gputop_perf_stream *stream,
+                                    const char *filename,
+                                    int period_exponent,
+                                    int reader_cpu,
+                                    char **error);
+
+static inline size_t
+gputop_perf_ring_taken(struct gputop_perf_ring *ring)
+{
+    return ring->head - ring->tail;
+}
+
 struct gputop_perf_stream *
 gputop_perf_open_trace(int pid,
                        int cpu,
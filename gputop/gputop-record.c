@@ -0,0 +1,503 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include <i915_oa_drm.h>
+
+#include "gputop-util.h"
+#include "gputop-log.h"
+#include "gputop-record.h"
+
+/* The header is padded so that the records that follow are naturally
+ * aligned for reading in place from the mmaped file */
+#define GPUTOP_RECORD_HEADER_SIZE 256
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "gputop recordings are little endian and read in place"
+#endif
+
+_Static_assert(sizeof(struct gputop_record_header) == 168,
+               "GPUTOP_RECORD_VERSION must be bumped if the header changes");
+
+static void
+record_devinfo_pack(struct gputop_record_devinfo *record_devinfo,
+                    const struct gputop_devinfo *devinfo)
+{
+    record_devinfo->devid = devinfo->devid;
+    record_devinfo->gen = devinfo->gen;
+    record_devinfo->timestamp_frequency = devinfo->timestamp_frequency;
+    record_devinfo->n_eus = devinfo->n_eus;
+    record_devinfo->n_eu_slices = devinfo->n_eu_slices;
+    record_devinfo->n_eu_sub_slices = devinfo->n_eu_sub_slices;
+    record_devinfo->eu_threads_count = devinfo->eu_threads_count;
+    record_devinfo->subslice_mask = devinfo->subslice_mask;
+    record_devinfo->slice_mask = devinfo->slice_mask;
+    record_devinfo->gt_min_freq = devinfo->gt_min_freq;
+    record_devinfo->gt_max_freq = devinfo->gt_max_freq;
+}
+
+static void
+record_devinfo_unpack(struct gputop_devinfo *devinfo,
+                      const struct gputop_record_devinfo *record_devinfo)
+{
+    memset(devinfo, 0, sizeof(*devinfo));
+    devinfo->devid = record_devinfo->devid;
+    devinfo->gen = record_devinfo->gen;
+    devinfo->timestamp_frequency = record_devinfo->timestamp_frequency;
+    devinfo->n_eus = record_devinfo->n_eus;
+    devinfo->n_eu_slices = record_devinfo->n_eu_slices;
+    devinfo->n_eu_sub_slices = record_devinfo->n_eu_sub_slices;
+    devinfo->eu_threads_count = record_devinfo->eu_threads_count;
+    devinfo->subslice_mask = record_devinfo->subslice_mask;
+    devinfo->slice_mask = record_devinfo->slice_mask;
+    devinfo->gt_min_freq = record_devinfo->gt_min_freq;
+    devinfo->gt_max_freq = record_devinfo->gt_max_freq;
+}
+
+/* Converts the 32bit OA report timestamps into a 64bit nanosecond time
+ * relative to the first report, according to the timestamp frequency of
+ * the recorded device (which isn't necessarily the device we are
+ * running on when replaying) */
+struct record_clock {
+    bool initialized;
+    uint64_t frequency;
+    uint32_t last_u32;
+    uint64_t ns;
+};
+
+static uint64_t
+record_clock_progress(struct record_clock *clock, const uint32_t *report)
+{
+    uint32_t u32_timestamp = report[1];
+
+    if (!clock->initialized) {
+        clock->initialized = true;
+        clock->last_u32 = u32_timestamp;
+        clock->ns = 0;
+    } else {
+        uint64_t delta = (uint32_t)(u32_timestamp - clock->last_u32);
+
+        clock->ns += (delta * 1000000000) / clock->frequency;
+        clock->last_u32 = u32_timestamp;
+    }
+
+    return clock->ns;
+}
+
+struct gputop_record_writer {
+    char *filename;
+    FILE *fp;
+    uint64_t offset;
+
+    struct record_clock clock;
+    uint64_t next_index_timestamp;
+    struct array *index;
+};
+
+struct gputop_record_writer *
+gputop_record_writer_open(const char *filename,
+                          struct gputop_metric_set *metric_set,
+                          int period_exponent,
+                          char **error)
+{
+    struct gputop_record_writer *writer;
+    struct gputop_record_header header;
+    uint8_t pad[GPUTOP_RECORD_HEADER_SIZE - sizeof(header)];
+    FILE *fp;
+
+    assert(sizeof(header) <= GPUTOP_RECORD_HEADER_SIZE);
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        asprintf(error, "Failed to open %s for recording: %m\n", filename);
+        return NULL;
+    }
+
+    /* We write the records in fairly small chunks as they are read from
+     * the kernel so a large buffer saves a lot of write() syscalls */
+    setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GPUTOP_RECORD_MAGIC, sizeof(header.magic));
+    header.version = GPUTOP_RECORD_VERSION;
+    header.header_size = GPUTOP_RECORD_HEADER_SIZE;
+    record_devinfo_pack(&header.devinfo, &gputop_devinfo);
+    strncpy(header.guid, metric_set->guid, sizeof(header.guid) - 1);
+    header.period_exponent = period_exponent;
+    header.perf_oa_format = metric_set->perf_oa_format;
+    header.perf_raw_size = metric_set->perf_raw_size;
+
+    memset(pad, 0, sizeof(pad));
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(pad, sizeof(pad), 1, fp) != 1)
+    {
+        asprintf(error, "Failed to write recording header to %s: %m\n",
+                 filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    writer = xmalloc0(sizeof(*writer));
+    writer->filename = strdup(filename);
+    writer->fp = fp;
+    writer->offset = GPUTOP_RECORD_HEADER_SIZE;
+    writer->clock.frequency = gputop_devinfo.timestamp_frequency;
+    writer->index = array_new(sizeof(struct gputop_record_index_entry), 64);
+
+    return writer;
+}
+
+static void
+update_index(struct gputop_record_writer *writer,
+             const uint8_t *data, int len)
+{
+    const uint8_t *start = data;
+    const uint8_t *end = data + len;
+
+    while (data < end) {
+        const struct i915_perf_record_header *header =
+            (const struct i915_perf_record_header *)data;
+
+        if (header->size == 0) {
+            dbg("Spurious zero length i915 perf record while recording\n");
+            return;
+        }
+
+        if (header->type == DRM_I915_PERF_RECORD_SAMPLE) {
+            const uint32_t *report = (const uint32_t *)(header + 1);
+            uint64_t timestamp = record_clock_progress(&writer->clock, report);
+
+            if (timestamp >= writer->next_index_timestamp) {
+                struct gputop_record_index_entry entry = {
+                    .timestamp = timestamp,
+                    .offset = writer->offset + (data - start),
+                };
+
+                array_append(writer->index, &entry);
+                writer->next_index_timestamp =
+                    timestamp + GPUTOP_RECORD_INDEX_PERIOD_NS;
+            }
+        }
+
+        data += header->size;
+    }
+}
+
+/* Appends a buffer of whole i915 perf records, as read() from the
+ * kernel, to the recording.
+ *
+ * On error the recording is stopped, but the writer remains valid until
+ * gputop_record_writer_close() so the caller doesn't need to care. */
+void
+gputop_record_writer_write(struct gputop_record_writer *writer,
+                           const uint8_t *data, int len)
+{
+    if (!writer->fp)
+        return;
+
+    update_index(writer, data, len);
+
+    if (fwrite(data, len, 1, writer->fp) != 1) {
+        dbg("Failed to write to recording %s: %m; stopping recording\n",
+            writer->filename);
+        fclose(writer->fp);
+        writer->fp = NULL;
+        return;
+    }
+
+    writer->offset += len;
+}
+
+void
+gputop_record_writer_close(struct gputop_record_writer *writer)
+{
+    if (writer->fp) {
+        uint64_t index_offset = writer->offset;
+        uint64_t n_index_entries = writer->index->len;
+
+        if (fwrite(writer->index->data, writer->index->elem_size,
+                   writer->index->len, writer->fp) != n_index_entries ||
+            fseek(writer->fp, offsetof(struct gputop_record_header, index_offset),
+                  SEEK_SET) < 0 ||
+            fwrite(&index_offset, sizeof(index_offset), 1, writer->fp) != 1 ||
+            fwrite(&n_index_entries, sizeof(n_index_entries), 1, writer->fp) != 1)
+        {
+            dbg("Failed to write index for recording %s: %m\n",
+                writer->filename);
+        }
+
+        fclose(writer->fp);
+    }
+
+    array_free(writer->index);
+    free(writer->filename);
+    free(writer);
+}
+
+static void
+rebuild_index(struct gputop_record_reader *reader)
+{
+    struct record_clock clock = {
+        .frequency = reader->devinfo.timestamp_frequency,
+    };
+    struct array *index =
+        array_new(sizeof(struct gputop_record_index_entry), 64);
+    uint64_t next_index_timestamp = 0;
+    const uint8_t *data = reader->records;
+
+    while (data + sizeof(struct i915_perf_record_header) <=
+           reader->records_end)
+    {
+        const struct i915_perf_record_header *header =
+            (const struct i915_perf_record_header *)data;
+
+        /* Probably a truncated recording */
+        if (header->size < sizeof(*header) ||
+            data + header->size > reader->records_end)
+        {
+            break;
+        }
+
+        if (header->type == DRM_I915_PERF_RECORD_SAMPLE) {
+            uint64_t timestamp =
+                record_clock_progress(&clock, (const uint32_t *)(header + 1));
+
+            if (timestamp >= next_index_timestamp) {
+                struct gputop_record_index_entry entry = {
+                    .timestamp = timestamp,
+                    .offset = data - reader->data,
+                };
+
+                array_append(index, &entry);
+                next_index_timestamp =
+                    timestamp + GPUTOP_RECORD_INDEX_PERIOD_NS;
+            }
+        }
+
+        data += header->size;
+    }
+
+    reader->records_end = data;
+    reader->n_index_entries = index->len;
+    reader->index = index->data;
+    reader->owns_index = true;
+
+    /* steal the data */
+    free(index);
+}
+
+struct gputop_record_reader *
+gputop_record_reader_open(const char *filename, char **error)
+{
+    struct gputop_record_reader *reader;
+    const struct gputop_record_header *header;
+    struct stat sb;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        asprintf(error, "Failed to open recording %s: %m\n", filename);
+        return NULL;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        asprintf(error, "Failed to stat recording %s: %m\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    if (sb.st_size < GPUTOP_RECORD_HEADER_SIZE) {
+        asprintf(error, "%s is too small to be a gputop recording\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        asprintf(error, "Failed to map recording %s: %m\n", filename);
+        return NULL;
+    }
+
+    header = data;
+    if (memcmp(header->magic, GPUTOP_RECORD_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != GPUTOP_RECORD_VERSION ||
+        header->header_size < sizeof(*header) ||
+        header->header_size > sb.st_size ||
+        header->devinfo.timestamp_frequency == 0)
+    {
+        asprintf(error, "%s is not a valid gputop recording\n", filename);
+        munmap(data, sb.st_size);
+        return NULL;
+    }
+
+    /* Replaying is sequential from a seek point */
+    madvise(data, sb.st_size, MADV_SEQUENTIAL);
+
+    reader = xmalloc0(sizeof(*reader));
+    reader->data = data;
+    reader->size = sb.st_size;
+    reader->header = header;
+    record_devinfo_unpack(&reader->devinfo, &header->devinfo);
+    reader->records = reader->data + header->header_size;
+
+    if (header->index_offset >= header->header_size &&
+        header->index_offset <= reader->size &&
+        header->n_index_entries <=
+        (reader->size - header->index_offset) / sizeof(struct gputop_record_index_entry))
+    {
+        reader->records_end = reader->data + header->index_offset;
+        reader->index = (struct gputop_record_index_entry *)
+            (reader->data + header->index_offset);
+        reader->n_index_entries = header->n_index_entries;
+    } else {
+        dbg("No index found in recording %s, rebuilding\n", filename);
+        reader->records_end = reader->data + reader->size;
+        rebuild_index(reader);
+    }
+
+    return reader;
+}
+
+void
+gputop_record_reader_close(struct gputop_record_reader *reader)
+{
+    if (reader->owns_index)
+        free(reader->index);
+    munmap((void *)reader->data, reader->size);
+    free(reader);
+}
+
+/* Returns a pointer to the record to start replaying from so as to cover
+ * @timestamp (in nanoseconds relative to the start of the recording). */
+const uint8_t *
+gputop_record_reader_seek(struct gputop_record_reader *reader,
+                          uint64_t timestamp)
+{
+    uint64_t lo = 0, hi = reader->n_index_entries;
+
+    if (reader->n_index_entries == 0 ||
+        timestamp < reader->index[0].timestamp)
+        return reader->records;
+
+    /* Find the last index entry at or before the timestamp */
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (reader->index[mid].timestamp <= timestamp)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return reader->data + reader->index[lo].offset;
+}
+
+/* Replays the recorded reports from @start through @accumulator, calling
+ * @update_cb each time @aggregation_period nanoseconds of GPU time have
+ * been accumulated (and once more for any remainder).
+ *
+ * Note: the accumulator converts timestamps according to the global
+ * gputop_devinfo which the caller should initialize from
+ * reader->devinfo when replaying on a different device. */
+void
+gputop_record_reader_accumulate(struct gputop_record_reader *reader,
+                                const uint8_t *start,
+                                struct gputop_oa_accumulator *accumulator,
+                                uint64_t aggregation_period,
+                                void (*update_cb)(struct gputop_oa_accumulator *accumulator,
+                                                  void *data),
+                                void *data)
+{
+    const uint8_t *last = NULL;
+    const uint8_t *pos = start;
+
+    while (pos + sizeof(struct i915_perf_record_header) <=
+           reader->records_end)
+    {
+        const struct i915_perf_record_header *header =
+            (const struct i915_perf_record_header *)pos;
+
+        if (header->size < sizeof(*header) ||
+            pos + header->size > reader->records_end)
+        {
+            dbg("Truncated record in recording\n");
+            break;
+        }
+
+        switch (header->type) {
+        case DRM_I915_PERF_RECORD_OA_BUFFER_LOST:
+        case DRM_I915_PERF_RECORD_OA_REPORT_LOST:
+            /* Don't accumulate across a discontinuity */
+            last = NULL;
+            break;
+
+        case DRM_I915_PERF_RECORD_SAMPLE: {
+            const uint8_t *report = (const uint8_t *)(header + 1);
+
+            if (last &&
+                gputop_oa_accumulate_reports(accumulator, last, report, false))
+            {
+                uint64_t elapsed = (accumulator->last_timestamp -
+                                    accumulator->first_timestamp);
+
+                if (elapsed > aggregation_period) {
+                    update_cb(accumulator, data);
+                    gputop_oa_accumulator_clear(accumulator);
+                }
+            }
+
+            last = report;
+            break;
+        }
+
+        default:
+            dbg("Spurious header type = %d\n", header->type);
+            break;
+        }
+
+        pos += header->size;
+    }
+
+    if (accumulator->first_timestamp != accumulator->last_timestamp)
+        update_cb(accumulator, data);
+}
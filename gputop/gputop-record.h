@@ -0,0 +1,137 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gputop-oa-counters.h"
+
+/*
+ * On-disk capture of a raw i915 perf OA stream.
+ *
+ * A recording starts with a struct gputop_record_header (padded to
+ * header_size bytes), followed by the i915_perf_record_header records
+ * exactly as read() from the kernel. When a recording is finished cleanly
+ * a seek index, of struct gputop_record_index_entry, is appended after the
+ * records and the header is updated to point to it. (If the index is
+ * missing, e.g. because gputop crashed, the reader rebuilds it by scanning
+ * the records.)
+ *
+ * Index entries are written roughly every GPUTOP_RECORD_INDEX_PERIOD_NS of
+ * GPU time and give the file offset of the first sample at or after a
+ * timestamp, in nanoseconds relative to the first sample of the recording.
+ *
+ * The header only uses fixed width fields and the device info is copied
+ * into it field by field (see struct gputop_record_devinfo), so its layout
+ * doesn't depend on struct gputop_devinfo. GPUTOP_RECORD_VERSION must be
+ * bumped whenever the layout changes.
+ *
+ * All values are stored little endian: the records are the kernel's, in
+ * CPU byte order, and recordings are read in place, so gputop-record.c
+ * won't build for a big endian host (i915 is only found on x86 anyway).
+ */
+
+#define GPUTOP_RECORD_MAGIC "GPUTOPOA"
+#define GPUTOP_RECORD_VERSION 1
+#define GPUTOP_RECORD_INDEX_PERIOD_NS 100000000ULL
+
+struct gputop_record_devinfo {
+    uint32_t devid;
+    uint32_t gen;
+    uint64_t timestamp_frequency;
+    uint64_t n_eus;
+    uint64_t n_eu_slices;
+    uint64_t n_eu_sub_slices;
+    uint64_t eu_threads_count;
+    uint64_t subslice_mask;
+    uint64_t slice_mask;
+    uint64_t gt_min_freq;
+    uint64_t gt_max_freq;
+};
+
+struct gputop_record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; /* offset of the first record */
+
+    struct gputop_record_devinfo devinfo;
+
+    char guid[40];
+    uint32_t period_exponent;
+    uint32_t perf_oa_format;
+    uint32_t perf_raw_size;
+    uint32_t pad;
+
+    uint64_t index_offset; /* zero if no index was written */
+    uint64_t n_index_entries;
+};
+
+struct gputop_record_index_entry {
+    uint64_t timestamp;
+    uint64_t offset;
+};
+
+struct gputop_record_writer;
+
+struct gputop_record_writer *
+gputop_record_writer_open(const char *filename,
+                          struct gputop_metric_set *metric_set,
+                          int period_exponent,
+                          char **error);
+void gputop_record_writer_write(struct gputop_record_writer *writer,
+                                const uint8_t *data, int len);
+void gputop_record_writer_close(struct gputop_record_writer *writer);
+
+struct gputop_record_reader {
+    const uint8_t *data;
+    size_t size;
+
+    const struct gputop_record_header *header;
+    struct gputop_devinfo devinfo; /* of the recorded device */
+
+    const uint8_t *records;
+    const uint8_t *records_end;
+
+    struct gputop_record_index_entry *index;
+    uint64_t n_index_entries;
+    bool owns_index;
+};
+
+struct gputop_record_reader *gputop_record_reader_open(const char *filename,
+                                                       char **error);
+void gputop_record_reader_close(struct gputop_record_reader *reader);
+
+const uint8_t *gputop_record_reader_seek(struct gputop_record_reader *reader,
+                                         uint64_t timestamp);
+
+void gputop_record_reader_accumulate(struct gputop_record_reader *reader,
+                                     const uint8_t *start,
+                                     struct gputop_oa_accumulator *accumulator,
+                                     uint64_t aggregation_period,
+                                     void (*update_cb)(struct gputop_oa_accumulator *accumulator,
+                                                       void *data),
+                                     void *data);
@@ -56,13 +56,13 @@
 #include "gputop-gl.h"
 #endif
 
-static h2o_websocket_conn_t *h2o_conn;
 static h2o_globalconf_t config;
 static h2o_context_t ctx;
 static SSL_CTX *ssl_ctx;
 static uv_tcp_t listener;
 
 static uv_timer_t timer;
+static uv_timer_t log_timer;
 
 
 
@@ -72,17 +72,47 @@ enum {
     WS_MESSAGE_I915_PERF,
 };
 
-struct protobuf_msg_closure;
-
-typedef void (*gputop_closure_done_t)(struct protobuf_msg_closure *closure);
+struct client;
 
+/* NB: the closure and packed message data are allocated together from
+ * the client's msg_arena (see send_pb_message()) */
 struct protobuf_msg_closure {
+    struct client *client;
     int current_offset;
     int len;
     uint8_t *data;
-    gputop_closure_done_t done_callback;
+    bool heap_allocated;
+};
+
+/* For building messages, and unpacking requests, that only need to live
+ * until they have been packed (or handled); reset by each of the mainloop
+ * callbacks that use it once they're done (see scratch_reset()) */
+static struct gputop_arena scratch_arena;
+
+static void *
+arena_pb_alloc(void *allocator_data, size_t size)
+{
+    return gputop_arena_alloc(allocator_data, size);
+}
+
+static void
+arena_pb_free(void *allocator_data, void *ptr)
+{
+    /* freed in bulk by gputop_arena_reset() */
+}
+
+static ProtobufCAllocator scratch_allocator = {
+    .alloc = arena_pb_alloc,
+    .free = arena_pb_free,
+    .allocator_data = &scratch_arena,
 };
 
+static void
+scratch_reset(void)
+{
+    gputop_arena_reset(&scratch_arena);
+}
+
 static ssize_t
 fragmented_protobuf_msg_read_cb(wslay_event_context_ptr ctx,
                                 uint8_t *data, size_t len,
@@ -117,17 +147,123 @@ fragmented_protobuf_msg_read_cb(wslay_event_context_ptr ctx,
     return total;
 }
 
+/* A message sent, or to be sent, to a session, including the 8 byte
+ * websocket message header */
+struct session_msg {
+    gputop_list_t link;
+    int ref_count; /* the backlog's, plus one per queued send */
+    uint64_t seq;
+    uint64_t timestamp;
+    size_t len;
+    uint8_t data[];
+};
+
+/* Default limits on a session's backlog (see AttachSession) */
+#define SESSION_RETENTION_BYTES (64 * 1024 * 1024)
+#define SESSION_RETENTION_MS (60 * 1000)
+
+/* A websocket connection. Each client has its own set of open queries,
+ * identified by ids of its own choosing. */
+struct client {
+    int ref_count;
+    h2o_websocket_conn_t *conn; /* NULL once disconnected */
+    gputop_list_t link;
+    gputop_list_t queries;
+
+    /* Protobuf messages queued to send are packed into this arena, which
+     * is reset whenever the queue empties... */
+    struct gputop_arena msg_arena;
+    int n_queued_msgs;
+
+    /* Once named by an AttachSession request the client outlives its
+     * connection, keeping its queries open. Every message for the session
+     * is numbered and kept in the backlog until the client acknowledges
+     * it or the retention limits are hit, so a connection that attaches
+     * later can be sent whatever never arrived... */
+    char *session_name;
+    gputop_list_t backlog;
+    size_t backlog_size;
+    uint64_t backlog_seq; /* seq of the next message appended */
+    uint64_t retention_bytes;
+    uint64_t retention_ms;
+};
+
+/* If a client is so slow that its queue never empties we stop growing
+ * its msg_arena and fall back to the heap */
+#define MAX_MSG_ARENA_SIZE (4 * 1024 * 1024)
+
+static void client_unref(struct client *client);
+
 static void
 on_protobuf_msg_sent_cb(const union wslay_event_msg_source *source, void *user_data)
 {
     struct protobuf_msg_closure *closure = (void *)source->data;
+    struct client *client = closure->client;
 
-    free(closure->data);
-    free(closure);
+    if (closure->heap_allocated)
+        free(closure);
+
+    if (--client->n_queued_msgs == 0)
+        gputop_arena_reset(&client->msg_arena);
+
+    client_unref(client);
 }
 
-static gputop_list_t streams;
-static gputop_list_t closing_streams;
+/* An i915 perf OA stream shared by all the queries, from any client, that
+ * ask for the same metric set, period exponent and context.
+ *
+ * Records are drained from the kernel once into the stream's ring and each
+ * subscribed query forwards from its own position in the ring. The ring is
+ * only consumed up to the position of the subscriber furthest behind, so
+ * the data is never copied per client (besides into the websocket frames
+ * themselves). */
+struct shared_oa_stream {
+    struct gputop_perf_stream *stream;
+    int period_exponent;
+    struct ctx_handle *ctx;
+    gputop_list_t link;
+    gputop_list_t subscribers;
+};
+
+struct client_query {
+    struct client *client;
+    uint32_t id;
+    struct gputop_perf_stream *stream;
+    gputop_list_t link;
+
+    /* For OA queries... */
+    struct shared_oa_stream *oa;
+    gputop_list_t oa_link;
+    uint64_t oa_tail; /* ring position forwarded up to */
+
+    /* For OA queries accumulated by the server instead of forwarding
+     * raw reports (see OAQueryInfo.aggregation_period)... */
+    uint64_t aggregation_period;
+    struct gputop_oa_accumulator *accumulator;
+    double *counter_values;
+    /* The last report seen, to continue aggregating from with the
+     * next flush, since the ring may be overwritten by then */
+    uint8_t *continuation_report;
+    bool have_continuation_report;
+
+    /* Optionally, instead of the single accumulator, deltas are
+     * attributed to the contexts that were running with updates sent
+     * per context (see OAQueryInfo.demux_contexts)... */
+    struct gputop_oa_ctx_demux *ctx_demux;
+    uint64_t ctx_period_start;
+
+    /* For CPU stats queries batching samples into CpuStatsBlocks, the
+     * last sample sent for each CPU (see CpuStatsInfo.packed)... */
+    struct cpu_stat *cpu_stats_last;
+    bool have_cpu_stats_last;
+
+    char *close_uuid; /* request to ACK once closed */
+    bool flushing;
+    bool pending_close;
+};
+
+static gputop_list_t clients;
+static gputop_list_t oa_streams;
 
 /*
  * FIXME: don't duplicate these...
@@ -153,15 +289,15 @@ struct perf_flush_closure {
     bool header_written;
     int id;
     int total_len;
-    struct gputop_perf_stream *stream;
+    struct client_query *query;
     uint64_t head;
     uint64_t tail;
 };
 
-static unsigned int
+static uint64_t
 read_perf_head(struct perf_event_mmap_page *mmap_page)
 {
-    unsigned int head = (*(volatile uint64_t *)&mmap_page->data_head);
+    uint64_t head = (*(volatile uint64_t *)&mmap_page->data_head);
     rmb();
 
     return head;
@@ -169,7 +305,7 @@ read_perf_head(struct perf_event_mmap_page *mmap_page)
 
 static void
 write_perf_tail(struct perf_event_mmap_page *mmap_page,
-                unsigned int tail)
+                uint64_t tail)
 {
     /* Make sure we've finished reading all the sample data we
      * were consuming before updating the tail... */
@@ -177,80 +313,399 @@ write_perf_tail(struct perf_event_mmap_page *mmap_page,
     mmap_page->data_tail = tail;
 }
 
+/* Sends a message on the connection as is, not via the client's session
+ * backlog (see client_send_pb_message()) */
 static void
-send_pb_message(h2o_websocket_conn_t *conn, ProtobufCMessage *pb_message)
+queue_pb_message(h2o_websocket_conn_t *conn, ProtobufCMessage *pb_message)
 {
     struct wslay_event_fragmented_msg msg;
     struct protobuf_msg_closure *closure;
+    struct client *client;
+    size_t len;
 
     if (!conn)
         return;
 
-    closure = xmalloc(sizeof(*closure));
+    client = conn->data;
+    len = protobuf_c_message_get_packed_size(pb_message);
+
+    if (client->msg_arena.total + sizeof(*closure) + len <= MAX_MSG_ARENA_SIZE) {
+        closure = gputop_arena_alloc(&client->msg_arena, sizeof(*closure) + len);
+        closure->heap_allocated = false;
+    } else {
+        closure = xmalloc(sizeof(*closure) + len);
+        closure->heap_allocated = true;
+    }
+    closure->client = client;
     closure->current_offset = 0;
-    closure->len = protobuf_c_message_get_packed_size(pb_message);
-    closure->data = xmalloc(closure->len);
+    closure->len = len;
+    closure->data = (uint8_t *)(closure + 1);
 
     protobuf_c_message_pack(pb_message, closure->data);
 
+    /* NB: the connection may be handed over to a session while messages
+     * are still queued (see handle_attach_session()) */
+    client->ref_count++;
+    client->n_queued_msgs++;
+
     msg.opcode = WSLAY_BINARY_FRAME;
     msg.source.data = closure;
     msg.read_callback = fragmented_protobuf_msg_read_cb;
     msg.finish_callback = on_protobuf_msg_sent_cb;
 
-    wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg);
+    /* If the message can't be queued (e.g. once a close frame has been
+     * queued) then the finish callback will never be called */
+    if (wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg) != 0) {
+        if (closure->heap_allocated)
+            free(closure);
+
+        if (--client->n_queued_msgs == 0)
+            gputop_arena_reset(&client->msg_arena);
+        client->ref_count--;
+        return;
+    }
+
     wslay_event_send(conn->ws_ctx);
 }
 
 static void
-stream_closed_cb(struct gputop_perf_stream *stream)
+session_msg_unref(struct session_msg *msg)
+{
+    if (--msg->ref_count == 0)
+        free(msg);
+}
+
+/* NB: the message may still be queued to send, in which case it's only
+ * freed once sent */
+static void
+session_msg_free(struct client *client, struct session_msg *msg)
+{
+    gputop_list_remove(&msg->link);
+    client->backlog_size -= msg->len;
+    session_msg_unref(msg);
+}
+
+/* Drops the oldest messages from the backlog that are past the
+ * session's retention time, or to make room for @reserve more bytes */
+static void
+session_backlog_trim(struct client *client, size_t reserve)
+{
+    uint64_t now = gputop_get_time();
+    struct session_msg *msg, *tmp;
+
+    gputop_list_for_each_safe(msg, tmp, &client->backlog, link) {
+        if (client->backlog_size + reserve <= client->retention_bytes &&
+            now - msg->timestamp <= client->retention_ms * 1000000)
+            break;
+
+        session_msg_free(client, msg);
+    }
+}
+
+/* Drops the messages the client has acknowledged receiving, i.e. all
+ * those before @cursor */
+static void
+session_backlog_ack(struct client *client, uint64_t cursor)
+{
+    struct session_msg *msg, *tmp;
+
+    gputop_list_for_each_safe(msg, tmp, &client->backlog, link) {
+        if (msg->seq >= cursor)
+            break;
+        session_msg_free(client, msg);
+    }
+}
+
+/* Appends a message with space for @len bytes of data to a session's
+ * backlog, following a header like the websocket messages have.
+ *
+ * NB: a single message larger than the retention limit is still kept,
+ * so long as it's the only one in the backlog */
+static struct session_msg *
+session_backlog_append(struct client *client, int type, uint32_t id, size_t len)
+{
+    struct session_msg *msg;
+
+    session_backlog_trim(client, 8 + len);
+
+    msg = xmalloc(sizeof(*msg) + 8 + len);
+    msg->ref_count = 1;
+    msg->seq = client->backlog_seq++;
+    msg->timestamp = gputop_get_time();
+    msg->len = 8 + len;
+
+    memset(msg->data, 0, 8);
+    msg->data[0] = type;
+    *(uint32_t *)(msg->data + 4) = id;
+
+    gputop_list_insert(client->backlog.prev, &msg->link);
+    client->backlog_size += msg->len;
+
+    return msg;
+}
+
+struct session_send_closure {
+    struct client *client;
+    struct client_query *query; /* if forwarding the query's samples */
+    struct session_msg *msg;
+    size_t offset;
+};
+
+static ssize_t
+session_msg_read_cb(wslay_event_context_ptr ctx,
+                    uint8_t *data, size_t len,
+                    const union wslay_event_msg_source *source,
+                    int *eof,
+                    void *user_data)
+{
+    struct session_send_closure *closure = (void *)source->data;
+    struct session_msg *msg = closure->msg;
+    size_t read_len = MIN(msg->len - closure->offset, len);
+
+    /* NB: the buffered message already includes the header */
+    memcpy(data, msg->data + closure->offset, read_len);
+    closure->offset += read_len;
+
+    if (closure->offset == msg->len)
+        *eof = 1;
+
+    return read_len;
+}
+
+static void finish_query_close(struct client_query *query);
+
+static void
+on_session_msg_sent(const union wslay_event_msg_source *source, void *user_data)
+{
+    struct session_send_closure *closure = (void *)source->data;
+    struct client_query *query = closure->query;
+
+    if (query) {
+        struct gputop_perf_stream *stream = query->stream;
+
+        query->flushing = false;
+
+        if (query->pending_close)
+            finish_query_close(query);
+
+        gputop_perf_stream_unref(stream);
+    }
+
+    /* NB: the message stays in the backlog (unless trimmed meanwhile)
+     * until the client acknowledges receiving it, in case the connection
+     * is lost with it still in flight */
+    session_msg_unref(closure->msg);
+    client_unref(closure->client);
+    free(closure);
+}
+
+/* Sends a message from the session's backlog. If @query is given the
+ * message holds the query's samples and the query is marked as flushing
+ * until it's sent, so a slow client throttles forwarding */
+static void
+session_send_msg(struct client *client, struct session_msg *msg,
+                 struct client_query *query)
+{
+    h2o_websocket_conn_t *conn = client->conn;
+    struct session_send_closure *closure = xmalloc(sizeof(*closure));
+    struct wslay_event_fragmented_msg send;
+
+    closure->client = client;
+    closure->query = query;
+    closure->msg = msg;
+    closure->offset = 0;
+
+    memset(&send, 0, sizeof(send));
+    send.opcode = WSLAY_BINARY_FRAME;
+    send.source.data = closure;
+    send.read_callback = session_msg_read_cb;
+    send.finish_callback = on_session_msg_sent;
+
+    /* If the message can't be queued (e.g. once a close frame has been
+     * queued) then it just stays in the backlog */
+    if (wslay_event_queue_fragmented_msg(conn->ws_ctx, &send) != 0) {
+        free(closure);
+        return;
+    }
+
+    client->ref_count++;
+    msg->ref_count++;
+    if (query) {
+        query->flushing = true;
+        gputop_perf_stream_ref(query->stream);
+    }
+
+    wslay_event_send(conn->ws_ctx);
+}
+
+/* Sends to the client if connected. Every message for a named session is
+ * numbered and kept in the session's backlog, even while attached, so
+ * that it can be replayed if the connection is lost before the client
+ * receives it (see handle_attach_session()) */
+static void
+client_send_pb_message(struct client *client, ProtobufCMessage *pb_message)
+{
+    if (client->session_name) {
+        size_t len = protobuf_c_message_get_packed_size(pb_message);
+        struct session_msg *msg = session_backlog_append(client,
+                                                         WS_MESSAGE_PROTOBUF,
+                                                         0, len);
+
+        protobuf_c_message_pack(pb_message, msg->data + 8);
+
+        if (client->conn)
+            session_send_msg(client, msg, NULL);
+    } else if (client->conn)
+        queue_pb_message(client->conn, pb_message);
+}
+
+static void
+send_pb_message(h2o_websocket_conn_t *conn, ProtobufCMessage *pb_message)
+{
+    if (conn)
+        client_send_pb_message(conn->data, pb_message);
+}
+
+static void
+client_unref(struct client *client)
+{
+    if (--(client->ref_count) == 0) {
+        struct session_msg *msg, *tmp;
+
+        assert(client->conn == NULL);
+
+        gputop_list_for_each_safe(msg, tmp, &client->backlog, link)
+            session_msg_free(client, msg);
+        free(client->session_name);
+
+        gputop_arena_fini(&client->msg_arena);
+        free(client);
+    }
+}
+
+static struct client_query *
+client_query_new(struct client *client,
+                 uint32_t id,
+                 struct gputop_perf_stream *stream)
+{
+    struct client_query *query = xmalloc0(sizeof(*query));
+
+    query->client = client;
+    client->ref_count++;
+
+    query->id = id;
+    query->stream = stream;
+    gputop_list_insert(client->queries.prev, &query->link);
+
+    return query;
+}
+
+static void
+query_closed(struct client_query *query)
 {
+    struct client *client = query->client;
     Gputop__Message message_ack = GPUTOP__MESSAGE__INIT;
     Gputop__Message message = GPUTOP__MESSAGE__INIT;
     Gputop__CloseNotify notify = GPUTOP__CLOSE_NOTIFY__INIT;
 
-    /* stream->user.data will = a UUID if it was closed
-     * in response to a remote request which we need to
-     * ACK... */
-    if (stream->user.data) {
+    /* query->close_uuid will be set if it was closed in response to a
+     * remote request which we need to ACK... */
+    if (query->close_uuid) {
 
-        message_ack.reply_uuid = stream->user.data;
+        message_ack.reply_uuid = query->close_uuid;
         message_ack.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
         message_ack.ack = true;
 
-        dbg("CMD_ACK: %s\n", (char *)stream->user.data);
+        dbg("CMD_ACK: %s\n", query->close_uuid);
 
-        send_pb_message(h2o_conn, &message_ack.base);
+        client_send_pb_message(client, &message_ack.base);
 
-        free(stream->user.data);
-        stream->user.data = NULL;
+        free(query->close_uuid);
     }
 
-    notify.id = stream->user.id;
+    notify.id = query->id;
 
     message.cmd_case = GPUTOP__MESSAGE__CMD_CLOSE_NOTIFY;
     message.close_notify = &notify;
 
-    send_pb_message(h2o_conn, &message.base);
+    client_send_pb_message(client, &message.base);
+
+    if (query->ctx_demux) {
+        gputop_oa_ctx_demux_fini(query->ctx_demux);
+        free(query->ctx_demux);
+    }
+    free(query->accumulator);
+    free(query->counter_values);
+    free(query->continuation_report);
+    free(query->cpu_stats_last);
+    free(query);
+    client_unref(client);
+}
 
-    gputop_list_remove(&stream->user.link);
+static void
+stream_closed_cb(struct gputop_perf_stream *stream)
+{
+    query_closed(stream->user.data);
 
     gputop_perf_stream_unref(stream);
 }
 
+static void
+update_shared_oa_stream_tail(struct shared_oa_stream *oa)
+{
+    struct gputop_perf_ring *ring = &oa->stream->oa.ring;
+    struct client_query *query;
+    uint64_t tail = ring->head;
+
+    gputop_list_for_each(query, &oa->subscribers, oa_link)
+        tail = MIN(tail, query->oa_tail);
+
+    if (tail != ring->tail)
+        gputop_i915_perf_stream_ring_consume(oa->stream, tail - ring->tail);
+}
+
+static void
+finish_query_close(struct client_query *query)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    struct shared_oa_stream *oa = query->oa;
+
+    if (oa) {
+        gputop_list_remove(&query->oa_link);
+
+        if (!gputop_list_empty(&oa->subscribers)) {
+            /* Other queries are still using the stream, but we might have
+             * been holding back the ring... */
+            update_shared_oa_stream_tail(oa);
+            query_closed(query);
+            return;
+        }
+
+        gputop_list_remove(&oa->link);
+        free(oa);
+    }
+
+    /* NB: we only acknowledge the close once the stream is really closed
+     * so that the client can immediately open a new i915 perf stream */
+    stream->user.data = query;
+    gputop_perf_stream_close(stream, stream_closed_cb);
+}
+
 static void
 on_perf_flush_done(const union wslay_event_msg_source *source, void *user_data)
 {
     struct perf_flush_closure *closure =
         (struct perf_flush_closure *)source->data;
+    struct client_query *query = closure->query;
+    struct gputop_perf_stream *stream = query->stream;
 
     //fprintf(stderr, "wrote perf message: len=%d\n", closure->total_len);
-    closure->stream->user.flushing = false;
+    query->flushing = false;
 
-    if (closure->stream->pending_close)
-        gputop_perf_stream_close(closure->stream, stream_closed_cb);
+    if (query->pending_close)
+        finish_query_close(query);
 
-    gputop_perf_stream_unref(closure->stream);
+    gputop_perf_stream_unref(stream);
 
     free(closure);
 }
@@ -264,7 +719,7 @@ fragmented_perf_read_cb(wslay_event_context_ptr ctx,
 {
     struct perf_flush_closure *closure =
         (struct perf_flush_closure *)source->data;
-    struct gputop_perf_stream *stream = closure->stream;
+    struct gputop_perf_stream *stream = closure->query->stream;
     const uint64_t mask = stream->perf.buffer_size - 1;
     int read_len;
     int total = 0;
@@ -329,14 +784,38 @@ fragmented_perf_read_cb(wslay_event_context_ptr ctx,
 }
 
 static void
-flush_perf_stream_samples(struct gputop_perf_stream *stream)
+flush_perf_stream_samples(struct client_query *query)
 {
+    struct gputop_perf_stream *stream = query->stream;
+    struct gputop_perf_parser *parser = &stream->perf.parser;
+    h2o_websocket_conn_t *conn = query->client->conn;
     uint64_t head = read_perf_head(stream->perf.mmap_page);
     uint64_t tail = stream->perf.mmap_page->data_tail;
+    uint64_t n_lost = parser->n_lost_samples;
     struct perf_flush_closure *closure;
     struct wslay_event_fragmented_msg msg;
 
-    stream->user.flushing = true;
+    query->flushing = true;
+
+    /* Walk the record headers we're about to forward (without decoding
+     * the samples) so we can report when perf has had to drop samples
+     * because we aren't keeping up... */
+    gputop_perf_parser_parse_ring(parser,
+                                  stream->perf.buffer,
+                                  stream->perf.buffer_size,
+                                  head, tail,
+                                  NULL, NULL);
+    if (parser->n_lost_samples != n_lost) {
+        char *message = NULL;
+
+        asprintf(&message, "perf query %d: %"PRIu64" samples lost (%"PRIu64" total)\n",
+                 query->id, parser->n_lost_samples - n_lost,
+                 parser->n_lost_samples);
+        if (message) {
+            gputop_log(GPUTOP_LOG_LEVEL_HIGH, message, -1);
+            free(message);
+        }
+    }
 
     /* Ensure the stream can't be freed while we're in the
      * middle of forwarding samples... */
@@ -346,9 +825,9 @@ flush_perf_stream_samples(struct gputop_perf_stream *stream)
 
     closure = xmalloc(sizeof(*closure));
     closure->header_written = false;
-    closure->id = stream->user.id;
+    closure->id = query->id;
     closure->total_len = 0;
-    closure->stream = stream;
+    closure->query = query;
     closure->head = head;
     closure->tail = tail;
 
@@ -358,31 +837,70 @@ flush_perf_stream_samples(struct gputop_perf_stream *stream)
     msg.read_callback = fragmented_perf_read_cb;
     msg.finish_callback = on_perf_flush_done;
 
-    wslay_event_queue_fragmented_msg(h2o_conn->ws_ctx, &msg);
+    wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg);
 
-    wslay_event_send(h2o_conn->ws_ctx);
+    wslay_event_send(conn->ws_ctx);
 }
 
+/* NB: must be a power of two. This should be large enough to cover a
+ * few forwarding periods of the highest sampling frequencies so a slow
+ * client doesn't result in the kernel's OA buffer overflowing. */
+#define I915_PERF_RING_SIZE (8 * 1024 * 1024)
+
+/* With GPUTOP_RECORD set, only the first OA query opened is recorded so
+ * that a later query can't clobber the capture */
+static bool recording_started;
+
 struct i915_perf_flush_closure {
     bool header_written;
     int id;
     int total_len;
-    struct gputop_perf_stream *stream;
+    struct client_query *query;
+
+    /* ring position up to which this message will forward */
+    uint64_t end;
 };
 
+static void
+send_i915_perf_fill_notify(struct client_query *query)
+{
+    struct gputop_perf_ring *ring = &query->stream->oa.ring;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__BufferFillNotify notify = GPUTOP__BUFFER_FILL_NOTIFY__INIT;
+
+    notify.query_id = query->id;
+    notify.fill_percentage = ((ring->head - query->oa_tail) * 100) / ring->size;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_FILL_NOTIFY;
+    message.fill_notify = &notify;
+
+    client_send_pb_message(query->client, &message.base);
+}
+
+static void flush_i915_perf_stream_samples(struct client_query *query);
+
 static void
 on_i915_perf_flush_done(const union wslay_event_msg_source *source, void *user_data)
 {
     struct i915_perf_flush_closure *closure =
         (struct i915_perf_flush_closure *)source->data;
+    struct client_query *query = closure->query;
+    struct gputop_perf_stream *stream = query->stream;
+    struct gputop_perf_ring *ring = &stream->oa.ring;
 
     //fprintf(stderr, "wrote perf message: len=%d\n", closure->total_len);
-    closure->stream->user.flushing = false;
-
-    if (closure->stream->pending_close)
-        gputop_perf_stream_close(closure->stream, stream_closed_cb);
+    query->flushing = false;
+
+    if (query->pending_close)
+        finish_query_close(query);
+    else if (query->client->conn &&
+             ring->head - query->oa_tail > ring->size / 2)
+    {
+        /* Keep sending while we're behind instead of waiting for the next
+         * periodic flush... */
+        flush_i915_perf_stream_samples(query);
+    }
 
-    gputop_perf_stream_unref(closure->stream);
+    gputop_perf_stream_unref(stream);
 
     free(closure);
 }
@@ -396,7 +914,8 @@ fragmented_i915_perf_read_cb(wslay_event_context_ptr ctx,
 {
     struct i915_perf_flush_closure *closure =
         (struct i915_perf_flush_closure *)source->data;
-    struct gputop_perf_stream *stream = closure->stream;
+    struct client_query *query = closure->query;
+    struct gputop_perf_ring *ring = &query->stream->oa.ring;
     int total = 0;
     int read_len;
 
@@ -413,30 +932,37 @@ fragmented_i915_perf_read_cb(wslay_event_context_ptr ctx,
         closure->header_written = true;
     }
 
-    if (gputop_fake_mode)
-        read_len = gputop_perf_fake_read(stream, data, len);
-    else
-        while ((read_len = read(stream->fd, data, len)) < 0 && errno == EINTR)
-            ;
-    if (read_len > 0) {
-        total += read_len;
-        closure->total_len += total;
-    } else {
+    /* NB: the ring is mapped twice, back to back, so the pending data is
+     * always contiguous even if it straddles the wrap point */
+    read_len = MIN(closure->end - query->oa_tail, len);
+    memcpy(data, ring->data + (query->oa_tail & (ring->size - 1)), read_len);
+    query->oa_tail += read_len;
+    update_shared_oa_stream_tail(query->oa);
+
+    total += read_len;
+    closure->total_len += total;
+
+    if (query->oa_tail == closure->end)
         *eof = 1;
-        if (!gputop_fake_mode && errno != EAGAIN)
-            dbg("Error reading i915 perf stream %m\n");
-    }
 
     return total;
 }
 
 static void
-flush_i915_perf_stream_samples(struct gputop_perf_stream *stream)
+flush_i915_perf_stream_samples(struct client_query *query)
 {
+    struct gputop_perf_stream *stream = query->stream;
+    h2o_websocket_conn_t *conn = query->client->conn;
     struct i915_perf_flush_closure *closure;
     struct wslay_event_fragmented_msg msg;
 
-    stream->user.flushing = true;
+    /* Make sure we forward everything available so far */
+    gputop_i915_perf_stream_drain(stream);
+
+    if (query->oa_tail == stream->oa.ring.head)
+        return;
+
+    query->flushing = true;
 
     /* Ensure the stream can't be freed while we're in the
      * middle of forwarding samples... */
@@ -446,9 +972,10 @@ flush_i915_perf_stream_samples(struct gputop_perf_stream *stream)
 
     closure = xmalloc(sizeof(*closure));
     closure->header_written = false;
-    closure->id = stream->user.id;
+    closure->id = query->id;
     closure->total_len = 0;
-    closure->stream = stream;
+    closure->query = query;
+    closure->end = stream->oa.ring.head;
 
     memset(&msg, 0, sizeof(msg));
     msg.opcode = WSLAY_BINARY_FRAME;
@@ -456,28 +983,238 @@ flush_i915_perf_stream_samples(struct gputop_perf_stream *stream)
     msg.read_callback = fragmented_i915_perf_read_cb;
     msg.finish_callback = on_i915_perf_flush_done;
 
-    wslay_event_queue_fragmented_msg(h2o_conn->ws_ctx, &msg);
+    wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg);
 
-    wslay_event_send(h2o_conn->ws_ctx);
+    wslay_event_send(conn->ws_ctx);
 }
 
+/* Called whenever the kernel has new i915 perf records for us. We drain
+ * them into the stream's ring straight away, regardless of whether we're
+ * still in the middle of forwarding earlier data to the client, so the
+ * kernel's OA buffer can't overflow just because the client is slow. */
 static void
-flush_cpu_stats(struct gputop_perf_stream *stream)
+i915_perf_stream_ready_cb(struct gputop_perf_stream *stream)
 {
-    int n_cpus = gputop_cpu_count();
-    int n;
-    int pos;
+    struct shared_oa_stream *oa = stream->user.data;
+    bool was_full = stream->oa.ring_full;
 
-    if (stream->cpu.stats_buf_pos == 0 && !stream->cpu.stats_buf_full)
-        return;
+    gputop_i915_perf_stream_drain(stream);
 
-    if (stream->cpu.stats_buf_full) {
-        n = stream->cpu.stats_buf_len / n_cpus;
-        pos = stream->cpu.stats_buf_pos;
-    } else {
-        n = stream->cpu.stats_buf_pos / n_cpus;
-        pos = 0;
+    if (stream->oa.ring_full && !was_full) {
+        struct client_query *query;
+
+        /* Let whoever is holding back the ring know they're not keeping
+         * up... */
+        gputop_list_for_each(query, &oa->subscribers, oa_link) {
+            if (query->oa_tail != stream->oa.ring.tail)
+                continue;
+
+            dbg("i915 perf query %u: forwarding ring full, client not keeping up\n",
+                query->id);
+            send_i915_perf_fill_notify(query);
+        }
+    }
+}
+
+/* NB: these match the reasons reported by gputop-web.c */
+enum update_reason {
+    UPDATE_REASON_PERIOD            = 1,
+    UPDATE_REASON_CTX_SWITCH_TO     = 2,
+    UPDATE_REASON_CTX_SWITCH_AWAY   = 4
+};
+
+/* NB: ctx may be NULL if the update isn't for a specific context */
+static void
+send_counter_update(struct client_query *query,
+                    struct gputop_oa_accumulator *accumulator,
+                    struct gputop_oa_ctx_accumulator *ctx,
+                    enum update_reason reason)
+{
+    struct gputop_metric_set *metric_set = query->stream->metric_set;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__CounterUpdate update = GPUTOP__COUNTER_UPDATE__INIT;
+
+    metric_set->read_all(&gputop_devinfo, metric_set, accumulator->deltas,
+                         query->counter_values);
+
+    update.id = query->id;
+    update.start_timestamp = accumulator->first_timestamp;
+    update.end_timestamp = accumulator->last_timestamp;
+    update.reason = reason;
+    update.n_values = metric_set->n_counters * 2;
+    update.values = query->counter_values;
+
+    if (ctx) {
+        update.has_ctx_id = true;
+        update.ctx_id = ctx->ctx_id;
+    }
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_COUNTER_UPDATE;
+    message.counter_update = &update;
+
+    client_send_pb_message(query->client, &message.base);
+}
+
+static void
+send_ctx_counter_updates(struct client_query *query)
+{
+    struct gputop_hash_entry *entry;
+
+    gputop_hash_table_foreach(query->ctx_demux->contexts, entry) {
+        struct gputop_oa_ctx_accumulator *ctx = entry->data;
+
+        if (ctx->accumulator.first_timestamp)
+            send_counter_update(query, &ctx->accumulator, ctx,
+                                UPDATE_REASON_PERIOD);
+    }
+
+    gputop_oa_ctx_demux_clear(query->ctx_demux);
+}
+
+static void
+accumulate_ctx_demux(struct client_query *query,
+                     const uint8_t *report0, const uint8_t *report1)
+{
+    struct gputop_oa_ctx_demux *demux = query->ctx_demux;
+    uint64_t now;
+
+    gputop_oa_ctx_demux_accumulate(demux, report0, report1);
+
+    now = gputop_u32_clock_get_time(&demux->clock);
+    if (now - query->ctx_period_start > query->aggregation_period) {
+        send_ctx_counter_updates(query);
+        query->ctx_period_start = now;
+    }
+}
+
+static void
+accumulate_sample_run(struct client_query *query,
+                      const uint8_t *reports, size_t stride, int n_reports)
+{
+    struct gputop_oa_accumulator *accumulator = query->accumulator;
+
+    while (n_reports > 1) {
+        int n = gputop_oa_accumulator_period_reports(accumulator,
+                                                     reports, stride,
+                                                     n_reports,
+                                                     query->aggregation_period);
+
+        gputop_oa_accumulate_report_batch(accumulator, reports, stride, n);
+
+        if (accumulator->last_timestamp - accumulator->first_timestamp >
+            query->aggregation_period)
+        {
+            send_counter_update(query, accumulator, NULL, UPDATE_REASON_PERIOD);
+            gputop_oa_accumulator_clear(accumulator);
+        }
+
+        /* The last report accumulated starts the next period */
+        reports += (n - 1) * stride;
+        n_reports -= n - 1;
+    }
+}
+
+/* Instead of forwarding raw OA reports, accumulate them here and send the
+ * client compact CounterUpdate messages for each aggregation period */
+static void
+accumulate_i915_perf_stream_samples(struct client_query *query)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    struct gputop_oa_accumulator *accumulator = query->accumulator;
+    const uint8_t *last = NULL;
+    const uint8_t *data;
+    const uint8_t *end;
+
+    gputop_i915_perf_stream_drain(stream);
+
+    if (query->have_continuation_report)
+        last = query->continuation_report;
+
+    /* NB: the ring is mapped twice, back to back, so the pending data is
+     * always contiguous even if it straddles the wrap point */
+    data = ring->data + (query->oa_tail & (ring->size - 1));
+    end = data + (ring->head - query->oa_tail);
+
+    while (data < end) {
+        const struct i915_perf_record_header *header = (const void *)data;
+
+        switch (header->type) {
+        case DRM_I915_PERF_RECORD_OA_BUFFER_LOST:
+            dbg("i915_oa: OA buffer error - all records lost\n");
+            last = NULL;
+            break;
+        case DRM_I915_PERF_RECORD_OA_REPORT_LOST:
+            dbg("i915_oa: OA report lost\n");
+            last = NULL;
+            break;
+
+        case DRM_I915_PERF_RECORD_SAMPLE: {
+            const uint8_t *report = (const uint8_t *)(header + 1);
+            enum update_reason reason = 0;
+
+            if (last && query->ctx_demux)
+                accumulate_ctx_demux(query, last, report);
+            else if (last &&
+                     gputop_oa_accumulate_reports(accumulator, last, report,
+                                                  stream->per_ctx_mode))
+            {
+                uint64_t elapsed = (accumulator->last_timestamp -
+                                    accumulator->first_timestamp);
+
+                if (elapsed > query->aggregation_period)
+                    reason = UPDATE_REASON_PERIOD;
+                if (accumulator->flags & GPUTOP_ACCUMULATOR_CTX_SW_TO_SEEN)
+                    reason = UPDATE_REASON_CTX_SWITCH_TO;
+                if (accumulator->flags & GPUTOP_ACCUMULATOR_CTX_SW_FROM_SEEN)
+                    reason = UPDATE_REASON_CTX_SWITCH_AWAY;
+
+                if (reason) {
+                    send_counter_update(query, accumulator, NULL, reason);
+                    gputop_oa_accumulator_clear(accumulator);
+                }
+            }
+
+            last = report;
+
+            /* Without any per-context filtering, the run of samples that
+             * follows can be accumulated in batches, split wherever an
+             * aggregation period ends */
+            if (!query->ctx_demux && !stream->per_ctx_mode) {
+                int n = gputop_i915_perf_count_sample_run(data, end);
+
+                accumulate_sample_run(query, report, header->size, n);
+                last = report + (n - 1) * header->size;
+                data += (n - 1) * header->size;
+            }
+            break;
+        }
+
+        default:
+            dbg("i915 perf: Spurious header type = %d\n", header->type);
+            break;
+        }
+
+        data += header->size;
+    }
+
+    if (last && last != query->continuation_report) {
+        memcpy(query->continuation_report, last,
+               stream->metric_set->perf_raw_size);
     }
+    query->have_continuation_report = last != NULL;
+
+    query->oa_tail = ring->head;
+    update_shared_oa_stream_tail(query->oa);
+}
+
+/* Sends @n samples from the stream's buffer, starting at @pos, as a
+ * CpuStatsSet message each */
+static void
+send_cpu_stats_sets(struct client_query *query, int pos, int n)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    int n_cpus = gputop_cpu_count();
 
     for (int i = 0; i < n; i++) {
         Gputop__Message message = GPUTOP__MESSAGE__INIT;
@@ -493,7 +1230,7 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
 
         message.cpu_stats = &set;
 
-        set.id = stream->user.id;
+        set.id = query->id;
         set.n_cpus = n_cpus;
         set.cpus = stats_vec;
 
@@ -513,26 +1250,208 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
             stats[i].guest_nice = stat[i].guest_nice;
         }
 
-        send_pb_message(h2o_conn, &message.base);
+        client_send_pb_message(query->client, &message.base);
+
+        pos += n_cpus;
+        if (pos >= stream->cpu.stats_buf_len)
+            pos = 0;
+    }
+}
+
+/* Sends @n samples from the stream's buffer, starting at @pos, as a
+ * single CpuStatsBlock of deltas from the previous samples */
+static void
+send_cpu_stats_block(struct client_query *query, int pos, int n)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    struct cpu_stat *last = query->cpu_stats_last;
+    int n_cpus = gputop_cpu_count();
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__CpuStatsBlock block = GPUTOP__CPU_STATS_BLOCK__INIT;
+    uint64_t *timestamp_deltas;
+    int32_t *values;
+    int n_values;
+
+    /* The very first sample is only a baseline for the next... */
+    if (!query->have_cpu_stats_last) {
+        memcpy(last, stream->cpu.stats_buf + pos, sizeof(*last) * n_cpus);
+        query->have_cpu_stats_last = true;
+
+        pos += n_cpus;
+        if (pos >= stream->cpu.stats_buf_len)
+            pos = 0;
+        n--;
+    }
+
+    if (n == 0)
+        return;
+
+    n_values = n_cpus * n;
+    timestamp_deltas = gputop_arena_alloc(&scratch_arena, sizeof(uint64_t) * n);
+    values = gputop_arena_alloc(&scratch_arena, sizeof(int32_t) * n_values * 10);
+
+    block.id = query->id;
+    block.n_cpus = n_cpus;
+    block.n_samples = n;
+    block.start_timestamp = last[0].timestamp;
+
+    block.n_timestamp_deltas = n;
+    block.timestamp_deltas = timestamp_deltas;
+
+    block.n_user = n_values;
+    block.user = values;
+    block.n_nice = n_values;
+    block.nice = block.user + n_values;
+    block.n_system = n_values;
+    block.system = block.nice + n_values;
+    block.n_idle = n_values;
+    block.idle = block.system + n_values;
+    block.n_iowait = n_values;
+    block.iowait = block.idle + n_values;
+    block.n_irq = n_values;
+    block.irq = block.iowait + n_values;
+    block.n_softirq = n_values;
+    block.softirq = block.irq + n_values;
+    block.n_steal = n_values;
+    block.steal = block.softirq + n_values;
+    block.n_guest = n_values;
+    block.guest = block.steal + n_values;
+    block.n_guest_nice = n_values;
+    block.guest_nice = block.guest + n_values;
+
+    for (int i = 0; i < n; i++) {
+        struct cpu_stat *stat = stream->cpu.stats_buf + pos;
+
+        timestamp_deltas[i] = stat[0].timestamp - last[0].timestamp;
+
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            int j = cpu * n + i;
+
+            block.user[j] = stat[cpu].user - last[cpu].user;
+            block.nice[j] = stat[cpu].nice - last[cpu].nice;
+            block.system[j] = stat[cpu].system - last[cpu].system;
+            block.idle[j] = stat[cpu].idle - last[cpu].idle;
+            block.iowait[j] = stat[cpu].iowait - last[cpu].iowait;
+            block.irq[j] = stat[cpu].irq - last[cpu].irq;
+            block.softirq[j] = stat[cpu].softirq - last[cpu].softirq;
+            block.steal[j] = stat[cpu].steal - last[cpu].steal;
+            block.guest[j] = stat[cpu].guest - last[cpu].guest;
+            block.guest_nice[j] = stat[cpu].guest_nice - last[cpu].guest_nice;
+
+            last[cpu] = stat[cpu];
+        }
 
         pos += n_cpus;
         if (pos >= stream->cpu.stats_buf_len)
             pos = 0;
     }
 
+    message.cmd_case = GPUTOP__MESSAGE__CMD_CPU_STATS_BLOCK;
+    message.cpu_stats_block = &block;
+
+    client_send_pb_message(query->client, &message.base);
+}
+
+static void
+flush_cpu_stats(struct client_query *query)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    int n_cpus = gputop_cpu_count();
+    int n;
+    int pos;
+
+    if (stream->cpu.stats_buf_pos == 0 && !stream->cpu.stats_buf_full)
+        return;
+
+    if (stream->cpu.stats_buf_full) {
+        n = stream->cpu.stats_buf_len / n_cpus;
+        pos = stream->cpu.stats_buf_pos;
+        /* Non-overwrite streams stop sampling at the end of the buffer */
+        if (pos >= stream->cpu.stats_buf_len)
+            pos = 0;
+    } else {
+        n = stream->cpu.stats_buf_pos / n_cpus;
+        pos = 0;
+    }
+
+    if (query->cpu_stats_last)
+        send_cpu_stats_block(query, pos, n);
+    else
+        send_cpu_stats_sets(query, pos, n);
+
     stream->cpu.stats_buf_pos = 0;
     stream->cpu.stats_buf_full = false;
 }
 
+/* For a session the raw samples are copied into its backlog, and sent on
+ * from there if attached, so they can be replayed if the connection is
+ * lost (and the stream's buffer doesn't fill up while no client is around
+ * to forward them to)... */
+static void
+backlog_perf_stream_samples(struct client_query *query)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    struct client *client = query->client;
+    const uint64_t mask = stream->perf.buffer_size - 1;
+    uint64_t head = read_perf_head(stream->perf.mmap_page);
+    uint64_t tail = stream->perf.mmap_page->data_tail;
+    uint64_t len = head - tail;
+    uint64_t before;
+    struct session_msg *msg;
+    uint8_t *data;
+
+    msg = session_backlog_append(client, WS_MESSAGE_PERF, query->id, len);
+    data = msg->data + 8;
+
+    before = MIN(len, stream->perf.buffer_size - (tail & mask));
+    memcpy(data, stream->perf.buffer + (tail & mask), before);
+    memcpy(data + before, stream->perf.buffer, len - before);
+
+    write_perf_tail(stream->perf.mmap_page, head);
+
+    if (client->conn)
+        session_send_msg(client, msg, query);
+}
+
+static void
+backlog_i915_perf_stream_samples(struct client_query *query)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    struct gputop_perf_ring *ring = &stream->oa.ring;
+    struct client *client = query->client;
+    struct session_msg *msg;
+    uint64_t len;
+
+    gputop_i915_perf_stream_drain(stream);
+
+    len = ring->head - query->oa_tail;
+    if (len == 0)
+        return;
+
+    msg = session_backlog_append(client, WS_MESSAGE_I915_PERF, query->id, len);
+
+    /* NB: the ring is mapped twice, back to back, so the pending data is
+     * always contiguous even if it straddles the wrap point */
+    memcpy(msg->data + 8, ring->data + (query->oa_tail & (ring->size - 1)), len);
+    query->oa_tail = ring->head;
+    update_shared_oa_stream_tail(query->oa);
+
+    if (client->conn)
+        session_send_msg(client, msg, query);
+}
+
 static void
-flush_stream_samples(struct gputop_perf_stream *stream)
+flush_query_samples(struct client_query *query)
 {
-    if (stream->user.flushing) {
+    struct gputop_perf_stream *stream = query->stream;
+    bool session = query->client->session_name != NULL;
+
+    if (query->flushing) {
         fprintf(stderr, "Throttling websocket forwarding\n");
         return;
     }
 
-    assert(!stream->pending_close);
+    assert(!query->pending_close);
     assert(!stream->closed);
 
     if (!gputop_stream_data_pending(stream))
@@ -540,13 +1459,21 @@ flush_stream_samples(struct gputop_perf_stream *stream)
 
     switch (stream->type) {
     case GPUTOP_STREAM_PERF:
-        flush_perf_stream_samples(stream);
+        if (session)
+            backlog_perf_stream_samples(query);
+        else
+            flush_perf_stream_samples(query);
         break;
     case GPUTOP_STREAM_I915_PERF:
-        flush_i915_perf_stream_samples(stream);
+        if (query->accumulator)
+            accumulate_i915_perf_stream_samples(query);
+        else if (session)
+            backlog_i915_perf_stream_samples(query);
+        else
+            flush_i915_perf_stream_samples(query);
         break;
     case GPUTOP_STREAM_CPU:
-        flush_cpu_stats(stream);
+        flush_cpu_stats(query);
         break;
     }
 }
@@ -554,84 +1481,211 @@ flush_stream_samples(struct gputop_perf_stream *stream)
 static void
 flush_streams(void)
 {
-    struct gputop_perf_stream *stream;
+    struct client *client;
+    struct client_query *query;
 
-    gputop_list_for_each(stream, &streams, user.link) {
-        flush_stream_samples(stream);
+    gputop_list_for_each(client, &clients, link) {
+        gputop_list_for_each(query, &client->queries, link)
+            flush_query_samples(query);
     }
 }
 
 static void
 forward_logs(void)
 {
-    Gputop__Log *log = gputop_get_pb_log();
+    Gputop__Log *log = gputop_get_pb_log(&scratch_allocator);
 
     if (log) {
         Gputop__Message msg = GPUTOP__MESSAGE__INIT;
+        struct client *client;
 
         fprintf(stderr, "forwarding log to UI\n");
 
         msg.cmd_case = GPUTOP__MESSAGE__CMD_LOG;
         msg.log = log;
 
-        send_pb_message(h2o_conn, &msg.base);
+        gputop_list_for_each(client, &clients, link)
+            client_send_pb_message(client, &msg.base);
 
-        gputop_pb_log_free(log);
+        gputop_pb_log_free(log, &scratch_allocator);
     }
+
+    scratch_reset();
 }
 
 static void
 periodic_forward_cb(uv_timer_t *timer)
 {
     flush_streams();
+    scratch_reset();
+}
 
+/* NB: the log ring has a fixed capacity so we drain it regularly,
+ * regardless of whether any queries are open */
+static void
+periodic_log_cb(uv_timer_t *timer)
+{
     forward_logs();
 }
 
+static void
+update_query_head_pointers(struct client_query *query)
+{
+    struct gputop_perf_stream *stream = query->stream;
+    struct gputop_perf_header_buf_stats *stats;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__StreamStats stream_stats = GPUTOP__STREAM_STATS__INIT;
+
+    if (stream->type != GPUTOP_STREAM_PERF)
+        return;
+
+    gputop_perf_update_header_offsets(stream);
+
+    stats = &stream->perf.header_buf.stats;
+
+    if (!stream->perf.header_buf.full) {
+        Gputop__BufferFillNotify notify = GPUTOP__BUFFER_FILL_NOTIFY__INIT;
+
+        notify.query_id = query->id;
+        notify.fill_percentage = stats->fill_percentage;
+        message.cmd_case = GPUTOP__MESSAGE__CMD_FILL_NOTIFY;
+        message.fill_notify = &notify;
+
+        client_send_pb_message(query->client, &message.base);
+    }
+
+    stream_stats.id = query->id;
+    stream_stats.n_records = stats->n_records;
+    stream_stats.n_trampled = stats->n_trampled;
+    stream_stats.n_overflows = stats->n_overflows;
+    stream_stats.fill_percentage = stats->fill_percentage;
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_STREAM_STATS;
+    message.stream_stats = &stream_stats;
+
+    client_send_pb_message(query->client, &message.base);
+}
+
 static void
 periodic_update_head_pointers(uv_timer_t *timer)
 {
-    struct gputop_perf_stream *stream;
+    struct client *client;
+    struct client_query *query;
+
+    gputop_list_for_each(client, &clients, link) {
+        gputop_list_for_each(query, &client->queries, link)
+            update_query_head_pointers(query);
+    }
+}
+
+static void
+unref_closed_stream_cb(struct gputop_perf_stream *stream)
+{
+    gputop_perf_stream_unref(stream);
+}
 
-    gputop_list_for_each(stream, &streams, user.link) {
-        struct gputop_perf_header_buf *hdr_buf;
+static struct shared_oa_stream *
+lookup_shared_oa_stream(struct gputop_metric_set *metric_set,
+                        int period_exponent,
+                        struct ctx_handle *ctx)
+{
+    struct shared_oa_stream *oa;
 
-        if (stream->type != GPUTOP_STREAM_PERF)
-            continue;
+    gputop_list_for_each(oa, &oa_streams, link) {
+        if (oa->stream->metric_set == metric_set &&
+            oa->period_exponent == period_exponent &&
+            oa->ctx == ctx)
+            return oa;
+    }
 
-        hdr_buf = &stream->perf.header_buf;
+    return NULL;
+}
 
-        gputop_perf_update_header_offsets(stream);
+static struct shared_oa_stream *
+open_shared_oa_stream(struct gputop_metric_set *metric_set,
+                      int period_exponent,
+                      struct ctx_handle *ctx,
+                      bool overwrite,
+                      char **error)
+{
+    const char *cpu = getenv("GPUTOP_OA_READER_CPU");
+    int reader_cpu = cpu ? atoi(cpu) : -1;
+    struct gputop_perf_stream *stream;
+    struct shared_oa_stream *oa;
 
-        if (!hdr_buf->full) {
-            Gputop__Message message = GPUTOP__MESSAGE__INIT;
-            Gputop__BufferFillNotify notify = GPUTOP__BUFFER_FILL_NOTIFY__INIT;
+    stream = gputop_open_i915_perf_oa_stream(metric_set,
+                                             period_exponent,
+                                             ctx,
+                                             i915_perf_stream_ready_cb,
+                                             overwrite,
+                                             error);
+    if (!stream)
+        return NULL;
+
+    if (!gputop_i915_perf_stream_enable_ring(stream, I915_PERF_RING_SIZE,
+                                             error))
+    {
+        gputop_perf_stream_close(stream, unref_closed_stream_cb);
+        return NULL;
+    }
 
-            notify.query_id = stream->user.id;
-            notify.fill_percentage =
-                (hdr_buf->offsets[(hdr_buf->head - 1) % hdr_buf->len] /
-                 (float)stream->perf.buffer_size) * 100.0f;
-            message.cmd_case = GPUTOP__MESSAGE__CMD_FILL_NOTIFY;
-            message.fill_notify = &notify;
+    /* NB: recording reads the stream from a thread regardless of
+     * GPUTOP_OA_READER_THREAD */
+    if (getenv("GPUTOP_RECORD") && !recording_started) {
+        const char *filename = getenv("GPUTOP_RECORD");
+        char *record_error = NULL;
+
+        /* A failure to record shouldn't stop the query from running */
+        if (gputop_i915_perf_stream_record(stream, filename,
+                                           period_exponent,
+                                           reader_cpu,
+                                           &record_error))
+        {
+            dbg("Recording OA metrics %s to %s\n", metric_set->name, filename);
+            recording_started = true;
+        } else {
+            dbg("%s", record_error);
+            free(record_error);
+        }
+    }
 
-            send_pb_message(h2o_conn, &message.base);
-            //dbg("XXX: %s > %d%% full\n", stream->query ? stream->query->name : "unknown", notify.fill_percentage);
+    if (!stream->oa.reader &&
+        (getenv("GPUTOP_OA_READER_THREAD") || getenv("GPUTOP_OA_READER_CPU")))
+    {
+        char *reader_error = NULL;
+
+        /* Falling back to reading from the mainloop is fine */
+        if (!gputop_i915_perf_stream_start_reader(stream, reader_cpu,
+                                                  &reader_error))
+        {
+            dbg("%s", reader_error);
+            free(reader_error);
         }
     }
 
-    forward_logs();
+    oa = xmalloc0(sizeof(*oa));
+    oa->stream = stream;
+    oa->period_exponent = period_exponent;
+    oa->ctx = ctx;
+    gputop_list_init(&oa->subscribers);
+    gputop_list_insert(oa_streams.prev, &oa->link);
+
+    stream->user.data = oa;
+
+    return oa;
 }
 
 static void
 handle_open_i915_perf_oa_query(h2o_websocket_conn_t *conn,
                                Gputop__Request *request)
 {
+    struct client *client = conn->data;
     Gputop__OpenQuery *open_query = request->open_query;
     uint32_t id = open_query->id;
     Gputop__OAQueryInfo *oa_query_info = open_query->oa_query;
     struct gputop_metric_set *metric_set = NULL;
-    struct gputop_hash_entry *entry = NULL;
-    struct gputop_perf_stream *stream;
+    struct shared_oa_stream *oa;
+    struct client_query *query;
     char *error = NULL;
     struct ctx_handle *ctx = NULL;
     Gputop__Message message = GPUTOP__MESSAGE__INIT;
@@ -644,10 +1698,8 @@ handle_open_i915_perf_oa_query(h2o_websocket_conn_t *conn,
     }
     dbg("handle_open_i915_perf_oa_query: id = %d\n", id);
 
-    entry = gputop_hash_table_search(metrics, oa_query_info->guid);
-    if (entry != NULL) {
-        metric_set = entry->data;
-    } else {
+    metric_set = gputop_perf_lookup_metric_set(oa_query_info->guid);
+    if (metric_set == NULL) {
         asprintf(&error, "Guid is not available\n");
         goto err;
     }
@@ -663,16 +1715,42 @@ handle_open_i915_perf_oa_query(h2o_websocket_conn_t *conn,
             goto err;
     }
 
-    stream = gputop_open_i915_perf_oa_stream(metric_set,
-                                             oa_query_info->period_exponent,
-                                             ctx,
-                                             NULL,
-                                             open_query->overwrite,
-                                             &error);
-    if (stream) {
-        stream->user.id = id;
-        gputop_list_init(&stream->user.link);
-        gputop_list_insert(streams.prev, &stream->user.link);
+    /* Piggy back on an existing stream with the same configuration if
+     * another query (maybe from another client) already opened one */
+    oa = lookup_shared_oa_stream(metric_set, oa_query_info->period_exponent,
+                                 ctx);
+    if (oa) {
+        dbg("Sharing existing OA stream for set=%s period=%d\n",
+            metric_set->name, oa_query_info->period_exponent);
+    } else {
+        oa = open_shared_oa_stream(metric_set,
+                                   oa_query_info->period_exponent,
+                                   ctx,
+                                   open_query->overwrite,
+                                   &error);
+    }
+
+    if (oa) {
+        query = client_query_new(client, id, oa->stream);
+        query->oa = oa;
+        query->oa_tail = oa->stream->oa.ring.head;
+        gputop_list_insert(oa->subscribers.prev, &query->oa_link);
+
+        if (oa_query_info->has_aggregation_period &&
+            oa_query_info->aggregation_period)
+        {
+            query->aggregation_period = oa_query_info->aggregation_period;
+            query->accumulator = xmalloc(sizeof(*query->accumulator));
+            gputop_oa_accumulator_init(query->accumulator, metric_set);
+            query->counter_values =
+                xmalloc(sizeof(double) * 2 * metric_set->n_counters);
+            query->continuation_report = xmalloc(metric_set->perf_raw_size);
+
+            if (oa_query_info->demux_contexts) {
+                query->ctx_demux = xmalloc(sizeof(*query->ctx_demux));
+                gputop_oa_ctx_demux_init(query->ctx_demux, metric_set);
+            }
+        }
 
         if (open_query->live_updates)
             uv_timer_start(&timer, periodic_forward_cb, 200, 200);
@@ -703,6 +1781,7 @@ static void
 handle_open_trace_query(h2o_websocket_conn_t *conn,
                         Gputop__Request *request)
 {
+    struct client *client = conn->data;
     Gputop__OpenQuery *open_query = request->open_query;
     uint32_t id = open_query->id;
     Gputop__TraceInfo *trace_info = open_query->trace;
@@ -738,9 +1817,7 @@ handle_open_trace_query(h2o_websocket_conn_t *conn,
                                     open_query->overwrite,
                                     &error);
     if (stream) {
-        stream->user.id = id;
-        gputop_list_init(&stream->user.link);
-        gputop_list_insert(streams.prev, &stream->user.link);
+        client_query_new(client, id, stream);
 
         if (open_query->live_updates)
             uv_timer_start(&timer, periodic_forward_cb, 200, 200);
@@ -762,6 +1839,7 @@ static void
 handle_open_generic_query(h2o_websocket_conn_t *conn,
                           Gputop__Request *request)
 {
+    struct client *client = conn->data;
     Gputop__OpenQuery *open_query = request->open_query;
     uint32_t id = open_query->id;
     Gputop__GenericEventInfo *generic_info = open_query->generic;
@@ -794,9 +1872,7 @@ handle_open_generic_query(h2o_websocket_conn_t *conn,
                                               open_query->overwrite,
                                               &error);
     if (stream) {
-        stream->user.id = id;
-        gputop_list_init(&stream->user.link);
-        gputop_list_insert(streams.prev, &stream->user.link);
+        client_query_new(client, id, stream);
 
         if (open_query->live_updates)
             uv_timer_start(&timer, periodic_forward_cb, 200, 200);
@@ -817,6 +1893,7 @@ static void
 handle_open_cpu_stats(h2o_websocket_conn_t *conn,
                       Gputop__Request *request)
 {
+    struct client *client = conn->data;
     Gputop__OpenQuery *open_query = request->open_query;
     uint32_t id = open_query->id;
     Gputop__CpuStatsInfo *stats_info = open_query->cpu_stats;
@@ -834,9 +1911,12 @@ handle_open_cpu_stats(h2o_websocket_conn_t *conn,
     stream = gputop_perf_open_cpu_stats(open_query->overwrite,
                                         stats_info->sample_period_ms);
     if (stream) {
-        stream->user.id = id;
-        gputop_list_init(&stream->user.link);
-        gputop_list_insert(streams.prev, &stream->user.link);
+        struct client_query *query = client_query_new(client, id, stream);
+
+        if (stats_info->packed) {
+            query->cpu_stats_last = xmalloc(sizeof(struct cpu_stat) *
+                                            gputop_cpu_count());
+        }
 
         if (open_query->live_updates)
             uv_timer_start(&timer, periodic_forward_cb, 200, 200);
@@ -879,30 +1959,29 @@ handle_open_query(h2o_websocket_conn_t *conn, Gputop__Request *request)
 }
 
 static void
-close_stream(struct gputop_perf_stream *stream)
+close_query(struct client_query *query)
 {
-    /* By moving the stream into the closing_streams list we ensure we
-     * won't forward anymore for the stream in case we can't close the
-     * stream immediately.
+    /* By removing the query from the client's list we ensure we won't
+     * forward anymore for the query in case we can't close it
+     * immediately.
      */
-    gputop_list_remove(&stream->user.link);
-    gputop_list_insert(closing_streams.prev, &stream->user.link);
-    stream->pending_close = true;
+    gputop_list_remove(&query->link);
+    query->pending_close = true;
 
-    /* NB: we can't synchronously close the perf event if we're in the
+    /* NB: we can't synchronously close the query if we're in the
      * middle of writing samples to the websocket...
      */
-    if (!stream->user.flushing)
-        gputop_perf_stream_close(stream, stream_closed_cb);
+    if (!query->flushing)
+        finish_query_close(query);
 }
 
 static void
-close_all_streams(void)
+close_client_queries(struct client *client)
 {
-    struct gputop_perf_stream *stream, *tmp;
+    struct client_query *query, *tmp;
 
-    gputop_list_for_each_safe(stream, tmp, &streams, user.link) {
-        close_stream(stream);
+    gputop_list_for_each_safe(query, tmp, &client->queries, link) {
+        close_query(query);
     }
 }
 
@@ -910,20 +1989,123 @@ static void
 handle_close_query(h2o_websocket_conn_t *conn,
                    Gputop__Request *request)
 {
-    struct gputop_perf_stream *stream;
+    struct client *client = conn->data;
+    struct client_query *query;
     uint32_t id = request->close_query;
 
     dbg("handle_close_query: id=%d, request_uuid=%s\n", id, request->uuid);
 
-    gputop_list_for_each(stream, &streams, user.link) {
-        if (stream->user.id == id) {
-            assert(stream->user.data == NULL);
+    gputop_list_for_each(query, &client->queries, link) {
+        if (query->id == id) {
+            assert(query->close_uuid == NULL);
+
+            query->close_uuid = strdup(request->uuid);
+            close_query(query);
+            return;
+        }
+    }
+}
+
+static struct client *
+lookup_session(const char *name)
+{
+    struct client *client;
+
+    gputop_list_for_each(client, &clients, link) {
+        if (client->session_name && strcmp(client->session_name, name) == 0)
+            return client;
+    }
+
+    return NULL;
+}
+
+static void
+handle_attach_session(h2o_websocket_conn_t *conn,
+                      Gputop__Request *request)
+{
+    struct client *client = conn->data;
+    Gputop__AttachSession *attach = request->attach_session;
+    struct client *session = lookup_session(attach->name);
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__SessionInfo info = GPUTOP__SESSION_INFO__INIT;
+    struct session_msg *msg;
+
+    dbg("handle_attach_session: name=%s, cursor=%"PRIu64"\n",
+        attach->name, attach->cursor);
+
+    message.reply_uuid = request->uuid;
+
+    if (client->session_name) {
+        message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+        message.error = "Already attached to a session\n";
+        send_pb_message(conn, &message.base);
+        return;
+    }
+
+    if (session) {
+        if (session->conn) {
+            message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+            message.error = "Session is already attached to another connection\n";
+            send_pb_message(conn, &message.base);
+            return;
+        }
 
-            stream->user.data = strdup(request->uuid);
-            close_stream(stream);
+        if (!gputop_list_empty(&client->queries)) {
+            message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+            message.error = "Can't attach to a session with queries already open\n";
+            send_pb_message(conn, &message.base);
             return;
         }
+
+        /* Hand the connection over to the session... */
+        gputop_list_remove(&client->link);
+        client->conn = NULL;
+        client_unref(client);
+
+        session->conn = conn;
+        conn->data = session;
+        client = session;
+    } else
+        client->session_name = strdup(attach->name);
+
+    if (attach->has_retention_bytes)
+        client->retention_bytes = attach->retention_bytes;
+    if (attach->has_retention_ms)
+        client->retention_ms = attach->retention_ms;
+
+    session_backlog_trim(client, 0);
+
+    /* Drop whatever the client already received before reconnecting */
+    session_backlog_ack(client, attach->cursor);
+
+    info.replay_seq = client->backlog_seq;
+    gputop_list_for_each(msg, &client->backlog, link) {
+        info.replay_seq = msg->seq;
+        break;
     }
+    info.name = client->session_name;
+    info.n_replay = client->backlog_seq - info.replay_seq;
+    if (attach->cursor < info.replay_seq)
+        info.n_lost = info.replay_seq - attach->cursor;
+
+    /* NB: the reply itself isn't numbered; every session message sent
+     * after it is, starting from replay_seq */
+    message.cmd_case = GPUTOP__MESSAGE__CMD_SESSION_INFO;
+    message.session_info = &info;
+    queue_pb_message(conn, &message.base);
+
+    gputop_list_for_each(msg, &client->backlog, link)
+        session_send_msg(client, msg, NULL);
+}
+
+static void
+handle_session_ack(h2o_websocket_conn_t *conn,
+                   Gputop__Request *request)
+{
+    struct client *client = conn->data;
+
+    if (client->session_name)
+        session_backlog_ack(client, request->session_ack);
 }
 
 bool
@@ -1129,17 +2311,35 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
     //dbg("on_ws_message\n");
 
     if (arg == NULL) {
+        struct client *client = conn->data;
+
         //dbg("socket closed\n");
-        h2o_conn = NULL;
-        close_all_streams();
+        client->conn = NULL;
+
+        /* A session keeps its queries open, buffering their data until
+         * another connection attaches to it... */
+        if (client->session_name && !gputop_list_empty(&client->queries)) {
+            dbg("session %s detached\n", client->session_name);
+            h2o_websocket_close(conn);
+            return;
+        }
+
+        gputop_list_remove(&client->link);
+
+        /* NB: this finishes any messages still queued for the client
+         * (see on_*_flush_done()) so none of its queries will still be
+         * flushing when we close them... */
         h2o_websocket_close(conn);
+
+        close_client_queries(client);
+        client_unref(client);
         return;
     }
 
     if (!wslay_is_ctrl_frame(arg->opcode)) {
         Gputop__Request *request =
             (void *)protobuf_c_message_unpack(&gputop__request__descriptor,
-                                              NULL, /* default allocator */
+                                              &scratch_allocator,
                                               arg->msg_length,
                                               arg->msg);
 
@@ -1170,6 +2370,13 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
             fprintf(stderr, "CloseQuery request received\n");
             handle_close_query(conn, request);
             break;
+        case GPUTOP__REQUEST__REQ_ATTACH_SESSION:
+            fprintf(stderr, "AttachSession request received\n");
+            handle_attach_session(conn, request);
+            break;
+        case GPUTOP__REQUEST__REQ_SESSION_ACK:
+            handle_session_ack(conn, request);
+            break;
         case GPUTOP__REQUEST__REQ_TEST_LOG:
             fprintf(stderr, "TEST LOG: %s\n", request->test_log);
             break;
@@ -1177,14 +2384,30 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
             assert(0);
         }
 
-        free(request);
+        scratch_reset();
     }
 }
 
+static struct client *
+client_new(void)
+{
+    struct client *client = xmalloc0(sizeof(*client));
+
+    client->ref_count = 1; /* dropped on disconnect */
+    gputop_list_init(&client->queries);
+    gputop_list_init(&client->backlog);
+    client->retention_bytes = SESSION_RETENTION_BYTES;
+    client->retention_ms = SESSION_RETENTION_MS;
+    gputop_list_insert(clients.prev, &client->link);
+
+    return client;
+}
+
 static int on_req(h2o_handler_t *self, h2o_req_t *req)
 {
     const char *client_key;
     ssize_t proto_header_index;
+    struct client *client;
 
     //dbg("on_req\n");
 
@@ -1204,7 +2427,9 @@ static int on_req(h2o_handler_t *self, h2o_req_t *req)
                               0, "binary", strlen("binary"));
     }
 
-    h2o_conn = h2o_upgrade_to_websocket(req, client_key, NULL, on_ws_message);
+    client = client_new();
+    client->conn = h2o_upgrade_to_websocket(req, client_key, client,
+                                            on_ws_message);
 
     return 0;
 }
@@ -1250,13 +2475,16 @@ bool gputop_server_run(void)
     char *port_env;
     unsigned long port;
 
-    gputop_list_init(&streams);
-    gputop_list_init(&closing_streams);
+    gputop_list_init(&clients);
+    gputop_list_init(&oa_streams);
 
     loop = gputop_mainloop;
 
     uv_timer_init(gputop_mainloop, &timer);
 
+    uv_timer_init(gputop_mainloop, &log_timer);
+    uv_timer_start(&log_timer, periodic_log_cb, 200, 200);
+
     if ((r = uv_tcp_init(loop, &listener)) != 0) {
         dbg("uv_tcp_init:%s\n", uv_strerror(r));
         goto error;
@@ -52,6 +52,8 @@ function GputopUI () {
     this.graph_array = [];
     this.zoom = 10; //seconds
 
+    this.graph_renderer = new CounterGraphRenderer();
+
     this.series = [{
         lines: {
             fill: true
@@ -90,6 +92,273 @@ function create_default_markings(xaxis) {
     return markings;
 }
 
+/* The points plotted for a counter's live graph, as a fixed capacity
+ * FIFO of [x, y] vertices in typed arrays, in timestamp order. New
+ * updates are appended incrementally and old ones are dropped once
+ * they scroll out of the range we keep (or once the FIFO is full) */
+function GraphVertexRing(capacity) {
+    var size = 1;
+    while (size < capacity)
+        size *= 2;
+
+    this.capacity = size;
+    this.mask_ = size - 1;
+    this.x = new Float64Array(size);
+    this.y = new Float64Array(size);
+    this.head_ = 0; /* index of the oldest vertex */
+    this.length = 0;
+}
+
+GraphVertexRing.prototype.at = function(i) {
+    return (this.head_ + i) & this.mask_;
+}
+
+GraphVertexRing.prototype.push = function(x, y) {
+    if (this.length === this.capacity) {
+        this.head_ = (this.head_ + 1) & this.mask_;
+        this.length--;
+    }
+
+    var k = (this.head_ + this.length) & this.mask_;
+    this.x[k] = x;
+    this.y[k] = y;
+    this.length++;
+}
+
+GraphVertexRing.prototype.drop_before = function(x) {
+    while (this.length > 0 && this.x[this.head_] < x) {
+        this.head_ = (this.head_ + 1) & this.mask_;
+        this.length--;
+    }
+}
+
+/* Returns the index of the first vertex with an x >= the given x */
+GraphVertexRing.prototype.lower_bound = function(x) {
+    var lo = 0;
+    var hi = this.length;
+
+    while (lo < hi) {
+        var mid = (lo + hi) >> 1;
+        if (this.x[this.at(mid)] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+GraphVertexRing.prototype.clear = function() {
+    this.head_ = 0;
+    this.length = 0;
+}
+
+/* Draws the live counter graphs onto a canvas per graph container.
+ *
+ * Unlike re-plotting each graph with flot, nothing is rebuilt per frame:
+ * each counter keeps a GraphVertexRing that's only appended to and the
+ * visible range is found with a binary search, then decimated to at most
+ * a min/max pair per pixel column, so the cost of a redraw depends on
+ * the size of the graphs rather than how much history we have.
+ */
+function CounterGraphRenderer() {
+    this.padding_left = 40;
+    this.padding_top = 8;
+    this.padding_bottom = 8;
+
+    this.fill_style = "rgba(102, 102, 255, 0.4)";
+    this.line_style = "#6666ff";
+    this.marking_style = "rgba(232, 232, 255, 0.4)";
+    this.border_style = "#545454";
+    this.font = "10px sans-serif";
+
+    /* Enough for 20 seconds of updates at ~1 update per pixel for a
+     * 1000 pixel wide graph showing 1 second */
+    this.vertex_capacity = 32768;
+}
+
+CounterGraphRenderer.prototype.vertices_for_counter = function(counter) {
+    if (counter.graph_vertices_ === undefined)
+        counter.graph_vertices_ = new GraphVertexRing(this.vertex_capacity);
+    return counter.graph_vertices_;
+}
+
+/* Drops any points we've kept for a counter, e.g. after its graph is
+ * hidden or the graphs are cleared */
+CounterGraphRenderer.prototype.clear_counter = function(counter) {
+    if (counter.graph_vertices_ !== undefined)
+        counter.graph_vertices_.clear();
+}
+
+/* Appends the mid points of the pending updates for a counter */
+CounterGraphRenderer.prototype.append_updates = function(counter, updates, n) {
+    var vertices = this.vertices_for_counter(counter);
+
+    for (var j = 0; j < n; j++) {
+        var k = updates.at(j);
+        var start = updates.start[k];
+        var end = updates.end[k];
+
+        vertices.push(start + (end - start) / 2, updates.value[k]);
+    }
+}
+
+/* Returns a canvas filling the given container, (re)creating it if
+ * something else (such as flot while paused) has taken over the
+ * container, and keeping its backing store matched to its size */
+CounterGraphRenderer.prototype.canvas_for_container = function(container) {
+    var canvas = container.graph_canvas_;
+
+    if (canvas === undefined || canvas.parentNode !== container) {
+        $(container).empty();
+
+        canvas = document.createElement('canvas');
+        canvas.style.width = "100%";
+        canvas.style.height = "100%";
+        container.appendChild(canvas);
+        container.graph_canvas_ = canvas;
+    }
+
+    var ratio = window.devicePixelRatio || 1;
+    var width = Math.round(container.clientWidth * ratio);
+    var height = Math.round(container.clientHeight * ratio);
+    if (canvas.width !== width || canvas.height !== height) {
+        canvas.width = width;
+        canvas.height = height;
+    }
+
+    return canvas;
+}
+
+/* Draws all the given graphs in one pass, where each graph is an object
+ * with a container element, a counter and the x_min/x_max range to show */
+CounterGraphRenderer.prototype.draw = function(graphs) {
+    var ratio = window.devicePixelRatio || 1;
+
+    for (var i = 0; i < graphs.length; i++) {
+        var graph = graphs[i];
+        var canvas = this.canvas_for_container(graph.container);
+        var ctx = canvas.getContext('2d');
+
+        ctx.setTransform(ratio, 0, 0, ratio, 0, 0);
+        this.draw_graph(ctx, canvas.width / ratio, canvas.height / ratio,
+                        graph.counter, graph.x_min, graph.x_max);
+    }
+}
+
+CounterGraphRenderer.prototype.draw_graph = function(ctx, width, height,
+                                                     counter, x_min, x_max) {
+    var left = this.padding_left;
+    var top = this.padding_top;
+    var plot_width = width - left - 1;
+    var plot_height = height - top - this.padding_bottom;
+    var bottom = top + plot_height;
+
+    ctx.clearRect(0, 0, width, height);
+
+    if (plot_width <= 0 || plot_height <= 0 || x_max <= x_min)
+        return;
+
+    var x_scale = plot_width / (x_max - x_min);
+    var y_max = counter.inferred_max > 0 ? 1.10 * counter.inferred_max : 110;
+    var y_scale = plot_height / y_max;
+
+    /* Background, with stripes every 10th of the range that scroll with
+     * the data */
+    var gradient = ctx.createLinearGradient(0, top, 0, bottom);
+    gradient.addColorStop(0, "#fff");
+    gradient.addColorStop(1, "#e4f4f4");
+    ctx.fillStyle = gradient;
+    ctx.fillRect(left, top, plot_width, plot_height);
+
+    var tick = (x_max - x_min) / 10;
+    ctx.fillStyle = this.marking_style;
+    for (var x = Math.floor(x_min / (tick * 2)) * tick * 2; x < x_max; x += tick * 2) {
+        var from = Math.max(left, left + (x - x_min) * x_scale);
+        var to = Math.min(left + plot_width, left + (x + tick - x_min) * x_scale);
+        if (to > from)
+            ctx.fillRect(from, top, to - from, plot_height);
+    }
+
+    ctx.save();
+    ctx.beginPath();
+    ctx.rect(left, top, plot_width, plot_height);
+    ctx.clip();
+
+    var vertices = counter.graph_vertices_;
+    if (vertices !== undefined && vertices.length > 0) {
+        var vx = vertices.x;
+        var vy = vertices.y;
+
+        /* Include one point either side of the visible range so the line
+         * reaches the edges */
+        var first = Math.max(vertices.lower_bound(x_min) - 1, 0);
+        var end = Math.min(vertices.lower_bound(x_max) + 1, vertices.length);
+
+        if (end > first) {
+            var column = -1;
+            var column_min = 0;
+            var column_max = 0;
+            var first_px = 0;
+            var last_px = 0;
+
+            ctx.beginPath();
+            for (var j = first; j < end; j++) {
+                var k = vertices.at(j);
+                var px = Math.round(left + (vx[k] - x_min) * x_scale);
+                var py = bottom - vy[k] * y_scale;
+
+                if (px === column) {
+                    column_min = Math.min(column_min, py);
+                    column_max = Math.max(column_max, py);
+                    continue;
+                }
+
+                if (column === -1) {
+                    ctx.moveTo(px, py);
+                    first_px = px;
+                } else {
+                    if (column_min !== column_max) {
+                        ctx.lineTo(column, column_min);
+                        ctx.lineTo(column, column_max);
+                    }
+                    ctx.lineTo(px, py);
+                }
+                column = px;
+                column_min = column_max = py;
+                last_px = px;
+            }
+            if (column_min !== column_max) {
+                ctx.lineTo(column, column_min);
+                ctx.lineTo(column, column_max);
+            }
+
+            ctx.lineWidth = 1.5;
+            ctx.strokeStyle = this.line_style;
+            ctx.stroke();
+
+            ctx.lineTo(last_px, bottom);
+            ctx.lineTo(first_px, bottom);
+            ctx.closePath();
+            ctx.fillStyle = this.fill_style;
+            ctx.fill();
+        }
+    }
+
+    ctx.restore();
+
+    ctx.lineWidth = 1;
+    ctx.strokeStyle = this.border_style;
+    ctx.strokeRect(left + 0.5, top + 0.5, plot_width - 1, plot_height - 1);
+
+    ctx.fillStyle = this.border_style;
+    ctx.font = this.font;
+    ctx.textAlign = "right";
+    ctx.textBaseline = "top";
+    ctx.fillText(y_max.toPrecision(3), left - 4, top);
+    ctx.textBaseline = "bottom";
+    ctx.fillText("0", left - 4, bottom);
+}
+
 /* returns true if the exponent changed and therefore the metric
  * stream needs to be re-opened, else false.
  */
@@ -148,14 +417,15 @@ GputopUI.prototype.clear_graphs = function() {
     var metric = this.lookup_metric_for_guid(global_guid);
 
     // reset the accumulator clock and continuation report
-    webc._gputop_webc_reset_accumulator(metric.webc_stream_ptr_);
+    this.post_webc_decoder({ cmd: 'stream_reset', id: metric.webc_stream_id_ });
 
     // go through the list of opened graphs
     for (var i = 0; i < this.graph_array.length; ++i) {
         var container = "#" + this.graph_array[i];
         var counter = $(container).data("counter");
         counter.graph_data = [];
-        counter.updates = [];
+        counter.updates.clear();
+        this.graph_renderer.clear_counter(counter);
         this.start_timestamp = 0;
     }
 }
@@ -167,13 +437,14 @@ GputopUI.prototype.update_graphs_paused = function (timestamp) {
         var container = "#" + this.graph_array[i];
         var counter = $(container).data("counter");
 
-        var length = counter.updates.length;
+        var updates = counter.updates;
+        var length = updates.length;
         var x_min = 0;
         var x_max = 1;
 
         if (length > 0) {
-                this.start_gpu_timestamp = counter.updates[0][0]; // end_timestamp
-                this.end_gpu_timestamp = counter.updates[length - 1][0]; // end_timestamp
+                this.start_gpu_timestamp = updates.start[updates.at(0)];
+                this.end_gpu_timestamp = updates.start[updates.at(length - 1)];
         }
         if (length > 0 || this.previous_zoom != this.zoom) {
             this.previous_zoom = this.zoom;
@@ -185,10 +456,10 @@ GputopUI.prototype.update_graphs_paused = function (timestamp) {
             var max_graph_data = x_max - 20000000000;
 
             for (var j = 0; j < length; j++) {
-                var start = counter.updates[j][0];
-                var end = counter.updates[j][1];
-                var val = counter.updates[j][2];
-                var max = counter.updates[j][3];
+                var k = updates.at(j);
+                var start = updates.start[k];
+                var end = updates.end[k];
+                var val = updates.value[k];
                 var mid = start + (end - start) / 2;
 
                 counter.graph_data.push([mid, val]);
@@ -207,8 +478,8 @@ GputopUI.prototype.update_graphs_paused = function (timestamp) {
             this.series[0].data = counter.graph_data;
             $.plot(container, this.series, counter.graph_options);
 
-            // remove all the samples from the updates array
-            counter.updates.splice(0, counter.updates.length);
+            // remove all the samples from the updates ring
+            updates.consume(length);
         }
     }
 }
@@ -221,18 +492,20 @@ GputopUI.prototype.update_oa_graphs = function(timestamp) {
     }
 
     var metric = this.lookup_metric_for_guid(global_guid);
+    var graphs = [];
 
     for (var i = 0; i < this.graph_array.length; ++i) {
-        var container = "#" + this.graph_array[i];
+        var container = document.getElementById(this.graph_array[i]);
         var counter = $(container).data("counter");
 
-        var length = counter.updates.length;
+        var updates = counter.updates;
+        var length = updates.length;
         var x_min = 0;
         var x_max = 1;
 
         if (!this.start_timestamp && length > 0) {
             this.start_timestamp = timestamp;
-            this.start_gpu_timestamp = counter.updates[length - 1][0]; // end_timestamp
+            this.start_gpu_timestamp = updates.start[updates.at(length - 1)];
         }
 
         var elapsed = (timestamp - this.start_timestamp) * 1000000; // elapsed time from the very begining
@@ -247,52 +520,26 @@ GputopUI.prototype.update_oa_graphs = function(timestamp) {
         // of the zoom value
         var max_graph_data = x_max - 20000000000;
 
-        // remove the old samples from the graph data
-        for (var j = 0; j < counter.graph_data.length &&
-            counter.graph_data[j][0] < max_graph_data; j++) {}
-        if (j > 0)
-            counter.graph_data = counter.graph_data.slice(j);
-
-        // remove old markings from the graph
-        for (var j = 0; j < counter.graph_markings.length &&
-             counter.graph_markings[j].xaxis.from < max_graph_data; j++) {}
-        if (j > 0)
-            counter.graph_markings = counter.graph_markings.slice(j);
-
-        var save_index = -1;
-        for (var j = 0; j < length; j++) {
-            var start = counter.updates[j][0];
-            var end = counter.updates[j][1];
-            var val = counter.updates[j][2];
-            var max = counter.updates[j][3];
-            var mid = start + (end - start) / 2;
-
-            counter.graph_data.push([mid, val]);
-            counter.graph_options.yaxis.max = 1.10 * counter.inferred_max; // add another 10% to the Y axis
-            save_index = j;
-        }
+        this.graph_renderer.append_updates(counter, updates, length);
+        this.graph_renderer.vertices_for_counter(counter).drop_before(max_graph_data);
 
         // resync the timestamps (the javascript timestamp with the counter timestamp)
-        if (elapsed > 5000000000 && save_index > -1)
+        if (elapsed > 5000000000 && length > 0)
         {
             this.start_timestamp = timestamp;
-            this.start_gpu_timestamp = counter.updates[save_index][0];
+            this.start_gpu_timestamp = updates.start[updates.at(length - 1)];
         }
 
-        // adjust the min and max (start and end of the graph)
-        counter.graph_options.xaxis.min = x_min + margin;
-        counter.graph_options.xaxis.max = x_max - margin;
-        counter.graph_options.xaxis.label = this.zoom + ' seconds';
-
-        var default_markings = create_default_markings(counter.graph_options.xaxis);
-        counter.graph_options.grid.markings = default_markings.concat(counter.graph_markings);
-
-        this.series[0].data = counter.graph_data;
-        $.plot(container, this.series, counter.graph_options);
+        graphs.push({ container: container,
+                      counter: counter,
+                      x_min: x_min + margin,
+                      x_max: x_max - margin });
 
-        // remove all the samples from the updates array
-        counter.updates.splice(0, counter.updates.length);
+        // remove all the samples from the updates ring
+        updates.consume(length);
     }
+
+    this.graph_renderer.draw(graphs);
 }
 
 
@@ -516,20 +763,24 @@ GputopUI.prototype.update_features = function(features) {
     this.cpu_stats_stream = this.open_cpu_stats({sample_period_ms: 300}, () => {
         console.log("CPU Stats stream open");
 
-        this.cpu_stats_stream.on('update', (ev) => {
-            var stats = ev.stats;
+        this.cpu_stats_stream.on('block', (ev) => {
+            var block = ev.block;
+            var n = block.n_samples;
+            var last_time;
 
             if (this.cpu_stats_last == undefined) {
-                this.cpu_stats_start = stats.cpus[0].get_timestamp().toNumber();
+                this.cpu_stats_start = block.start_timestamp;
                 this.cpu_stats_timestamp_updates = [];
-                this.cpu_stats = new Array(stats.cpus.length);
-                for (var i = 0; i < stats.cpus.length; i++) {
+                this.cpu_stats = new Array(block.n_cpus);
+                for (var i = 0; i < block.n_cpus; i++) {
                     this.cpu_stats[i] = [];
                 }
-            } else {
-                var last = this.cpu_stats_last;
-                var last_time = last.cpus[0].get_timestamp().toNumber();
-                var time = stats.cpus[0].get_timestamp().toNumber();
+                last_time = block.start_timestamp;
+            } else
+                last_time = this.cpu_stats_last;
+
+            for (var s = 0; s < n; s++) {
+                var time = block.timestamps[s];
                 var mid_time = last_time + ((time - last_time) / 2);
 
                 console.assert(time > last_time, "Time went backwards!");
@@ -537,30 +788,24 @@ GputopUI.prototype.update_features = function(features) {
                  * just maintain one array of timestamp updates... */
                 this.cpu_stats_timestamp_updates.push(mid_time);
 
-                for (var i = 0; i < stats.cpus.length; i++) {
-                    var core_last = last.cpus[i];
-                    var core = stats.cpus[i];
+                for (var i = 0; i < block.n_cpus; i++) {
+                    /* NB: the block values are already deltas */
+                    var j = i * n + s;
+                    var idle = block.idle[j];
 
-                    var user = core.user - core_last.user;
-                    var nice = core.nice - core_last.nice;
-                    var system = core.system - core_last.system;
-                    var idle = core.idle - core_last.idle;
-                    var iowait = core.iowait - core_last.iowait;
-                    var irq = core.irq - core_last.irq;
-                    var softirq = core.softirq - core_last.softirq;
-                    var steal = core.steal - core_last.steal;
-                    var guest = core.guest - core_last.guest;
-                    var guest_nice = core.guest_nice - core_last.guest_nice;
-
-                    var total = user + nice + system + idle + iowait + irq + softirq + steal + guest + guest_nice;
+                    var total = block.user[j] + block.nice[j] + block.system[j] +
+                        idle + block.iowait[j] + block.irq[j] + block.softirq[j] +
+                        block.steal[j] + block.guest[j] + block.guest_nice[j];
 
                     var busy_percentage = 100 - ((idle / total) * 100);
                     this.cpu_stats[i].push(busy_percentage);
 
                     //console.log("CPU" + i + ": ts = " + mid_time + " busy = " + busy_percentage);
                 }
+
+                last_time = time;
             }
-            this.cpu_stats_last = stats;
+            this.cpu_stats_last = last_time;
         });
     });
 }
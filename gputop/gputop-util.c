@@ -36,6 +36,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "gputop-util.h"
 
 bool
 gputop_get_bool_env(const char *var)
@@ -86,3 +87,69 @@ gputop_read_file(const char *filename, void *buf, int max)
 
     return true;
 }
+
+#define GPUTOP_ARENA_MIN_CHUNK_SIZE 4096
+
+/* Starts a new chunk with room for at least size bytes */
+struct gputop_arena_chunk *
+gputop_arena_grow(struct gputop_arena *arena, size_t size)
+{
+    struct gputop_arena_chunk *chunk;
+    size_t chunk_size = GPUTOP_ARENA_MIN_CHUNK_SIZE;
+
+    if (arena->chunks)
+        chunk_size = arena->chunks->size * 2;
+    chunk_size = MAX(chunk_size, size);
+
+    chunk = xmalloc(sizeof(*chunk) + chunk_size);
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+
+    arena->chunks = chunk;
+    arena->used = 0;
+
+    return chunk;
+}
+
+void
+gputop_arena_reset(struct gputop_arena *arena)
+{
+    struct gputop_arena_chunk *chunk = arena->chunks;
+
+    /* If we had to grow then replace all the chunks with one that would
+     * have fit everything... */
+    if (chunk && chunk->next) {
+        size_t size = 0;
+
+        while (chunk) {
+            struct gputop_arena_chunk *next = chunk->next;
+
+            size += chunk->size;
+            free(chunk);
+            chunk = next;
+        }
+
+        arena->chunks = NULL;
+        gputop_arena_grow(arena, size);
+    }
+
+    arena->used = 0;
+    arena->total = 0;
+}
+
+void
+gputop_arena_fini(struct gputop_arena *arena)
+{
+    struct gputop_arena_chunk *chunk = arena->chunks;
+
+    while (chunk) {
+        struct gputop_arena_chunk *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+    arena->used = 0;
+    arena->total = 0;
+}
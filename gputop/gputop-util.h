@@ -140,6 +140,58 @@ array_append(struct array *array, void *data)
 
 #define array_value_at(ARRAY, TYPE, IDX) *(((TYPE *)(ARRAY)->data) + IDX)
 
+/*
+ * A bump allocator for short lived allocations that are all freed
+ * together by gputop_arena_reset().
+ *
+ * The memory is kept for reuse after a reset (coalesced into a single
+ * chunk if the arena had to grow), so once an arena has grown to fit its
+ * peak usage it doesn't touch the heap again. A zeroed struct is a valid,
+ * empty arena.
+ */
+#define GPUTOP_ARENA_ALIGN 8
+
+struct gputop_arena_chunk
+{
+    struct gputop_arena_chunk *next;
+    size_t size;
+    uint8_t data[];
+};
+
+struct gputop_arena
+{
+    struct gputop_arena_chunk *chunks; /* current chunk first */
+    size_t used; /* of the current chunk */
+    size_t total; /* used across all chunks since the last reset */
+};
+
+struct gputop_arena_chunk *
+gputop_arena_grow(struct gputop_arena *arena, size_t size);
+
+void
+gputop_arena_reset(struct gputop_arena *arena);
+
+void
+gputop_arena_fini(struct gputop_arena *arena);
+
+static inline void *
+gputop_arena_alloc(struct gputop_arena *arena, size_t size)
+{
+    struct gputop_arena_chunk *chunk = arena->chunks;
+    void *ret;
+
+    size = (size + GPUTOP_ARENA_ALIGN - 1) & ~(size_t)(GPUTOP_ARENA_ALIGN - 1);
+
+    if (unlikely(!chunk || chunk->size - arena->used < size))
+        chunk = gputop_arena_grow(arena, size);
+
+    ret = chunk->data + arena->used;
+    arena->used += size;
+    arena->total += size;
+
+    return ret;
+}
+
 bool
 gputop_get_bool_env(const char *var);
 
@@ -39,6 +39,3 @@ void gputop_web_console_error(const char *format, ...);
 
 void _gputop_web_console_assert(bool condition, const char *message);
 void gputop_web_console_assert(bool condition, const char *format, ...);
-
-void gputop_web_index_metric_set(const char *guid, struct gputop_metric_set *metric_set);
-struct gputop_metric_set *gputop_web_lookup_metric_set(const char *guid);
@@ -26,13 +26,12 @@
 
 var LibraryGpuTopWeb = {
     $GPUTop: {
-        _guid_to_metric_set_map: {},
     },
 
     _gputop_web_console_log: function (message) {
         var gputop = Module['gputop_singleton'];
         if (gputop !== undefined)
-            gputop.log(message);
+            gputop.log(Pointer_stringify(message));
         else
             console.log(Pointer_stringify(message));
     },
@@ -40,7 +39,7 @@ var LibraryGpuTopWeb = {
     _gputop_web_console_warn: function (message) {
         var gputop = Module['gputop_singleton'];
         if (gputop !== undefined)
-            gputop.log(message, gputop.WARN);
+            gputop.log(Pointer_stringify(message), gputop.WARN);
         else
             console.warn(Pointer_stringify(message));
     },
@@ -48,7 +47,7 @@ var LibraryGpuTopWeb = {
     _gputop_web_console_error: function (message) {
         var gputop = Module['gputop_singleton'];
         if (gputop !== undefined)
-            gputop.log(message, gputop.ERROR);
+            gputop.log(Pointer_stringify(message), gputop.ERROR);
         else
             console.error(Pointer_stringify(message));
     },
@@ -57,39 +56,19 @@ var LibraryGpuTopWeb = {
         console.assert(condition, Pointer_stringify(message));
     },
 
-    gputop_web_index_metric_set: function (guid, metric_set) {
-        GPUTop._guid_to_metric_set_map[Pointer_stringify(guid)] = metric_set;
-    },
-    gputop_web_lookup_metric_set: function (guid) {
-        var key = Pointer_stringify(guid);
-        if (key in GPUTop._guid_to_metric_set_map)
-            return GPUTop._guid_to_metric_set_map[key];
-        else {
-            console.error('Failed to find metric_set with guid = ' + key);
-            return 0;
-        }
-    },
-
-    _gputop_stream_start_update: function (stream_ptr, start_timestamp, end_timestamp, reason) {
-        var gputop = Module['gputop_singleton'];
-        if (gputop !== undefined)
-            gputop.stream_start_update.call(gputop, stream_ptr, start_timestamp, end_timestamp, reason);
-        else
-            console.error("Gputop singleton not initialized");
-    },
-    _gputop_stream_update_counter: function (stream_ptr, counter_idx, max, value) {
+    _gputop_stream_updated: function (stream_ptr, start_timestamp, end_timestamp, reason, n_counters) {
         var gputop = Module['gputop_singleton'];
         if (gputop !== undefined)
-            gputop.stream_update_counter.call(gputop, stream_ptr, counter_idx, max, value);
+            gputop.stream_updated.call(gputop, stream_ptr, start_timestamp, end_timestamp, reason, n_counters);
         else
             console.error("Gputop singleton not initialized");
     },
-    _gputop_stream_end_update: function (stream_ptr) {
+    _gputop_stream_perf_event: function (stream_ptr, type, timestamp, value, raw_ptr, raw_size) {
         var gputop = Module['gputop_singleton'];
-        if (gputop !== undefined)
-            gputop.stream_end_update.call(gputop, stream_ptr);
-        else
+        if (gputop === undefined)
             console.error("Gputop singleton not initialized");
+        else if (gputop.stream_perf_event !== undefined)
+            gputop.stream_perf_event.call(gputop, stream_ptr, type, timestamp, value, raw_ptr, raw_size);
     },
 };
 
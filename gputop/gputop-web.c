@@ -37,6 +37,8 @@
 
 #include <gputop-string.h>
 #include <gputop-oa-counters.h>
+#include <gputop-oa-xml.h>
+#include <gputop-perf-records.h>
 
 #include "gputop-web-lib.h"
 
@@ -52,10 +54,40 @@ struct gputop_webc_stream {
     struct gputop_metric_set *oa_metric_set;
     struct gputop_oa_accumulator oa_accumulator;
 
+    /* (value, max) pairs for each counter, as passed to JavaScript for
+     * each update */
+    double *counter_values;
+
+    /* The aggregation periods completed while handling a message, which
+     * are evaluated together (see flush_stream_updates()) once the whole
+     * message has been accumulated, with MAX_RAW_OA_COUNTERS deltas and
+     * n_counters (value, max) pairs per period */
+    struct pending_update *pending;
+    uint64_t *pending_deltas;
+    double *pending_values;
+    int n_pending;
+    int pending_size;
+
+    /* If a counter mask is set (see gputop_webc_stream_set_counter_mask())
+     * only the (value, max) pairs of these counters, in ascending order,
+     * are forwarded, packed at the start of counter_values */
+    int *selected_counters;
+    int n_selected_counters;
+
     /* Aggregation may happen accross multiple perf data messages
      * so we may need to copy the last report so that aggregation
      * can continue with the next message... */
     uint8_t *continuation_report;
+
+    /* For tracepoint and generic perf event streams */
+    struct gputop_perf_parser perf_parser;
+    uint64_t perf_n_lost_reported;
+};
+
+struct pending_update {
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    int reason;
 };
 
 struct oa_sample {
@@ -73,14 +105,36 @@ assert_not_reached(void)
 
 #define JS_MAX_SAFE_INTEGER (((uint64_t)1<<53) - 1)
 
+/* The metric sets for the device described via
+ * gputop_webc_set_system_property() */
+static const struct gputop_oa_metrics *oa_metrics;
+
+/* Non-NULL if metric sets were loaded via gputop_webc_load_metrics_xml() */
+static struct gputop_oa_metrics *xml_metrics;
+
+static struct gputop_metric_set *
+lookup_metric_set(const char *guid)
+{
+    struct gputop_metric_set *metric_set =
+        gputop_oa_metrics_lookup(oa_metrics, &gputop_devinfo, guid);
+
+    if (!metric_set)
+        gputop_web_console_error("Failed to find metric_set with guid = %s", guid);
+
+    return metric_set;
+}
+
 /* Returns the ID for a counter_name using the symbol_name */
 int EMSCRIPTEN_KEEPALIVE
 gputop_webc_get_counter_id(const char *guid, const char *counter_symbol_name)
 {
-    struct gputop_metric_set *metric_set = gputop_web_lookup_metric_set(guid);
+    struct gputop_metric_set *metric_set = lookup_metric_set(guid);
+
+    if (!metric_set)
+        return -1;
 
     for (int t=0; t<metric_set->n_counters; t++) {
-        struct gputop_metric_set_counter *counter = &metric_set->counters[t];
+        const struct gputop_metric_set_counter *counter = &metric_set->counters[t];
         if (!strcmp(counter->symbol_name, counter_symbol_name))
             return t;
     }
@@ -93,79 +147,190 @@ enum update_reason {
     UPDATE_REASON_CTX_SWITCH_AWAY   = 4
 };
 
+/* Notifies JavaScript that stream->counter_values holds a new set of
+ * [value, max] pairs for n_counters counters. The values are read back
+ * through a Float64Array view of the heap, so there's a single call
+ * into JavaScript per aggregation period instead of one per counter.
+ */
 void
-_gputop_stream_start_update(struct gputop_webc_stream *stream,
-                            double start_timestamp, double end_timestamp,
-                            int reason);
-void
-_gputop_stream_update_counter(struct gputop_webc_stream *stream,
-                              int counter,
-                              double max, double value);
+_gputop_stream_updated(struct gputop_webc_stream *stream,
+                       double start_timestamp, double end_timestamp,
+                       int reason, int n_counters);
 void
-_gputop_stream_end_update(struct gputop_webc_stream *stream);
+_gputop_stream_perf_event(struct gputop_webc_stream *stream,
+                          int type, double timestamp, double value,
+                          const uint8_t *raw, int raw_size);
 
+/* Evaluates just the selected counters with their individual read
+ * functions (which read any counters they depend on themselves) instead
+ * of evaluating every counter via read_all() */
 static void
-forward_stream_update(struct gputop_webc_stream *stream,
-                      enum update_reason reason)
+read_selected_counters(struct gputop_webc_stream *stream, uint64_t *deltas)
 {
     struct gputop_metric_set *oa_metric_set = stream->oa_metric_set;
-    struct gputop_oa_accumulator *oa_accumulator = &stream->oa_accumulator;
     int i;
 
-    //printf("start ts = %"PRIu64" end ts = %"PRIu64" agg. period =%"PRIu64"\n",
-    //        stream->start_timestamp, stream->end_timestamp, stream->aggregation_period);
+    for (i = 0; i < stream->n_selected_counters; i++) {
+        const struct gputop_metric_set_counter *counter =
+            &oa_metric_set->counters[stream->selected_counters[i]];
+        double *out = stream->counter_values + i * 2;
 
-    _gputop_stream_start_update(stream,
-                                oa_accumulator->first_timestamp,
-                                oa_accumulator->last_timestamp,
-                                reason);
+        switch (counter->data_type) {
+        case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
+            out[0] = counter->oa_counter_read_uint64(&gputop_devinfo,
+                                                     oa_metric_set, deltas);
+            break;
+        case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
+            out[0] = counter->oa_counter_read_float(&gputop_devinfo,
+                                                    oa_metric_set, deltas);
+            break;
+        default:
+            assert_not_reached();
+        }
 
-    for (i = 0; i < oa_metric_set->n_counters; i++) {
-        uint64_t u53_check;
-        double d_value = 0;
-        uint64_t max = 0;
+        out[1] = counter->max ?
+            counter->max(&gputop_devinfo, oa_metric_set, deltas) : 0;
+    }
+}
 
-        struct gputop_metric_set_counter *counter = &oa_metric_set->counters[i];
-        if (counter->max) {
-            max = counter->max(&gputop_devinfo, oa_metric_set,
-                               oa_accumulator->deltas);
-        }
+static void
+forward_stream_update(struct gputop_webc_stream *stream,
+                      const struct pending_update *update,
+                      int n_counters)
+{
+    struct gputop_metric_set *oa_metric_set = stream->oa_metric_set;
+    int i;
 
-        switch(counter->data_type) {
-            case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-                u53_check = counter->oa_counter_read_uint64(&gputop_devinfo,
-                                                            oa_metric_set,
-                                                            oa_accumulator->deltas);
-                if (u53_check > JS_MAX_SAFE_INTEGER) {
-                    gputop_web_console_error("Clamping counter to large to represent in JavaScript %s ", counter->symbol_name);
-                    u53_check = JS_MAX_SAFE_INTEGER;
-                }
-                d_value = u53_check;
-                break;
-            case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-                d_value = counter->oa_counter_read_float(&gputop_devinfo,
-                                                         oa_metric_set,
-                                                         oa_accumulator->deltas);
-                break;
-            case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-                gputop_web_console_assert(0, "Unexpected counter data type");
-                break;
+    for (i = 0; i < n_counters; i++) {
+        int idx = stream->selected_counters ? stream->selected_counters[i] : i;
+        const struct gputop_metric_set_counter *counter = &oa_metric_set->counters[idx];
+
+        if (counter->data_type == GPUTOP_PERFQUERY_COUNTER_DATA_UINT64 &&
+            stream->counter_values[i * 2] > JS_MAX_SAFE_INTEGER)
+        {
+            gputop_web_console_error("Clamping counter to large to represent in JavaScript %s ", counter->symbol_name);
+            stream->counter_values[i * 2] = JS_MAX_SAFE_INTEGER;
         }
+    }
+
+    _gputop_stream_updated(stream,
+                           update->first_timestamp,
+                           update->last_timestamp,
+                           update->reason,
+                           n_counters);
+}
+
+/* Saves the aggregation period that was just accumulated, to be
+ * forwarded by flush_stream_updates() */
+static void
+queue_stream_update(struct gputop_webc_stream *stream,
+                    enum update_reason reason)
+{
+    struct gputop_oa_accumulator *oa_accumulator = &stream->oa_accumulator;
+    struct pending_update *update;
+
+    if (stream->n_pending == stream->pending_size) {
+        int n_values = stream->oa_metric_set->n_counters * 2;
+
+        stream->pending_size = stream->pending_size ? stream->pending_size * 2 : 16;
+        stream->pending = realloc(stream->pending,
+                                  sizeof(struct pending_update) *
+                                  stream->pending_size);
+        stream->pending_deltas = realloc(stream->pending_deltas,
+                                         sizeof(uint64_t) * MAX_RAW_OA_COUNTERS *
+                                         stream->pending_size);
+        stream->pending_values = realloc(stream->pending_values,
+                                         sizeof(double) * n_values *
+                                         stream->pending_size);
+        assert(stream->pending);
+        assert(stream->pending_deltas);
+        assert(stream->pending_values);
+    }
+
+    update = &stream->pending[stream->n_pending];
+    update->first_timestamp = oa_accumulator->first_timestamp;
+    update->last_timestamp = oa_accumulator->last_timestamp;
+    update->reason = reason;
+
+    memcpy(stream->pending_deltas + stream->n_pending * MAX_RAW_OA_COUNTERS,
+           oa_accumulator->deltas, sizeof(oa_accumulator->deltas));
 
-        _gputop_stream_update_counter(stream, i, max, d_value);
+    stream->n_pending++;
+}
+
+/* Evaluates the counters for all the queued aggregation periods in one
+ * go and then notifies JavaScript of each period in turn */
+static void
+flush_stream_updates(struct gputop_webc_stream *stream)
+{
+    struct gputop_metric_set *oa_metric_set = stream->oa_metric_set;
+    int n_values = oa_metric_set->n_counters * 2;
+    int n_counters = stream->selected_counters ?
+        stream->n_selected_counters : oa_metric_set->n_counters;
+    /* Unless only a few of the generated per-counter read functions are
+     * needed... */
+    bool read_all = !stream->selected_counters || oa_metric_set->program;
+    int i, j;
+
+    if (!stream->n_pending)
+        return;
+
+    if (read_all) {
+        gputop_oa_metric_set_read_all_batch(&gputop_devinfo, oa_metric_set,
+                                            stream->pending_deltas,
+                                            MAX_RAW_OA_COUNTERS,
+                                            stream->n_pending,
+                                            stream->pending_values);
     }
 
-    _gputop_stream_end_update(stream);
+    for (i = 0; i < stream->n_pending; i++) {
+        const double *values = stream->pending_values + i * n_values;
+
+        if (!read_all) {
+            read_selected_counters(stream, stream->pending_deltas +
+                                   i * MAX_RAW_OA_COUNTERS);
+        } else if (stream->selected_counters) {
+            for (j = 0; j < n_counters; j++) {
+                int idx = stream->selected_counters[j];
+
+                stream->counter_values[j * 2] = values[idx * 2];
+                stream->counter_values[j * 2 + 1] = values[idx * 2 + 1];
+            }
+        } else
+            memcpy(stream->counter_values, values, sizeof(double) * n_values);
+
+        forward_stream_update(stream, &stream->pending[i], n_counters);
+    }
+
+    stream->n_pending = 0;
 }
 
+static void
+perf_event_cb(const struct gputop_perf_event *event, void *data)
+{
+    struct gputop_webc_stream *stream = data;
+
+    _gputop_stream_perf_event(stream, event->type, event->time,
+                              event->value, event->raw, event->raw_size);
+}
+
+/* NB: the server forwards perf records exactly as found in the perf
+ * circular buffer, but linearized so no record wraps */
 void EMSCRIPTEN_KEEPALIVE
 gputop_webc_handle_perf_message(struct gputop_webc_stream *stream,
                                 uint8_t *data,
                                 int len)
 {
-    gputop_web_console_log("FIXME: parse perf data");
+    struct gputop_perf_parser *parser = &stream->perf_parser;
+
+    gputop_perf_parser_parse(parser, data, len, perf_event_cb, stream);
+
+    if (parser->n_lost_samples != stream->perf_n_lost_reported) {
+        gputop_web_console_warn("perf: %"PRIu64" samples lost (%"PRIu64" total)\n",
+                                parser->n_lost_samples - stream->perf_n_lost_reported,
+                                parser->n_lost_samples);
+        stream->perf_n_lost_reported = parser->n_lost_samples;
+    }
 }
 
 // function that resets the accumulator clock and the continuation_report
@@ -235,7 +400,7 @@ gputop_webc_handle_i915_perf_message(struct gputop_webc_stream *stream,
                         reason = UPDATE_REASON_CTX_SWITCH_AWAY;
 
                     if (reason) {
-                        forward_stream_update(stream, reason);
+                        queue_stream_update(stream, reason);
                         gputop_oa_accumulator_clear(oa_accumulator);
                     }
                 }
@@ -248,10 +413,13 @@ gputop_webc_handle_i915_perf_message(struct gputop_webc_stream *stream,
 
         default:
             gputop_web_console_log("i915 perf: Spurious header type = %d\n", header->type);
+            flush_stream_updates(stream);
             return;
         }
     }
 
+    flush_stream_updates(stream);
+
     if (last) {
         int raw_size = stream->oa_metric_set->perf_raw_size;
 
@@ -262,15 +430,6 @@ gputop_webc_handle_i915_perf_message(struct gputop_webc_stream *stream,
     }
 }
 
-/* The C code generated by oa-gen.py calls this function for each
- * metric set.
- */
-void
-gputop_register_oa_metric_set(struct gputop_metric_set *metric_set)
-{
-    gputop_web_index_metric_set(metric_set->guid, metric_set);
-}
-
 void EMSCRIPTEN_KEEPALIVE
 gputop_webc_reset_system_properties(void)
 {
@@ -342,22 +501,94 @@ gputop_webc_update_system_metrics(void)
 
     gputop_web_console_assert(devid != 0, "Device ID not initialized before trying to update system metrics");
 
-    if (IS_HASWELL(devid))
-        gputop_oa_add_metrics_hsw(&gputop_devinfo);
+    /* The available counters may have changed with the system properties */
+    if (oa_metrics)
+        gputop_oa_metrics_reset(oa_metrics);
+
+    if (xml_metrics)
+        oa_metrics = xml_metrics;
+    else if (IS_HASWELL(devid))
+        oa_metrics = &gputop_oa_metrics_hsw;
     else if (IS_BROADWELL(devid))
-        gputop_oa_add_metrics_bdw(&gputop_devinfo);
+        oa_metrics = &gputop_oa_metrics_bdw;
     else if (IS_CHERRYVIEW(devid))
-        gputop_oa_add_metrics_chv(&gputop_devinfo);
+        oa_metrics = &gputop_oa_metrics_chv;
     else if (IS_SKYLAKE(devid))
-        gputop_oa_add_metrics_skl(&gputop_devinfo);
+        oa_metrics = &gputop_oa_metrics_skl;
     else
         assert_not_reached();
 }
 
+/* Instead of the metric sets compiled into gputop-web.js, use the metric
+ * sets described by an OA metrics xml file (with the equations compiled
+ * at runtime), or go back to the built in metric sets if xml is NULL.
+ *
+ * NB: this should be called before creating any streams and
+ * gputop_webc_update_system_metrics() needs to be called afterwards.
+ */
+bool EMSCRIPTEN_KEEPALIVE
+gputop_webc_load_metrics_xml(const char *xml)
+{
+    char *error = NULL;
+
+    if (oa_metrics)
+        gputop_oa_metrics_reset(oa_metrics);
+    oa_metrics = NULL;
+
+    if (xml_metrics) {
+        gputop_oa_xml_free(xml_metrics);
+        xml_metrics = NULL;
+    }
+
+    if (!xml)
+        return true;
+
+    xml_metrics = gputop_oa_xml_load(xml, NULL, &error);
+    if (!xml_metrics) {
+        gputop_web_console_error("Failed to load metrics xml: %s", error);
+        free(error);
+        return false;
+    }
+
+    return true;
+}
+
+/* Selects which counters are evaluated and forwarded for each update,
+ * with bit (i % 32) of counter_mask[i / 32] set to select
+ * oa_metric_set->counters[i]. Counters beyond the end of the mask aren't
+ * selected, while a NULL mask selects every counter. */
+void EMSCRIPTEN_KEEPALIVE
+gputop_webc_stream_set_counter_mask(struct gputop_webc_stream *stream,
+                                    const uint32_t *counter_mask,
+                                    int n_mask_words)
+{
+    struct gputop_metric_set *oa_metric_set = stream->oa_metric_set;
+    int i;
+
+    free(stream->selected_counters);
+    stream->selected_counters = NULL;
+    stream->n_selected_counters = 0;
+
+    if (!counter_mask)
+        return;
+
+    stream->selected_counters = malloc(sizeof(int) * oa_metric_set->n_counters);
+    assert(stream->selected_counters);
+
+    for (i = 0; i < oa_metric_set->n_counters && i / 32 < n_mask_words; i++) {
+        if (counter_mask[i / 32] & (1U << (i % 32)))
+            stream->selected_counters[stream->n_selected_counters++] = i;
+    }
+}
+
+/* NB: counter_mask may be NULL to evaluate every counter (see
+ * gputop_webc_stream_set_counter_mask()) */
 struct gputop_webc_stream * EMSCRIPTEN_KEEPALIVE
 gputop_webc_stream_new(const char *guid,
                        bool per_ctx_mode,
-                       uint32_t aggregation_period)
+                       uint32_t aggregation_period,
+                       const uint32_t *counter_mask,
+                       int n_mask_words)
 {
     struct gputop_webc_stream *stream = malloc(sizeof(*stream));
 
@@ -367,12 +598,35 @@ gputop_webc_stream_new(const char *guid,
     stream->aggregation_period = aggregation_period;
     stream->per_ctx_mode = per_ctx_mode;
 
-    stream->oa_metric_set = gputop_web_lookup_metric_set(guid);
+    stream->oa_metric_set = lookup_metric_set(guid);
     assert(stream->oa_metric_set);
     assert(stream->oa_metric_set->perf_oa_format);
 
     gputop_oa_accumulator_init(&stream->oa_accumulator, stream->oa_metric_set);
 
+    stream->counter_values =
+        malloc(sizeof(double) * 2 * stream->oa_metric_set->n_counters);
+    assert(stream->counter_values);
+
+    gputop_webc_stream_set_counter_mask(stream, counter_mask, n_mask_words);
+
+    return stream;
+}
+
+/* NB: JavaScript can't represent 64bit integers so we only accept
+ * the lower 32 bits of the sample type/read format which covers all
+ * that the parser understands */
+struct gputop_webc_stream * EMSCRIPTEN_KEEPALIVE
+gputop_webc_perf_stream_new(uint32_t sample_type,
+                            uint32_t read_format)
+{
+    struct gputop_webc_stream *stream = malloc(sizeof(*stream));
+
+    assert(stream);
+
+    memset(stream, 0, sizeof(*stream));
+    gputop_perf_parser_init(&stream->perf_parser, sample_type, read_format);
+
     return stream;
 }
 
@@ -383,12 +637,27 @@ gputop_webc_update_stream_period(struct gputop_webc_stream *stream,
     stream->aggregation_period = aggregation_period;
 }
 
+/* Returns the heap address of the interleaved [value, max] doubles that
+ * forward_stream_update() fills for each aggregated period, for
+ * JavaScript to wrap in a Float64Array view. */
+double * EMSCRIPTEN_KEEPALIVE
+gputop_webc_stream_counter_values(struct gputop_webc_stream *stream)
+{
+    return stream->counter_values;
+}
+
 void EMSCRIPTEN_KEEPALIVE
 gputop_webc_stream_destroy(struct gputop_webc_stream *stream)
 {
     gputop_web_console_log("Freeing webc stream %p\n", stream);
 
+    gputop_perf_parser_fini(&stream->perf_parser);
     free(stream->continuation_report);
+    free(stream->counter_values);
+    free(stream->pending);
+    free(stream->pending_deltas);
+    free(stream->pending_values);
+    free(stream->selected_counters);
     free(stream);
 }
 
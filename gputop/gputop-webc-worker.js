@@ -0,0 +1,352 @@
+"use strict";
+
+//# sourceURL=gputop-webc-worker.js
+// https://google.github.io/styleguide/javascriptguide.xml
+
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2015-2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* The i915 perf OA reports for a stream are decoded and accumulated by
+ * the Emscripten compiled webc code (gputop-web.c). That's a lot of work
+ * to be doing on the same thread that's rendering graphs, so in a browser
+ * gputop.js runs a dedicated instance of the webc code in this Worker.
+ *
+ * Messages received from gputop.js:
+ *
+ *   { cmd: 'system_properties', properties: { name: value, ... } }
+ *   { cmd: 'stream_new', id, guid, per_ctx_mode, period_ns, keep_history,
+ *     counter_ids }
+ *   { cmd: 'stream_period', id, period_ns }
+ *   { cmd: 'stream_counter_mask', id, counter_ids }
+ *   { cmd: 'stream_reset', id }
+ *   { cmd: 'stream_destroy', id }
+ *   { cmd: 'i915_perf', id, data }  (data is a transferred Uint8Array)
+ *   { cmd: 'replay', id }
+ *
+ * Messages posted back:
+ *
+ *   { cmd: 'updates', id, n_counters, n_updates, timestamps, values,
+ *     counter_ids }
+ *
+ *      timestamps holds [start, end, reason] for each aggregated period
+ *      and values holds n_counters [value, max] pairs per period, both as
+ *      transferred Float64Arrays, batched per forwarded message.
+ *
+ *      counter_ids is an optional array of counter indices (into the
+ *      metric set's counters) that may be given for a stream so that only
+ *      those counters are evaluated. When set the values pairs correspond
+ *      to the (ascending, de-duplicated) counter_ids, otherwise there's a
+ *      pair for every counter.
+ *
+ *   { cmd: 'log', message, level }
+ *
+ * Under node.js there are no Workers so gputop.js instead require()s this
+ * file and drives a WebcDecoder directly, with the same messages.
+ */
+
+/* The last 1MB of perf data for each metric set (by guid) is kept to be
+ * able to replay it after pausing, which closes the stream and reopens
+ * a new one with keep_history set */
+var MAX_HISTORY_SIZE = 1048576;
+
+function WebcDecoder(webc, post) {
+    this.webc_ = webc;
+    this.post_ = post;
+
+    this.streams_ = {};         /* struct gputop_webc_stream pointers by id */
+    this.stream_ptr_to_id_ = {};
+    this.stream_guids_ = {};
+    this.stream_counter_ids_ = {};
+    this.histories_ = {};       /* by guid */
+
+    /* Persistent heap allocation that messages are copied into before
+     * being decoded, grown as needed. (Allocating on the Emscripten stack
+     * instead risks overflowing it with large messages) */
+    this.msg_ptr_ = 0;
+    this.msg_size_ = 0;
+
+    /* Updates accumulated while decoding a single message */
+    this.batch_id_ = -1;
+    this.batch_n_counters_ = 0;
+    this.batch_n_updates_ = 0;
+    this.batch_timestamps_ = new Float64Array(64 * 3);
+    this.batch_values_ = new Float64Array(1024);
+
+    /* Tell gputop-web-lib.js about this object so that the webc code can
+     * call stream_updated() and log() on it */
+    webc.gputop_singleton = this;
+}
+
+WebcDecoder.prototype.LOG = 0;
+WebcDecoder.prototype.WARN = 1;
+WebcDecoder.prototype.ERROR = 2;
+
+WebcDecoder.prototype.log = function(message, level) {
+    if (level === undefined)
+        level = this.LOG;
+    this.post_({ cmd: 'log', message: message, level: level });
+}
+
+WebcDecoder.prototype.handle = function(msg) {
+    var webc = this.webc_;
+
+    switch (msg.cmd) {
+    case 'system_properties':
+        webc._gputop_webc_reset_system_properties();
+
+        for (var name in msg.properties) {
+            var sp = webc.Runtime.stackSave();
+            var name_c_string = webc.allocate(webc.intArrayFromString(name),
+                                              'i8', webc.ALLOC_STACK);
+            webc._gputop_webc_set_system_property(name_c_string,
+                                                  msg.properties[name]);
+            webc.Runtime.stackRestore(sp);
+        }
+
+        webc._gputop_webc_update_system_metrics();
+        break;
+    case 'metrics_xml':
+        var xml_c_string = webc.allocate(webc.intArrayFromString(msg.xml),
+                                         'i8', webc.ALLOC_NORMAL);
+        if (!webc._gputop_webc_load_metrics_xml(xml_c_string))
+            this.log("Failed to load metrics xml", this.ERROR);
+        webc._free(xml_c_string);
+        webc._gputop_webc_update_system_metrics();
+        break;
+    case 'stream_new':
+        var sp = webc.Runtime.stackSave();
+        var guid_c_string = webc.allocate(webc.intArrayFromString(msg.guid),
+                                          'i8', webc.ALLOC_STACK);
+        var counter_ids = this.normalize_counter_ids_(msg.counter_ids);
+        var mask = this.counter_mask_(counter_ids);
+        var mask_ptr = mask ? webc.allocate(mask, 'i32', webc.ALLOC_STACK) : 0;
+        var stream_ptr = webc._gputop_webc_stream_new(guid_c_string,
+                                                      msg.per_ctx_mode,
+                                                      msg.period_ns,
+                                                      mask_ptr,
+                                                      mask ? mask.length : 0);
+        webc.Runtime.stackRestore(sp);
+
+        this.streams_[msg.id] = stream_ptr;
+        this.stream_ptr_to_id_[stream_ptr] = msg.id;
+        this.stream_guids_[msg.id] = msg.guid;
+        this.stream_counter_ids_[msg.id] = counter_ids;
+        if (!msg.keep_history || !(msg.guid in this.histories_))
+            this.histories_[msg.guid] = { messages: [], size: 0 };
+        break;
+    case 'stream_period':
+        if (msg.id in this.streams_)
+            webc._gputop_webc_update_stream_period(this.streams_[msg.id],
+                                                   msg.period_ns);
+        break;
+    case 'stream_counter_mask':
+        if (msg.id in this.streams_) {
+            var counter_ids = this.normalize_counter_ids_(msg.counter_ids);
+            var mask = this.counter_mask_(counter_ids);
+            var sp = webc.Runtime.stackSave();
+            var mask_ptr = mask ? webc.allocate(mask, 'i32', webc.ALLOC_STACK) : 0;
+
+            webc._gputop_webc_stream_set_counter_mask(this.streams_[msg.id],
+                                                      mask_ptr,
+                                                      mask ? mask.length : 0);
+            webc.Runtime.stackRestore(sp);
+
+            this.stream_counter_ids_[msg.id] = counter_ids;
+        }
+        break;
+    case 'stream_reset':
+        if (msg.id in this.streams_)
+            webc._gputop_webc_reset_accumulator(this.streams_[msg.id]);
+        break;
+    case 'stream_destroy':
+        if (msg.id in this.streams_) {
+            var stream_ptr = this.streams_[msg.id];
+
+            webc._gputop_webc_stream_destroy(stream_ptr);
+            delete this.stream_ptr_to_id_[stream_ptr];
+            delete this.streams_[msg.id];
+            delete this.stream_guids_[msg.id];
+            delete this.stream_counter_ids_[msg.id];
+        }
+        break;
+    case 'i915_perf':
+        if (!(msg.id in this.streams_)) {
+            this.log("Ignoring i915 perf data for unknown stream", this.WARN);
+            break;
+        }
+
+        var history = this.histories_[this.stream_guids_[msg.id]];
+        history.messages.push(msg.data);
+        history.size += msg.data.length;
+        while (history.size > MAX_HISTORY_SIZE)
+            history.size -= history.messages.shift().length;
+
+        this.decode_i915_perf_message(msg.id, msg.data);
+        break;
+    case 'replay':
+        if (msg.id in this.streams_) {
+            var messages = this.histories_[this.stream_guids_[msg.id]].messages;
+            for (var i = 0; i < messages.length; i++)
+                this.decode_i915_perf_message(msg.id, messages[i]);
+        }
+        break;
+    default:
+        this.log("Unknown webc worker command " + msg.cmd, this.ERROR);
+        break;
+    }
+}
+
+/* Sorts and de-duplicates a list of counter indices to match the order
+ * that the webc code forwards selected counter values in, or returns
+ * undefined if all counters should be forwarded */
+WebcDecoder.prototype.normalize_counter_ids_ = function(counter_ids) {
+    if (counter_ids === undefined || counter_ids === null)
+        return undefined;
+
+    var sorted = counter_ids.slice().sort(function (a, b) { return a - b; });
+    var ids = [];
+    for (var i = 0; i < sorted.length; i++) {
+        if (sorted[i] >= 0 && (ids.length === 0 || ids[ids.length - 1] !== sorted[i]))
+            ids.push(sorted[i]);
+    }
+    return ids;
+}
+
+/* Packs counter indices into the uint32_t mask words expected by
+ * gputop_webc_stream_set_counter_mask() */
+WebcDecoder.prototype.counter_mask_ = function(counter_ids) {
+    if (counter_ids === undefined)
+        return null;
+
+    var n_words = 1;
+    if (counter_ids.length)
+        n_words = (counter_ids[counter_ids.length - 1] >> 5) + 1;
+
+    var mask = new Array(n_words);
+    for (var i = 0; i < n_words; i++)
+        mask[i] = 0;
+    for (var i = 0; i < counter_ids.length; i++)
+        mask[counter_ids[i] >> 5] |= 1 << (counter_ids[i] & 31);
+
+    return mask;
+}
+
+WebcDecoder.prototype.decode_i915_perf_message = function(id, data) {
+    var webc = this.webc_;
+
+    if (data.length > this.msg_size_) {
+        if (this.msg_ptr_)
+            webc._free(this.msg_ptr_);
+        this.msg_size_ = Math.max(data.length, this.msg_size_ * 2, 65536);
+        this.msg_ptr_ = webc._malloc(this.msg_size_);
+    }
+    webc.HEAPU8.set(data, this.msg_ptr_);
+
+    this.batch_id_ = id;
+    this.batch_n_updates_ = 0;
+
+    webc._gputop_webc_handle_i915_perf_message(this.streams_[id],
+                                               this.msg_ptr_,
+                                               data.length);
+
+    this.flush_updates();
+}
+
+/* Called by the webc code (via gputop-web-lib.js) each time an
+ * aggregation period completes with the [value, max] pairs for the
+ * period left in the stream's counter_values array */
+WebcDecoder.prototype.stream_updated = function(stream_ptr,
+                                                start_timestamp,
+                                                end_timestamp,
+                                                reason,
+                                                n_counters) {
+    if (this.stream_ptr_to_id_[stream_ptr] !== this.batch_id_) {
+        this.log("Ignoring spurious update for unknown stream", this.ERROR);
+        return;
+    }
+
+    var n = this.batch_n_updates_;
+    var n_values = n_counters * 2;
+
+    if ((n + 1) * 3 > this.batch_timestamps_.length) {
+        var timestamps = new Float64Array(this.batch_timestamps_.length * 2);
+        timestamps.set(this.batch_timestamps_);
+        this.batch_timestamps_ = timestamps;
+    }
+    if ((n + 1) * n_values > this.batch_values_.length) {
+        var values = new Float64Array(Math.max(this.batch_values_.length * 2,
+                                               (n + 1) * n_values));
+        values.set(this.batch_values_.subarray(0, n * n_values));
+        this.batch_values_ = values;
+    }
+
+    this.batch_timestamps_[n * 3] = start_timestamp;
+    this.batch_timestamps_[n * 3 + 1] = end_timestamp;
+    this.batch_timestamps_[n * 3 + 2] = reason;
+
+    /* NB: HEAPF64 may be a new view if the heap has grown */
+    var ptr = this.webc_._gputop_webc_stream_counter_values(stream_ptr);
+    this.batch_values_.set(this.webc_.HEAPF64.subarray(ptr >> 3,
+                                                       (ptr >> 3) + n_values),
+                           n * n_values);
+
+    this.batch_n_counters_ = n_counters;
+    this.batch_n_updates_ = n + 1;
+}
+
+WebcDecoder.prototype.flush_updates = function() {
+    var n = this.batch_n_updates_;
+
+    if (n === 0)
+        return;
+
+    var timestamps = this.batch_timestamps_.slice(0, n * 3);
+    var values = this.batch_values_.slice(0, n * this.batch_n_counters_ * 2);
+
+    this.post_({ cmd: 'updates',
+                 id: this.batch_id_,
+                 n_counters: this.batch_n_counters_,
+                 n_updates: n,
+                 timestamps: timestamps,
+                 values: values,
+                 counter_ids: this.stream_counter_ids_[this.batch_id_] },
+               [ timestamps.buffer, values.buffer ]);
+
+    this.batch_n_updates_ = 0;
+}
+
+if (typeof module !== 'undefined' && module.exports) {
+    /* For use as a node.js module... */
+    exports.WebcDecoder = WebcDecoder;
+} else if (typeof importScripts === 'function') {
+    importScripts('gputop-web.js');
+
+    var decoder = new WebcDecoder(Module, function (msg, transfer) {
+        postMessage(msg, transfer);
+    });
+
+    onmessage = function (evt) {
+        decoder.handle(evt.data);
+    };
+}
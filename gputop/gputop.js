@@ -39,6 +39,8 @@ if (typeof module !== 'undefined' && module.exports) {
     var webc = require("./gputop-web.js");
     webc.gputop_singleton = undefined;
 
+    var WebcDecoder = require("./gputop-webc-worker.js").WebcDecoder;
+
     var install_prefix = require.resolve("./gputop-web.js");
     var path = require('path');
     install_prefix = path.resolve(install_prefix, '..');
@@ -72,6 +74,73 @@ Gputop.prototype.is_demo = function() {
     return false;
 }
 
+/* A fixed capacity FIFO of counter updates, stored as a struct of typed
+ * arrays so that appending an update is O(1) and doesn't create garbage.
+ *
+ * Consumers read the .length pending updates oldest first, using at(i) to
+ * map the i'th pending update to an index into the start, end, value, max
+ * and reason arrays, and then discard what they've read with consume().
+ * Once full, pushing a new update discards the oldest one.
+ *
+ * NB: the capacity is rounded up to a power of two
+ */
+function CounterUpdateRing(capacity) {
+    var size = 1;
+
+    while (size < capacity)
+        size *= 2;
+
+    this.capacity = size;
+    this.start = new Float64Array(size);
+    this.end = new Float64Array(size);
+    this.value = new Float64Array(size);
+    this.max = new Float64Array(size);
+    this.reason = new Float64Array(size);
+
+    this.n_discarded = 0; /* updates pushed out by newer ones */
+
+    this.tail_ = 0; /* index of the oldest update */
+    this.len_ = 0;
+}
+
+Object.defineProperty(CounterUpdateRing.prototype, 'length', {
+    get: function() { return this.len_; }
+});
+
+CounterUpdateRing.prototype.at = function(i) {
+    return (this.tail_ + i) & (this.capacity - 1);
+}
+
+/* Returns false if the oldest update had to be discarded */
+CounterUpdateRing.prototype.push = function(start, end, value, max, reason) {
+    var i = (this.tail_ + this.len_) & (this.capacity - 1);
+    var discarded = this.len_ === this.capacity;
+
+    this.start[i] = start;
+    this.end[i] = end;
+    this.value[i] = value;
+    this.max[i] = max;
+    this.reason[i] = reason;
+
+    if (discarded) {
+        this.tail_ = (this.tail_ + 1) & (this.capacity - 1);
+        this.n_discarded++;
+    } else
+        this.len_++;
+
+    return !discarded;
+}
+
+CounterUpdateRing.prototype.consume = function(n) {
+    n = Math.min(n, this.len_);
+    this.tail_ = (this.tail_ + n) & (this.capacity - 1);
+    this.len_ -= n;
+}
+
+CounterUpdateRing.prototype.clear = function() {
+    this.consume(this.len_);
+}
+
 function Counter (metricParent) {
 
     this.metric = metricParent;
@@ -94,14 +163,14 @@ function Counter (metricParent) {
      * we've seen */
     this.inferred_max = 0;
 
-    this.updates = [];
+    this.updates = new CounterUpdateRing(metricParent.gputop.counter_history_capacity);
     this.graph_data = [];
     this.graph_options = []; /* each counter has its own graph options so that
                               * we can adjust the Y axis for each of them */
     this.units = '';
     this.graph_markings = [];
 
-    /* whether append_counter_data() should really append to counter.updates[] */
+    /* whether append_counter_data() should really append to counter.updates */
     this.record_data = false;
 
     this.eq_xml = ""; // mathml equation
@@ -122,10 +191,11 @@ Counter.prototype.append_counter_data = function (start_timestamp, end_timestamp
         max *= per_sec_scale;
     }
     if (this.record_data) {
-        this.updates.push([start_timestamp, end_timestamp, value, max, reason]);
-        if (this.updates.length > 2000) {
-            console.warn("Discarding old counter update (> 2000 updates old)");
-            this.updates.shift();
+        if (!this.updates.push(start_timestamp, end_timestamp, value, max, reason) &&
+            this.updates.n_discarded === 1)
+        {
+            console.warn("Discarding old counter updates (> " +
+                         this.updates.capacity + " updates old)");
         }
     }
 
@@ -162,7 +232,11 @@ function Metric (gputopParent) {
     this.metric_set_ = 0;
 
     this.server_handle = 0;
-    this.webc_stream_ptr_ = 0;
+    this.webc_stream_id_ = 0;
+
+    /* webc_counter_id_s of the only counters that webc should evaluate
+     * for each update, or undefined for all (see set_counter_selection) */
+    this.webc_counter_selection_ = undefined;
 
     this.per_ctx_mode_ = false;
 
@@ -171,9 +245,6 @@ function Metric (gputopParent) {
 
     // OA HW periodic timer exponent
     this.exponent = 14;
-    this.history = []; // buffer used when query is paused.
-    this.history_index = 0;
-    this.history_size = 0;
 }
 
 Metric.prototype.is_per_ctx_mode = function() {
@@ -245,8 +316,33 @@ Metric.prototype.set_aggregation_period = function(period_ns) {
 
     this.period_ns_ = period_ns;
 
-    if (this.webc_stream_ptr_)
-        webc._gputop_webc_update_stream_period(this.webc_stream_ptr_, period_ns);
+    if (this.webc_stream_id_) {
+        this.gputop.post_webc_decoder({ cmd: 'stream_period',
+                                        id: this.webc_stream_id_,
+                                        period_ns: period_ns });
+    }
+}
+
+/* Limits which counters are evaluated and updated for this metric set,
+ * given an array of Counter objects, or all counters if undefined. The
+ * values of other counters won't be updated until they are selected
+ * again. */
+Metric.prototype.set_counter_selection = function(counters) {
+    if (counters === undefined) {
+        this.webc_counter_selection_ = undefined;
+    } else {
+        this.webc_counter_selection_ = [];
+        for (var i = 0; i < counters.length; i++) {
+            if (counters[i].webc_counter_id_ !== -1)
+                this.webc_counter_selection_.push(counters[i].webc_counter_id_);
+        }
+    }
+
+    if (this.webc_stream_id_) {
+        this.gputop.post_webc_decoder({ cmd: 'stream_counter_mask',
+                                        id: this.webc_stream_id_,
+                                        counter_ids: this.webc_counter_selection_ });
+    }
 }
 
 function Process_info () {
@@ -291,11 +387,20 @@ function Gputop () {
     this.metrics_ = [];
     this.map_metrics_ = {}; // Map of metrics by GUID
 
+    /* How many updates each counter keeps until they're consumed, see
+     * Counter.updates (must be set before loading the metrics) */
+    this.counter_history_capacity = 2048;
+
     this.is_connected_ = false;
 
     this.config_ = {
         architecture: 'ukn'
     }
+
+    /* If true then counters are evaluated by compiling the equations of
+     * the metrics xml file at runtime instead of using the code built
+     * into gputop-web.js (see gputop_webc_load_metrics_xml()) */
+    this.runtime_metrics_xml = false;
     this.demo_architecture =  "hsw";
 
     this.get_arch_pretty_name = function() {
@@ -323,20 +428,31 @@ function Gputop () {
     this.server_handle_to_metric_map = {};
     this.server_handle_to_stream_map = {};
 
-    /* When we open a stream of metrics we also call into the
-     * Emscripten compiled webc code to allocate a corresponding
-     * struct gputop_webc_stream. This map lets us look up a
-     * Metric object given a sputop_webc_stream pointer.
+    /* When we open a stream of metrics we also ask the webc decoder
+     * (see gputop-webc-worker.js) to allocate a corresponding
+     * struct gputop_webc_stream, identified by a stream id. This map
+     * lets us look up a Metric object given a webc stream id.
      */
-    this.webc_stream_ptr_to_metric_map = {};
+    this.next_webc_stream_id = 1;
+    this.webc_stream_id_to_metric_map = {};
+    this.webc_decoder_ = undefined;
     this.active_oa_metric_ = undefined;
 
-    this.current_update_ = { metric: null };
-
     // Pending RPC request closures, indexed by request uuid,
     // to be called once we receive a reply.
     this.rpc_closures_ = {};
 
+    /* With a named server side session (see attach_session()) the server
+     * numbers every message it sends after the SessionInfo reply. We count
+     * the messages received so that we can resume from the same point if
+     * we have to reconnect, and periodically acknowledge them so the
+     * server doesn't have to keep them.
+     */
+    this.session_cursor_ = 0;
+    this.session_attached_ = false;
+    this.session_acked_cursor_ = 0;
+    this.session_ack_timer_ = undefined;
+
     // Process list map organized by PID
     this.map_processes_ = [];
 
@@ -484,60 +600,63 @@ Gputop.prototype.parse_metrics_set_xml = function (xml_elem) {
     });
 }
 
-Gputop.prototype.stream_start_update = function (stream_ptr,
-                                                 start_timestamp,
-                                                 end_timestamp,
-                                                 reason) {
-    var update = this.current_update_;
-
-    if (!(stream_ptr in this.webc_stream_ptr_to_metric_map)) {
-        console.error("Ignoring spurious update for unknown stream");
-        update.metric = null;
-        return;
-    }
-
-    update.metric = this.webc_stream_ptr_to_metric_map[stream_ptr];
-    update.start_timestamp = start_timestamp;
-    update.end_timestamp = end_timestamp;
-    update.reason = reason;
+/* Sends a message to the webc decoder, running in a Worker except for
+ * node.js where it's called directly. See gputop-webc-worker.js for the
+ * messages understood. */
+Gputop.prototype.post_webc_decoder = function(msg, transfer) {
+    if (is_nodejs)
+        this.webc_decoder_.handle(msg);
+    else
+        this.webc_decoder_.postMessage(msg, transfer);
 }
 
-Gputop.prototype.stream_update_counter = function (stream_ptr,
-                                                   counter_id,
-                                                   max,
-                                                   value) {
-    var update = this.current_update_;
-
-    var metric = update.metric;
-    if (metric === null) {
-        /* Will have already logged an error when starting the update */
-        return;
-    }
-
-    if (counter_id >= metric.webc_counters.length) {
-        console.error("Ignoring spurious counter update for out-of-range counter index");
-        return;
-    }
-
-    var counter = metric.webc_counters[counter_id];
-    counter.append_counter_data(update.start_timestamp,
-                                update.end_timestamp,
-                                max, value,
-                                update.reason);
-}
+Gputop.prototype.handle_webc_decoder_message = function(msg) {
+    switch (msg.cmd) {
+    case 'updates':
+        if (!(msg.id in this.webc_stream_id_to_metric_map)) {
+            /* Probably decoded before we closed the stream */
+            break;
+        }
 
-Gputop.prototype.stream_end_update = function (stream_ptr) {
-    var update = this.current_update_;
+        var metric = this.webc_stream_id_to_metric_map[msg.id];
+        var counters = metric.webc_counters;
+        var n_counters = Math.min(msg.n_counters, counters.length);
+        var counter_ids = msg.counter_ids;
+        var timestamps = msg.timestamps;
+        var values = msg.values;
+
+        /* If only some counters were selected the values are for those
+         * counters, in order of counter_ids */
+        if (counter_ids !== undefined)
+            n_counters = Math.min(msg.n_counters, counter_ids.length);
+
+        for (var u = 0; u < msg.n_updates; u++) {
+            var start = timestamps[u * 3];
+            var end = timestamps[u * 3 + 1];
+            var reason = timestamps[u * 3 + 2];
+            var base = u * msg.n_counters * 2;
+
+            for (var i = 0; i < n_counters; i++) {
+                var counter = counter_ids === undefined ?
+                    counters[i] : counters[counter_ids[i]];
+
+                /* webc_counters is sparse if some counters were unavailable */
+                if (counter === undefined)
+                    continue;
+
+                counter.append_counter_data(start, end,
+                                            values[base + i * 2 + 1],
+                                            values[base + i * 2],
+                                            reason);
+            }
+        }
 
-    var metric = update.metric;
-    if (metric === null) {
-        /* Will have already logged an error when starting the update */
-        return;
+        this.notify_metric_updated(metric);
+        break;
+    case 'log':
+        this.log(msg.message, msg.level);
+        break;
     }
-
-    update.metric = null;
-
-    this.notify_metric_updated(metric);
 }
 
 Gputop.prototype.notify_metric_updated = function (metric) {
@@ -578,22 +697,27 @@ Gputop.prototype.open_oa_metric_set = function(config, callback) {
         if ('per_ctx_mode' in config)
             per_ctx_mode = config.per_ctx_mode;
 
+        /* Optionally only evaluate the given Counters (see
+         * Metric.set_counter_selection()) */
+        if ('counters' in config)
+            metric.set_counter_selection(config.counters);
+
         function _finalize_open() {
             this.log("Opened OA metric set " + metric.name);
 
             metric.exponent = oa_exponent;
             metric.per_ctx_mode_ = per_ctx_mode;
 
-            var sp = webc.Runtime.stackSave();
-
-            metric.webc_stream_ptr_ =
-                webc._gputop_webc_stream_new(String_pointerify_on_stack(config.guid),
-                                             per_ctx_mode,
-                                             metric.period_ns_);
-
-            webc.Runtime.stackRestore(sp);
+            metric.webc_stream_id_ = this.next_webc_stream_id++;
+            this.post_webc_decoder({ cmd: 'stream_new',
+                                     id: metric.webc_stream_id_,
+                                     guid: config.guid,
+                                     per_ctx_mode: per_ctx_mode,
+                                     period_ns: metric.period_ns_,
+                                     keep_history: 'paused_state' in config,
+                                     counter_ids: metric.webc_counter_selection_ });
 
-            this.webc_stream_ptr_to_metric_map[metric.webc_stream_ptr_] = metric;
+            this.webc_stream_id_to_metric_map[metric.webc_stream_id_] = metric;
 
             if (callback != undefined)
                 callback(metric);
@@ -615,6 +739,19 @@ Gputop.prototype.open_oa_metric_set = function(config, callback) {
             oa_query.guid = config.guid;
             oa_query.period_exponent = oa_exponent;
 
+            /* Optionally have the server accumulate the reports and only
+             * send us counter values for each aggregation period, e.g. for
+             * slow links. (Note: the period can't be changed after opening
+             * in this case) */
+            if ('server_aggregation' in config && config.server_aggregation) {
+                oa_query.aggregation_period = metric.period_ns_;
+
+                /* Also have the server break down a system wide stream
+                 * into per-context updates (see metric.ctx_updates) */
+                if ('demux_contexts' in config && config.demux_contexts)
+                    oa_query.demux_contexts = true;
+            }
+
             var open = new this.gputop_proto_.OpenQuery();
 
             metric.server_handle = this.next_server_handle++;
@@ -628,9 +765,6 @@ Gputop.prototype.open_oa_metric_set = function(config, callback) {
             this.server_handle_to_metric_map[open.id] = metric;
 
             this.rpc_request('open_query', open, _finalize_open.bind(this));
-
-            metric.history = [];
-            metric.history_size = 0;
         }
     }
 
@@ -670,11 +804,12 @@ Gputop.prototype.close_oa_metric_set = function(metric, callback) {
     }
 
     function _finish_close() {
-        webc._gputop_webc_stream_destroy(metric.webc_stream_ptr_);
-        delete this.webc_stream_ptr_to_metric_map[metric.webc_stream_ptr_];
+        this.post_webc_decoder({ cmd: 'stream_destroy',
+                                 id: metric.webc_stream_id_ });
+        delete this.webc_stream_id_to_metric_map[metric.webc_stream_id_];
         delete this.server_handle_to_metric_map[metric.server_handle];
 
-        metric.webc_stream_ptr_ = 0;
+        metric.webc_stream_id_ = 0;
         metric.server_handle = 0;
 
         metric.closing_ = false;
@@ -755,6 +890,40 @@ var Stream = function(server_handle) {
 
 Stream.prototype = Object.create(EventTarget.prototype);
 
+/* Unpacks a CpuStatsBlock into typed arrays:
+ *
+ * timestamps[i] is the time of sample i and each of the per-field arrays
+ * (user, nice, system, ...) holds the change in that counter since the
+ * previous sample, CPU major: [cpu * n_samples + i]
+ */
+Gputop.prototype.decode_cpu_stats_block = function(block) {
+    var n_samples = block.n_samples;
+    var timestamps = new Float64Array(n_samples);
+    var t = block.start_timestamp.toNumber();
+
+    for (var i = 0; i < n_samples; i++) {
+        t += block.timestamp_deltas[i].toNumber();
+        timestamps[i] = t;
+    }
+
+    return {
+        n_cpus: block.n_cpus,
+        n_samples: n_samples,
+        start_timestamp: block.start_timestamp.toNumber(),
+        timestamps: timestamps,
+        user: Int32Array.from(block.user),
+        nice: Int32Array.from(block.nice),
+        system: Int32Array.from(block.system),
+        idle: Int32Array.from(block.idle),
+        iowait: Int32Array.from(block.iowait),
+        irq: Int32Array.from(block.irq),
+        softirq: Int32Array.from(block.softirq),
+        steal: Int32Array.from(block.steal),
+        guest: Int32Array.from(block.guest),
+        guest_nice: Int32Array.from(block.guest_nice),
+    };
+}
+
 Gputop.prototype.open_cpu_stats = function(config, callback) {
     var stream = new Stream(this.next_server_handle++);
 
@@ -764,6 +933,11 @@ Gputop.prototype.open_cpu_stats = function(config, callback) {
     else
         cpu_stats.set('sample_period_ms', 10);
 
+    /* Unless asked for a CpuStatsSet 'update' per sample, receive batches
+     * of samples as 'block' events (see decode_cpu_stats_block()) */
+    if (!('packed' in config) || config.packed)
+        cpu_stats.set('packed', true);
+
     var open = new this.gputop_proto_.OpenQuery();
     open.set('id', stream.server_handle);
     open.set('cpu_stats', cpu_stats);
@@ -929,6 +1103,9 @@ Gputop.prototype.process_features = function(features){
     this.system_properties = {};
     webc._gputop_webc_reset_system_properties();
 
+    /* Numeric properties to forward to the webc decoder */
+    var webc_properties = {};
+
     var DevInfo = this.builder_.lookup("gputop.DevInfo");
     var fields = DevInfo.getChildren(ProtoBuf.Reflect.Message.Field);
     fields.forEach((field) => {
@@ -943,10 +1120,12 @@ Gputop.prototype.process_features = function(features){
              * necessary */
             val = features.devinfo[field.name].toInt();
             webc._gputop_webc_set_system_property(name_c_string, val);
+            webc_properties[field.name] = val;
             break;
         case "uint32":
             val = features.devinfo[field.name];
             webc._gputop_webc_set_system_property(name_c_string, val);
+            webc_properties[field.name] = val;
             break;
         case "string":
             val = features.devinfo[field.name];
@@ -965,9 +1144,19 @@ Gputop.prototype.process_features = function(features){
 
     webc._gputop_webc_update_system_metrics();
 
+    /* Under node.js the decoder shares our webc instance, which is now
+     * already up to date */
+    if (!is_nodejs) {
+        this.post_webc_decoder({ cmd: 'system_properties',
+                                 properties: webc_properties });
+    }
+
     this.xml_file_name_ = this.config_.architecture + ".xml";
 
     get_file(this.xml_file_name_, (xml) => {
+        if (this.runtime_metrics_xml)
+            this.load_webc_metrics_xml(xml);
+
         this.parse_xml_metrics(xml);
 
         if (this.is_demo())
@@ -992,6 +1181,25 @@ Gputop.prototype.process_features = function(features){
     }, function (error) { console.log(error); });
 }
 
+/* Switches the webc decoder (both ours and the worker's) to the metric
+ * sets of the given xml, compiled at runtime */
+Gputop.prototype.load_webc_metrics_xml = function(xml) {
+    var xml_c_string = webc.allocate(webc.intArrayFromString(xml),
+                                     'i8', webc.ALLOC_NORMAL);
+    var loaded = webc._gputop_webc_load_metrics_xml(xml_c_string);
+    webc._free(xml_c_string);
+
+    if (!loaded) {
+        this.user_msg("Failed to load metrics from " + this.xml_file_name_ +
+                      ", using built in metrics", this.ERROR);
+        webc._gputop_webc_load_metrics_xml(0);
+    }
+    webc._gputop_webc_update_system_metrics();
+
+    if (loaded && !is_nodejs)
+        this.post_webc_decoder({ cmd: 'metrics_xml', xml: xml });
+}
+
 Gputop.prototype.load_emscripten = function(callback) {
     if (this.native_js_loaded_) {
         callback();
@@ -1012,6 +1220,14 @@ Gputop.prototype.load_emscripten = function(callback) {
                      */
                     webc.gputop_singleton = this;
 
+                    /* The webc code used to decode i915 perf data runs
+                     * separately in a Worker so that it doesn't compete
+                     * with rendering. */
+                    this.webc_decoder_ = new Worker('gputop-webc-worker.js');
+                    this.webc_decoder_.onmessage = (evt) => {
+                        this.handle_webc_decoder_message(evt.data);
+                    };
+
                     this.native_js_loaded_ = true;
                     this.log("GPUTop Emscripten code loaded\n");
                     callback();
@@ -1025,10 +1241,13 @@ Gputop.prototype.load_emscripten = function(callback) {
          */
         this.native_js_loaded_ = true;
 
-        /* Tell gputop-web-lib.js about this object so that the webc
-         * code can call methods on it...
+        /* Without Workers the decoder uses the same webc instance and
+         * also becomes the object that gputop-web-lib.js calls methods
+         * on, passing any log messages back to us...
          */
-        webc.gputop_singleton = this;
+        this.webc_decoder_ = new WebcDecoder(webc, (msg) => {
+            this.handle_webc_decoder_message(msg);
+        });
         callback();
     }
 }
@@ -1040,18 +1259,27 @@ Gputop.prototype.dispose = function() {
 
     this.is_connected_ = false;
 
-    this.metrics_.forEach(function (metric) {
-        if (!metric.closing_ && metric.webc_stream_ptr_)
-            _gputop_webc_stream_destroy(metric.webc_stream_ptr_);
+    this.metrics_.forEach((metric) => {
+        if (!metric.closing_ && metric.webc_stream_id_) {
+            this.post_webc_decoder({ cmd: 'stream_destroy',
+                                     id: metric.webc_stream_id_ });
+        }
     });
 
     this.metrics_ = [];
     this.map_metrics_ = {}; // Map of metrics by GUID
 
-    this.webc_stream_ptr_to_metric_map = {};
+    this.webc_stream_id_to_metric_map = {};
     this.server_handle_to_metric_map = {};
     this.server_handle_to_stream_map = {};
     this.active_oa_metric_ = undefined;
+
+    /* NB: the session cursor is kept for attaching again */
+    this.session_attached_ = false;
+    if (this.session_ack_timer_ !== undefined) {
+        clearInterval(this.session_ack_timer_);
+        this.session_ack_timer_ = undefined;
+    }
 }
 
 function gputop_socket_on_close() {
@@ -1070,18 +1298,8 @@ Gputop.prototype.replay_buffer = function() {
 
     this.clear_graphs();
 
-    for (var i = 0; i < metric.history.length; i++) {
-        var data = metric.history[i];
-
-        var sp = webc.Runtime.stackSave();
-
-        var stack_data = webc.allocate(data, 'i8', webc.ALLOC_STACK);
-
-        webc._gputop_webc_handle_i915_perf_message(metric.webc_stream_ptr_,
-                                                   stack_data,
-                                                   data.length);
-        webc.Runtime.stackRestore(sp);
-    }
+    /* The decoder keeps the last 1MB of data for each stream */
+    this.post_webc_decoder({ cmd: 'replay', id: metric.webc_stream_id_ });
 }
 
 function gputop_socket_on_message(evt) {
@@ -1089,6 +1307,12 @@ function gputop_socket_on_message(evt) {
     var data = new Uint8Array(evt.data, 8);
     var msg_type = dv.getUint8(0);
 
+    /* Once attached to a session every message is numbered, starting with
+     * the backlog sent straight after the SessionInfo reply to
+     * attach_session() */
+    if (this.session_attached_)
+        this.session_cursor_++;
+
     switch(msg_type) {
     case 1: /* WS_MESSAGE_PERF */
         var id = dv.getUint16(4, true /* little endian */);
@@ -1118,6 +1342,80 @@ function gputop_socket_on_message(evt) {
             process.update(msg.process_info);
             this.log(msg.reply_uuid + " recv: Console process info "+pid);
             break;
+        case 'fill_notify':
+            var server_handle = msg.fill_notify.query_id;
+
+            if (server_handle in this.server_handle_to_metric_map) {
+                var metric = this.server_handle_to_metric_map[server_handle];
+
+                this.user_msg("Falling behind forwarding " + metric.name +
+                              " data (server buffer " +
+                              msg.fill_notify.fill_percentage + "% full)",
+                              this.WARN);
+            }
+            break;
+        case 'counter_update':
+            var update = msg.counter_update;
+            var server_handle = update.id;
+
+            if (server_handle in this.server_handle_to_metric_map) {
+                var metric = this.server_handle_to_metric_map[server_handle];
+                var start = update.start_timestamp.toNumber();
+                var end = update.end_timestamp.toNumber();
+
+                /* Per-context updates are kept separately from the
+                 * metric's system wide counter data... */
+                if (update.ctx_id !== null && update.ctx_id !== undefined) {
+                    if (metric.ctx_updates === undefined)
+                        metric.ctx_updates = {};
+                    metric.ctx_updates[update.ctx_id] = update;
+                    this.notify_metric_updated(metric);
+                    break;
+                }
+
+                for (var i = 0; i < metric.webc_counters.length; i++) {
+                    var counter = metric.webc_counters[i];
+
+                    if (counter === undefined)
+                        continue;
+
+                    counter.append_counter_data(start, end,
+                                                update.values[i * 2 + 1],
+                                                update.values[i * 2],
+                                                update.reason);
+                }
+
+                this.notify_metric_updated(metric);
+            }
+            break;
+        case 'session_info':
+            var info = msg.session_info;
+
+            this.session_cursor_ = info.replay_seq.toNumber();
+            this.session_acked_cursor_ = this.session_cursor_;
+            this.session_attached_ = true;
+
+            if (this.session_ack_timer_ === undefined) {
+                this.session_ack_timer_ =
+                    setInterval(this.ack_session.bind(this), 1000);
+            }
+
+            var n_lost = info.n_lost.toNumber();
+            if (n_lost > 0) {
+                this.log("Session " + info.name + ": " + n_lost +
+                         " buffered messages lost", this.WARN);
+            }
+            break;
+        case 'stream_stats':
+            var server_handle = msg.stream_stats.id;
+
+            if (server_handle in this.server_handle_to_stream_map) {
+                var stream = this.server_handle_to_stream_map[server_handle];
+
+                var ev = { type: "stats", stats: msg.stream_stats };
+                stream.dispatchEvent(ev);
+            }
+            break;
         case 'cpu_stats':
             var server_handle = msg.cpu_stats.id;
 
@@ -1128,6 +1426,17 @@ function gputop_socket_on_message(evt) {
                 stream.dispatchEvent(ev);
             }
             break;
+        case 'cpu_stats_block':
+            var server_handle = msg.cpu_stats_block.id;
+
+            if (server_handle in this.server_handle_to_stream_map) {
+                var stream = this.server_handle_to_stream_map[server_handle];
+
+                var ev = { type: "block",
+                           block: this.decode_cpu_stats_block(msg.cpu_stats_block) };
+                stream.dispatchEvent(ev);
+            }
+            break;
         }
 
         if (msg.reply_uuid in this.rpc_closures_) {
@@ -1141,23 +1450,15 @@ function gputop_socket_on_message(evt) {
         var server_handle = dv.getUint16(4, true /* little endian */);
 
         if (server_handle in this.server_handle_to_metric_map) {
-            var sp = webc.Runtime.stackSave();
-
-            var stack_data = webc.allocate(data, 'i8', webc.ALLOC_STACK);
-
             var metric = this.server_handle_to_metric_map[server_handle];
 
-            // save messages in a buffer to replay when query is paused
-            metric.history.push(data);
-            metric.history_size += data.length;
-            if (metric.history_size > 1048576) // 1 MB of data
-                metric.history.shift();
-
-            webc._gputop_webc_handle_i915_perf_message(metric.webc_stream_ptr_,
-                                                       stack_data,
-                                                       data.length);
-
-            webc.Runtime.stackRestore(sp);
+            /* Hand the message over to the decoder without a copy (evt.data
+             * is detached once transferred). The decoder also keeps a
+             * history to replay when the query is paused */
+            this.post_webc_decoder({ cmd: 'i915_perf',
+                                     id: metric.webc_stream_id_,
+                                     data: data },
+                                   [ evt.data ]);
         } else {
             console.log("Ignoring i915 perf data for unknown Metric object")
         }
@@ -1169,6 +1470,39 @@ Gputop.prototype.get_process_info = function(pid, callback) {
     this.rpc_request('get_process_info', pid, callback);
 }
 
+/* Names the connection's session on the server so that its queries stay
+ * open if we get disconnected, with their data buffered until we attach
+ * again (up to retention_bytes or retention_ms, if given).
+ *
+ * NB: the server only lets a connection without any open queries attach to
+ * an existing session, so this should be called before opening any.
+ */
+Gputop.prototype.attach_session = function(name, retention, callback) {
+    var attach = new this.gputop_proto_.AttachSession();
+
+    attach.name = name;
+    attach.cursor = this.session_cursor_;
+    if (retention !== undefined) {
+        if (retention.bytes !== undefined)
+            attach.retention_bytes = retention.bytes;
+        if (retention.ms !== undefined)
+            attach.retention_ms = retention.ms;
+    }
+
+    this.rpc_request('attach_session', attach, callback);
+}
+
+/* Lets the server drop the session messages we've received so far from
+ * its backlog */
+Gputop.prototype.ack_session = function() {
+    if (!this.session_attached_ ||
+        this.session_cursor_ === this.session_acked_cursor_)
+        return;
+
+    this.session_acked_cursor_ = this.session_cursor_;
+    this.rpc_request('session_ack', this.session_cursor_);
+}
+
 Gputop.prototype.connect_web_socket = function(websocket_url, onopen) {
     var socket = new WebSocket(websocket_url, "binary");
     socket.binaryType = "arraybuffer";
@@ -1224,4 +1558,5 @@ Gputop.prototype.connect = function(address, callback) {
 if (is_nodejs) {
     /* For use as a node.js module... */
     exports.Gputop = Gputop;
+    exports.CounterUpdateRing = CounterUpdateRing;
 }
@@ -300,7 +300,7 @@ def output_rpn_equation_code(set, counter, equation, counter_vars):
 
     c("\nreturn " + value + ";")
 
-def splice_rpn_expression(set, counter, expression):
+def splice_rpn_expression(set, counter, expression, vars=hw_vars):
     tokens = expression.split()
     stack = []
 
@@ -313,8 +313,8 @@ def splice_rpn_expression(set, counter, expression):
             for i in range(0, argc):
                 operand = stack.pop()
                 if operand[0] == "$":
-                    if operand in hw_vars:
-                        operand = hw_vars[operand]
+                    if operand in vars:
+                        operand = vars[operand]
                     else:
                         raise Exception("Failed to resolve variable " + operand + " in expression " + expression + " for " + set.get('name') + " :: " + counter.get('name'));
                 args.append(operand)
@@ -360,10 +360,10 @@ def output_counter_max(set, counter, counter_vars):
     max_eq = counter.get('max_equation')
 
     if not max_eq:
-        return "NULL; /* undefined */"
+        return "NULL /* undefined */"
 
     if max_eq == "100":
-        return "percentage_max_callback;"
+        return "percentage_max_callback"
 
     c("\n")
     c("/* " + set.get('name') + " :: " + counter.get('name') + " */")
@@ -383,7 +383,170 @@ def output_counter_max(set, counter, counter_vars):
     c_outdent(3)
     c("}")
 
-    return max_sym + ";"
+    return max_sym
+
+
+# Offsets into accumulator->deltas[] matching the metric_set->*_offset values
+# assigned in add_<set>_metric_set() below...
+def read_offsets(chipset):
+    if chipset == "hsw":
+        return { "GPU_TIME": 0, "GPU_CLOCK": 0, "A": 1, "B": 46, "C": 54 }
+    else:
+        return { "GPU_TIME": 0, "GPU_CLOCK": 1, "A": 2, "B": 38, "C": 46 }
+
+class FusedState:
+    def __init__(self):
+        self.tmp_id = 0
+        self.cse = {}
+        self.hoisted = {}
+        self.counter_locals = {}
+
+def fused_hw_var(state, var):
+    field = hw_vars[var][len("devinfo->"):]
+    state.hoisted[var] = field
+    return field
+
+def output_fused_rpn_equation_code(set, counter, label, equation, state):
+    c("/* " + label + ": " + equation + " */")
+    tokens = equation.split()
+    stack = []
+    offsets = read_offsets(chipset)
+
+    for token in tokens:
+        stack.append(token)
+        while stack and stack[-1] in ops:
+            op = stack.pop()
+            argc, callback, mathml_callback = ops[op]
+            args = []
+            for i in range(0, argc):
+                operand = stack.pop()
+                if operand[0] == "$":
+                    if operand in hw_vars:
+                        operand = fused_hw_var(state, operand)
+                    elif operand in state.counter_locals:
+                        operand = state.counter_locals[operand]
+                    else:
+                        raise Exception("Failed to resolve variable " + operand + " in equation " + equation + " for " + set.get('name') + " :: " + counter.get('name'));
+                args.append(operand)
+
+            # Reads are resolved to constant indices at build time...
+            if op == "READ":
+                stack.append("deltas[" + str(offsets[args[1]] + int(args[0])) + "]")
+                continue
+
+            # ... and every other operation is pure, so identical
+            # sub-expressions across counters are only evaluated once
+            key = op + "(" + ", ".join(args) + ")"
+            if key not in state.cse:
+                state.tmp_id = callback(state.tmp_id, args)
+                state.cse[key] = "tmp" + str(state.tmp_id - 1)
+            stack.append(state.cse[key])
+
+    if len(stack) != 1:
+        raise Exception("Spurious empty rpn code for " + set.get('name') + " :: " +
+                counter.get('name') + ".\nThis is probably due to some unhandled RPN function, in the equation \"" +
+                equation + "\"")
+
+    value = stack.pop()
+
+    if value in hw_vars:
+        value = fused_hw_var(state, value)
+
+    return value
+
+class CodeBuffer:
+    def __init__(self):
+        self.chunks = []
+    def write(self, text):
+        self.chunks.append(text)
+    def getvalue(self):
+        return ''.join(self.chunks)
+
+# Evaluates every counter of a metric set in one go, in dependency order.
+#
+# All the counter values and maximums are computed up front as declarations
+# (counters may only reference counters declared before them) and then
+# written out for the counters that are available on the current device, in
+# the same order they are added to metric_set->counters[].
+def output_read_all(set, counters):
+    global c_file
+    global _c_indent
+
+    state = FusedState()
+    read_all_sym = set.get('chipset').lower() + "__" + set.get('underscore_name') + "__read_all"
+
+    real_c_file = c_file
+    real_c_indent = _c_indent
+    c_file = CodeBuffer()
+    _c_indent = 4
+
+    outputs = []
+    for counter in counters:
+        data_type = counter.get('data_type')
+        c_type = "uint64_t" if data_type == "uint64" else data_type
+        local = "counter_" + counter.get('underscore_name')
+
+        value = output_fused_rpn_equation_code(set, counter, counter.get('symbol_name'),
+                                               counter.get('equation'), state)
+        c(c_type + " " + local + " = " + value + ";")
+        state.counter_locals["$" + counter.get('symbol_name')] = local
+
+        max_eq = counter.get('max_equation')
+        if not max_eq:
+            max_value = "0"
+        elif max_eq == "100":
+            max_value = "100"
+        else:
+            max_value = local + "_max"
+            value = output_fused_rpn_equation_code(set, counter, counter.get('symbol_name') + " max",
+                                                   max_eq, state)
+            c("uint64_t " + max_value + " = " + value + ";")
+
+        outputs.append((counter, local, max_value))
+
+    decls = c_file.getvalue()
+    c_file = CodeBuffer()
+
+    for counter, local, max_value in outputs:
+        availability = counter.get('availability')
+        if availability:
+            hoisted_vars = {}
+            for var in hw_vars:
+                if var in availability:
+                    hoisted_vars[var] = fused_hw_var(state, var)
+            c("if (" + splice_rpn_expression(set, counter, availability, hoisted_vars) + ") {")
+            c_indent(4)
+        c("out[0] = " + local + ";")
+        c("out[1] = " + max_value + ";")
+        c("out += 2;")
+        if availability:
+            c_outdent(4)
+            c("}")
+
+    stmts = c_file.getvalue()
+
+    c_file = real_c_file
+    _c_indent = real_c_indent
+
+    c("\n")
+    c("static void")
+    c(read_all_sym + "(struct gputop_devinfo *devinfo,\n")
+    c_indent(len(read_all_sym) + 1)
+    c("const struct gputop_metric_set *metric_set,\n")
+    c("const uint64_t *deltas,\n")
+    c("double *out)\n")
+    c_outdent(len(read_all_sym) + 1)
+    c("{")
+    for var in sorted(state.hoisted):
+        field = state.hoisted[var]
+        c("    const uint64_t " + field + " = devinfo->" + field + ";")
+    c("")
+    c_frag(decls)
+    c("")
+    c_frag(stmts)
+    c("}")
+
+    return read_all_sym
 
 
 semantic_type_map = {
@@ -391,13 +554,9 @@ semantic_type_map = {
     "ratio": "event"
     }
 
-def output_counter_report(set, counter):
+def output_counter_descriptor(set, counter):
     data_type = counter.get('data_type')
     data_type_uc = data_type.upper()
-    c_type = data_type
-
-    if "uint" in c_type:
-        c_type = c_type + "_t"
 
     semantic_type = counter.get('semantic_type')
     if semantic_type in semantic_type_map:
@@ -405,36 +564,54 @@ def output_counter_report(set, counter):
 
     semantic_type_uc = semantic_type.upper()
 
-    c("\n")
-
     availability = counter.get('availability')
     if availability:
-        expression = splice_rpn_expression(set, counter, availability)
-        lines = expression.split(' && ')
-        n_lines = len(lines)
-        if n_lines == 1:
-            c("if (" + lines[0] + ") {")
+        availability = "0x%x, /* %s */" % (availability_bits[availability],
+                                          splice_rpn_expression(set, counter, availability))
+    else:
+        availability = "0,"
+
+    c("{")
+    c_indent(3)
+    c(".name = \"" + counter.get('name') + "\",")
+    c(".symbol_name = \"" + counter.get('symbol_name') + "\",")
+    c(".desc = \"" + counter.get('description') + "\",")
+    c(".type = GPUTOP_PERFQUERY_COUNTER_" + semantic_type_uc + ",")
+    c(".data_type = GPUTOP_PERFQUERY_COUNTER_DATA_" + data_type_uc + ",")
+    c(".max = " + max_funcs[counter.get('symbol_name')] + ",")
+    c(".oa_counter_read_" + data_type + " = " + read_funcs[counter.get('symbol_name')] + ",")
+    c(".availability = " + availability)
+    c_outdent(3)
+    c("},")
+
+
+# Must match gputop_oa_guid_hash() in gputop-oa-counters.h
+def guid_hash(guid, seed):
+    h = (2166136261 ^ seed) & 0xffffffff
+    for ch in guid:
+        h ^= ord(ch)
+        h = (h * 16777619) & 0xffffffff
+    return h ^ (h >> 16)
+
+# Finds a seed that maps each guid to a distinct slot of a power of two
+# sized table, so a lookup is a single hash and string comparison
+def perfect_hash(guids):
+    size = 1
+    while size < len(guids) * 2:
+        size *= 2
+    mask = size - 1
+
+    for seed in range(0, 1 << 20):
+        table = [-1] * size
+        for i in range(len(guids)):
+            slot = guid_hash(guids[i], seed) & mask
+            if table[slot] != -1:
+                break
+            table[slot] = i
         else:
-            c("if (" + lines[0] + " &&")
-            c_indent(4)
-            for i in range(1, (n_lines - 1)):
-                c(lines[i] + " &&")
-            c(lines[(n_lines - 1)] + ") {")
-            c_outdent(4)
-        c_indent(4)
+            return seed, mask, table
 
-    c("counter = &metric_set->counters[metric_set->n_counters++];\n")
-    c("counter->oa_counter_read_" + data_type + " = " + read_funcs[counter.get('symbol_name')] + ";\n")
-    c("counter->name = \"" + counter.get('name') + "\";\n")
-    c("counter->symbol_name = \"" + counter.get('symbol_name') + "\";\n")
-    c("counter->desc = \"" + counter.get('description') + "\";\n")
-    c("counter->type = GPUTOP_PERFQUERY_COUNTER_" + semantic_type_uc + ";\n")
-    c("counter->data_type = GPUTOP_PERFQUERY_COUNTER_DATA_" + data_type_uc + ";\n")
-    c("counter->max = " + max_funcs[counter.get('symbol_name')] + "\n")
-
-    if availability:
-        c_outdent(4)
-        c("}\n")
+    raise Exception("Failed to find a perfect hash for the metric set guids")
 
 
 parser = argparse.ArgumentParser()
@@ -509,8 +686,6 @@ c(
 #include "gputop-util.h"
 #include "gputop-oa-counters.h"
 
-extern void gputop_register_oa_metric_set(struct gputop_metric_set *metric_set);
-
 static uint64_t
 percentage_max_callback(struct gputop_devinfo *devinfo,
                         const struct gputop_metric_set *metric_set,
@@ -521,7 +696,27 @@ percentage_max_callback(struct gputop_devinfo *devinfo,
 
 """)
 
-for set in tree.findall(".//set"):
+def counters_table_sym(set):
+    return set.get('chipset').lower() + "__" + set.get('underscore_name') + "__counters"
+
+sets = tree.findall(".//set")
+
+# Each distinct availability expression is evaluated once per device as a
+# bit in the mask returned by <chipset>__availability()...
+availability_bits = {}
+availability_users = {}
+for set in sets:
+    for counter in set.findall("counter"):
+        availability = counter.get('availability')
+        if availability and availability not in availability_bits:
+            availability_bits[availability] = 1 << len(availability_bits)
+            availability_users[availability] = (set, counter)
+
+assert len(availability_bits) <= 32
+
+read_all_funcs = {}
+
+for set in sets:
     max_funcs = {}
     read_funcs = {}
     counter_vars = {}
@@ -540,64 +735,91 @@ for set in tree.findall(".//set"):
             xml_max_equation = splice_mathml_expression(counter.get('max_equation'), "MAX_EQ")
             counter.append(ET.fromstring(xml_max_equation))
 
-    c("\nstatic void\n")
-    c("add_" + set.get('underscore_name') + "_metric_set(struct gputop_devinfo *devinfo)\n")
-    c("{\n")
-    c_indent(3)
-
-    c("struct gputop_metric_set *metric_set;\n")
-    c("struct gputop_metric_set_counter *counter;\n\n")
-
-    c("metric_set = xmalloc0(sizeof(struct gputop_metric_set));\n")
-    c("metric_set->name = \"" + set.get('name') + "\";\n")
-    c("metric_set->symbol_name = \"" + set.get('symbol_name') + "\";\n")
-    c("metric_set->guid = \"" + set.get('guid') + "\";\n")
-    c("metric_set->counters = xmalloc0(sizeof(struct gputop_metric_set_counter) * " + str(len(counters)) + ");\n")
-    c("metric_set->n_counters = 0;\n")
-    c("metric_set->perf_oa_metrics_set = 0; // determined at runtime\n")
-
-    if chipset == "hsw":
-        c("""metric_set->perf_oa_format = I915_OA_FORMAT_A45_B8_C8;
-
-metric_set->perf_raw_size = 256;
-metric_set->gpu_time_offset = 0;
-metric_set->a_offset = 1;
-metric_set->b_offset = metric_set->a_offset + 45;
-metric_set->c_offset = metric_set->b_offset + 8;
-
-""")
-    else:
-        c("""metric_set->perf_oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8;
-
-metric_set->perf_raw_size = 256;
-metric_set->gpu_time_offset = 0;
-metric_set->gpu_clock_offset = 1;
-metric_set->a_offset = 2;
-metric_set->b_offset = metric_set->a_offset + 36;
-metric_set->c_offset = metric_set->b_offset + 8;
-
-""")
+    read_all_funcs[set.get('guid')] = output_read_all(set, counters)
 
+    c("\nstatic const struct gputop_metric_set_counter " + counters_table_sym(set) + "[] = {")
+    c_indent(3)
     for counter in counters:
-        output_counter_report(set, counter)
-
-    c("\n\ngputop_register_oa_metric_set(metric_set);\n")
-
+        output_counter_descriptor(set, counter)
     c_outdent(3)
-    c("}\n")
+    c("};")
 
 if args.xml_eq:
     tree.write(args.xml_eq)
 
-h("void gputop_oa_add_metrics_" + chipset + "(struct gputop_devinfo *devinfo);\n")
+h("extern const struct gputop_oa_metrics gputop_oa_metrics_" + chipset + ";\n")
 
-c("\nvoid")
-c("gputop_oa_add_metrics_" + chipset + "(struct gputop_devinfo *devinfo)")
+c("\nstatic uint32_t")
+c(chipset + "__availability(const struct gputop_oa_metrics *metrics,")
+c("".rjust(len(chipset) + len("__availability(")) + "struct gputop_devinfo *devinfo)")
 c("{")
 c_indent(4)
+c("uint32_t available = 0;\n")
+for availability, bit in sorted(availability_bits.items(), key=lambda item: item[1]):
+    set, counter = availability_users[availability]
+    expression = splice_rpn_expression(set, counter, availability)
+    c("if (" + expression + ")")
+    c("    available |= 0x%x;" % bit)
+c("\nreturn available;")
+c_outdent(4)
+c("}")
 
-for set in tree.findall(".//set"):
-    c("add_" + set.get('underscore_name') + "_metric_set(devinfo);")
+if chipset == "hsw":
+    perf_oa_format = "I915_OA_FORMAT_A45_B8_C8"
+else:
+    perf_oa_format = "I915_OA_FORMAT_A32u40_A4u32_B8_C8"
+offsets = read_offsets(chipset)
 
+c("\nstatic struct gputop_metric_set " + chipset + "__metric_sets[] = {")
+c_indent(4)
+for set in sets:
+    counters = set.findall("counter")
+    predicated = [counter for counter in counters if counter.get('availability')]
+    table = counters_table_sym(set)
+
+    c("{")
+    c_indent(4)
+    c(".name = \"" + set.get('name') + "\",")
+    c(".symbol_name = \"" + set.get('symbol_name') + "\",")
+    c(".guid = \"" + set.get('guid') + "\",")
+    c(".all_counters = " + table + ",")
+    c(".n_all_counters = " + str(len(counters)) + ",")
+    if predicated:
+        c("/* .counters determined at runtime */")
+    else:
+        c(".counters = " + table + ",")
+        c(".n_counters = " + str(len(counters)) + ",")
+    c(".perf_oa_metrics_set = 0, /* determined at runtime */")
+    c(".perf_oa_format = " + perf_oa_format + ",")
+    c(".perf_raw_size = 256,")
+    c(".gpu_time_offset = " + str(offsets["GPU_TIME"]) + ",")
+    c(".gpu_clock_offset = " + str(offsets["GPU_CLOCK"]) + ",")
+    c(".a_offset = " + str(offsets["A"]) + ",")
+    c(".b_offset = " + str(offsets["B"]) + ",")
+    c(".c_offset = " + str(offsets["C"]) + ",")
+    c(".read_all = " + read_all_funcs[set.get('guid')] + ",")
+    c_outdent(4)
+    c("},")
 c_outdent(4)
-c("}")
+c("};")
+
+assert len(sets) < 128
+seed, mask, table = perfect_hash([set.get('guid') for set in sets])
+
+c("\nstatic const int8_t " + chipset + "__metric_sets_hash[] = {")
+c_indent(4)
+for i in range(0, len(table), 8):
+    c(" ".join(str(idx) + "," for idx in table[i:i + 8]))
+c_outdent(4)
+c("};")
+
+c("\nconst struct gputop_oa_metrics gputop_oa_metrics_" + chipset + " = {")
+c_indent(4)
+c(".metric_sets = " + chipset + "__metric_sets,")
+c(".n_metric_sets = " + str(len(sets)) + ",")
+c(".hash_table = " + chipset + "__metric_sets_hash,")
+c(".hash_seed = " + str(seed) + ",")
+c(".hash_mask = 0x%x," % mask)
+c(".availability = " + chipset + "__availability,")
+c_outdent(4)
+c("};")
@@ -0,0 +1,210 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Compares each A32u40_A4u32_B8_C8 accumulation kernel supported by the
+ * CPU against accumulate_a32u40_scalar() with random reports, where about
+ * half of the 40bit A counters wrap between consecutive reports, both
+ * directly and via gputop_oa_accumulate_report_batch() for odd and even
+ * run lengths.
+ *
+ * Pass a seed as the first argument to reproduce a failure.
+ */
+
+#include "gputop-oa-counters.c"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#define REPORT_SIZE 256
+#define MAX_REPORTS 64
+#define N_ITERATIONS 2000
+
+struct kernel {
+    const char *name;
+    a32u40_accumulate_func_t func;
+};
+
+static uint64_t rand_state;
+
+static uint32_t
+rand_u32(void)
+{
+    /* xorshift64* */
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return (rand_state * 2685821657736338717ULL) >> 32;
+}
+
+static void
+random_reports(uint8_t *reports, size_t stride, int n_reports)
+{
+    for (int n = 0; n < n_reports; n++) {
+        uint32_t *report = (uint32_t *)(reports + n * stride);
+        uint8_t *high_bytes = (uint8_t *)(report + 40);
+
+        for (int i = 0; i < stride / 4; i++)
+            report[i] = rand_u32();
+
+        report[0] = OAREPORT_REASON_TIMER << OAREPORT_REASON_SHIFT;
+
+        /* Also make sure we hit the extremes of the 40bit range */
+        for (int i = 0; i < 32; i++) {
+            switch (rand_u32() % 8) {
+            case 0:
+                report[4 + i] = 0;
+                high_bytes[i] = 0;
+                break;
+            case 1:
+                report[4 + i] = UINT32_MAX;
+                high_bytes[i] = UINT8_MAX;
+                break;
+            }
+        }
+    }
+}
+
+static bool
+check_deltas(const char *what, const struct kernel *kernel,
+             const uint64_t *expected, const uint64_t *deltas,
+             size_t stride, int n_reports)
+{
+    for (int i = 0; i < MAX_RAW_OA_COUNTERS; i++) {
+        if (deltas[i] != expected[i]) {
+            fprintf(stderr, "%s: %s: stride = %zu, n_reports = %d: "
+                    "deltas[%d] = %"PRIu64", expected %"PRIu64"\n",
+                    kernel->name, what, stride, n_reports, i,
+                    deltas[i], expected[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+test_kernel(const struct kernel *kernel, struct gputop_metric_set *metric_set,
+            uint8_t *reports)
+{
+    size_t stride = (rand_u32() % 2) ? REPORT_SIZE : REPORT_SIZE + 8;
+    int n_reports = 2 + rand_u32() % (MAX_REPORTS - 1);
+    struct gputop_oa_accumulator expected, accumulator;
+    uint64_t initial[MAX_RAW_OA_COUNTERS];
+    uint64_t deltas[MAX_RAW_OA_COUNTERS];
+
+    random_reports(reports, stride, n_reports);
+
+    for (int i = 0; i < MAX_RAW_OA_COUNTERS; i++)
+        initial[i] = (uint64_t)rand_u32() << 16;
+
+    /* The reference: the scalar kernel, one pair at a time */
+    gputop_oa_accumulator_init(&expected, metric_set);
+    memcpy(expected.deltas, initial, sizeof(initial));
+
+    accumulate_a32u40 = accumulate_a32u40_scalar;
+    for (int n = 0; n < n_reports - 1; n++) {
+        gputop_oa_accumulate_reports(&expected,
+                                     reports + n * stride,
+                                     reports + (n + 1) * stride,
+                                     false);
+    }
+
+    /* The kernel called directly, with pre-existing deltas... */
+    memcpy(deltas, initial, sizeof(initial));
+    kernel->func(reports, reports + stride, stride, n_reports - 1, deltas);
+    if (!check_deltas("direct", kernel, expected.deltas, deltas,
+                      stride, n_reports))
+        return false;
+
+    /* ...and via the batch entry point, as for a run of sample records */
+    gputop_oa_accumulator_init(&accumulator, metric_set);
+    memcpy(accumulator.deltas, initial, sizeof(initial));
+
+    accumulate_a32u40 = kernel->func;
+    gputop_oa_accumulate_report_batch(&accumulator, reports, stride,
+                                      n_reports);
+    if (!check_deltas("batch", kernel, expected.deltas, accumulator.deltas,
+                      stride, n_reports))
+        return false;
+
+    if (accumulator.first_timestamp != expected.first_timestamp ||
+        accumulator.last_timestamp != expected.last_timestamp ||
+        accumulator.last_ctx_id != expected.last_ctx_id) {
+        fprintf(stderr, "%s: batch: stride = %zu, n_reports = %d: "
+                "timestamps or context id differ\n",
+                kernel->name, stride, n_reports);
+        return false;
+    }
+
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct gputop_metric_set metric_set = {
+        .name = "test",
+        .perf_oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8,
+        .perf_raw_size = REPORT_SIZE,
+    };
+    struct kernel kernels[3];
+    int n_kernels = 0;
+    uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : time(NULL);
+    uint8_t *reports = xmalloc(MAX_REPORTS * (REPORT_SIZE + 8));
+    int failed = 0;
+
+    /* For converting timestamps to nanoseconds, as for Haswell */
+    gputop_devinfo.timestamp_frequency = 12500000;
+
+    kernels[n_kernels++] = (struct kernel){ "scalar", accumulate_a32u40_scalar };
+#ifdef GPUTOP_OA_ACCUMULATE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        kernels[n_kernels++] = (struct kernel){ "sse4.2", accumulate_a32u40_sse42 };
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n_kernels++] = (struct kernel){ "avx2", accumulate_a32u40_avx2 };
+#endif
+
+    for (int k = 0; k < n_kernels; k++) {
+        bool ok = true;
+
+        rand_state = seed | 1;
+
+        for (int i = 0; i < N_ITERATIONS && ok; i++)
+            ok = test_kernel(&kernels[k], &metric_set, reports);
+
+        printf("%s: %s\n", kernels[k].name, ok ? "ok" : "FAIL");
+        if (!ok)
+            failed = 1;
+    }
+
+    if (failed)
+        fprintf(stderr, "seed = %"PRIu64"\n", seed);
+
+    free(reports);
+
+    return failed;
+}
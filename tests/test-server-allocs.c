@@ -0,0 +1,189 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks that, once warmed up, forwarding logs, unpacking requests and
+ * queuing replies (see queue_pb_message()) don't touch the heap; the
+ * scratch and per-client message arenas should be recycled instead.
+ *
+ * The websocket is faked by capturing queued messages and draining them
+ * via their read/finish callbacks, as wslay would once they're sent.
+ */
+
+#include "gputop-server.c"
+
+#define N_CLIENTS 3
+#define N_ROUNDS 50
+#define N_WARM_UP_ROUNDS 1
+#define MAX_LOG_MESSAGES 20
+#define MAX_REPLIES 8
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static bool counting;
+static int n_allocs;
+
+void *
+malloc(size_t size)
+{
+    if (counting)
+        n_allocs++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if (counting)
+        n_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (counting)
+        n_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+#define MAX_QUEUED (N_CLIENTS * (MAX_REPLIES + 2))
+
+static struct wslay_event_fragmented_msg queued[MAX_QUEUED];
+static int n_queued;
+
+int
+wslay_event_queue_fragmented_msg(wslay_event_context_ptr ctx,
+                                 const struct wslay_event_fragmented_msg *arg)
+{
+    assert(n_queued < MAX_QUEUED);
+    queued[n_queued++] = *arg;
+    return 0;
+}
+
+int
+wslay_event_send(wslay_event_context_ptr ctx)
+{
+    return 0;
+}
+
+static void
+drain_queued_msgs(void)
+{
+    uint8_t frame[4096];
+
+    for (int i = 0; i < n_queued; i++) {
+        struct wslay_event_fragmented_msg *msg = &queued[i];
+        int eof = 0;
+
+        while (!eof)
+            msg->read_callback(NULL, frame, sizeof(frame), &msg->source,
+                               &eof, NULL);
+        msg->finish_callback(&msg->source, NULL);
+    }
+    n_queued = 0;
+}
+
+/* Round 0 sends the most and the largest messages so that the arenas
+ * have reached their high water mark by the end of the warm up */
+static void
+run_round(h2o_websocket_conn_t *conns, int round)
+{
+    int n_log_messages = MAX_LOG_MESSAGES - (round % 5);
+    int n_replies = MAX_REPLIES - (round % 3);
+    char text[GPUTOP_LOG_MAX_MESSAGE_LEN];
+    struct wslay_event_on_msg_recv_arg arg;
+    Gputop__Request request = GPUTOP__REQUEST__INIT;
+    uint8_t packed[512];
+
+    for (int i = 0; i < n_log_messages; i++) {
+        int len = snprintf(text, sizeof(text),
+                           "round %d log message %d %*s\n",
+                           round, i, 200 - (round * 7 + i) % 100, "");
+        gputop_log(GPUTOP_LOG_LEVEL_NOTIFICATION, text, len);
+    }
+
+    snprintf(text, sizeof(text), "round %d %*s", round,
+             120 - round % 60, "");
+    request.uuid = "test-server-allocs";
+    request.req_case = GPUTOP__REQUEST__REQ_TEST_LOG;
+    request.test_log = text;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.opcode = WSLAY_BINARY_FRAME;
+    arg.msg = packed;
+    arg.msg_length = gputop__request__pack(&request, packed);
+
+    counting = true;
+
+    forward_logs();
+
+    for (int i = 0; i < N_CLIENTS; i++) {
+        on_ws_message(&conns[i], &arg);
+
+        for (int j = 0; j < n_replies; j++) {
+            Gputop__Message message = GPUTOP__MESSAGE__INIT;
+
+            message.reply_uuid = request.uuid;
+            message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+            message.error = text + (j * 13) % 60;
+            send_pb_message(&conns[i], &message.base);
+        }
+    }
+
+    drain_queued_msgs();
+
+    counting = false;
+}
+
+int
+main(int argc, char **argv)
+{
+    static h2o_websocket_conn_t conns[N_CLIENTS];
+    int failed = 0;
+
+    gputop_list_init(&clients);
+
+    for (int i = 0; i < N_CLIENTS; i++) {
+        struct client *client = client_new();
+
+        conns[i].data = client;
+        client->conn = &conns[i];
+    }
+
+    for (int round = 0; round < N_ROUNDS; round++) {
+        n_allocs = 0;
+        run_round(conns, round);
+
+        if (round >= N_WARM_UP_ROUNDS && n_allocs) {
+            fprintf(stderr, "round %d: %d allocations after warm up\n",
+                    round, n_allocs);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}